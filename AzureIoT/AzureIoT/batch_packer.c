@@ -0,0 +1,169 @@
+#include <stdio.h>
+#include <string.h>
+#include "batch_packer.h"
+
+void BatchPacker_Init(BatchPacker *packer, const TelemetryEncoder *encoder, size_t messageLimit,
+                      BatchPackerEmitFunction emit, void *emitContext)
+{
+    memset(packer, 0, sizeof(*packer));
+    packer->encoder = encoder;
+    packer->messageLimit =
+        messageLimit < BATCH_PACKER_MAX_MESSAGE_SIZE ? messageLimit : BATCH_PACKER_MAX_MESSAGE_SIZE;
+    packer->emit = emit;
+    packer->emitContext = emitContext;
+}
+
+static int OpenBatchForRecords(BatchPacker *packer, OpenBatch *batch, const TelemetryMessage *first)
+{
+    // Keep back the bytes needed to close the batch, so that any record that is accepted can
+    // always be followed by endBatch without exceeding the limit.
+    TelemetryBuffer_Init(&batch->buffer, batch->storage,
+                         packer->messageLimit - packer->encoder->batchClosingSize);
+    if (packer->encoder->beginBatch(&batch->buffer) != 0) {
+        return -1;
+    }
+    batch->open = true;
+    batch->node = first->node;
+    batch->priority = first->priority;
+    return 0;
+}
+
+static void CloseBatch(BatchPacker *packer, OpenBatch *batch, TelemetryClass telemetryClass)
+{
+    if (!batch->open) {
+        return;
+    }
+    batch->open = false;
+    if (batch->buffer.recordCount == 0) {
+        return;
+    }
+
+    PackedMessage message = {.node = batch->node,
+                             .telemetryClass = telemetryClass,
+                             .priority = batch->priority,
+                             .recordCount = batch->buffer.recordCount};
+
+    if (batch->buffer.recordCount == 1) {
+        // A single record goes out as a plain record, exactly as unbatched telemetry did.
+        size_t opening = packer->encoder->batchOpeningSize;
+        message.body = batch->buffer.data + opening;
+        message.length = batch->buffer.length - opening;
+    } else {
+        batch->buffer.capacity = packer->messageLimit;
+        packer->encoder->endBatch(&batch->buffer);
+        message.body = batch->buffer.data;
+        message.length = batch->buffer.length;
+    }
+
+    uint32_t fillPermille = (uint32_t)(message.length * 1000 / packer->messageLimit);
+    packer->statistics.messages++;
+    packer->statistics.bytes += message.length;
+    packer->statistics.fillPermilleTotal += fillPermille;
+    packer->statistics.lastFillPermille = fillPermille;
+
+    packer->emit(&message, packer->emitContext);
+}
+
+/// <summary>
+///     Encodes the message as one record at the end of the batch, or leaves the batch untouched
+///     if the record does not fit.
+/// </summary>
+static int AppendRecord(const TelemetryEncoder *encoder, OpenBatch *batch,
+                        const TelemetryMessage *message)
+{
+    TelemetryBuffer *buffer = &batch->buffer;
+    size_t startLength = buffer->length;
+    size_t startRecords = buffer->recordCount;
+
+    int result = encoder->begin(buffer);
+    for (size_t i = 0; result == 0 && i < message->fieldCount; i++) {
+        result = encoder->addField(buffer, message->keys[i], message->values[i]);
+    }
+    if (result == 0) {
+        result = encoder->end(buffer);
+    }
+
+    if (result != 0) {
+        buffer->length = startLength;
+        buffer->recordCount = startRecords;
+        if (startLength < buffer->capacity) {
+            buffer->data[startLength] = 0;
+        }
+    }
+    return result;
+}
+
+void BatchPacker_SetBatching(BatchPacker *packer, bool batching)
+{
+    if (!batching) {
+        BatchPacker_Flush(packer);
+    }
+    packer->batching = batching;
+}
+
+void BatchPacker_SetEncoder(BatchPacker *packer, const TelemetryEncoder *encoder)
+{
+    BatchPacker_Flush(packer);
+    packer->encoder = encoder;
+}
+
+int BatchPacker_Append(BatchPacker *packer, const TelemetryMessage *message)
+{
+    TelemetryClass telemetryClass = message->telemetryClass;
+    OpenBatch *batch = &packer->batches[telemetryClass];
+    int result = 0;
+
+    if (batch->open && AppendRecord(packer->encoder, batch, message) == 0) {
+        result = 1;
+        if (batch->node != message->node) {
+            batch->node = TELEMETRY_NODE_MIXED;
+        }
+        if (message->priority > batch->priority) {
+            batch->priority = message->priority;
+        }
+    } else {
+        // Either nothing is open or the record would overflow the open batch: send what is
+        // there and start a new batch with this record.
+        CloseBatch(packer, batch, telemetryClass);
+        if (OpenBatchForRecords(packer, batch, message) != 0 ||
+            AppendRecord(packer->encoder, batch, message) != 0) {
+            batch->open = false;
+            packer->statistics.oversizedRecords++;
+            return -1;
+        }
+    }
+    packer->statistics.records++;
+
+    if (!packer->batching || message->priority == MessagePriority_High) {
+        CloseBatch(packer, batch, telemetryClass);
+    }
+    return result;
+}
+
+void BatchPacker_Flush(BatchPacker *packer)
+{
+    for (int i = 0; i < BATCH_PACKER_CLASS_COUNT; i++) {
+        CloseBatch(packer, &packer->batches[i], (TelemetryClass)i);
+    }
+}
+
+bool BatchPacker_HasOpenBatch(const BatchPacker *packer)
+{
+    for (int i = 0; i < BATCH_PACKER_CLASS_COUNT; i++) {
+        if (packer->batches[i].open && packer->batches[i].buffer.recordCount > 0) {
+            return true;
+        }
+    }
+    return false;
+}
+
+int BatchPacker_FormatStatistics(const BatchPacker *packer, char *buffer, size_t bufferSize)
+{
+    const BatchPackerStatistics *s = &packer->statistics;
+    uint32_t averageFill = s->messages > 0 ? (uint32_t)(s->fillPermilleTotal / s->messages) : 0;
+    return snprintf(buffer, bufferSize,
+                    "\"messages\":%u,\"records\":%u,\"bytes\":%llu,\"oversizedRecords\":%u,"
+                    "\"averageFillPermille\":%u,\"lastFillPermille\":%u,\"limit\":%zu",
+                    s->messages, s->records, (unsigned long long)s->bytes, s->oversizedRecords,
+                    averageFill, s->lastFillPermille, packer->messageLimit);
+}
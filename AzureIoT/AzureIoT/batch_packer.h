@@ -0,0 +1,129 @@
+#pragma once
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include "outbound_queue.h"
+#include "telemetry_encoder.h"
+
+/// <summary>
+///     Largest message body the packer can build. The configured limit is clamped to this.
+/// </summary>
+#define BATCH_PACKER_MAX_MESSAGE_SIZE 4096
+#define BATCH_PACKER_CLASS_COUNT 3
+
+/// <summary>
+///     A closed batch, ready to be sent as one IoT Hub message.
+/// </summary>
+typedef struct PackedMessage {
+    const uint8_t *body;
+    size_t length;
+    /// <summary>
+    /// Node all records came from, or TELEMETRY_NODE_MIXED.
+    /// </summary>
+    int node;
+    TelemetryClass telemetryClass;
+    /// <summary>
+    /// Highest priority of the records.
+    /// </summary>
+    MessagePriority priority;
+    size_t recordCount;
+} PackedMessage;
+
+/// <summary>
+///     Function the packer calls with each closed batch.
+/// </summary>
+typedef void (*BatchPackerEmitFunction)(const PackedMessage *message, void *context);
+
+/// <summary>
+///     A batch being filled for one telemetry class.
+/// </summary>
+typedef struct OpenBatch {
+    bool open;
+    int node;
+    MessagePriority priority;
+    TelemetryBuffer buffer;
+    uint8_t storage[BATCH_PACKER_MAX_MESSAGE_SIZE];
+} OpenBatch;
+
+/// <summary>
+///     Counters describing how well batches are filled.
+/// </summary>
+typedef struct BatchPackerStatistics {
+    uint32_t messages;
+    uint32_t records;
+    uint64_t bytes;
+    uint32_t oversizedRecords;
+    /// <summary>
+    /// Sum over all messages of length / limit, in thousandths.
+    /// </summary>
+    uint64_t fillPermilleTotal;
+    uint32_t lastFillPermille;
+} BatchPackerStatistics;
+
+/// <summary>
+/// <para>Packs telemetry records into messages of up to a size limit.</para>
+/// <para>Each telemetry class has its own open batch so that the metricClass routing property
+/// stays exact. The encoded size is tracked as records are appended: the buffer capacity is set
+/// to the limit minus the bytes needed to close the batch, so a record that would overflow is
+/// rejected by the encoder itself. The batch is then closed as it stands and the record starts
+/// the next one; records are never split and earlier records are never re-encoded.</para>
+/// <para>Batching is off until BatchPacker_SetBatching turns it on. Until then every record is
+/// emitted on its own as a plain record, since consumers such as IoT Central expect one record
+/// per message rather than an array.</para>
+/// </summary>
+typedef struct BatchPacker {
+    const TelemetryEncoder *encoder;
+    size_t messageLimit;
+    bool batching;
+    OpenBatch batches[BATCH_PACKER_CLASS_COUNT];
+    BatchPackerEmitFunction emit;
+    void *emitContext;
+    BatchPackerStatistics statistics;
+} BatchPacker;
+
+/// <summary>
+///     Initializes a packer with no open batches and batching off.
+/// </summary>
+/// <param name="packer">Packer to initialize</param>
+/// <param name="encoder">Encoder used for message bodies</param>
+/// <param name="messageLimit">Maximum body size in bytes, clamped to
+/// BATCH_PACKER_MAX_MESSAGE_SIZE</param>
+/// <param name="emit">Function called with each closed batch</param>
+/// <param name="emitContext">Context passed to emit</param>
+void BatchPacker_Init(BatchPacker *packer, const TelemetryEncoder *encoder, size_t messageLimit,
+                      BatchPackerEmitFunction emit, void *emitContext);
+
+/// <summary>
+///     Closes any open batches and switches to a different encoder.
+/// </summary>
+void BatchPacker_SetEncoder(BatchPacker *packer, const TelemetryEncoder *encoder);
+
+/// <summary>
+///     Turns batching on or off. Turning it off closes and emits every open batch.
+/// </summary>
+void BatchPacker_SetBatching(BatchPacker *packer, bool batching);
+
+/// <summary>
+///     Appends a message as one record to the open batch of its class, closing that batch first
+///     if the record does not fit. High-priority records close their batch straight away so
+///     they are not held back, as does every record while batching is off.
+/// </summary>
+/// <returns>0 if the record started a new batch, 1 if it joined the open one, or -1 if the
+/// record alone exceeds the message limit</returns>
+int BatchPacker_Append(BatchPacker *packer, const TelemetryMessage *message);
+
+/// <summary>
+///     Closes and emits every open batch.
+/// </summary>
+void BatchPacker_Flush(BatchPacker *packer);
+
+/// <summary>
+///     Checks whether any batch holds records that have not been emitted.
+/// </summary>
+bool BatchPacker_HasOpenBatch(const BatchPacker *packer);
+
+/// <summary>
+///     Formats the statistics as a JSON object body, without the surrounding braces.
+/// </summary>
+/// <returns>The snprintf result</returns>
+int BatchPacker_FormatStatistics(const BatchPacker *packer, char *buffer, size_t bufferSize);
@@ -0,0 +1,85 @@
+#pragma once
+#include <stdbool.h>
+#include <stddef.h>
+#include <iothub_client_core_common.h>
+
+/// <summary>
+///     Callbacks a transport makes into the application. They keep the IoT Hub SDK signatures,
+///     so that the application handles a stand-in exactly as it handles the hub.
+/// </summary>
+typedef struct CloudTransportCallbacks {
+    IOTHUB_CLIENT_CONNECTION_STATUS_CALLBACK connectionStatus;
+    IOTHUB_CLIENT_DEVICE_TWIN_CALLBACK twinUpdate;
+    IOTHUB_CLIENT_DEVICE_METHOD_CALLBACK_ASYNC method;
+    /// <summary>
+    /// Passed to every callback.
+    /// </summary>
+    void *context;
+} CloudTransportCallbacks;
+
+/// <summary>
+/// <para>Function table for the connection that carries telemetry, reported properties, twin
+/// updates and direct methods between the gateway and the cloud.</para>
+/// <para>There is one connection per process, so the functions take no handle. Like the IoT Hub
+/// LL client, a transport does its work and makes its callbacks only from doWork, on the thread
+/// that calls it.</para>
+/// </summary>
+typedef struct CloudTransport {
+    /// <summary>
+    /// Name for logs and reports, e.g. "iothub" or "fake".
+    /// </summary>
+    const char *name;
+    /// <summary>
+    /// Host and device to connect to without provisioning, for local stand-ins, or NULL if the
+    /// transport connects to the hub that DPS assigns.
+    /// </summary>
+    const char *localHostName;
+    const char *localDeviceId;
+    /// <summary>
+    /// Creates the connection, replacing any previous one. Connecting completes later, through
+    /// the connection status callback.
+    /// </summary>
+    /// <param name="authFailure">Set to true if the device's credentials could not be set up,
+    /// false for other failures</param>
+    /// <returns>0 on success, or -1 on failure</returns>
+    int (*create)(const char *hostName, const char *deviceId, int keepAliveSeconds,
+                  const CloudTransportCallbacks *callbacks, bool *authFailure);
+    /// <summary>
+    /// Destroys the connection, if there is one. Telemetry it still holds completes with
+    /// IOTHUB_CLIENT_CONFIRMATION_BECAUSE_DESTROY before this returns, so every accepted message
+    /// gets exactly one confirmation callback.
+    /// </summary>
+    void (*destroy)(void);
+    bool (*isCreated)(void);
+    /// <summary>
+    /// Queues a telemetry message; the transport takes a copy. The callback reports the outcome.
+    /// </summary>
+    /// <returns>0 on success, or -1 if the message was not queued</returns>
+    int (*sendEvent)(IOTHUB_MESSAGE_HANDLE message,
+                     IOTHUB_CLIENT_EVENT_CONFIRMATION_CALLBACK callback, void *context);
+    /// <summary>
+    /// Queues a reported properties patch. The callback receives the HTTP status.
+    /// </summary>
+    /// <returns>0 on success, or -1 if the patch was not queued</returns>
+    int (*sendReportedState)(const unsigned char *json, size_t length,
+                             IOTHUB_CLIENT_REPORTED_STATE_CALLBACK callback, void *context);
+    /// <summary>
+    /// Checks that no telemetry is waiting to be sent or acknowledged.
+    /// </summary>
+    bool (*isSendIdle)(void);
+    /// <summary>
+    /// Sends, receives and makes callbacks.
+    /// </summary>
+    void (*doWork)(void);
+    /// <summary>
+    /// Formats the transport's own counters as a JSON object body, without the surrounding
+    /// braces, or NULL if it keeps none.
+    /// </summary>
+    int (*formatStatistics)(char *buffer, size_t bufferSize);
+} CloudTransport;
+
+/// <summary>
+///     The IoT Hub device client over MQTT, authenticated with the device authentication
+///     certificate.
+/// </summary>
+extern const CloudTransport IoTHubCloudTransport;
@@ -0,0 +1,150 @@
+#include <stdio.h>
+#include <string.h>
+#include "connection_state.h"
+
+static const char *const stateNames[ConnectionState_Count] = {"WaitingForNetwork", "Connecting",
+                                                              "Connected", "BackingOff"};
+
+static void EnterState(ConnectionStateMachine *machine, ConnectionState state, uint64_t nowMs)
+{
+    if (state == machine->state) {
+        return;
+    }
+    machine->statistics.timeInStateMs[machine->state] += nowMs - machine->stateSinceMs;
+    machine->statistics.entries[state]++;
+    machine->state = state;
+    machine->stateSinceMs = nowMs;
+}
+
+/// <summary>
+///     Returns a random number from min to max inclusive.
+/// </summary>
+static uint32_t RandomBetween(ConnectionStateMachine *machine, uint32_t min, uint32_t max)
+{
+    // xorshift32
+    uint32_t x = machine->randomState;
+    x ^= x << 13;
+    x ^= x >> 17;
+    x ^= x << 5;
+    machine->randomState = x;
+    if (max <= min) {
+        return min;
+    }
+    return min + x % (max - min + 1);
+}
+
+void ConnectionStateMachine_Init(ConnectionStateMachine *machine,
+                                 const ConnectionBackoffConfig *config, uint32_t seed,
+                                 uint64_t nowMs)
+{
+    memset(machine, 0, sizeof(*machine));
+    machine->config = *config;
+    machine->state = ConnectionState_WaitingForNetwork;
+    machine->stateSinceMs = nowMs;
+    machine->statistics.entries[ConnectionState_WaitingForNetwork] = 1;
+    // xorshift gets stuck at zero
+    machine->randomState = seed != 0 ? seed : 0x9e3779b9u;
+}
+
+void ConnectionStateMachine_WaitForNetwork(ConnectionStateMachine *machine, uint64_t nowMs)
+{
+    EnterState(machine, ConnectionState_WaitingForNetwork, nowMs);
+}
+
+void ConnectionStateMachine_StartAttempt(ConnectionStateMachine *machine, uint64_t nowMs)
+{
+    machine->statistics.attempts++;
+    EnterState(machine, ConnectionState_Connecting, nowMs);
+}
+
+void ConnectionStateMachine_Connected(ConnectionStateMachine *machine, uint64_t nowMs)
+{
+    machine->statistics.connects++;
+    machine->failureStreak = 0;
+    machine->previousDelayMs = 0;
+    machine->retryDelayMs = 0;
+    EnterState(machine, ConnectionState_Connected, nowMs);
+}
+
+uint32_t ConnectionStateMachine_Fail(ConnectionStateMachine *machine, ConnectionFailure failure,
+                                     uint64_t nowMs)
+{
+    const ConnectionBackoffConfig *config = &machine->config;
+    machine->statistics.failures[failure]++;
+
+    if (failure == ConnectionFailure_Network) {
+        machine->retryDelayMs = 0;
+        EnterState(machine, ConnectionState_WaitingForNetwork, nowMs);
+        return 0;
+    }
+
+    machine->failureStreak++;
+    uint32_t delayMs;
+    if (failure == ConnectionFailure_Transient && machine->failureStreak <= config->fastRetries) {
+        delayMs = RandomBetween(machine, config->fastRetryMinMs, config->fastRetryMaxMs);
+        // Carry the jitter over, or the first backoff after the quick retries would be exactly
+        // the base for every device.
+        machine->previousDelayMs = delayMs;
+    } else {
+        // Decorrelated jitter
+        uint32_t baseMs =
+            failure == ConnectionFailure_Auth ? config->authBaseMs : config->transientBaseMs;
+        uint64_t upperMs = (uint64_t)machine->previousDelayMs * 3;
+        if (upperMs < baseMs) {
+            upperMs = baseMs;
+        }
+        if (upperMs > config->capMs) {
+            upperMs = config->capMs;
+        }
+        delayMs = RandomBetween(machine, baseMs < config->capMs ? baseMs : config->capMs,
+                                (uint32_t)upperMs);
+        machine->previousDelayMs = delayMs;
+    }
+
+    machine->retryDelayMs = delayMs;
+    machine->statistics.lastRetryDelayMs = delayMs;
+    EnterState(machine, ConnectionState_BackingOff, nowMs);
+    return delayMs;
+}
+
+ConnectionState ConnectionStateMachine_GetState(const ConnectionStateMachine *machine)
+{
+    return machine->state;
+}
+
+uint32_t ConnectionStateMachine_GetRetryDelayMs(const ConnectionStateMachine *machine)
+{
+    return machine->retryDelayMs;
+}
+
+const char *ConnectionState_GetName(ConnectionState state)
+{
+    return state < ConnectionState_Count ? stateNames[state] : "Unknown";
+}
+
+int ConnectionStateMachine_FormatStatistics(const ConnectionStateMachine *machine, uint64_t nowMs,
+                                            char *buffer, size_t bufferSize)
+{
+    const ConnectionStatistics *s = &machine->statistics;
+    uint64_t currentMs = nowMs - machine->stateSinceMs;
+    unsigned long long timeInStateMs[ConnectionState_Count];
+    for (int i = 0; i < ConnectionState_Count; i++) {
+        timeInStateMs[i] = s->timeInStateMs[i] + (i == (int)machine->state ? currentMs : 0);
+    }
+
+    return snprintf(
+        buffer, bufferSize,
+        "\"state\":\"%s\",\"inStateMs\":%llu,\"attempts\":%u,\"connects\":%u,"
+        "\"failures\":{\"network\":%u,\"transient\":%u,\"auth\":%u},\"lastRetryDelayMs\":%u,"
+        "\"timeInStateMs\":{\"WaitingForNetwork\":%llu,\"Connecting\":%llu,\"Connected\":%llu,"
+        "\"BackingOff\":%llu},\"entries\":{\"WaitingForNetwork\":%u,\"Connecting\":%u,"
+        "\"Connected\":%u,\"BackingOff\":%u}",
+        ConnectionState_GetName(machine->state), (unsigned long long)currentMs, s->attempts,
+        s->connects, s->failures[ConnectionFailure_Network],
+        s->failures[ConnectionFailure_Transient], s->failures[ConnectionFailure_Auth],
+        s->lastRetryDelayMs, timeInStateMs[ConnectionState_WaitingForNetwork],
+        timeInStateMs[ConnectionState_Connecting], timeInStateMs[ConnectionState_Connected],
+        timeInStateMs[ConnectionState_BackingOff], s->entries[ConnectionState_WaitingForNetwork],
+        s->entries[ConnectionState_Connecting], s->entries[ConnectionState_Connected],
+        s->entries[ConnectionState_BackingOff]);
+}
@@ -0,0 +1,143 @@
+#pragma once
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+/// <summary>
+///     State of the connection to IoT Hub.
+/// </summary>
+typedef enum {
+    /// <summary>Waiting for the device to have a network connection.</summary>
+    ConnectionState_WaitingForNetwork,
+    /// <summary>Provisioning and creating the IoT Hub client.</summary>
+    ConnectionState_Connecting,
+    ConnectionState_Connected,
+    /// <summary>Waiting to retry after a failed attempt or a lost connection.</summary>
+    ConnectionState_BackingOff,
+    ConnectionState_Count
+} ConnectionState;
+
+/// <summary>
+///     Why a connection attempt failed or a connection was lost. Each kind is retried
+///     differently.
+/// </summary>
+typedef enum {
+    /// <summary>No network: retried as soon as the network is back, without backing off.</summary>
+    ConnectionFailure_Network,
+    /// <summary>A failure that is likely to clear by itself, such as a communication error or an
+    /// expired SAS token: a few quick retries, then backoff.</summary>
+    ConnectionFailure_Transient,
+    /// <summary>The device could not authenticate, or is not enrolled or is disabled: a slower
+    /// backoff from the start, as retrying quickly will not help.</summary>
+    ConnectionFailure_Auth,
+    ConnectionFailure_Count
+} ConnectionFailure;
+
+/// <summary>
+///     Retry timing.
+/// </summary>
+typedef struct ConnectionBackoffConfig {
+    /// <summary>Quick retries after a transient failure before backing off.</summary>
+    uint32_t fastRetries;
+    /// <summary>Range of the quick retry delay.</summary>
+    uint32_t fastRetryMinMs;
+    uint32_t fastRetryMaxMs;
+    /// <summary>Shortest delay once backing off from transient failures.</summary>
+    uint32_t transientBaseMs;
+    /// <summary>Shortest delay after an authentication failure.</summary>
+    uint32_t authBaseMs;
+    /// <summary>Longest delay of any kind.</summary>
+    uint32_t capMs;
+} ConnectionBackoffConfig;
+
+/// <summary>
+///     Counters and time spent in each state. Times include the current state only once it has
+///     been left; ConnectionStateMachine_FormatStatistics adds it.
+/// </summary>
+typedef struct ConnectionStatistics {
+    uint32_t attempts;
+    uint32_t connects;
+    uint32_t failures[ConnectionFailure_Count];
+    uint32_t entries[ConnectionState_Count];
+    uint64_t timeInStateMs[ConnectionState_Count];
+    uint32_t lastRetryDelayMs;
+} ConnectionStatistics;
+
+/// <summary>
+/// <para>Tracks the connection to IoT Hub and decides when to retry.</para>
+/// <para>After a transient failure, the first few retries come after a short random delay, so a
+/// brief loss of connection costs seconds rather than minutes. After that, and from the start
+/// for authentication failures, the delay uses decorrelated jitter: a random time between the
+/// base and three times the previous delay, up to the cap. Devices that lose their connection
+/// together therefore spread out rather than reconnect in lockstep. A connection resets the
+/// backoff.</para>
+/// </summary>
+typedef struct ConnectionStateMachine {
+    ConnectionBackoffConfig config;
+    ConnectionState state;
+    uint64_t stateSinceMs;
+    /// <summary>Failures since the last connection.</summary>
+    uint32_t failureStreak;
+    uint32_t previousDelayMs;
+    /// <summary>Delay chosen for the current backoff.</summary>
+    uint32_t retryDelayMs;
+    uint32_t randomState;
+    ConnectionStatistics statistics;
+} ConnectionStateMachine;
+
+/// <summary>
+///     Initializes the state machine in the WaitingForNetwork state.
+/// </summary>
+/// <param name="machine">State machine to initialize</param>
+/// <param name="config">Retry timing; copied</param>
+/// <param name="seed">Seed for the jitter, which should differ between devices</param>
+/// <param name="nowMs">Current time in milliseconds</param>
+void ConnectionStateMachine_Init(ConnectionStateMachine *machine,
+                                 const ConnectionBackoffConfig *config, uint32_t seed,
+                                 uint64_t nowMs);
+
+/// <summary>
+///     Records that the network is not ready.
+/// </summary>
+void ConnectionStateMachine_WaitForNetwork(ConnectionStateMachine *machine, uint64_t nowMs);
+
+/// <summary>
+///     Records the start of a connection attempt.
+/// </summary>
+void ConnectionStateMachine_StartAttempt(ConnectionStateMachine *machine, uint64_t nowMs);
+
+/// <summary>
+///     Records a connection, which resets the backoff.
+/// </summary>
+void ConnectionStateMachine_Connected(ConnectionStateMachine *machine, uint64_t nowMs);
+
+/// <summary>
+///     Records a failed attempt or a lost connection and chooses the delay before the next
+///     attempt. A network failure moves to WaitingForNetwork with no delay; the others move to
+///     BackingOff.
+/// </summary>
+/// <returns>The delay before the next attempt, in milliseconds</returns>
+uint32_t ConnectionStateMachine_Fail(ConnectionStateMachine *machine, ConnectionFailure failure,
+                                     uint64_t nowMs);
+
+/// <summary>
+///     Gets the current state.
+/// </summary>
+ConnectionState ConnectionStateMachine_GetState(const ConnectionStateMachine *machine);
+
+/// <summary>
+///     Gets the delay chosen by the last failure.
+/// </summary>
+uint32_t ConnectionStateMachine_GetRetryDelayMs(const ConnectionStateMachine *machine);
+
+/// <summary>
+///     Gets the name of a state, for logs and reports.
+/// </summary>
+const char *ConnectionState_GetName(ConnectionState state);
+
+/// <summary>
+///     Formats the state and statistics as a JSON object body, without the surrounding braces.
+/// </summary>
+/// <returns>The snprintf result</returns>
+int ConnectionStateMachine_FormatStatistics(const ConnectionStateMachine *machine, uint64_t nowMs,
+                                            char *buffer, size_t bufferSize);
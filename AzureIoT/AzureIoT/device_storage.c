@@ -0,0 +1,257 @@
+#include <errno.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <applibs/log.h>
+#include <applibs/storage.h>
+#include "device_storage.h"
+
+// The file holds two slots, each a header followed by the document. Saves alternate between
+// them, so a reset during a save can only damage the slot being written; Load takes the valid
+// slot with the later sequence number. Two slots fill the MutableStorage size in the app
+// manifest.
+#define SLOT_SIZE (8 * 1024)
+#define SLOT_COUNT 2
+#define SLOT_MAGIC 0x31475453 // "STG1"
+
+typedef struct SlotHeader {
+    uint32_t magic;
+    uint32_t sequence;
+    uint32_t length;
+    /// <summary>
+    /// FNV-1a hash of the sequence, the length and the document.
+    /// </summary>
+    uint32_t checksum;
+} SlotHeader;
+
+#define MAX_DOCUMENT_SIZE (SLOT_SIZE - sizeof(SlotHeader))
+
+static JSON_Value *document = NULL;
+// Sequence number of the slot last loaded or saved, and the slot the next save goes to
+static uint32_t sequence = 0;
+static int nextSlot = 0;
+
+static void ResetDocument(void)
+{
+    json_value_free(document);
+    document = json_value_init_object();
+}
+
+static uint32_t HashBytes(uint32_t hash, const void *bytes, size_t count)
+{
+    const uint8_t *byte = bytes;
+    for (size_t i = 0; i < count; i++) {
+        hash = (hash ^ byte[i]) * 16777619u;
+    }
+    return hash;
+}
+
+static uint32_t GetChecksum(const SlotHeader *header, const char *text)
+{
+    uint32_t hash = 2166136261u;
+    hash = HashBytes(hash, &header->sequence, sizeof(header->sequence));
+    hash = HashBytes(hash, &header->length, sizeof(header->length));
+    return HashBytes(hash, text, header->length);
+}
+
+/// <summary>
+///     Reads up to count bytes at the given offset.
+/// </summary>
+/// <returns>The number of bytes read, which is less than count at the end of the file, or -1 on
+/// failure</returns>
+static ssize_t ReadAt(int fd, off_t offset, void *buffer, size_t count)
+{
+    if (lseek(fd, offset, SEEK_SET) == -1) {
+        return -1;
+    }
+    size_t length = 0;
+    while (length < count) {
+        ssize_t bytesRead = read(fd, (char *)buffer + length, count - length);
+        if (bytesRead == -1) {
+            return -1;
+        }
+        if (bytesRead == 0) {
+            break;
+        }
+        length += (size_t)bytesRead;
+    }
+    return (ssize_t)length;
+}
+
+static int WriteAt(int fd, off_t offset, const void *buffer, size_t count)
+{
+    if (lseek(fd, offset, SEEK_SET) == -1) {
+        return -1;
+    }
+    size_t written = 0;
+    while (written < count) {
+        ssize_t bytesWritten = write(fd, (const char *)buffer + written, count - written);
+        if (bytesWritten == -1) {
+            return -1;
+        }
+        written += (size_t)bytesWritten;
+    }
+    return 0;
+}
+
+typedef enum {
+    SlotState_ReadFailed = -1,
+    /// <summary>
+    /// Never written: the file ends before the slot, or its header is zeros.
+    /// </summary>
+    SlotState_Blank,
+    SlotState_Damaged,
+    SlotState_Valid
+} SlotState;
+
+/// <summary>
+///     Reads one slot, and its document into text with a terminator. text must hold
+///     MAX_DOCUMENT_SIZE + 1 bytes.
+/// </summary>
+static SlotState ReadSlot(int fd, int slot, SlotHeader *header, char *text)
+{
+    static const SlotHeader blankHeader = {0};
+    off_t offset = (off_t)slot * SLOT_SIZE;
+    ssize_t bytesRead = ReadAt(fd, offset, header, sizeof(*header));
+    if (bytesRead == -1) {
+        return SlotState_ReadFailed;
+    }
+    bool zeros = (size_t)bytesRead == sizeof(*header) &&
+                 memcmp(header, &blankHeader, sizeof(*header)) == 0;
+    if (bytesRead == 0 || zeros) {
+        return SlotState_Blank;
+    }
+    if ((size_t)bytesRead < sizeof(*header) || header->magic != SLOT_MAGIC ||
+        header->length > MAX_DOCUMENT_SIZE) {
+        return SlotState_Damaged;
+    }
+    bytesRead = ReadAt(fd, offset + (off_t)sizeof(*header), text, header->length);
+    if (bytesRead == -1) {
+        return SlotState_ReadFailed;
+    }
+    if ((size_t)bytesRead < header->length || GetChecksum(header, text) != header->checksum) {
+        return SlotState_Damaged;
+    }
+    text[header->length] = '\0';
+    return SlotState_Valid;
+}
+
+int DeviceStorage_Load(void)
+{
+    ResetDocument();
+    sequence = 0;
+    nextSlot = 0;
+
+    int fd = Storage_OpenMutableFile();
+    if (fd == -1) {
+        Log_Debug("ERROR: Could not open mutable storage: %s (%d).\n", strerror(errno), errno);
+        return -1;
+    }
+
+    static char text[MAX_DOCUMENT_SIZE + 1];
+    SlotHeader header;
+    int newest = -1;
+    uint32_t newestSequence = 0;
+    bool damaged = false;
+    for (int slot = 0; slot < SLOT_COUNT; slot++) {
+        SlotState state = ReadSlot(fd, slot, &header, text);
+        if (state == SlotState_ReadFailed) {
+            Log_Debug("ERROR: Could not read mutable storage: %s (%d).\n", strerror(errno), errno);
+            close(fd);
+            return -1;
+        }
+        if (state != SlotState_Valid) {
+            damaged |= state == SlotState_Damaged;
+            continue;
+        }
+        // The sequence number may have wrapped
+        if (newest == -1 || (int32_t)(header.sequence - newestSequence) > 0) {
+            newest = slot;
+            newestSequence = header.sequence;
+        }
+    }
+    if (damaged) {
+        Log_Debug("WARNING: A settings slot in mutable storage is damaged; %s\n",
+                  newest == -1 ? "starting empty" : "using the other");
+    }
+    if (newest == -1) {
+        close(fd);
+        return damaged ? -1 : 0;
+    }
+    // The loop may have left the other slot in the buffer
+    SlotState state = ReadSlot(fd, newest, &header, text);
+    close(fd);
+    if (state != SlotState_Valid) {
+        Log_Debug("ERROR: Could not read mutable storage: %s (%d).\n", strerror(errno), errno);
+        return -1;
+    }
+
+    JSON_Value *parsed = json_parse_string(text);
+    if (parsed == NULL || json_value_get_type(parsed) != JSONObject) {
+        Log_Debug("WARNING: Mutable storage does not hold a settings document; starting empty\n");
+        json_value_free(parsed);
+        return -1;
+    }
+    json_value_free(document);
+    document = parsed;
+    sequence = header.sequence;
+    nextSlot = (newest + 1) % SLOT_COUNT;
+    return 0;
+}
+
+JSON_Object *DeviceStorage_GetRoot(void)
+{
+    if (document == NULL) {
+        ResetDocument();
+    }
+    return json_value_get_object(document);
+}
+
+int DeviceStorage_Save(void)
+{
+    char *serialized = json_serialize_to_string(document);
+    if (serialized == NULL) {
+        Log_Debug("ERROR: Could not serialize settings\n");
+        return -1;
+    }
+    size_t length = strlen(serialized);
+    if (length > MAX_DOCUMENT_SIZE) {
+        Log_Debug("ERROR: Settings are %zu bytes, over the %zu byte limit\n", length,
+                  MAX_DOCUMENT_SIZE);
+        json_free_serialized_string(serialized);
+        return -1;
+    }
+
+    int fd = Storage_OpenMutableFile();
+    if (fd == -1) {
+        Log_Debug("ERROR: Could not open mutable storage: %s (%d).\n", strerror(errno), errno);
+        json_free_serialized_string(serialized);
+        return -1;
+    }
+
+    // The slot that is not overwritten keeps the previous document until this one is complete
+    SlotHeader header = {.magic = SLOT_MAGIC, .sequence = sequence + 1, .length = (uint32_t)length};
+    header.checksum = GetChecksum(&header, serialized);
+    off_t offset = (off_t)nextSlot * SLOT_SIZE;
+    int result = -1;
+    if (WriteAt(fd, offset + (off_t)sizeof(header), serialized, length) == -1 ||
+        WriteAt(fd, offset, &header, sizeof(header)) == -1) {
+        Log_Debug("ERROR: Could not write mutable storage: %s (%d).\n", strerror(errno), errno);
+    } else {
+        sequence = header.sequence;
+        nextSlot = (nextSlot + 1) % SLOT_COUNT;
+        result = 0;
+    }
+
+    close(fd);
+    json_free_serialized_string(serialized);
+    return result;
+}
+
+void DeviceStorage_Close(void)
+{
+    json_value_free(document);
+    document = NULL;
+}
@@ -0,0 +1,36 @@
+#pragma once
+#include "parson.h"
+
+/// <summary>
+/// <para>Settings the application keeps across restarts, stored as one JSON document in its
+/// mutable storage file. The app manifest must request 16 KB of MutableStorage, which holds two
+/// copies: each save overwrites the older one, so a reset during a save leaves the previous
+/// document intact.</para>
+/// <para>The document is read once by DeviceStorage_Load and kept in memory. Callers change it
+/// through the parson object API and write it back with DeviceStorage_Save. Each user keeps its
+/// settings under its own top-level name. A missing or unreadable file gives an empty
+/// document.</para>
+/// </summary>
+
+/// <summary>
+///     Reads the document from mutable storage.
+/// </summary>
+/// <returns>0 on success, or -1 if the file could not be read or neither copy is intact, in which
+/// case the document is empty</returns>
+int DeviceStorage_Load(void);
+
+/// <summary>
+///     Gets the root object of the document. Valid until DeviceStorage_Close.
+/// </summary>
+JSON_Object *DeviceStorage_GetRoot(void);
+
+/// <summary>
+///     Writes the document to mutable storage, replacing the previous contents.
+/// </summary>
+/// <returns>0 on success, or -1 on failure</returns>
+int DeviceStorage_Save(void);
+
+/// <summary>
+///     Frees the document.
+/// </summary>
+void DeviceStorage_Close(void);
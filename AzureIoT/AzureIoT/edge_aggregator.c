@@ -0,0 +1,184 @@
+#include <stdio.h>
+#include <string.h>
+#include "edge_aggregator.h"
+
+#define FIXED_POINT_TEXT_LENGTH 16
+
+void EdgeAggregator_Init(EdgeAggregator *aggregator, EdgeAggregatorEmitFunction emit,
+                         void *emitContext)
+{
+    memset(aggregator, 0, sizeof(*aggregator));
+    aggregator->emit = emit;
+    aggregator->emitContext = emitContext;
+}
+
+int EdgeAggregator_ParseFixedPoint(const char *text, int32_t *value)
+{
+    bool negative = false;
+    int64_t integer = 0;
+    int64_t fraction = 0;
+    int fractionDigits = 0;
+    bool anyDigits = false;
+
+    if (*text == '-' || *text == '+') {
+        negative = (*text == '-');
+        text++;
+    }
+    for (; *text >= '0' && *text <= '9'; text++) {
+        integer = integer * 10 + (*text - '0');
+        // Keeps integer small while digits are read; the full value is checked below.
+        if (integer > INT32_MAX / EDGE_AGGREGATOR_SCALE) {
+            return -1;
+        }
+        anyDigits = true;
+    }
+    if (*text == '.') {
+        text++;
+        for (; *text >= '0' && *text <= '9'; text++) {
+            if (fractionDigits < 2) {
+                fraction = fraction * 10 + (*text - '0');
+                fractionDigits++;
+            }
+            anyDigits = true;
+        }
+    }
+    if (!anyDigits || *text != 0) {
+        return -1;
+    }
+    for (; fractionDigits < 2; fractionDigits++) {
+        fraction *= 10;
+    }
+
+    int64_t result = integer * EDGE_AGGREGATOR_SCALE + fraction;
+    if (result > (negative ? -(int64_t)INT32_MIN : INT32_MAX)) {
+        return -1;
+    }
+    *value = (int32_t)(negative ? -result : result);
+    return 0;
+}
+
+static void FormatFixedPoint(int32_t value, char *buffer)
+{
+    const char *sign = value < 0 ? "-" : "";
+    uint32_t magnitude = value < 0 ? (uint32_t)0 - (uint32_t)value : (uint32_t)value;
+    snprintf(buffer, FIXED_POINT_TEXT_LENGTH, "%s%lu.%02lu", sign,
+             (unsigned long)(magnitude / EDGE_AGGREGATOR_SCALE),
+             (unsigned long)(magnitude % EDGE_AGGREGATOR_SCALE));
+}
+
+static void ResetWindow(AggregateSeries *series)
+{
+    series->min = INT32_MAX;
+    series->max = INT32_MIN;
+    series->sum = 0;
+    series->count = 0;
+}
+
+static AggregateSeries *FindOrAddSeries(EdgeAggregator *aggregator, int node, const char *key)
+{
+    for (size_t i = 0; i < aggregator->seriesCount; i++) {
+        AggregateSeries *series = &aggregator->series[i];
+        if (series->node == node && strncmp(series->key, key, TELEMETRY_KEY_LENGTH) == 0) {
+            return series;
+        }
+    }
+    if (aggregator->seriesCount == EDGE_AGGREGATOR_MAX_SERIES ||
+        strlen(key) >= TELEMETRY_KEY_LENGTH) {
+        return NULL;
+    }
+
+    AggregateSeries *series = &aggregator->series[aggregator->seriesCount++];
+    memset(series, 0, sizeof(*series));
+    series->node = node;
+    strcpy(series->key, key);
+    ResetWindow(series);
+    return series;
+}
+
+int EdgeAggregator_SetRawThreshold(EdgeAggregator *aggregator, int node, const char *key,
+                                   int32_t low, int32_t high)
+{
+    AggregateSeries *series = FindOrAddSeries(aggregator, node, key);
+    if (series == NULL) {
+        return -1;
+    }
+    series->hasRawThreshold = true;
+    series->rawLow = low;
+    series->rawHigh = high;
+    return 0;
+}
+
+int EdgeAggregator_AddReading(EdgeAggregator *aggregator, int node, MessagePriority priority,
+                              TelemetryClass telemetryClass, const char *key, const char *value)
+{
+    int32_t reading;
+    if (EdgeAggregator_ParseFixedPoint(value, &reading) != 0) {
+        return -1;
+    }
+    AggregateSeries *series = FindOrAddSeries(aggregator, node, key);
+    if (series == NULL) {
+        return -1;
+    }
+
+    series->priority = priority;
+    series->telemetryClass = telemetryClass;
+    if (reading < series->min) {
+        series->min = reading;
+    }
+    if (reading > series->max) {
+        series->max = reading;
+    }
+    series->sum += reading;
+    series->count++;
+    series->last = reading;
+
+    if (series->hasRawThreshold) {
+        bool outside = reading < series->rawLow || reading > series->rawHigh;
+        if (outside != series->outsideRawBand) {
+            series->outsideRawBand = outside;
+            const char *keys[] = {key};
+            const char *values[] = {value};
+            aggregator->emit(node, priority, telemetryClass, keys, values, 1,
+                             aggregator->emitContext);
+        }
+    }
+    return 0;
+}
+
+void EdgeAggregator_Flush(EdgeAggregator *aggregator)
+{
+    static const char *const suffixes[] = {"Min", "Max", "Avg", "Last", "N"};
+    char keys[5][TELEMETRY_KEY_LENGTH];
+    char values[5][FIXED_POINT_TEXT_LENGTH];
+    const char *keyPointers[5];
+    const char *valuePointers[5];
+
+    for (size_t i = 0; i < aggregator->seriesCount; i++) {
+        AggregateSeries *series = &aggregator->series[i];
+        if (series->count == 0) {
+            continue;
+        }
+
+        // Round the mean half away from zero.
+        int64_t half = (int64_t)series->count / 2;
+        int64_t mean = (series->sum + (series->sum < 0 ? -half : half)) / (int64_t)series->count;
+
+        FormatFixedPoint(series->min, values[0]);
+        FormatFixedPoint(series->max, values[1]);
+        FormatFixedPoint((int32_t)mean, values[2]);
+        FormatFixedPoint(series->last, values[3]);
+        snprintf(values[4], FIXED_POINT_TEXT_LENGTH, "%u", series->count);
+        for (int field = 0; field < 5; field++) {
+            // Keys that do not fit lose characters from the metric name, not the suffix.
+            int nameLength = (int)(TELEMETRY_KEY_LENGTH - 1 - strlen(suffixes[field]));
+            snprintf(keys[field], TELEMETRY_KEY_LENGTH, "%.*s%s", nameLength, series->key,
+                     suffixes[field]);
+            keyPointers[field] = keys[field];
+            valuePointers[field] = values[field];
+        }
+
+        aggregator->emit(series->node, series->priority, series->telemetryClass, keyPointers,
+                         valuePointers, 5, aggregator->emitContext);
+        ResetWindow(series);
+    }
+}
@@ -0,0 +1,105 @@
+#pragma once
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include "outbound_queue.h"
+
+#define EDGE_AGGREGATOR_MAX_SERIES 32
+
+/// <summary>
+///     Number of decimal places kept by the fixed-point readings, i.e. values are stored in
+///     hundredths.
+/// </summary>
+#define EDGE_AGGREGATOR_SCALE 100
+
+/// <summary>
+///     Function the aggregator calls to send a window summary or a raw sample.
+/// </summary>
+/// <param name="node">Node the series belongs to</param>
+/// <param name="priority">Priority the readings were submitted with</param>
+/// <param name="telemetryClass">Class the readings were submitted with</param>
+/// <param name="keys">Field names</param>
+/// <param name="values">Field values, formatted as decimal text</param>
+/// <param name="count">Number of fields</param>
+/// <param name="context">Context given to EdgeAggregator_Init</param>
+typedef void (*EdgeAggregatorEmitFunction)(int node, MessagePriority priority,
+                                           TelemetryClass telemetryClass,
+                                           const char *const keys[], const char *const values[],
+                                           size_t count, void *context);
+
+/// <summary>
+/// <para>Streaming statistics for one metric of one node over the current window.</para>
+/// <para>Values are fixed-point with EDGE_AGGREGATOR_SCALE; the sum is 64-bit so a window can
+/// hold far more readings than a node can produce.</para>
+/// </summary>
+typedef struct AggregateSeries {
+    int node;
+    MessagePriority priority;
+    TelemetryClass telemetryClass;
+    char key[TELEMETRY_KEY_LENGTH];
+    int32_t min;
+    int32_t max;
+    int64_t sum;
+    uint32_t count;
+    int32_t last;
+    /// <summary>
+    /// Raw samples outside [rawLow, rawHigh] are forwarded as they cross the band edge.
+    /// </summary>
+    bool hasRawThreshold;
+    int32_t rawLow;
+    int32_t rawHigh;
+    bool outsideRawBand;
+} AggregateSeries;
+
+/// <summary>
+///     Per node and metric tumbling-window aggregator. All state is preallocated; adding a
+///     reading never allocates.
+/// </summary>
+typedef struct EdgeAggregator {
+    AggregateSeries series[EDGE_AGGREGATOR_MAX_SERIES];
+    size_t seriesCount;
+    EdgeAggregatorEmitFunction emit;
+    void *emitContext;
+} EdgeAggregator;
+
+/// <summary>
+///     Initializes an empty aggregator.
+/// </summary>
+void EdgeAggregator_Init(EdgeAggregator *aggregator, EdgeAggregatorEmitFunction emit,
+                         void *emitContext);
+
+/// <summary>
+///     Forwards raw samples of a series whenever they cross out of or back into [low, high],
+///     in addition to the window summary. Values are fixed-point with EDGE_AGGREGATOR_SCALE.
+/// </summary>
+/// <returns>0 on success, or -1 if the series table is full</returns>
+int EdgeAggregator_SetRawThreshold(EdgeAggregator *aggregator, int node, const char *key,
+                                   int32_t low, int32_t high);
+
+/// <summary>
+///     Adds a reading to the current window of its series.
+/// </summary>
+/// <param name="aggregator">The aggregator</param>
+/// <param name="node">Node the reading came from</param>
+/// <param name="priority">Priority used for the summary and any raw sample</param>
+/// <param name="telemetryClass">Class used for the summary and any raw sample</param>
+/// <param name="key">Metric name, e.g. "RoomTemp"</param>
+/// <param name="value">Reading as decimal text</param>
+/// <returns>0 on success, or -1 if the value is not numeric or the series table is full, in
+/// which case the caller should forward the reading itself</returns>
+int EdgeAggregator_AddReading(EdgeAggregator *aggregator, int node, MessagePriority priority,
+                              TelemetryClass telemetryClass, const char *key, const char *value);
+
+/// <summary>
+///     Ends the current window: emits one summary per series that received readings and resets
+///     the statistics. Series and thresholds are kept.
+/// </summary>
+void EdgeAggregator_Flush(EdgeAggregator *aggregator);
+
+/// <summary>
+///     Parses decimal text such as "23", "-4.5" or "3.05" into a fixed-point value with
+///     EDGE_AGGREGATOR_SCALE. Digits beyond the scale are truncated.
+/// </summary>
+/// <returns>0 on success, or -1 if the text is not a decimal number or the value does not fit
+/// in an int32_t</returns>
+int EdgeAggregator_ParseFixedPoint(const char *text, int32_t *value);
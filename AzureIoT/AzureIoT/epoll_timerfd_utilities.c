@@ -2,14 +2,72 @@
    Licensed under the MIT License. */
 
 #include <errno.h>
+#include <stdio.h>
 #include <string.h>
 #include <unistd.h>
+#include <sys/eventfd.h>
 #include <sys/timerfd.h>
 #include <applibs/log.h>
 #include "epoll_timerfd_utilities.h"
+#ifdef EVENT_LOOP_IO_URING
+#include "io_uring_loop.h"
+#endif
+
+// Events harvested by WaitForEventsAndCallHandlers that have not been dispatched yet, so that
+// unregistering or closing a file descriptor can cancel them.
+static struct epoll_event *pendingEvents = NULL;
+static int pendingEventCount = 0;
+
+// Budget of the handler being dispatched by WaitForEventsAndCallHandlers: the time it must
+// yield by, or 0 if it has no budget.
+static uint64_t dispatchDeadlineUs = 0;
+static EventDispatchStatistics *dispatchStatistics = NULL;
+
+// Calls into the kernel to register and wait for events since the last wait, added to the
+// statistics by WaitForEventsAndCallHandlers.
+static uint32_t backendSyscalls = 0;
+
+/// <summary>
+///     Cancels any harvested events for the file descriptor that are still to be dispatched.
+/// </summary>
+static void DiscardPendingEvents(int fd)
+{
+    for (int i = 0; i < pendingEventCount; i++) {
+        EventData *eventData = pendingEvents[i].data.ptr;
+        if (eventData != NULL && eventData->fd == fd) {
+            pendingEvents[i].data.ptr = NULL;
+        }
+    }
+}
+
+static uint64_t GetMonotonicTimeUs(void)
+{
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (uint64_t)now.tv_sec * 1000000 + (uint64_t)now.tv_nsec / 1000;
+}
+
+/// <summary>
+///     Calls an event's handler, timing it if the event has statistics attached.
+/// </summary>
+static void CallEventHandler(EventData *eventData)
+{
+    if (eventData->statistics == NULL) {
+        eventData->eventHandler(eventData);
+        return;
+    }
+
+    HandlerTiming timing;
+    HandlerStatistics_Begin(eventData->statistics, &timing);
+    eventData->eventHandler(eventData);
+    HandlerStatistics_End(eventData->statistics, &timing);
+}
 
 int CreateEpollFd(void)
 {
+#ifdef EVENT_LOOP_IO_URING
+    return IoUringLoop_Create();
+#else
     int epollFd = -1;
 
     epollFd = epoll_create1(0);
@@ -19,20 +77,31 @@ int CreateEpollFd(void)
     }
 
     return epollFd;
+#endif
 }
 
 int RegisterEventHandlerToEpoll(int epollFd, int eventFd, EventData *persistentEventData,
                                 const uint32_t epollEventMask)
 {
     persistentEventData->fd = eventFd;
+#ifdef EVENT_LOOP_IO_URING
+    if (IoUringLoop_Register(epollFd, eventFd, persistentEventData, epollEventMask) != 0) {
+        Log_Debug("ERROR: Could not register event to io_uring: %s (%d).\n", strerror(errno),
+                  errno);
+        return -1;
+    }
+    return 0;
+#else
     struct epoll_event eventToAddOrModify = {.data.ptr = persistentEventData,
                                              .events = epollEventMask};
 
     // Register the eventFd on the epoll instance referred by epollFd
     // and register the eventHandler handler for events in epollEventMask.
+    backendSyscalls++;
     if (epoll_ctl(epollFd, EPOLL_CTL_ADD, eventFd, &eventToAddOrModify) == -1) {
         // If the Add fails, retry with the Modify as the file descriptor has already been
         // added to the epoll set after it was removed by the kernel upon its closure.
+        backendSyscalls++;
         if (epoll_ctl(epollFd, EPOLL_CTL_MOD, eventFd, &eventToAddOrModify) == -1) {
             Log_Debug("ERROR: Could not register event to epoll instance: %s (%d).\n",
                       strerror(errno), errno);
@@ -41,12 +110,23 @@ int RegisterEventHandlerToEpoll(int epollFd, int eventFd, EventData *persistentE
     }
 
     return 0;
+#endif
 }
 
 int UnregisterEventHandlerFromEpoll(int epollFd, int eventFd)
 {
     int res = 0;
+    DiscardPendingEvents(eventFd);
+#ifdef EVENT_LOOP_IO_URING
+    if ((res = IoUringLoop_Unregister(epollFd, eventFd)) == -1) {
+        Log_Debug("ERROR: Could not remove event from io_uring: %s (%d).\n", strerror(errno),
+                  errno);
+    }
+    return res;
+#else
+
     // Unregister the eventFd on the epoll instance referred by epollFd.
+    backendSyscalls++;
     if ((res = epoll_ctl(epollFd, EPOLL_CTL_DEL, eventFd, NULL)) == -1) {
         if (res == -1 && errno != EBADF) { // Ignore EBADF errors
             Log_Debug("ERROR: Could not remove event from epoll instance: %s (%d).\n",
@@ -56,6 +136,7 @@ int UnregisterEventHandlerFromEpoll(int epollFd, int eventFd)
     }
 
     return 0;
+#endif
 }
 
 int SetTimerFdToPeriod(int timerFd, const struct timespec *period)
@@ -119,10 +200,33 @@ int CreateTimerFdAndAddToEpoll(int epollFd, const struct timespec *period,
     return timerFd;
 }
 
+/// <summary>
+///     Waits on the epoll instance, or on the io_uring that stands in for it.
+/// </summary>
+static int WaitForBackendEvents(int epollFd, struct epoll_event *events, int maxEvents,
+                                int timeoutMs)
+{
+#ifdef EVENT_LOOP_IO_URING
+    return IoUringLoop_Wait(epollFd, events, maxEvents, timeoutMs, &backendSyscalls);
+#else
+    backendSyscalls++;
+    return epoll_wait(epollFd, events, maxEvents, timeoutMs);
+#endif
+}
+
+const char *GetEventLoopBackendName(void)
+{
+#ifdef EVENT_LOOP_IO_URING
+    return "io_uring";
+#else
+    return "epoll";
+#endif
+}
+
 int WaitForEventAndCallHandler(int epollFd)
 {
     struct epoll_event event;
-    int numEventsOccurred = epoll_wait(epollFd, &event, 1, -1);
+    int numEventsOccurred = WaitForBackendEvents(epollFd, &event, 1, -1);
 
     if (numEventsOccurred == -1) {
         if (errno == EINTR) {
@@ -134,19 +238,882 @@ int WaitForEventAndCallHandler(int epollFd)
     }
 
     if (numEventsOccurred == 1 && event.data.ptr != NULL) {
-        EventData *eventData = event.data.ptr;
-        eventData->eventHandler(eventData);
+        CallEventHandler(event.data.ptr);
     }
 
     return 0;
 }
 
+/// <summary>
+///     Gets the dispatch class of an event, treating out-of-range priorities as the nearest class.
+/// </summary>
+static int GetPriorityClass(const EventData *eventData)
+{
+    if (eventData->priority > EventPriority_High) {
+        return EventPriority_High;
+    }
+    if (eventData->priority < EventPriority_Low) {
+        return EventPriority_Low;
+    }
+    return eventData->priority;
+}
+
+int WaitForEventsAndCallHandlers(int epollFd, struct epoll_event *events, int maxEvents,
+                                 int timeoutMs, EventDispatchStatistics *statistics)
+{
+    int numEventsOccurred = WaitForBackendEvents(epollFd, events, maxEvents, timeoutMs);
+    if (statistics != NULL) {
+        statistics->syscalls += backendSyscalls;
+        backendSyscalls = 0;
+    }
+
+    if (numEventsOccurred == -1) {
+        if (errno == EINTR) {
+            // interrupted by signal, e.g. due to breakpoint being set; ignore
+            return 0;
+        }
+        Log_Debug("ERROR: Failed waiting on events: %s (%d).\n", strerror(errno), errno);
+        return -1;
+    }
+
+    if (numEventsOccurred == 0) {
+        return 0;
+    }
+
+    if (statistics != NULL) {
+        statistics->wakeups++;
+        if ((uint32_t)numEventsOccurred > statistics->maxEventsPerWakeup) {
+            statistics->maxEventsPerWakeup = (uint32_t)numEventsOccurred;
+        }
+    }
+
+    pendingEvents = events;
+    pendingEventCount = numEventsOccurred;
+    dispatchStatistics = statistics;
+    // One pass per priority class keeps the order stable within a class. An entry is cleared
+    // when it is dispatched, so later passes skip it; entries still cleared before their pass
+    // were cancelled by an earlier handler.
+    int dispatched = 0;
+    for (int priority = EventPriority_High; priority >= EventPriority_Low; priority--) {
+        for (int i = 0; i < numEventsOccurred; i++) {
+            EventData *eventData = events[i].data.ptr;
+            if (eventData == NULL || GetPriorityClass(eventData) != priority) {
+                continue;
+            }
+            // Clear the entry first so the handler cannot cancel its own, already running, event.
+            events[i].data.ptr = NULL;
+            dispatchDeadlineUs =
+                eventData->budgetUs == 0 ? 0 : GetMonotonicTimeUs() + eventData->budgetUs;
+            CallEventHandler(eventData);
+            dispatchDeadlineUs = 0;
+            dispatched++;
+        }
+    }
+    dispatchStatistics = NULL;
+    pendingEvents = NULL;
+    pendingEventCount = 0;
+
+    if (statistics != NULL) {
+        statistics->eventsDispatched += (uint32_t)dispatched;
+        statistics->staleEventsSkipped += (uint32_t)(numEventsOccurred - dispatched);
+    }
+
+    return numEventsOccurred;
+}
+
+bool IsEventHandlerOverBudget(void)
+{
+    if (dispatchDeadlineUs == 0 || GetMonotonicTimeUs() < dispatchDeadlineUs) {
+        return false;
+    }
+    if (dispatchStatistics != NULL) {
+        dispatchStatistics->budgetYields++;
+    }
+    return true;
+}
+
+uint64_t GetMonotonicTimeMs(void)
+{
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (uint64_t)now.tv_sec * 1000 + (uint64_t)now.tv_nsec / 1000000;
+}
+
 void CloseFdAndPrintError(int fd, const char *fdName)
 {
     if (fd >= 0) {
+        // Closing removes the fd from epoll, but not events already harvested for it.
+        DiscardPendingEvents(fd);
+#ifdef EVENT_LOOP_IO_URING
+        IoUringLoop_ForgetFd(fd);
+#endif
         int result = close(fd);
         if (result != 0) {
             Log_Debug("ERROR: Could not close fd %s: %s (%d).\n", fdName, strerror(errno), errno);
         }
     }
-}
\ No newline at end of file
+}
+
+#define TIMER_WHEEL_SLOT_MASK (TIMER_WHEEL_SLOTS - 1)
+#define TIMER_WHEEL_OVERFLOW_LEVEL TIMER_WHEEL_LEVELS
+#define TIMER_WHEEL_NO_LEVEL 0xff
+
+static void TimerList_Init(TimerListNode *head)
+{
+    head->next = head;
+    head->prev = head;
+}
+
+static bool TimerList_IsEmpty(const TimerListNode *head)
+{
+    return head->next == head;
+}
+
+static void TimerList_Append(TimerListNode *head, TimerListNode *node)
+{
+    node->prev = head->prev;
+    node->next = head;
+    head->prev->next = node;
+    head->prev = node;
+}
+
+static void TimerList_Remove(TimerListNode *node)
+{
+    node->prev->next = node->next;
+    node->next->prev = node->prev;
+    node->next = node;
+    node->prev = node;
+}
+
+/// <summary>
+///     Moves every node of one list to the end of another, leaving the first list empty.
+/// </summary>
+static void TimerList_MoveAll(TimerListNode *from, TimerListNode *to)
+{
+    if (TimerList_IsEmpty(from)) {
+        return;
+    }
+    from->next->prev = to->prev;
+    to->prev->next = from->next;
+    from->prev->next = to;
+    to->prev = from->prev;
+    TimerList_Init(from);
+}
+
+/// <summary>
+///     Puts an armed timer in the slot for its deadline. The deadline must not be earlier than
+///     the wheel's current time.
+/// </summary>
+static void QueueTimer(TimerWheel *wheel, LogicalTimer *timer)
+{
+    for (int level = 0; level < TIMER_WHEEL_LEVELS; level++) {
+        unsigned int higherShift = TIMER_WHEEL_SLOT_BITS * (unsigned int)(level + 1);
+        if ((timer->deadlineMs >> higherShift) == (wheel->currentMs >> higherShift)) {
+            unsigned int slot =
+                (unsigned int)(timer->deadlineMs >> (TIMER_WHEEL_SLOT_BITS * level)) &
+                TIMER_WHEEL_SLOT_MASK;
+            timer->level = (uint8_t)level;
+            timer->slot = (uint8_t)slot;
+            TimerList_Append(&wheel->slots[level][slot], &timer->node);
+            wheel->occupiedSlots[level] |= 1ULL << slot;
+            return;
+        }
+    }
+
+    timer->level = TIMER_WHEEL_OVERFLOW_LEVEL;
+    TimerList_Append(&wheel->overflow, &timer->node);
+}
+
+static void UnqueueTimer(TimerWheel *wheel, LogicalTimer *timer)
+{
+    TimerList_Remove(&timer->node);
+    if (timer->level < TIMER_WHEEL_LEVELS &&
+        TimerList_IsEmpty(&wheel->slots[timer->level][timer->slot])) {
+        wheel->occupiedSlots[timer->level] &= ~(1ULL << timer->slot);
+    }
+    timer->level = TIMER_WHEEL_NO_LEVEL;
+}
+
+/// <summary>
+///     Re-queues every timer of a list, now that the current time has moved closer to them.
+/// </summary>
+static void RequeueTimers(TimerWheel *wheel, TimerListNode *head)
+{
+    TimerListNode pending;
+    TimerList_Init(&pending);
+    TimerList_MoveAll(head, &pending);
+    while (!TimerList_IsEmpty(&pending)) {
+        LogicalTimer *timer = (LogicalTimer *)pending.next;
+        TimerList_Remove(&timer->node);
+        QueueTimer(wheel, timer);
+    }
+}
+
+/// <summary>
+///     Moves timers down from the higher-level slots that start at the current time. Higher
+///     levels go first, as their timers may land in a lower slot that is cascaded next.
+/// </summary>
+static void CascadeTimers(TimerWheel *wheel)
+{
+    uint64_t current = wheel->currentMs;
+
+    if ((current & ((1ULL << (TIMER_WHEEL_SLOT_BITS * TIMER_WHEEL_LEVELS)) - 1)) == 0) {
+        RequeueTimers(wheel, &wheel->overflow);
+    }
+    for (int level = TIMER_WHEEL_LEVELS - 1; level > 0; level--) {
+        unsigned int shift = TIMER_WHEEL_SLOT_BITS * (unsigned int)level;
+        if ((current & ((1ULL << shift) - 1)) != 0) {
+            continue;
+        }
+        unsigned int slot = (unsigned int)(current >> shift) & TIMER_WHEEL_SLOT_MASK;
+        wheel->occupiedSlots[level] &= ~(1ULL << slot);
+        RequeueTimers(wheel, &wheel->slots[level][slot]);
+    }
+}
+
+/// <summary>
+///     Sets a timer's expiry, rounded up to its alignment, and its deadline.
+/// </summary>
+static void SetExpiry(LogicalTimer *timer, uint64_t expiryMs)
+{
+    if (timer->alignMs != 0) {
+        expiryMs = (expiryMs + timer->alignMs - 1) / timer->alignMs * timer->alignMs;
+    }
+    timer->expiryMs = expiryMs;
+    timer->deadlineMs = expiryMs + timer->slackMs;
+}
+
+static LogicalTimer *GetSlackTimer(TimerListNode *node)
+{
+    return (LogicalTimer *)((char *)node - offsetof(LogicalTimer, slackNode));
+}
+
+/// <summary>
+///     Runs the timers on the expired list. Periodic timers are re-queued before their handler
+///     runs so that the handler may cancel them, for their first expiry after nowMs, the time the
+///     wheel is being advanced to.
+/// </summary>
+static void RunExpiredList(TimerWheel *wheel, uint64_t nowMs)
+{
+    // A handler may cancel or restart any timer, including ones still on the expired list.
+    while (!TimerList_IsEmpty(&wheel->expired)) {
+        LogicalTimer *timer = (LogicalTimer *)wheel->expired.next;
+        TimerList_Remove(&timer->node);
+        wheel->statistics.timersRun++;
+        if (timer->periodMs != 0) {
+            uint64_t missed = (nowMs - timer->expiryMs) / timer->periodMs;
+            SetExpiry(timer, timer->expiryMs + (missed + 1) * timer->periodMs);
+            QueueTimer(wheel, timer);
+        } else {
+            timer->armed = false;
+            TimerList_Remove(&timer->slackNode);
+        }
+
+        if (timer->statistics == NULL) {
+            timer->handler(timer);
+        } else {
+            HandlerTiming timing;
+            HandlerStatistics_Begin(timer->statistics, &timing);
+            timer->handler(timer);
+            HandlerStatistics_End(timer->statistics, &timing);
+        }
+    }
+}
+
+/// <summary>
+///     Runs the timers in a level-0 slot, all of which have their deadline at the current time.
+/// </summary>
+static void RunExpiredTimers(TimerWheel *wheel, unsigned int slot, uint64_t nowMs)
+{
+    TimerListNode *head = &wheel->slots[0][slot];
+    if (TimerList_IsEmpty(head)) {
+        return;
+    }
+    wheel->occupiedSlots[0] &= ~(1ULL << slot);
+    TimerList_MoveAll(head, &wheel->expired);
+    for (TimerListNode *node = wheel->expired.next; node != &wheel->expired; node = node->next) {
+        ((LogicalTimer *)node)->level = TIMER_WHEEL_NO_LEVEL;
+    }
+    RunExpiredList(wheel, nowMs);
+}
+
+/// <summary>
+///     Runs the timers with slack whose expiry is not later than the current time, ahead of
+///     their deadline.
+/// </summary>
+/// <returns>The number of timers run</returns>
+static uint32_t RunSlackTimers(TimerWheel *wheel)
+{
+    uint32_t count = 0;
+    for (TimerListNode *node = wheel->slackTimers.next; node != &wheel->slackTimers;
+         node = node->next) {
+        LogicalTimer *timer = GetSlackTimer(node);
+        if (timer->level != TIMER_WHEEL_NO_LEVEL && timer->expiryMs <= wheel->currentMs) {
+            UnqueueTimer(wheel, timer);
+            TimerList_Append(&wheel->expired, &timer->node);
+            count++;
+        }
+    }
+    wheel->statistics.coalesced += count;
+    RunExpiredList(wheel, wheel->currentMs);
+    return count;
+}
+
+/// <summary>
+///     Finds the next time after the current time at which the wheel has work: a level-0 slot in
+///     use, a higher-level slot in use that cascades, or the overflow list cascading. As in
+///     GetNextDeadline, the lowest level with a slot in use after the current one comes first.
+/// </summary>
+/// <returns>The time, or UINT64_MAX if no timer is queued</returns>
+static uint64_t GetNextSlotTime(const TimerWheel *wheel)
+{
+    uint64_t current = wheel->currentMs;
+    for (int level = 0; level < TIMER_WHEEL_LEVELS; level++) {
+        unsigned int shift = TIMER_WHEEL_SLOT_BITS * (unsigned int)level;
+        unsigned int index = (unsigned int)(current >> shift) & TIMER_WHEEL_SLOT_MASK;
+        uint64_t laterSlots = index == TIMER_WHEEL_SLOT_MASK
+                                  ? 0
+                                  : wheel->occupiedSlots[level] & (~0ULL << (index + 1));
+        if (laterSlots != 0) {
+            uint64_t rotationStart = current & ~((1ULL << (shift + TIMER_WHEEL_SLOT_BITS)) - 1);
+            return rotationStart + ((uint64_t)__builtin_ctzll(laterSlots) << shift);
+        }
+    }
+
+    if (!TimerList_IsEmpty(&wheel->overflow)) {
+        unsigned int wheelBits = TIMER_WHEEL_SLOT_BITS * TIMER_WHEEL_LEVELS;
+        return ((current >> wheelBits) + 1) << wheelBits;
+    }
+    return UINT64_MAX;
+}
+
+/// <summary>
+///     Runs every timer that expires up to the given time. The wheel moves straight to the next
+///     slot in use at any level, so catching up after a long sleep does not step through the
+///     empty slots in between.
+/// </summary>
+static void AdvanceTimerWheel(TimerWheel *wheel, uint64_t nowMs)
+{
+    while (wheel->currentMs < nowMs) {
+        uint64_t next = GetNextSlotTime(wheel);
+        if (next > nowMs) {
+            wheel->currentMs = nowMs;
+            return;
+        }
+
+        wheel->currentMs = next;
+        if ((next & TIMER_WHEEL_SLOT_MASK) == 0) {
+            CascadeTimers(wheel);
+        }
+        RunExpiredTimers(wheel, (unsigned int)next & TIMER_WHEEL_SLOT_MASK, nowMs);
+    }
+}
+
+static uint64_t GetEarliestDeadline(const TimerListNode *head)
+{
+    uint64_t earliest = UINT64_MAX;
+    for (const TimerListNode *node = head->next; node != head; node = node->next) {
+        const LogicalTimer *timer = (const LogicalTimer *)node;
+        if (timer->deadlineMs < earliest) {
+            earliest = timer->deadlineMs;
+        }
+    }
+    return earliest;
+}
+
+/// <summary>
+///     Finds the earliest deadline of any armed timer. Every timer at one level expires before any
+///     timer at the next, and within a level the first slot in use after the current one holds
+///     the earliest timers.
+/// </summary>
+/// <returns>The deadline, or 0 if no timer is armed</returns>
+static uint64_t GetNextDeadline(const TimerWheel *wheel)
+{
+    for (int level = 0; level < TIMER_WHEEL_LEVELS; level++) {
+        unsigned int shift = TIMER_WHEEL_SLOT_BITS * (unsigned int)level;
+        unsigned int index = (unsigned int)(wheel->currentMs >> shift) & TIMER_WHEEL_SLOT_MASK;
+        uint64_t laterSlots = index == TIMER_WHEEL_SLOT_MASK
+                                  ? 0
+                                  : wheel->occupiedSlots[level] & (~0ULL << (index + 1));
+        if (laterSlots == 0) {
+            continue;
+        }
+        unsigned int slot = (unsigned int)__builtin_ctzll(laterSlots);
+        if (level == 0) {
+            return (wheel->currentMs & ~(uint64_t)TIMER_WHEEL_SLOT_MASK) + slot;
+        }
+        return GetEarliestDeadline(&wheel->slots[level][slot]);
+    }
+
+    if (!TimerList_IsEmpty(&wheel->overflow)) {
+        return GetEarliestDeadline(&wheel->overflow);
+    }
+    return 0;
+}
+
+/// <summary>
+///     Arms the timerfd for the next deadline, unless it is already armed for it.
+/// </summary>
+static void RearmTimerWheel(TimerWheel *wheel)
+{
+    uint64_t deadline = GetNextDeadline(wheel);
+    if (deadline == wheel->armedDeadlineMs) {
+        return;
+    }
+    wheel->armedDeadlineMs = deadline;
+
+    struct timespec expiry = {0, 0};
+    if (deadline != 0) {
+        uint64_t nowMs = GetMonotonicTimeMs();
+        uint64_t delayMs = deadline > nowMs ? deadline - nowMs : 0;
+        expiry.tv_sec = (time_t)(delayMs / 1000);
+        // a zero expiry would disarm the timer
+        expiry.tv_nsec = delayMs > 0 ? (long)(delayMs % 1000) * 1000000 : 1;
+    }
+    SetTimerFdToSingleExpiry(wheel->timerFd, &expiry);
+}
+
+static void TimerWheelEventHandler(EventData *eventData)
+{
+    TimerWheel *wheel = (TimerWheel *)eventData;
+
+    // The read can find no expiry if a handler earlier in the same epoll batch re-armed the
+    // timerfd; the wheel is advanced to the current time either way.
+    uint64_t expirations;
+    (void)read(wheel->timerFd, &expirations, sizeof(expirations));
+
+    wheel->armedDeadlineMs = 0;
+    AdvanceTimerWheel(wheel, GetMonotonicTimeMs());
+    RunSlackTimers(wheel);
+    RearmTimerWheel(wheel);
+}
+
+int TimerWheel_Init(TimerWheel *wheel, int epollFd)
+{
+    memset(wheel, 0, sizeof(*wheel));
+    for (int level = 0; level < TIMER_WHEEL_LEVELS; level++) {
+        for (int slot = 0; slot < TIMER_WHEEL_SLOTS; slot++) {
+            TimerList_Init(&wheel->slots[level][slot]);
+        }
+    }
+    TimerList_Init(&wheel->overflow);
+    TimerList_Init(&wheel->expired);
+    TimerList_Init(&wheel->slackTimers);
+    wheel->currentMs = GetMonotonicTimeMs();
+    wheel->eventData.eventHandler = TimerWheelEventHandler;
+
+    struct timespec disarmed = {0, 0};
+    wheel->timerFd = CreateTimerFdAndAddToEpoll(epollFd, &disarmed, &wheel->eventData, EPOLLIN);
+    return wheel->timerFd < 0 ? -1 : 0;
+}
+
+void TimerWheel_Close(TimerWheel *wheel)
+{
+    CloseFdAndPrintError(wheel->timerFd, "TimerWheel");
+    wheel->timerFd = -1;
+}
+
+void LogicalTimer_Init(LogicalTimer *timer, LogicalTimerHandler handler, void *context)
+{
+    memset(timer, 0, sizeof(*timer));
+    TimerList_Init(&timer->node);
+    TimerList_Init(&timer->slackNode);
+    timer->handler = handler;
+    timer->context = context;
+    timer->level = TIMER_WHEEL_NO_LEVEL;
+}
+
+static void StartTimer(TimerWheel *wheel, LogicalTimer *timer, uint32_t delayMs,
+                       uint32_t periodMs)
+{
+    if (timer->armed) {
+        UnqueueTimer(wheel, timer);
+        TimerList_Remove(&timer->slackNode);
+    }
+
+    // The current slot has already been run, so the earliest possible expiry is the next one.
+    uint64_t expiryMs = GetMonotonicTimeMs() + delayMs;
+    if (expiryMs <= wheel->currentMs) {
+        expiryMs = wheel->currentMs + 1;
+    }
+    SetExpiry(timer, expiryMs);
+    timer->periodMs = periodMs;
+    timer->armed = true;
+    QueueTimer(wheel, timer);
+    if (timer->slackMs != 0) {
+        TimerList_Append(&wheel->slackTimers, &timer->slackNode);
+    }
+    RearmTimerWheel(wheel);
+}
+
+void TimerWheel_StartOneShot(TimerWheel *wheel, LogicalTimer *timer, uint32_t delayMs)
+{
+    StartTimer(wheel, timer, delayMs, 0);
+}
+
+void TimerWheel_StartPeriodic(TimerWheel *wheel, LogicalTimer *timer, uint32_t periodMs)
+{
+    if (periodMs == 0) {
+        TimerWheel_Cancel(wheel, timer);
+        return;
+    }
+    StartTimer(wheel, timer, periodMs, periodMs);
+}
+
+void TimerWheel_Cancel(TimerWheel *wheel, LogicalTimer *timer)
+{
+    if (!timer->armed) {
+        return;
+    }
+    UnqueueTimer(wheel, timer);
+    TimerList_Remove(&timer->slackNode);
+    timer->armed = false;
+    // Leaving the timerfd armed for a cancelled deadline costs one empty wakeup at most, which
+    // is cheaper than re-arming on every cancel.
+}
+
+void LogicalTimer_SetAlignment(LogicalTimer *timer, uint32_t alignMs)
+{
+    timer->alignMs = alignMs;
+}
+
+void LogicalTimer_SetSlack(LogicalTimer *timer, uint32_t slackMs)
+{
+    timer->slackMs = slackMs;
+}
+
+bool LogicalTimer_IsArmed(const LogicalTimer *timer)
+{
+    return timer->armed;
+}
+
+void TimerWheel_RunDue(TimerWheel *wheel)
+{
+    uint64_t nowMs = GetMonotonicTimeMs();
+    bool due = false;
+    for (TimerListNode *node = wheel->slackTimers.next; node != &wheel->slackTimers && !due;
+         node = node->next) {
+        due = GetSlackTimer(node)->expiryMs <= nowMs;
+    }
+    if (!due) {
+        return;
+    }
+
+    AdvanceTimerWheel(wheel, nowMs);
+    wheel->statistics.piggybacked += RunSlackTimers(wheel);
+    RearmTimerWheel(wheel);
+}
+
+int TimerWheel_FormatStatistics(const TimerWheel *wheel, char *buffer, size_t bufferSize)
+{
+    const TimerWheelStatistics *s = &wheel->statistics;
+    return snprintf(buffer, bufferSize, "\"timersRun\":%u,\"coalesced\":%u,\"piggybacked\":%u",
+                    s->timersRun, s->coalesced, s->piggybacked);
+}
+
+/// <summary>
+///     Removes whatever the task is waiting for.
+/// </summary>
+static void ClearTaskWait(AsyncTask *task)
+{
+    TimerWheel_Cancel(task->wheel, &task->timer);
+    if (task->awaitedFd >= 0) {
+        UnregisterEventHandlerFromEpoll(task->epollFd, task->awaitedFd);
+        task->awaitedFd = -1;
+    }
+    if (task->awaitedEvent != NULL) {
+        task->awaitedEvent->waiter = NULL;
+        task->awaitedEvent = NULL;
+    }
+}
+
+static void ResumeTask(AsyncTask *task, AsyncWaitResult result)
+{
+    ClearTaskWait(task);
+    task->waitResult = result;
+    if (task->function(task) == ASYNC_DONE) {
+        task->running = false;
+        task->resumePoint = 0;
+        AsyncEvent_Signal(&task->done);
+    }
+}
+
+static void AsyncTaskTimerHandler(LogicalTimer *timer)
+{
+    AsyncTask *task = timer->context;
+    bool timeout = task->awaitedFd >= 0 || task->awaitedEvent != NULL;
+    ResumeTask(task, timeout ? AsyncWait_TimedOut : AsyncWait_Ready);
+}
+
+static void AsyncTaskFdHandler(EventData *eventData)
+{
+    ResumeTask((AsyncTask *)eventData, AsyncWait_Ready);
+}
+
+void AsyncTask_Init(AsyncTask *task, TimerWheel *wheel, int epollFd, AsyncTaskFunction function,
+                    void *context)
+{
+    memset(task, 0, sizeof(*task));
+    task->eventData.eventHandler = AsyncTaskFdHandler;
+    task->function = function;
+    task->context = context;
+    task->wheel = wheel;
+    task->epollFd = epollFd;
+    task->awaitedFd = -1;
+    LogicalTimer_Init(&task->timer, AsyncTaskTimerHandler, task);
+    AsyncEvent_Init(&task->done);
+}
+
+void AsyncTask_Start(AsyncTask *task)
+{
+    AsyncTask_Cancel(task);
+    task->done.signaled = false;
+    task->running = true;
+    ResumeTask(task, AsyncWait_Ready);
+}
+
+void AsyncTask_Cancel(AsyncTask *task)
+{
+    ClearTaskWait(task);
+    task->running = false;
+    task->resumePoint = 0;
+}
+
+bool AsyncTask_IsRunning(const AsyncTask *task)
+{
+    return task->running;
+}
+
+void AsyncTask_WaitTimer(AsyncTask *task, uint32_t delayMs)
+{
+    TimerWheel_StartOneShot(task->wheel, &task->timer, delayMs);
+}
+
+int AsyncTask_WaitFd(AsyncTask *task, int fd, uint32_t events, int timeoutMs)
+{
+    if (RegisterEventHandlerToEpoll(task->epollFd, fd, &task->eventData, events) != 0) {
+        task->waitResult = AsyncWait_Failed;
+        return -1;
+    }
+    task->awaitedFd = fd;
+    if (timeoutMs >= 0) {
+        TimerWheel_StartOneShot(task->wheel, &task->timer, (uint32_t)timeoutMs);
+    }
+    return 0;
+}
+
+bool AsyncTask_WaitEvent(AsyncTask *task, AsyncEvent *event, int timeoutMs)
+{
+    if (event->signaled) {
+        event->signaled = false;
+        task->waitResult = AsyncWait_Ready;
+        return true;
+    }
+    event->waiter = task;
+    task->awaitedEvent = event;
+    if (timeoutMs >= 0) {
+        TimerWheel_StartOneShot(task->wheel, &task->timer, (uint32_t)timeoutMs);
+    }
+    return false;
+}
+
+void AsyncEvent_Init(AsyncEvent *event)
+{
+    event->signaled = false;
+    event->waiter = NULL;
+}
+
+void AsyncEvent_Signal(AsyncEvent *event)
+{
+    if (event->waiter != NULL) {
+        ResumeTask(event->waiter, AsyncWait_Ready);
+    } else {
+        event->signaled = true;
+    }
+}
+
+/// <summary>
+///     Links an entry onto the queue. Producers contend only on the swap of the head; the
+///     previous head is linked to the entry afterwards, so for a moment the list is cut short.
+/// </summary>
+static void PushCompletion(CompletionQueue *queue, CompletionEntry *entry)
+{
+    atomic_store_explicit(&entry->next, NULL, memory_order_relaxed);
+    CompletionEntry *previous = atomic_exchange_explicit(&queue->head, entry, memory_order_acq_rel);
+    atomic_store_explicit(&previous->next, entry, memory_order_release);
+}
+
+/// <summary>
+///     Unlinks the oldest entry.
+/// </summary>
+/// <returns>The entry, or NULL if the queue is empty or a post is still being linked</returns>
+static CompletionEntry *PopCompletion(CompletionQueue *queue)
+{
+    CompletionEntry *tail = queue->tail;
+    CompletionEntry *next = atomic_load_explicit(&tail->next, memory_order_acquire);
+    if (tail == &queue->stub) {
+        if (next == NULL) {
+            return NULL;
+        }
+        queue->tail = next;
+        tail = next;
+        next = atomic_load_explicit(&tail->next, memory_order_acquire);
+    }
+    if (next != NULL) {
+        queue->tail = next;
+        return tail;
+    }
+
+    // The tail is the last entry linked. Unless a producer has swapped in a newer head that it
+    // has not linked yet, put the stub back behind it so that the tail can be taken.
+    if (tail != atomic_load_explicit(&queue->head, memory_order_acquire)) {
+        return NULL;
+    }
+    PushCompletion(queue, &queue->stub);
+    next = atomic_load_explicit(&tail->next, memory_order_acquire);
+    if (next != NULL) {
+        queue->tail = next;
+        return tail;
+    }
+    return NULL;
+}
+
+/// <summary>
+///     Checks, from the event loop thread, whether any entry is waiting to be dispatched,
+///     including one whose post has not been linked yet.
+/// </summary>
+static bool HasCompletions(CompletionQueue *queue)
+{
+    return queue->tail != &queue->stub ||
+           atomic_load_explicit(&queue->head, memory_order_acquire) != &queue->stub;
+}
+
+static void SignalCompletionQueue(CompletionQueue *queue)
+{
+    if (!atomic_exchange(&queue->signaled, true) && queue->eventData.fd >= 0) {
+        eventfd_write(queue->eventData.fd, 1);
+    }
+}
+
+static void RecordCompletionLatency(CompletionQueueStatistics *statistics, uint64_t latencyUs)
+{
+    statistics->totalLatencyUs += latencyUs;
+    if (latencyUs > statistics->maxLatencyUs) {
+        statistics->maxLatencyUs = latencyUs > UINT32_MAX ? UINT32_MAX : (uint32_t)latencyUs;
+    }
+    unsigned int bucket = 0;
+    for (uint64_t limitUs = 100; bucket < COMPLETION_LATENCY_BUCKETS - 1 && latencyUs >= limitUs;
+         limitUs *= 10) {
+        bucket++;
+    }
+    statistics->latencyBuckets[bucket]++;
+}
+
+static void CompletionQueueEventHandler(EventData *eventData)
+{
+    CompletionQueue *queue = (CompletionQueue *)eventData;
+
+    // Consume the signal, then clear the flag before draining: a post linked after this point
+    // signals again, and one linked before it is found by the drain. Clearing the flag first
+    // would let a post signal in between and have its write consumed here, leaving the flag set
+    // with nothing left to wake the loop.
+    eventfd_t signals;
+    (void)eventfd_read(queue->eventData.fd, &signals);
+    atomic_store(&queue->signaled, false);
+    CompletionQueue_Drain(queue, queue->batchLimit);
+}
+
+int CompletionQueue_Init(CompletionQueue *queue, int epollFd, unsigned int batchLimit)
+{
+    memset(queue, 0, sizeof(*queue));
+    queue->eventData.eventHandler = CompletionQueueEventHandler;
+    queue->eventData.fd = -1;
+    queue->batchLimit = batchLimit;
+    atomic_init(&queue->stub.next, NULL);
+    atomic_init(&queue->head, &queue->stub);
+    queue->tail = &queue->stub;
+    atomic_init(&queue->signaled, false);
+
+    int fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    if (fd < 0) {
+        Log_Debug("ERROR: Could not create completion queue eventfd: %s (%d).\n", strerror(errno),
+                  errno);
+        return -1;
+    }
+    if (RegisterEventHandlerToEpoll(epollFd, fd, &queue->eventData, EPOLLIN) != 0) {
+        CloseFdAndPrintError(fd, "CompletionQueue");
+        queue->eventData.fd = -1;
+        return -1;
+    }
+    return 0;
+}
+
+void CompletionQueue_Close(CompletionQueue *queue, int epollFd)
+{
+    // A queue that was never initialized has no list to drain.
+    if (queue->tail != NULL) {
+        CompletionQueue_Drain(queue, 0);
+    }
+    if (queue->eventData.fd >= 0) {
+        UnregisterEventHandlerFromEpoll(epollFd, queue->eventData.fd);
+        CloseFdAndPrintError(queue->eventData.fd, "CompletionQueue");
+        queue->eventData.fd = -1;
+    }
+}
+
+void CompletionQueue_Post(CompletionQueue *queue, CompletionEntry *entry)
+{
+    entry->postedUs = GetMonotonicTimeUs();
+    PushCompletion(queue, entry);
+    SignalCompletionQueue(queue);
+}
+
+unsigned int CompletionQueue_Drain(CompletionQueue *queue, unsigned int maxEntries)
+{
+    CompletionQueueStatistics *statistics = &queue->statistics;
+    unsigned int count = 0;
+    bool stoppedEarly = false;
+
+    CompletionEntry *entry;
+    while ((entry = PopCompletion(queue)) != NULL) {
+        uint64_t nowUs = GetMonotonicTimeUs();
+        RecordCompletionLatency(statistics, nowUs > entry->postedUs ? nowUs - entry->postedUs : 0);
+        count++;
+        entry->handler(entry);
+
+        if ((maxEntries != 0 && count >= maxEntries) || IsEventHandlerOverBudget()) {
+            stoppedEarly = true;
+            break;
+        }
+    }
+
+    if (count > 0) {
+        statistics->dispatched += count;
+        statistics->batches++;
+        if (count > statistics->maxBatch) {
+            statistics->maxBatch = count;
+        }
+    }
+    // A post after this check signals the queue itself.
+    if (stoppedEarly && HasCompletions(queue)) {
+        // Come back for the rest after the other ready handlers have run.
+        statistics->yields++;
+        SignalCompletionQueue(queue);
+    }
+    return count;
+}
+
+int CompletionQueue_FormatStatistics(const CompletionQueue *queue, char *buffer,
+                                     size_t bufferSize)
+{
+    const CompletionQueueStatistics *s = &queue->statistics;
+    uint32_t meanLatencyUs = s->dispatched == 0 ? 0 : (uint32_t)(s->totalLatencyUs / s->dispatched);
+    return snprintf(buffer, bufferSize,
+                    "\"dispatched\":%u,\"batches\":%u,\"maxBatch\":%u,\"yields\":%u,"
+                    "\"meanLatencyUs\":%u,\"maxLatencyUs\":%u,"
+                    "\"latencyUs\":{\"lt100\":%u,\"lt1000\":%u,\"lt10000\":%u,\"lt100000\":%u,"
+                    "\"ge100000\":%u}",
+                    s->dispatched, s->batches, s->maxBatch, s->yields, meanLatencyUs,
+                    s->maxLatencyUs, s->latencyBuckets[0], s->latencyBuckets[1],
+                    s->latencyBuckets[2], s->latencyBuckets[3], s->latencyBuckets[4]);
+}
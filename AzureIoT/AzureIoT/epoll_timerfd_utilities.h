@@ -2,9 +2,14 @@
    Licensed under the MIT License. */
 
 #pragma once
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
 #include <time.h>
 #include <sys/epoll.h>
 #include <unistd.h>
+#include "handler_statistics.h"
 
 /// Forward declaration of the data type passed to the handlers.
 struct EventData;
@@ -15,6 +20,16 @@ struct EventData;
 /// <param name="eventData">The provided event data</param>
 typedef void (*EventHandler)(struct EventData *eventData);
 
+/// <summary>
+///     Priority class of an event handler. Within one wakeup of the event loop, the ready
+///     handlers run in order of priority.
+/// </summary>
+typedef enum {
+    EventPriority_Low = -1,
+    EventPriority_Normal = 0,
+    EventPriority_High = 1
+} EventPriority;
+
 /// <summary>
 /// <para>Contains context data for epoll events.</para>
 /// <para>When an event is registered with RegisterEventHandlerToEpoll, supply
@@ -31,10 +46,45 @@ typedef struct EventData {
     /// The file descriptor that generated the event.
     /// </summary>
     int fd;
+    /// <summary>
+    /// Where to record the handler's running time, or NULL to not measure it.
+    /// </summary>
+    HandlerStatistics *statistics;
+    /// <summary>
+    /// Priority class; zero-initialized data is EventPriority_Normal.
+    /// </summary>
+    EventPriority priority;
+    /// <summary>
+    /// Time the handler may run per dispatch before IsEventHandlerOverBudget returns true, in
+    /// microseconds, or 0 for no limit.
+    /// </summary>
+    uint32_t budgetUs;
 } EventData;
 
 /// <summary>
-///    Creates an epoll instance.
+///     Counters describing how many events each wait on the epoll instance delivered.
+/// </summary>
+typedef struct EventDispatchStatistics {
+    uint32_t wakeups;
+    uint32_t eventsDispatched;
+    uint32_t maxEventsPerWakeup;
+    /// <summary>
+    /// Events dropped because their handler was unregistered earlier in the same batch.
+    /// </summary>
+    uint32_t staleEventsSkipped;
+    /// <summary>
+    /// Times a handler found it had used its budget and returned early.
+    /// </summary>
+    uint32_t budgetYields;
+    /// <summary>
+    /// Calls into the kernel to register file descriptors and wait for events.
+    /// </summary>
+    uint32_t syscalls;
+} EventDispatchStatistics;
+
+/// <summary>
+///    Creates an epoll instance. When built with EVENT_LOOP_IO_URING, creates the io_uring that
+///    stands in for it; its file descriptor can then only be used with the functions in this file.
 /// </summary>
 /// <returns>A valid epoll file descriptor on success, or -1 on failure</returns>
 int CreateEpollFd(void);
@@ -105,6 +155,556 @@ int CreateTimerFdAndAddToEpoll(int epollFd, const struct timespec *period,
 /// <returns>0 on success, or -1 on failure</returns>
 int WaitForEventAndCallHandler(int epollFd);
 
+/// <summary>
+/// <para>Waits for events on an epoll instance and triggers the handler of each one, harvesting
+/// up to maxEvents ready file descriptors with a single epoll_wait.</para>
+/// <para>A handler may unregister or close any file descriptor, including ones whose events are
+/// later in the same batch: those events are skipped rather than dispatched to a stale
+/// handler.</para>
+/// <para>The ready handlers run once each per wakeup, high priority first, so no class can keep
+/// another from running. A handler with a budget should check IsEventHandlerOverBudget as it
+/// works and return when it is over. Its file descriptor is level-triggered, so the work left
+/// keeps it ready, and it is dispatched again on the next wakeup, after the other handlers that
+/// were ready have had their turn.</para>
+/// </summary>
+/// <param name="epollFd">
+///     Epoll file descriptor which was created with <see cref="CreateEpollFd" />.
+/// </param>
+/// <param name="events">Caller-provided array that receives the ready events</param>
+/// <param name="maxEvents">Number of entries in events</param>
+/// <param name="timeoutMs">How long to wait for an event: -1 waits indefinitely, 0 only
+/// collects events that are already ready</param>
+/// <param name="statistics">Counters to update, or NULL</param>
+/// <returns>The number of events collected, which is 0 if the wait timed out or was interrupted,
+/// or -1 on failure</returns>
+int WaitForEventsAndCallHandlers(int epollFd, struct epoll_event *events, int maxEvents,
+                                 int timeoutMs, EventDispatchStatistics *statistics);
+
+/// <summary>
+///     Checks, from inside a handler dispatched by WaitForEventsAndCallHandlers, whether it has
+///     run for longer than the budgetUs of its EventData. Always false for handlers without a
+///     budget.
+/// </summary>
+/// <returns>true if the handler should return and leave the rest of its work for the next
+/// wakeup</returns>
+bool IsEventHandlerOverBudget(void);
+
+/// <summary>
+///     Names the backend the event loop was built with: "epoll", or "io_uring" on Linux hosts
+///     built with EVENT_LOOP_IO_URING defined.
+/// </summary>
+const char *GetEventLoopBackendName(void);
+
+/// <summary>
+///     Number of levels in a timer wheel, and the log2 of the number of slots per level. With
+///     millisecond ticks the levels span 64 ms, 4 s, 4.4 min and 4.7 h; later timers wait in an
+///     overflow list.
+/// </summary>
+#define TIMER_WHEEL_LEVELS 4
+#define TIMER_WHEEL_SLOT_BITS 6
+#define TIMER_WHEEL_SLOTS (1 << TIMER_WHEEL_SLOT_BITS)
+
+/// Forward declaration of the logical timer passed to the handlers.
+struct LogicalTimer;
+
+/// <summary>
+///     Function signature for logical timer handlers.
+/// </summary>
+/// <param name="timer">The timer that expired</param>
+typedef void (*LogicalTimerHandler)(struct LogicalTimer *timer);
+
+/// <summary>
+///     Link in a circular doubly-linked list of timers.
+/// </summary>
+typedef struct TimerListNode {
+    struct TimerListNode *next;
+    struct TimerListNode *prev;
+} TimerListNode;
+
+/// <summary>
+/// <para>A one-shot or periodic timer run by a <see cref="TimerWheel" />.</para>
+/// <para>Initialize it with LogicalTimer_Init. It must stay in memory while it is armed.</para>
+/// </summary>
+typedef struct LogicalTimer {
+    /// <summary>
+    /// Link in the wheel slot; must be the first member.
+    /// </summary>
+    TimerListNode node;
+    /// <summary>
+    /// Function which is called when the timer expires.
+    /// </summary>
+    LogicalTimerHandler handler;
+    /// <summary>
+    /// Caller data for the handler.
+    /// </summary>
+    void *context;
+    /// <summary>
+    /// Earliest time the timer may run.
+    /// </summary>
+    uint64_t expiryMs;
+    /// <summary>
+    /// Latest time the timer may run: the expiry plus the slack. The wheel queues the timer by
+    /// this time.
+    /// </summary>
+    uint64_t deadlineMs;
+    /// <summary>
+    /// Period in milliseconds, or 0 for a one-shot timer.
+    /// </summary>
+    uint32_t periodMs;
+    /// <summary>
+    /// If not 0, expiries are rounded up to a multiple of this many milliseconds of the
+    /// monotonic clock, so that timers with the same alignment expire in the same wakeup.
+    /// </summary>
+    uint32_t alignMs;
+    /// <summary>
+    /// How many milliseconds after its expiry the timer may run, so that it can share a wakeup
+    /// with another timer or event.
+    /// </summary>
+    uint32_t slackMs;
+    /// <summary>
+    /// Link in the wheel's list of armed timers with slack.
+    /// </summary>
+    TimerListNode slackNode;
+    uint8_t level;
+    uint8_t slot;
+    bool armed;
+    /// <summary>
+    /// Where to record the handler's running time, or NULL to not measure it.
+    /// </summary>
+    HandlerStatistics *statistics;
+} LogicalTimer;
+
+/// <summary>
+///     Counters describing how the timer wheel ran its timers.
+/// </summary>
+typedef struct TimerWheelStatistics {
+    uint32_t timersRun;
+    /// <summary>
+    /// Timers with slack run before their deadline, in a wakeup that was due anyway.
+    /// </summary>
+    uint32_t coalesced;
+    /// <summary>
+    /// Of those, the timers run in a wakeup for another file descriptor.
+    /// </summary>
+    uint32_t piggybacked;
+} TimerWheelStatistics;
+
+/// <summary>
+/// <para>Hierarchical timer wheel that runs any number of logical timers from one timerfd.</para>
+/// <para>Each level has 64 slots holding a list of timers and a bitmap of the slots in use. A timer
+/// goes into the lowest level whose higher-order digits of the expiry time match the current
+/// time, so starting and cancelling a timer are O(1). When the current time crosses into a new
+/// slot of a higher level, that slot's timers cascade down. The timerfd is re-armed to the next
+/// deadline only, so the wheel does not tick while nothing is due.</para>
+/// <para>Timers are queued by their deadline, which is their expiry plus their slack. Whenever
+/// the wheel runs, it also runs the timers with slack whose expiry has passed, so a timer with
+/// slack shares the wakeup of any deadline that falls within its slack.</para>
+/// <para>The EventData must be the first member: the wheel registers itself with epoll.</para>
+/// </summary>
+typedef struct TimerWheel {
+    EventData eventData;
+    int timerFd;
+    /// <summary>
+    /// Time up to which the timers have been run.
+    /// </summary>
+    uint64_t currentMs;
+    /// <summary>
+    /// Deadline the timerfd is armed for, or 0 if it is disarmed.
+    /// </summary>
+    uint64_t armedDeadlineMs;
+    uint64_t occupiedSlots[TIMER_WHEEL_LEVELS];
+    TimerListNode slots[TIMER_WHEEL_LEVELS][TIMER_WHEEL_SLOTS];
+    TimerListNode overflow;
+    /// <summary>
+    /// Timers taken from a slot that are being run.
+    /// </summary>
+    TimerListNode expired;
+    /// <summary>
+    /// Armed timers with slack, linked through their slackNode.
+    /// </summary>
+    TimerListNode slackTimers;
+    TimerWheelStatistics statistics;
+} TimerWheel;
+
+/// <summary>
+///     Creates the timer wheel's timerfd and adds it to an epoll instance.
+/// </summary>
+/// <param name="wheel">Timer wheel to initialize</param>
+/// <param name="epollFd">Epoll file descriptor</param>
+/// <returns>0 on success, or -1 on failure</returns>
+int TimerWheel_Init(TimerWheel *wheel, int epollFd);
+
+/// <summary>
+///     Closes the timer wheel's timerfd. Armed timers are abandoned.
+/// </summary>
+void TimerWheel_Close(TimerWheel *wheel);
+
+/// <summary>
+///     Initializes a disarmed logical timer.
+/// </summary>
+/// <param name="timer">Timer to initialize</param>
+/// <param name="handler">Function called when the timer expires</param>
+/// <param name="context">Caller data for the handler</param>
+void LogicalTimer_Init(LogicalTimer *timer, LogicalTimerHandler handler, void *context);
+
+/// <summary>
+///     Arms a timer to expire once, replacing any earlier setting.
+/// </summary>
+/// <param name="wheel">The timer wheel</param>
+/// <param name="timer">The timer</param>
+/// <param name="delayMs">Milliseconds until expiry; 0 expires on the next millisecond</param>
+void TimerWheel_StartOneShot(TimerWheel *wheel, LogicalTimer *timer, uint32_t delayMs);
+
+/// <summary>
+///     Arms a timer to expire every period, starting one period from now, replacing any earlier
+///     setting. A period of 0 disarms the timer. Expiries missed while the event loop was busy
+///     are skipped rather than run in a burst.
+/// </summary>
+/// <param name="wheel">The timer wheel</param>
+/// <param name="timer">The timer</param>
+/// <param name="periodMs">The period in milliseconds</param>
+void TimerWheel_StartPeriodic(TimerWheel *wheel, LogicalTimer *timer, uint32_t periodMs);
+
+/// <summary>
+///     Disarms a timer. Does nothing if it is not armed.
+/// </summary>
+void TimerWheel_Cancel(TimerWheel *wheel, LogicalTimer *timer);
+
+/// <summary>
+///     Sets the alignment of a timer's expiries, or 0 for none. It applies from the next time the
+///     timer is started or, for a periodic timer, from its next period. A periodic timer's period
+///     should be a multiple of its alignment, or each period is stretched to the next multiple.
+/// </summary>
+void LogicalTimer_SetAlignment(LogicalTimer *timer, uint32_t alignMs);
+
+/// <summary>
+///     Sets how late a timer may run, or 0 to run it at its expiry. A timer with slack runs
+///     between its expiry and its expiry plus the slack, in whichever wakeup comes first. It
+///     applies from the next time the timer is started.
+/// </summary>
+void LogicalTimer_SetSlack(LogicalTimer *timer, uint32_t slackMs);
+
+/// <summary>
+///     Checks whether a timer is armed.
+/// </summary>
+bool LogicalTimer_IsArmed(const LogicalTimer *timer);
+
+/// <summary>
+///     Runs any timers with slack whose expiry has passed. Call it after the event loop has
+///     woken for another file descriptor, so that those timers do not need a wakeup of their own.
+/// </summary>
+void TimerWheel_RunDue(TimerWheel *wheel);
+
+/// <summary>
+///     Formats the statistics as a JSON object body, without the surrounding braces.
+/// </summary>
+/// <returns>The snprintf result</returns>
+int TimerWheel_FormatStatistics(const TimerWheel *wheel, char *buffer, size_t bufferSize);
+
+/// Forward declaration of the task passed to the task functions.
+struct AsyncTask;
+
+/// <summary>
+///     Function signature for async tasks.
+/// </summary>
+/// <param name="task">The task being resumed</param>
+/// <returns>ASYNC_WAITING if the task is waiting, or ASYNC_DONE if it has finished. Use
+/// ASYNC_BEGIN and ASYNC_END rather than returning these directly.</returns>
+typedef int (*AsyncTaskFunction)(struct AsyncTask *task);
+
+#define ASYNC_WAITING 0
+#define ASYNC_DONE 1
+
+/// <summary>
+///     Outcome of the last await.
+/// </summary>
+typedef enum {
+    AsyncWait_Ready = 0,
+    AsyncWait_TimedOut = 1,
+    /// <summary>
+    /// The file descriptor could not be added to the epoll instance.
+    /// </summary>
+    AsyncWait_Failed = 2
+} AsyncWaitResult;
+
+/// <summary>
+/// <para>A completion event one task can await. Signalling it before anyone waits latches it, so
+/// the next await returns straight away.</para>
+/// </summary>
+typedef struct AsyncEvent {
+    bool signaled;
+    struct AsyncTask *waiter;
+} AsyncEvent;
+
+/// <summary>
+/// <para>A stackless task run by the event loop, without a thread of its own.</para>
+/// <para>The task function is written as straight-line code between ASYNC_BEGIN and ASYNC_END,
+/// with ASYNC_SLEEP, ASYNC_AWAIT_FD and ASYNC_AWAIT_EVENT where it needs to wait. Each await
+/// saves the line it reached and returns to the event loop; when the wait is over the function
+/// is called again and jumps back to that line. Local variables are not kept across an await,
+/// so anything needed afterwards belongs in the context. Each await must be on a line of its
+/// own, and none can be used inside a switch statement in the task function.</para>
+/// <para>The EventData must be the first member: the task registers itself with epoll while it
+/// awaits a file descriptor.</para>
+/// </summary>
+typedef struct AsyncTask {
+    EventData eventData;
+    AsyncTaskFunction function;
+    /// <summary>
+    /// Caller data for the task function.
+    /// </summary>
+    void *context;
+    TimerWheel *wheel;
+    int epollFd;
+    /// <summary>
+    /// Line of the await the task is suspended at, or 0 to start from the beginning.
+    /// </summary>
+    unsigned int resumePoint;
+    bool running;
+    /// <summary>
+    /// Runs sleeps and await timeouts.
+    /// </summary>
+    LogicalTimer timer;
+    int awaitedFd;
+    AsyncEvent *awaitedEvent;
+    AsyncWaitResult waitResult;
+    /// <summary>
+    /// Signalled when the task finishes, so that another task can await it.
+    /// </summary>
+    AsyncEvent done;
+} AsyncTask;
+
+#define ASYNC_BEGIN(task)                                                                          \
+    switch ((task)->resumePoint) {                                                                 \
+    case 0:
+
+#define ASYNC_END(task)                                                                            \
+    }                                                                                              \
+    return ASYNC_DONE
+
+#define ASYNC_SUSPEND_(task)                                                                       \
+    do {                                                                                           \
+        (task)->resumePoint = __LINE__;                                                            \
+        return ASYNC_WAITING;                                                                      \
+    case __LINE__:;                                                                                \
+    } while (0)
+
+/// <summary>
+///     Suspends the task for delayMs milliseconds.
+/// </summary>
+#define ASYNC_SLEEP(task, delayMs)                                                                 \
+    do {                                                                                           \
+        AsyncTask_WaitTimer((task), (delayMs));                                                    \
+        ASYNC_SUSPEND_(task);                                                                      \
+    } while (0)
+
+/// <summary>
+///     Suspends the task until fd reports one of the epoll events, or for at most timeoutMs
+///     milliseconds if timeoutMs is not negative. The fd must not be registered with the epoll
+///     instance by anything else. Check task->waitResult afterwards.
+/// </summary>
+#define ASYNC_AWAIT_FD(task, fd, events, timeoutMs)                                                \
+    do {                                                                                           \
+        if (AsyncTask_WaitFd((task), (fd), (events), (timeoutMs)) == 0) {                          \
+            ASYNC_SUSPEND_(task);                                                                  \
+        }                                                                                          \
+    } while (0)
+
+/// <summary>
+///     Suspends the task until the event is signalled, or for at most timeoutMs milliseconds if
+///     timeoutMs is not negative. Continues straight away if the event is already signalled.
+///     Check task->waitResult afterwards.
+/// </summary>
+#define ASYNC_AWAIT_EVENT(task, event, timeoutMs)                                                  \
+    do {                                                                                           \
+        if (!AsyncTask_WaitEvent((task), (event), (timeoutMs))) {                                  \
+            ASYNC_SUSPEND_(task);                                                                  \
+        }                                                                                          \
+    } while (0)
+
+/// <summary>
+///     Initializes a task that is not running.
+/// </summary>
+/// <param name="task">Task to initialize</param>
+/// <param name="wheel">Timer wheel for sleeps and timeouts</param>
+/// <param name="epollFd">Epoll instance for file descriptor waits</param>
+/// <param name="function">The task function</param>
+/// <param name="context">Caller data for the function</param>
+void AsyncTask_Init(AsyncTask *task, TimerWheel *wheel, int epollFd, AsyncTaskFunction function,
+                    void *context);
+
+/// <summary>
+///     Starts the task from the beginning, cancelling it first if it is running. The task runs
+///     up to its first await before this returns.
+/// </summary>
+void AsyncTask_Start(AsyncTask *task);
+
+/// <summary>
+///     Stops a task wherever it is waiting. Its done event is not signalled.
+/// </summary>
+void AsyncTask_Cancel(AsyncTask *task);
+
+/// <summary>
+///     Checks whether a task has been started and has not finished or been cancelled.
+/// </summary>
+bool AsyncTask_IsRunning(const AsyncTask *task);
+
+/// <summary>
+///     Used by ASYNC_SLEEP. Arms the task's timer.
+/// </summary>
+void AsyncTask_WaitTimer(AsyncTask *task, uint32_t delayMs);
+
+/// <summary>
+///     Used by ASYNC_AWAIT_FD. Registers the fd for the task.
+/// </summary>
+/// <returns>0 if the task must suspend, or -1 if the fd could not be registered</returns>
+int AsyncTask_WaitFd(AsyncTask *task, int fd, uint32_t events, int timeoutMs);
+
+/// <summary>
+///     Used by ASYNC_AWAIT_EVENT. Consumes the event if it is signalled, and otherwise makes the
+///     task its waiter.
+/// </summary>
+/// <returns>true if the event was already signalled, or false if the task must suspend</returns>
+bool AsyncTask_WaitEvent(AsyncTask *task, AsyncEvent *event, int timeoutMs);
+
+/// <summary>
+///     Initializes an event that is not signalled.
+/// </summary>
+void AsyncEvent_Init(AsyncEvent *event);
+
+/// <summary>
+///     Signals an event. A task waiting for it is resumed before this returns; otherwise the
+///     event stays signalled until it is awaited.
+/// </summary>
+void AsyncEvent_Signal(AsyncEvent *event);
+
+/// Forward declaration of the entry passed to completion handlers.
+struct CompletionEntry;
+
+/// <summary>
+///     Function signature for completion handlers.
+/// </summary>
+/// <param name="entry">The entry that was posted</param>
+typedef void (*CompletionHandler)(struct CompletionEntry *entry);
+
+/// <summary>
+/// <para>A result handed back to the event loop through a CompletionQueue.</para>
+/// <para>The entry is linked into the queue rather than copied, so it must stay in memory until
+/// its handler has been called, and must not be posted again before then.</para>
+/// </summary>
+typedef struct CompletionEntry {
+    _Atomic(struct CompletionEntry *) next;
+    /// <summary>
+    /// Called on the thread that runs the event loop.
+    /// </summary>
+    CompletionHandler handler;
+    /// <summary>
+    /// Caller data for the handler.
+    /// </summary>
+    void *context;
+    /// <summary>
+    /// CLOCK_MONOTONIC time the entry was posted, in microseconds.
+    /// </summary>
+    uint64_t postedUs;
+} CompletionEntry;
+
+#define COMPLETION_LATENCY_BUCKETS 5
+
+/// <summary>
+///     Counters describing how a completion queue was drained, and the time from post to
+///     dispatch. Only the event loop thread updates them.
+/// </summary>
+typedef struct CompletionQueueStatistics {
+    uint32_t dispatched;
+    uint32_t batches;
+    uint32_t maxBatch;
+    /// <summary>
+    /// Batches that stopped at the batch limit or the handler budget with entries left over.
+    /// </summary>
+    uint32_t yields;
+    uint64_t totalLatencyUs;
+    uint32_t maxLatencyUs;
+    /// <summary>
+    /// Dispatches by latency: under 100 us, 1 ms, 10 ms, 100 ms, and the rest.
+    /// </summary>
+    uint32_t latencyBuckets[COMPLETION_LATENCY_BUCKETS];
+} CompletionQueueStatistics;
+
+/// <summary>
+/// <para>A queue through which any thread hands work back to the event loop.</para>
+/// <para>Producers link entries onto a lock-free multi-producer, single-consumer list and
+/// signal one eventfd registered with the epoll instance. Only the first post after the loop
+/// starts a drain writes to the eventfd, so a burst of posts costs one wakeup. The loop drains
+/// the entries in posting order, in batches of at most batchLimit; a batch that stops early
+/// signals the eventfd again, so other handlers run between batches.</para>
+/// <para>The EventData must be the first member.</para>
+/// </summary>
+typedef struct CompletionQueue {
+    EventData eventData;
+    /// <summary>
+    /// Most recently posted entry. Producers swap themselves in here.
+    /// </summary>
+    _Atomic(CompletionEntry *) head;
+    /// <summary>
+    /// Oldest entry not yet dispatched. Only the event loop thread uses it.
+    /// </summary>
+    CompletionEntry *tail;
+    /// <summary>
+    /// Placeholder that keeps the list from ever being empty.
+    /// </summary>
+    CompletionEntry stub;
+    /// <summary>
+    /// Set once the eventfd has been written and the loop has not yet started draining.
+    /// </summary>
+    atomic_bool signaled;
+    unsigned int batchLimit;
+    CompletionQueueStatistics statistics;
+} CompletionQueue;
+
+/// <summary>
+///     Creates the queue's eventfd and registers it with the epoll instance.
+/// </summary>
+/// <param name="queue">Queue to initialize</param>
+/// <param name="epollFd">Epoll instance of the event loop</param>
+/// <param name="batchLimit">Most entries dispatched per wakeup; 0 for no limit</param>
+/// <returns>0 on success, or -1 on failure</returns>
+int CompletionQueue_Init(CompletionQueue *queue, int epollFd, unsigned int batchLimit);
+
+/// <summary>
+///     Dispatches any entries still queued, then closes the eventfd. Producers must have
+///     stopped posting.
+/// </summary>
+void CompletionQueue_Close(CompletionQueue *queue, int epollFd);
+
+/// <summary>
+///     Queues an entry for its handler to be called on the event loop thread. Safe to call from
+///     any thread, including the event loop thread. Does not block or allocate.
+/// </summary>
+/// <param name="queue">The queue</param>
+/// <param name="entry">Entry with its handler and context set</param>
+void CompletionQueue_Post(CompletionQueue *queue, CompletionEntry *entry);
+
+/// <summary>
+///     Dispatches queued entries on the calling thread, which must be the event loop thread.
+/// </summary>
+/// <param name="queue">The queue</param>
+/// <param name="maxEntries">Most entries to dispatch; 0 for no limit</param>
+/// <returns>The number of entries dispatched</returns>
+unsigned int CompletionQueue_Drain(CompletionQueue *queue, unsigned int maxEntries);
+
+/// <summary>
+///     Formats the statistics as a JSON object body, without the surrounding braces.
+/// </summary>
+/// <returns>The snprintf result</returns>
+int CompletionQueue_FormatStatistics(const CompletionQueue *queue, char *buffer,
+                                     size_t bufferSize);
+
+/// <summary>
+///     Gets the current CLOCK_MONOTONIC time, which is the clock the timerfds run on.
+/// </summary>
+/// <returns>Milliseconds since an arbitrary fixed point</returns>
+uint64_t GetMonotonicTimeMs(void);
+
 /// <summary>
 ///     Closes a file descriptor and prints an error on failure.
 /// </summary>
@@ -0,0 +1,345 @@
+#include <errno.h>
+#include <limits.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "epoll_timerfd_utilities.h"
+#include "fake_transport.h"
+
+const FakeTransportConfig FakeTransportDefaultConfig = {.connectDelayMs = 0,
+                                                        .latencyMs = 50,
+                                                        .jitterMs = 0,
+                                                        .lossPercent = 0,
+                                                        .messageTimeoutMs = 5000,
+                                                        .ratePerSecond = 0,
+                                                        .burst = 1,
+                                                        .seed = 1};
+
+typedef struct PendingSend {
+    uint64_t submittedMs;
+    uint64_t dueMs;
+    bool lost;
+    bool isEvent;
+    IOTHUB_CLIENT_EVENT_CONFIRMATION_CALLBACK eventCallback;
+    IOTHUB_CLIENT_REPORTED_STATE_CALLBACK reportedCallback;
+    void *context;
+} PendingSend;
+
+static FakeTransportConfig config;
+static bool configured = false;
+static FakeTransportStatistics statistics;
+static CloudTransportCallbacks callbacks;
+static bool created = false;
+static bool connected = false;
+static uint64_t connectAtMs;
+static uint32_t randomState = 1;
+// Rate limit, as the time at which the next message would be accepted if there were no burst
+static uint64_t theoreticalArrivalUs;
+
+static PendingSend pending[FAKE_TRANSPORT_MAX_PENDING];
+static size_t pendingCount = 0;
+static size_t pendingEvents = 0;
+
+static uint32_t Random(void)
+{
+    // xorshift32
+    uint32_t x = randomState;
+    x ^= x << 13;
+    x ^= x >> 17;
+    x ^= x << 5;
+    randomState = x;
+    return x;
+}
+
+/// <summary>
+///     Takes the next slot under the rate limit.
+/// </summary>
+/// <returns>The time at which the message is accepted</returns>
+static uint64_t AcceptUnderRateLimit(uint64_t nowMs)
+{
+    if (config.ratePerSecond == 0) {
+        return nowMs;
+    }
+    uint64_t intervalUs = 1000000 / config.ratePerSecond;
+    uint64_t toleranceUs = (uint64_t)(config.burst > 0 ? config.burst : 1) * intervalUs;
+    uint64_t nowUs = nowMs * 1000;
+    if (theoreticalArrivalUs < nowUs) {
+        theoreticalArrivalUs = nowUs;
+    }
+    uint64_t acceptUs = nowUs;
+    if (theoreticalArrivalUs + intervalUs > nowUs + toleranceUs) {
+        acceptUs = theoreticalArrivalUs + intervalUs - toleranceUs;
+        statistics.throttled++;
+    }
+    theoreticalArrivalUs += intervalUs;
+    return acceptUs / 1000;
+}
+
+static int AddPending(const PendingSend *send)
+{
+    if (pendingCount == FAKE_TRANSPORT_MAX_PENDING) {
+        return -1;
+    }
+    pending[pendingCount++] = *send;
+    if (send->isEvent) {
+        pendingEvents++;
+        if (pendingEvents > statistics.maxPending) {
+            statistics.maxPending = (uint32_t)pendingEvents;
+        }
+    }
+    return 0;
+}
+
+/// <summary>
+///     Removes a pending send, preserving the order of the others, and makes its callback.
+/// </summary>
+static void CompletePending(size_t index, IOTHUB_CLIENT_CONFIRMATION_RESULT result, uint64_t nowMs)
+{
+    // Copied out first: the callback may queue another send.
+    PendingSend send = pending[index];
+    memmove(&pending[index], &pending[index + 1], (pendingCount - index - 1) * sizeof(pending[0]));
+    pendingCount--;
+
+    if (!send.isEvent) {
+        send.reportedCallback(result == IOTHUB_CLIENT_CONFIRMATION_OK ? 204 : 500, send.context);
+        return;
+    }
+
+    pendingEvents--;
+    if (result == IOTHUB_CLIENT_CONFIRMATION_OK) {
+        uint32_t ackMs = (uint32_t)(nowMs - send.submittedMs);
+        statistics.acknowledged++;
+        statistics.totalAckMs += ackMs;
+        if (ackMs > statistics.maxAckMs) {
+            statistics.maxAckMs = ackMs;
+        }
+    } else if (result == IOTHUB_CLIENT_CONFIRMATION_MESSAGE_TIMEOUT) {
+        statistics.lost++;
+    }
+    send.eventCallback(result, send.context);
+}
+
+static void Destroy(void)
+{
+    if (!created) {
+        return;
+    }
+    created = false;
+    connected = false;
+    // Like the IoT Hub client, destroying completes everything still held.
+    uint64_t nowMs = GetMonotonicTimeMs();
+    while (pendingCount > 0) {
+        CompletePending(0, IOTHUB_CLIENT_CONFIRMATION_BECAUSE_DESTROY, nowMs);
+    }
+}
+
+static int Create(const char *hostName, const char *deviceId, int keepAliveSeconds,
+                  const CloudTransportCallbacks *newCallbacks, bool *authFailure)
+{
+    // Nothing to connect to, and no connection to keep alive
+    (void)hostName;
+    (void)deviceId;
+    (void)keepAliveSeconds;
+    Destroy();
+    *authFailure = false;
+    if (!configured) {
+        FakeTransport_Configure(&FakeTransportDefaultConfig);
+    }
+    callbacks = *newCallbacks;
+    created = true;
+    connected = false;
+    connectAtMs = GetMonotonicTimeMs() + config.connectDelayMs;
+    theoreticalArrivalUs = 0;
+    return 0;
+}
+
+static bool IsCreated(void)
+{
+    return created;
+}
+
+static int SendEvent(IOTHUB_MESSAGE_HANDLE message,
+                     IOTHUB_CLIENT_EVENT_CONFIRMATION_CALLBACK callback, void *context)
+{
+    // The message is only counted, never delivered
+    (void)message;
+    if (!created) {
+        return -1;
+    }
+    uint64_t nowMs = GetMonotonicTimeMs();
+    // Like the IoT Hub client, messages sent before the connection is up wait for it.
+    uint64_t startMs = nowMs > connectAtMs ? nowMs : connectAtMs;
+    PendingSend send = {.submittedMs = nowMs,
+                        .isEvent = true,
+                        .eventCallback = callback,
+                        .context = context};
+    send.lost = config.lossPercent > 0 && Random() % 100 < config.lossPercent;
+    uint64_t acceptMs = AcceptUnderRateLimit(startMs);
+    uint32_t jitterMs = config.jitterMs > 0 ? Random() % (config.jitterMs + 1) : 0;
+    send.dueMs = acceptMs + (send.lost ? config.messageTimeoutMs : config.latencyMs + jitterMs);
+
+    if (AddPending(&send) != 0) {
+        statistics.rejected++;
+        return -1;
+    }
+    statistics.sent++;
+    return 0;
+}
+
+static int SendReportedState(const unsigned char *json, size_t length,
+                             IOTHUB_CLIENT_REPORTED_STATE_CALLBACK callback, void *context)
+{
+    (void)json;
+    (void)length;
+    if (!created) {
+        return -1;
+    }
+    uint64_t nowMs = GetMonotonicTimeMs();
+    uint64_t startMs = nowMs > connectAtMs ? nowMs : connectAtMs;
+    PendingSend send = {.submittedMs = nowMs,
+                        .dueMs = startMs + config.latencyMs,
+                        .isEvent = false,
+                        .reportedCallback = callback,
+                        .context = context};
+    if (AddPending(&send) != 0) {
+        return -1;
+    }
+    statistics.reportedStates++;
+    return 0;
+}
+
+static bool IsSendIdle(void)
+{
+    return pendingEvents == 0;
+}
+
+static void DoWork(void)
+{
+    if (!created) {
+        return;
+    }
+    uint64_t nowMs = GetMonotonicTimeMs();
+
+    if (!connected) {
+        if (nowMs < connectAtMs) {
+            return;
+        }
+        connected = true;
+        callbacks.connectionStatus(IOTHUB_CLIENT_CONNECTION_AUTHENTICATED,
+                                   IOTHUB_CLIENT_CONNECTION_OK, callbacks.context);
+        static const char initialTwin[] = "{\"desired\":{\"$version\":1},\"reported\":{}}";
+        callbacks.twinUpdate(DEVICE_TWIN_UPDATE_COMPLETE, (const unsigned char *)initialTwin,
+                             sizeof(initialTwin) - 1, callbacks.context);
+    }
+
+    size_t i = 0;
+    while (created && i < pendingCount) {
+        if (pending[i].dueMs <= nowMs) {
+            CompletePending(i, pending[i].lost ? IOTHUB_CLIENT_CONFIRMATION_MESSAGE_TIMEOUT
+                                               : IOTHUB_CLIENT_CONFIRMATION_OK,
+                            nowMs);
+        } else {
+            i++;
+        }
+    }
+}
+
+static int FormatStatistics(char *buffer, size_t bufferSize)
+{
+    uint32_t meanAckMs =
+        statistics.acknowledged > 0
+            ? (uint32_t)(statistics.totalAckMs / statistics.acknowledged)
+            : 0;
+    return snprintf(buffer, bufferSize,
+                    "\"sent\":%u,\"acknowledged\":%u,\"lost\":%u,\"rejected\":%u,"
+                    "\"throttled\":%u,\"reportedStates\":%u,\"maxPending\":%u,\"meanAckMs\":%u,"
+                    "\"maxAckMs\":%u",
+                    statistics.sent, statistics.acknowledged, statistics.lost, statistics.rejected,
+                    statistics.throttled, statistics.reportedStates, statistics.maxPending,
+                    meanAckMs, statistics.maxAckMs);
+}
+
+const CloudTransport FakeCloudTransport = {.name = "fake",
+                                           .localHostName = "localhost",
+                                           .localDeviceId = "fake-device",
+                                           .create = Create,
+                                           .destroy = Destroy,
+                                           .isCreated = IsCreated,
+                                           .sendEvent = SendEvent,
+                                           .sendReportedState = SendReportedState,
+                                           .isSendIdle = IsSendIdle,
+                                           .doWork = DoWork,
+                                           .formatStatistics = FormatStatistics};
+
+void FakeTransport_Configure(const FakeTransportConfig *newConfig)
+{
+    config = *newConfig;
+    configured = true;
+    // xorshift gets stuck at zero
+    randomState = config.seed != 0 ? config.seed : 1;
+}
+
+int FakeTransport_ParseConfig(const char *spec, FakeTransportConfig *target)
+{
+    static const struct {
+        const char *name;
+        size_t offset;
+    } fields[] = {
+        {"connectDelayMs", offsetof(FakeTransportConfig, connectDelayMs)},
+        {"latencyMs", offsetof(FakeTransportConfig, latencyMs)},
+        {"jitterMs", offsetof(FakeTransportConfig, jitterMs)},
+        {"lossPercent", offsetof(FakeTransportConfig, lossPercent)},
+        {"messageTimeoutMs", offsetof(FakeTransportConfig, messageTimeoutMs)},
+        {"ratePerSecond", offsetof(FakeTransportConfig, ratePerSecond)},
+        {"burst", offsetof(FakeTransportConfig, burst)},
+        {"seed", offsetof(FakeTransportConfig, seed)},
+    };
+
+    const char *setting = spec;
+    while (setting != NULL && *setting != '\0') {
+        const char *end = strchr(setting, ',');
+        size_t length = end != NULL ? (size_t)(end - setting) : strlen(setting);
+        const char *equals = memchr(setting, '=', length);
+        if (equals == NULL) {
+            return -1;
+        }
+        size_t nameLength = (size_t)(equals - setting);
+        // strtoul would accept a sign, and wrap a negative value
+        if (equals[1] < '0' || equals[1] > '9') {
+            return -1;
+        }
+        char *valueEnd;
+        errno = 0;
+        unsigned long value = strtoul(equals + 1, &valueEnd, 10);
+        if (valueEnd != setting + length || errno == ERANGE) {
+            return -1;
+        }
+#if ULONG_MAX > UINT32_MAX
+        if (value > UINT32_MAX) {
+            return -1;
+        }
+#endif
+
+        size_t i = 0;
+        while (i < sizeof(fields) / sizeof(fields[0]) &&
+               (strlen(fields[i].name) != nameLength ||
+                strncmp(fields[i].name, setting, nameLength) != 0)) {
+            i++;
+        }
+        if (i == sizeof(fields) / sizeof(fields[0])) {
+            return -1;
+        }
+        *(uint32_t *)((char *)target + fields[i].offset) = (uint32_t)value;
+
+        setting = end != NULL ? end + 1 : NULL;
+    }
+    if (target->lossPercent > 100) {
+        return -1;
+    }
+    return 0;
+}
+
+void FakeTransport_GetStatistics(FakeTransportStatistics *copy)
+{
+    *copy = statistics;
+}
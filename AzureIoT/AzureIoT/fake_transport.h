@@ -0,0 +1,75 @@
+#pragma once
+#include <stdint.h>
+#include "cloud_transport.h"
+
+/// <summary>
+///     Behaviour of the fake transport.
+/// </summary>
+typedef struct FakeTransportConfig {
+    /// <summary>Time from create to the connection being reported.</summary>
+    uint32_t connectDelayMs;
+    /// <summary>Time from a message being accepted to its acknowledgement.</summary>
+    uint32_t latencyMs;
+    /// <summary>Up to this much is added at random to each latency.</summary>
+    uint32_t jitterMs;
+    /// <summary>Percentage of messages lost, from 0 to 100. A lost message completes with
+    /// IOTHUB_CLIENT_CONFIRMATION_MESSAGE_TIMEOUT after messageTimeoutMs.</summary>
+    uint32_t lossPercent;
+    uint32_t messageTimeoutMs;
+    /// <summary>Messages per second accepted, or 0 for no limit. Above the rate, and once the
+    /// burst is used up, messages wait to be accepted, as when IoT Hub throttles a
+    /// device.</summary>
+    uint32_t ratePerSecond;
+    uint32_t burst;
+    uint32_t seed;
+} FakeTransportConfig;
+
+/// <summary>
+///     Counters kept by the fake transport.
+/// </summary>
+typedef struct FakeTransportStatistics {
+    uint32_t sent;
+    uint32_t acknowledged;
+    uint32_t lost;
+    /// <summary>Messages refused because FAKE_TRANSPORT_MAX_PENDING were pending.</summary>
+    uint32_t rejected;
+    /// <summary>Messages that had to wait for the rate limit.</summary>
+    uint32_t throttled;
+    uint32_t reportedStates;
+    uint32_t maxPending;
+    uint64_t totalAckMs;
+    uint32_t maxAckMs;
+} FakeTransportStatistics;
+
+#define FAKE_TRANSPORT_MAX_PENDING 64
+
+/// <summary>
+///     Connects at once, acknowledges after 50 ms, loses nothing and has no rate limit.
+/// </summary>
+extern const FakeTransportConfig FakeTransportDefaultConfig;
+
+/// <summary>
+/// <para>In-process stand-in for IoT Hub. It needs no provisioning and no network. The IoT Hub
+/// SDK is still needed for its message functions.</para>
+/// <para>Messages are acknowledged after the configured latency, lost at random, and held back
+/// by a rate limit, so that throughput and backpressure can be measured under controlled
+/// conditions. Reported properties are acknowledged with status 204 after the same latency.
+/// </para>
+/// </summary>
+extern const CloudTransport FakeCloudTransport;
+
+/// <summary>
+///     Sets the behaviour for connections created from now on.
+/// </summary>
+void FakeTransport_Configure(const FakeTransportConfig *config);
+
+/// <summary>
+///     Parses settings of the form "latencyMs=20,lossPercent=5,ratePerSecond=100" into config,
+///     keeping its values for names that are not given. The names are the FakeTransportConfig
+///     field names.
+/// </summary>
+/// <param name="spec">Settings, or NULL for none</param>
+/// <returns>0 on success, or -1 if a setting is not understood</returns>
+int FakeTransport_ParseConfig(const char *spec, FakeTransportConfig *config);
+
+void FakeTransport_GetStatistics(FakeTransportStatistics *copy);
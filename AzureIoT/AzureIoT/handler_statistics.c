@@ -0,0 +1,120 @@
+#include <stdbool.h>
+#include <stdio.h>
+#include <string.h>
+#include <applibs/log.h>
+#include "handler_statistics.h"
+
+static uint32_t ElapsedUs(const struct timespec *start, const struct timespec *end)
+{
+    int64_t us = (int64_t)(end->tv_sec - start->tv_sec) * 1000000 +
+                 (end->tv_nsec - start->tv_nsec) / 1000;
+    if (us < 0) {
+        return 0;
+    }
+    return us > UINT32_MAX ? UINT32_MAX : (uint32_t)us;
+}
+
+static void DurationHistogram_Record(DurationHistogram *histogram, uint32_t us)
+{
+    unsigned int bucket = us < 2 ? 0 : 31 - (unsigned int)__builtin_clz(us);
+    if (bucket >= HANDLER_HISTOGRAM_BUCKETS) {
+        bucket = HANDLER_HISTOGRAM_BUCKETS - 1;
+    }
+    histogram->buckets[bucket]++;
+    histogram->totalUs += us;
+    if (us > histogram->maxUs) {
+        histogram->maxUs = us;
+    }
+}
+
+void HandlerStatistics_Begin(const HandlerStatistics *statistics, HandlerTiming *timing)
+{
+    clock_gettime(CLOCK_MONOTONIC, &timing->wallStart);
+    StallWatchdog_Enter(&timing->watch, statistics->name,
+                        (uint64_t)timing->wallStart.tv_sec * 1000 +
+                            (uint64_t)timing->wallStart.tv_nsec / 1000000);
+    clock_gettime(CLOCK_THREAD_CPUTIME_ID, &timing->cpuStart);
+}
+
+void HandlerStatistics_End(HandlerStatistics *statistics, const HandlerTiming *timing)
+{
+    struct timespec cpuEnd, wallEnd;
+    clock_gettime(CLOCK_THREAD_CPUTIME_ID, &cpuEnd);
+    clock_gettime(CLOCK_MONOTONIC, &wallEnd);
+    uint32_t wallUs = ElapsedUs(&timing->wallStart, &wallEnd);
+    HandlerStatistics_Record(statistics, wallUs, ElapsedUs(&timing->cpuStart, &cpuEnd));
+    StallWatchdog_Leave(&timing->watch, wallUs / 1000);
+}
+
+void HandlerStatistics_Record(HandlerStatistics *statistics, uint32_t wallUs, uint32_t cpuUs)
+{
+    statistics->calls++;
+    DurationHistogram_Record(&statistics->wall, wallUs);
+    DurationHistogram_Record(&statistics->cpu, cpuUs);
+}
+
+static uint32_t DurationHistogram_GetCount(const DurationHistogram *histogram)
+{
+    uint32_t count = 0;
+    for (int i = 0; i < HANDLER_HISTOGRAM_BUCKETS; i++) {
+        count += histogram->buckets[i];
+    }
+    return count;
+}
+
+uint32_t DurationHistogram_GetPercentileUs(const DurationHistogram *histogram, uint32_t percent)
+{
+    uint64_t count = DurationHistogram_GetCount(histogram);
+    if (count == 0) {
+        return 0;
+    }
+
+    uint64_t rank = (count * percent + 99) / 100;
+    uint64_t seen = 0;
+    for (int i = 0; i < HANDLER_HISTOGRAM_BUCKETS - 1; i++) {
+        seen += histogram->buckets[i];
+        if (seen >= rank) {
+            uint32_t upperBound = (2u << i) - 1;
+            return upperBound < histogram->maxUs ? upperBound : histogram->maxUs;
+        }
+    }
+    return histogram->maxUs;
+}
+
+int HandlerStatistics_FormatSummary(const HandlerStatistics *statistics, char *buffer,
+                                    size_t bufferSize)
+{
+    return snprintf(buffer, bufferSize,
+                    "\"%s\":{\"calls\":%u,\"windowCalls\":%u,\"wallP50Us\":%u,\"wallP99Us\":%u,"
+                    "\"wallMaxUs\":%u,\"cpuMs\":%llu}",
+                    statistics->name, statistics->calls,
+                    DurationHistogram_GetCount(&statistics->wall),
+                    DurationHistogram_GetPercentileUs(&statistics->wall, 50),
+                    DurationHistogram_GetPercentileUs(&statistics->wall, 99),
+                    statistics->wall.maxUs, (unsigned long long)(statistics->cpu.totalUs / 1000));
+}
+
+void HandlerStatistics_Dump(const HandlerStatistics *statistics)
+{
+    uint32_t windowCalls = DurationHistogram_GetCount(&statistics->wall);
+    if (windowCalls == 0) {
+        return;
+    }
+    Log_Debug("INFO: handler %s: %u calls, wall total %llu us, cpu total %llu us\n",
+              statistics->name, windowCalls, (unsigned long long)statistics->wall.totalUs,
+              (unsigned long long)statistics->cpu.totalUs);
+    for (int i = 0; i < HANDLER_HISTOGRAM_BUCKETS; i++) {
+        if (statistics->wall.buckets[i] != 0 || statistics->cpu.buckets[i] != 0) {
+            bool last = i == HANDLER_HISTOGRAM_BUCKETS - 1;
+            Log_Debug("INFO:   %s %7u us: wall %u, cpu %u\n", last ? ">=" : "< ",
+                      last ? 1u << i : 2u << i, statistics->wall.buckets[i],
+                      statistics->cpu.buckets[i]);
+        }
+    }
+}
+
+void HandlerStatistics_ResetWindow(HandlerStatistics *statistics)
+{
+    memset(&statistics->wall, 0, sizeof(statistics->wall));
+    memset(&statistics->cpu, 0, sizeof(statistics->cpu));
+}
@@ -0,0 +1,91 @@
+#pragma once
+#include <stddef.h>
+#include <stdint.h>
+#include <time.h>
+#include "stall_watchdog.h"
+
+/// <summary>
+///     Number of histogram buckets. Bucket 0 counts durations under 2 microseconds, bucket i
+///     counts [2^i, 2^(i+1)) and the last bucket also holds anything longer.
+/// </summary>
+#define HANDLER_HISTOGRAM_BUCKETS 20
+
+/// <summary>
+///     Log-scale histogram of durations in microseconds, over one report window.
+/// </summary>
+typedef struct DurationHistogram {
+    uint32_t buckets[HANDLER_HISTOGRAM_BUCKETS];
+    uint64_t totalUs;
+    uint32_t maxUs;
+} DurationHistogram;
+
+/// <summary>
+/// <para>Wall-clock and thread CPU time spent in one event handler.</para>
+/// <para>Recording costs two clock reads on each side of the handler and a count-leading-zeros to
+/// pick the bucket, so it can be left on in production.</para>
+/// </summary>
+typedef struct HandlerStatistics {
+    /// <summary>
+    /// Name used when the statistics are reported.
+    /// </summary>
+    const char *name;
+    /// <summary>
+    /// Calls since start. Unlike the histograms, this is not reset with each window.
+    /// </summary>
+    uint32_t calls;
+    DurationHistogram wall;
+    DurationHistogram cpu;
+} HandlerStatistics;
+
+/// <summary>
+///     Clock readings taken just before a handler runs.
+/// </summary>
+typedef struct HandlerTiming {
+    struct timespec wallStart;
+    struct timespec cpuStart;
+    StallWatchScope watch;
+} HandlerTiming;
+
+/// <summary>
+///     Reads the clocks before a handler runs, and tells the stall watchdog which handler is
+///     running.
+/// </summary>
+void HandlerStatistics_Begin(const HandlerStatistics *statistics, HandlerTiming *timing);
+
+/// <summary>
+///     Reads the clocks after a handler has run, records the durations and reports the wall time
+///     to the stall watchdog.
+/// </summary>
+void HandlerStatistics_End(HandlerStatistics *statistics, const HandlerTiming *timing);
+
+/// <summary>
+///     Records one call with the given durations.
+/// </summary>
+void HandlerStatistics_Record(HandlerStatistics *statistics, uint32_t wallUs, uint32_t cpuUs);
+
+/// <summary>
+///     Estimates a percentile from a histogram as the upper bound of the bucket it falls in.
+/// </summary>
+/// <param name="histogram">The histogram</param>
+/// <param name="percent">Percentile, from 1 to 100</param>
+/// <returns>The estimate in microseconds, or 0 if the histogram is empty</returns>
+uint32_t DurationHistogram_GetPercentileUs(const DurationHistogram *histogram, uint32_t percent);
+
+/// <summary>
+///     Formats a summary of the current window as a JSON member, e.g.
+///     "\"Uart\":{\"calls\":10,\"windowCalls\":4,...}".
+/// </summary>
+/// <returns>The snprintf result</returns>
+int HandlerStatistics_FormatSummary(const HandlerStatistics *statistics, char *buffer,
+                                    size_t bufferSize);
+
+/// <summary>
+///     Writes every bucket of both histograms to the debug log, unless the handler has not run in
+///     the current window.
+/// </summary>
+void HandlerStatistics_Dump(const HandlerStatistics *statistics);
+
+/// <summary>
+///     Empties both histograms, starting a new report window.
+/// </summary>
+void HandlerStatistics_ResetWindow(HandlerStatistics *statistics);
@@ -0,0 +1,5 @@
+#pragma once
+#include <stdio.h>
+
+// Stand-in for the Azure Sphere log, for the programs in this directory
+#define Log_Debug printf
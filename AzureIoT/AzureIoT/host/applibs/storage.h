@@ -0,0 +1,5 @@
+#pragma once
+
+// Stand-in for the Azure Sphere mutable storage, for the programs in this directory. Each
+// program defines it, typically over a temporary file.
+int Storage_OpenMutableFile(void);
@@ -0,0 +1,130 @@
+// Latency benchmark for CompletionQueue, on a Linux host. Producer threads post entries in
+// bursts, as worker threads finishing jobs would, into one queue registered with epoll, and the
+// event loop dispatches them. Reports the mean, 99th percentile and maximum time from post to
+// dispatch, and checks that each producer's entries arrive in the order they were posted.
+//
+// Build and run from the directory above, optionally giving the number of producers:
+//     gcc -std=gnu11 -O2 -Ihost -I. host/completion_queue_bench.c epoll_timerfd_utilities.c
+//         handler_statistics.c stall_watchdog.c -o completion_queue_bench -lpthread
+//     ./completion_queue_bench 8
+
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+#include <unistd.h>
+#include "epoll_timerfd_utilities.h"
+
+#define MAX_PRODUCERS 64
+#define ENTRIES_PER_PRODUCER 20000
+#define BATCH_LIMIT 64
+
+typedef struct Producer {
+    pthread_t thread;
+    CompletionEntry entries[ENTRIES_PER_PRODUCER];
+    // Entries dispatched so far; the next one must be entries[dispatched]
+    size_t dispatched;
+} Producer;
+
+static CompletionQueue queue;
+static Producer producers[MAX_PRODUCERS];
+static uint32_t *latenciesUs;
+static size_t dispatchedCount;
+static unsigned int outOfOrder;
+
+static uint64_t GetTimeUs(void)
+{
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (uint64_t)now.tv_sec * 1000000 + (uint64_t)now.tv_nsec / 1000;
+}
+
+static void EntryHandler(CompletionEntry *entry)
+{
+    uint64_t nowUs = GetTimeUs();
+    latenciesUs[dispatchedCount++] =
+        (uint32_t)(nowUs > entry->postedUs ? nowUs - entry->postedUs : 0);
+
+    Producer *producer = entry->context;
+    if (entry != &producer->entries[producer->dispatched]) {
+        outOfOrder++;
+    }
+    producer->dispatched++;
+}
+
+static void *ProducerThread(void *argument)
+{
+    Producer *producer = argument;
+    for (int i = 0; i < ENTRIES_PER_PRODUCER; i++) {
+        producer->entries[i].handler = EntryHandler;
+        producer->entries[i].context = producer;
+        CompletionQueue_Post(&queue, &producer->entries[i]);
+        // Arrive in bursts, as jobs finishing on a pool would
+        if (i % 16 == 0) {
+            usleep(50);
+        }
+    }
+    return NULL;
+}
+
+static int CompareLatencies(const void *a, const void *b)
+{
+    uint32_t left = *(const uint32_t *)a;
+    uint32_t right = *(const uint32_t *)b;
+    return left < right ? -1 : left > right;
+}
+
+int main(int argc, char *argv[])
+{
+    int producerCount = argc > 1 ? atoi(argv[1]) : 4;
+    if (producerCount < 1 || producerCount > MAX_PRODUCERS) {
+        fprintf(stderr, "Producer count must be 1 to %d\n", MAX_PRODUCERS);
+        return EXIT_FAILURE;
+    }
+    size_t total = (size_t)producerCount * ENTRIES_PER_PRODUCER;
+    latenciesUs = malloc(total * sizeof(*latenciesUs));
+    int epollFd = CreateEpollFd();
+    if (latenciesUs == NULL || epollFd < 0 ||
+        CompletionQueue_Init(&queue, epollFd, BATCH_LIMIT) != 0) {
+        return EXIT_FAILURE;
+    }
+
+    uint64_t startMs = GetMonotonicTimeMs();
+    for (int i = 0; i < producerCount; i++) {
+        pthread_create(&producers[i].thread, NULL, ProducerThread, &producers[i]);
+    }
+
+    struct epoll_event events[8];
+    EventDispatchStatistics statistics = {0};
+    while (dispatchedCount < total) {
+        if (WaitForEventsAndCallHandlers(epollFd, events, 8, 1000, &statistics) < 0) {
+            return EXIT_FAILURE;
+        }
+    }
+    uint64_t elapsedMs = GetMonotonicTimeMs() - startMs;
+    for (int i = 0; i < producerCount; i++) {
+        pthread_join(producers[i].thread, NULL);
+    }
+    CompletionQueue_Close(&queue, epollFd);
+    CloseFdAndPrintError(epollFd, "Epoll");
+
+    uint64_t totalUs = 0;
+    for (size_t i = 0; i < total; i++) {
+        totalUs += latenciesUs[i];
+    }
+    qsort(latenciesUs, total, sizeof(*latenciesUs), CompareLatencies);
+    const CompletionQueueStatistics *s = &queue.statistics;
+    printf("%d producers: %lu entries/s, latency mean %llu us, p99 %u us, max %u us\n",
+           producerCount, (unsigned long)(total * 1000 / (elapsedMs > 0 ? elapsedMs : 1)),
+           (unsigned long long)(totalUs / total), latenciesUs[total * 99 / 100],
+           latenciesUs[total - 1]);
+    printf("%u wakeups, %u batches (largest %u), %u yields\n", statistics.wakeups, s->batches,
+           s->maxBatch, s->yields);
+    free(latenciesUs);
+
+    if (outOfOrder != 0) {
+        printf("FAIL: %u entries dispatched out of order\n", outOfOrder);
+        return EXIT_FAILURE;
+    }
+    return EXIT_SUCCESS;
+}
@@ -0,0 +1,110 @@
+// Tests of device_storage.c on a Linux host: a save torn by a reset must leave the previous
+// settings readable. Mutable storage is a temporary file. Exits with 0 if every check passes.
+//
+// Build and run from the directory above:
+//     gcc -std=gnu11 -Ihost -I. host/device_storage_test.c device_storage.c parson.c
+//         -o device_storage_test && ./device_storage_test
+
+#include <fcntl.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include "device_storage.h"
+
+static char path[] = "/tmp/device_storage_testXXXXXX";
+static int failures;
+
+int Storage_OpenMutableFile(void)
+{
+    return open(path, O_RDWR);
+}
+
+static void Check(bool condition, const char *what)
+{
+    if (!condition) {
+        failures++;
+        printf("FAIL: %s\n", what);
+    }
+}
+
+static void Save(const char *value)
+{
+    json_object_set_string(DeviceStorage_GetRoot(), "value", value);
+    Check(DeviceStorage_Save() == 0, "save failed");
+}
+
+/// <summary>
+///     Loads the settings again, as after a restart, and checks the result and the stored value.
+/// </summary>
+static void CheckLoad(int expectedResult, const char *expectedValue, const char *what)
+{
+    DeviceStorage_Close();
+    int result = DeviceStorage_Load();
+    const char *value = json_object_get_string(DeviceStorage_GetRoot(), "value");
+    bool matches = expectedValue == NULL ? value == NULL
+                                         : value != NULL && strcmp(value, expectedValue) == 0;
+    if (result != expectedResult || !matches) {
+        failures++;
+        printf("FAIL: %s: load gave %d and \"%s\"\n", what, result, value != NULL ? value : "");
+    }
+}
+
+/// <summary>
+///     Overwrites bytes of the file, as a save interrupted partway through would.
+/// </summary>
+static void Damage(off_t offset)
+{
+    int fd = open(path, O_WRONLY);
+    if (fd < 0 || pwrite(fd, "XX", 2, offset) != 2) {
+        exit(EXIT_FAILURE);
+    }
+    close(fd);
+}
+
+static void Replace(const void *contents, size_t length)
+{
+    int fd = open(path, O_WRONLY | O_TRUNC);
+    if (fd < 0 || write(fd, contents, length) != (ssize_t)length) {
+        exit(EXIT_FAILURE);
+    }
+    close(fd);
+}
+
+int main(void)
+{
+    int fd = mkstemp(path);
+    if (fd < 0) {
+        return EXIT_FAILURE;
+    }
+    close(fd);
+
+    CheckLoad(0, NULL, "a new device starts empty");
+    Save("one");
+    CheckLoad(0, "one", "first save");
+    Save("two");
+    Save("three");
+    CheckLoad(0, "three", "the latest of three saves");
+
+    // "three" went to the first slot: tear its document, then its header
+    Damage(20);
+    CheckLoad(0, "two", "torn document falls back to the previous save");
+    Save("four");
+    CheckLoad(0, "four", "save after a torn slot");
+    Damage(8192 + 4);
+    CheckLoad(0, "four", "damage to the older slot");
+    Damage(4);
+    CheckLoad(-1, NULL, "both slots damaged");
+
+    Replace("not settings", 12);
+    CheckLoad(-1, NULL, "a file of another format");
+    static const char zeros[16384];
+    Replace(zeros, sizeof(zeros));
+    CheckLoad(0, NULL, "a zero-filled file");
+
+    DeviceStorage_Close();
+    unlink(path);
+    printf(failures == 0 ? "PASS\n" : "%d checks failed\n", failures);
+    return failures == 0 ? EXIT_SUCCESS : EXIT_FAILURE;
+}
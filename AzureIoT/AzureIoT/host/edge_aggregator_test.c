@@ -0,0 +1,47 @@
+// Tests of the fixed-point parsing in edge_aggregator.c, on a Linux host. Exits with 0 if every
+// check passes.
+//
+// Build and run from the directory above:
+//     gcc -std=gnu11 -Ihost -I. host/edge_aggregator_test.c edge_aggregator.c outbound_queue.c
+//         -o edge_aggregator_test && ./edge_aggregator_test
+
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include "edge_aggregator.h"
+
+static int failures;
+
+static void CheckParse(const char *text, int expectedResult, int32_t expectedValue)
+{
+    int32_t value = 0;
+    int result = EdgeAggregator_ParseFixedPoint(text, &value);
+    if (result != expectedResult || (result == 0 && value != expectedValue)) {
+        failures++;
+        printf("FAIL: \"%s\" gave %d and %ld\n", text, result, (long)value);
+    }
+}
+
+int main(void)
+{
+    CheckParse("23", 0, 2300);
+    CheckParse("-4.5", 0, -450);
+    CheckParse("3.059", 0, 305);
+    CheckParse("+.5", 0, 50);
+    CheckParse("", -1, 0);
+    CheckParse("-", -1, 0);
+    CheckParse("1.2.3", -1, 0);
+    CheckParse("12a", -1, 0);
+
+    // The limits of an int32_t in hundredths, and just past them
+    CheckParse("21474836.47", 0, INT32_MAX);
+    CheckParse("21474836.48", -1, 0);
+    CheckParse("21474836.99", -1, 0);
+    CheckParse("-21474836.48", 0, INT32_MIN);
+    CheckParse("-21474836.49", -1, 0);
+    CheckParse("21474837", -1, 0);
+    CheckParse("99999999999999999999", -1, 0);
+
+    printf(failures == 0 ? "PASS\n" : "%d checks failed\n", failures);
+    return failures == 0 ? EXIT_SUCCESS : EXIT_FAILURE;
+}
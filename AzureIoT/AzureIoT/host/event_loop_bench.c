@@ -0,0 +1,119 @@
+// Loopback benchmark for the event loop backends, on a Linux host. Writers on 24 threads each
+// send fixed-size frames down their own pipe, and one event loop reads them all, so the frame
+// rate and the kernel calls per wakeup of epoll and io_uring can be compared on the same load.
+//
+// Build and run from the directory above, once without and once with -D EVENT_LOOP_IO_URING:
+//     gcc -std=gnu11 -O2 -Ihost -I. host/event_loop_bench.c epoll_timerfd_utilities.c
+//         io_uring_loop.c handler_statistics.c stall_watchdog.c -o event_loop_bench -lpthread
+
+// For pipe2
+#define _GNU_SOURCE
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include "epoll_timerfd_utilities.h"
+
+#define WRITERS 24
+#define FRAMES_PER_WRITER 20000
+#define FRAME_SIZE 32
+
+typedef struct Pipe {
+    // First, so that the handler can get from its EventData to the pipe
+    EventData eventData;
+    int readFd;
+    int writeFd;
+    long framesRead;
+} Pipe;
+
+static Pipe pipes[WRITERS];
+
+static void PipeEventHandler(EventData *eventData)
+{
+    Pipe *pipe = (Pipe *)eventData;
+    char buffer[1024];
+    for (;;) {
+        ssize_t bytesRead = read(pipe->readFd, buffer, sizeof(buffer));
+        if (bytesRead <= 0) {
+            break;
+        }
+        pipe->framesRead += bytesRead / FRAME_SIZE;
+        if (IsEventHandlerOverBudget()) {
+            break;
+        }
+    }
+}
+
+static void *WriterThread(void *argument)
+{
+    Pipe *pipe = argument;
+    char frame[FRAME_SIZE] = {0};
+    for (int i = 0; i < FRAMES_PER_WRITER; i++) {
+        // The pipe is non-blocking, so wait for the loop to make room
+        while (write(pipe->writeFd, frame, sizeof(frame)) != sizeof(frame)) {
+        }
+        // Arrive in bursts, as frames from the UART do
+        if (i % 16 == 0) {
+            usleep(50);
+        }
+    }
+    return NULL;
+}
+
+int main(void)
+{
+    int epollFd = CreateEpollFd();
+    if (epollFd < 0) {
+        return EXIT_FAILURE;
+    }
+    for (int i = 0; i < WRITERS; i++) {
+        int fds[2];
+        if (pipe2(fds, O_NONBLOCK) != 0) {
+            return EXIT_FAILURE;
+        }
+        pipes[i].readFd = fds[0];
+        pipes[i].writeFd = fds[1];
+        pipes[i].eventData.eventHandler = PipeEventHandler;
+        if (RegisterEventHandlerToEpoll(epollFd, fds[0], &pipes[i].eventData, EPOLLIN) != 0) {
+            return EXIT_FAILURE;
+        }
+    }
+    // Unregistering and registering again must leave the descriptor working
+    UnregisterEventHandlerFromEpoll(epollFd, pipes[0].readFd);
+    RegisterEventHandlerToEpoll(epollFd, pipes[0].readFd, &pipes[0].eventData, EPOLLIN);
+
+    pthread_t threads[WRITERS];
+    uint64_t startMs = GetMonotonicTimeMs();
+    for (int i = 0; i < WRITERS; i++) {
+        pthread_create(&threads[i], NULL, WriterThread, &pipes[i]);
+    }
+
+    struct epoll_event events[32];
+    EventDispatchStatistics statistics = {0};
+    long totalFrames = 0;
+    while (totalFrames < (long)WRITERS * FRAMES_PER_WRITER) {
+        if (WaitForEventsAndCallHandlers(epollFd, events, 32, 1000, &statistics) < 0) {
+            return EXIT_FAILURE;
+        }
+        totalFrames = 0;
+        for (int i = 0; i < WRITERS; i++) {
+            totalFrames += pipes[i].framesRead;
+        }
+    }
+    uint64_t elapsedMs = GetMonotonicTimeMs() - startMs;
+    for (int i = 0; i < WRITERS; i++) {
+        pthread_join(threads[i], NULL);
+        CloseFdAndPrintError(pipes[i].readFd, "Pipe");
+        close(pipes[i].writeFd);
+    }
+
+    printf("%s: %lu frames/s, %u wakeups, %u kernel calls (%.2f per wakeup), %u events\n",
+           GetEventLoopBackendName(),
+           (unsigned long)(totalFrames * 1000 / (elapsedMs > 0 ? elapsedMs : 1)),
+           statistics.wakeups, statistics.syscalls,
+           statistics.wakeups > 0 ? (double)statistics.syscalls / statistics.wakeups : 0.0,
+           statistics.eventsDispatched);
+    CloseFdAndPrintError(epollFd, "Epoll");
+    return EXIT_SUCCESS;
+}
@@ -0,0 +1,314 @@
+// Tests of the fake IoT Hub transport in fake_transport.c, on a Linux host. The clock is
+// replaced so that latency, loss and the rate limit can be checked exactly, and each message's
+// confirmation callback is checked against the counters. Exits with 0 if every check passes.
+//
+// Build and run from the directory above:
+//     gcc -std=gnu11 -Ihost -I. host/fake_transport_test.c fake_transport.c
+//         -o fake_transport_test && ./fake_transport_test
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include "fake_transport.h"
+
+#define MAX_MESSAGES 2000
+// No callback yet
+#define NO_RESULT (-1)
+
+static uint64_t nowMs = 1000000;
+static int results[MAX_MESSAGES];
+static int confirmations;
+static int reportedStatus;
+static int connections;
+static int twinUpdates;
+static FakeTransportStatistics before;
+static int failures;
+
+// Replaces the one in epoll_timerfd_utilities.c
+uint64_t GetMonotonicTimeMs(void)
+{
+    return nowMs;
+}
+
+static void Check(bool condition, const char *what, long value)
+{
+    if (!condition) {
+        failures++;
+        printf("FAIL: %s (%ld)\n", what, value);
+    }
+}
+
+static void ConnectionStatusCallback(IOTHUB_CLIENT_CONNECTION_STATUS result,
+                                     IOTHUB_CLIENT_CONNECTION_STATUS_REASON reason, void *context)
+{
+    (void)context;
+    Check(result == IOTHUB_CLIENT_CONNECTION_AUTHENTICATED &&
+              reason == IOTHUB_CLIENT_CONNECTION_OK,
+          "connection status was not authenticated", result);
+    connections++;
+}
+
+static void TwinCallback(DEVICE_TWIN_UPDATE_STATE state, const unsigned char *payload, size_t size,
+                         void *context)
+{
+    (void)payload;
+    (void)size;
+    (void)context;
+    Check(state == DEVICE_TWIN_UPDATE_COMPLETE, "first twin was not complete", state);
+    twinUpdates++;
+}
+
+static void SendConfirmationCallback(IOTHUB_CLIENT_CONFIRMATION_RESULT result, void *context)
+{
+    intptr_t id = (intptr_t)context;
+    Check(results[id] == NO_RESULT, "message confirmed twice", id);
+    results[id] = result;
+    confirmations++;
+}
+
+static void ReportedStateCallback(int status, void *context)
+{
+    (void)context;
+    reportedStatus = status;
+}
+
+/// <summary>
+///     Creates a connection with the given settings over the defaults, and forgets earlier
+///     callbacks. The counters only ever grow, so they are compared with a copy taken here.
+/// </summary>
+static void Start(const char *settings)
+{
+    FakeTransportConfig config = FakeTransportDefaultConfig;
+    if (FakeTransport_ParseConfig(settings, &config) != 0) {
+        printf("FAIL: settings \"%s\" not understood\n", settings);
+        exit(EXIT_FAILURE);
+    }
+    FakeTransport_Configure(&config);
+
+    static const CloudTransportCallbacks callbacks = {
+        .connectionStatus = ConnectionStatusCallback, .twinUpdate = TwinCallback};
+    bool authFailure;
+    Check(FakeCloudTransport.create(NULL, NULL, 0, &callbacks, &authFailure) == 0,
+          "create failed", 0);
+    for (int i = 0; i < MAX_MESSAGES; i++) {
+        results[i] = NO_RESULT;
+    }
+    confirmations = 0;
+    reportedStatus = 0;
+    connections = 0;
+    twinUpdates = 0;
+    FakeTransport_GetStatistics(&before);
+}
+
+static int Send(intptr_t id)
+{
+    return FakeCloudTransport.sendEvent(NULL, SendConfirmationCallback, (void *)id);
+}
+
+static void RunUntil(uint64_t timeMs)
+{
+    nowMs = timeMs;
+    FakeCloudTransport.doWork();
+}
+
+static int CountResults(int result)
+{
+    int count = 0;
+    for (int i = 0; i < MAX_MESSAGES; i++) {
+        count += results[i] == result;
+    }
+    return count;
+}
+
+/// <summary>
+///     The connection is reported after connectDelayMs, followed by the whole twin, and
+///     messages sent before then wait for it.
+/// </summary>
+static void TestConnect(void)
+{
+    uint64_t startMs = nowMs;
+    Start("connectDelayMs=300,latencyMs=50");
+    Check(Send(0) == 0, "send before connecting failed", 0);
+    RunUntil(startMs + 299);
+    Check(connections == 0, "connected early", connections);
+    RunUntil(startMs + 300);
+    Check(connections == 1 && twinUpdates == 1, "connection or twin not reported",
+          connections * 10 + twinUpdates);
+    Check(confirmations == 0, "message acknowledged before connecting plus latency", 0);
+    RunUntil(startMs + 350);
+    Check(results[0] == IOTHUB_CLIENT_CONFIRMATION_OK, "message not acknowledged", results[0]);
+}
+
+/// <summary>
+///     Messages are acknowledged between latencyMs and latencyMs + jitterMs after they are sent,
+///     and the acknowledgement times are counted.
+/// </summary>
+static void TestLatency(void)
+{
+    Start("latencyMs=40,jitterMs=20,seed=7");
+    RunUntil(nowMs);
+    uint64_t startMs = nowMs;
+    for (intptr_t i = 0; i < 50; i++) {
+        Send(i);
+    }
+    RunUntil(startMs + 39);
+    Check(confirmations == 0, "message acknowledged before the latency", confirmations);
+    RunUntil(startMs + 50);
+    Check(confirmations > 0 && confirmations < 50, "jitter did not spread acknowledgements",
+          confirmations);
+    RunUntil(startMs + 60);
+    Check(CountResults(IOTHUB_CLIENT_CONFIRMATION_OK) == 50, "messages not all acknowledged",
+          CountResults(IOTHUB_CLIENT_CONFIRMATION_OK));
+
+    FakeTransportStatistics after;
+    FakeTransport_GetStatistics(&after);
+    Check(after.sent - before.sent == 50, "sent not counted", after.sent - before.sent);
+    Check(after.acknowledged - before.acknowledged == 50, "acknowledged not counted",
+          after.acknowledged - before.acknowledged);
+    Check(after.maxAckMs >= 40 && after.maxAckMs <= 60, "maximum acknowledgement time wrong",
+          after.maxAckMs);
+    uint64_t totalAckMs = after.totalAckMs - before.totalAckMs;
+    Check(totalAckMs >= 50 * 40 && totalAckMs <= 50 * 60, "acknowledgement times not counted",
+          (long)totalAckMs);
+    Check(FakeCloudTransport.isSendIdle(), "not idle with every message acknowledged", 0);
+}
+
+/// <summary>
+///     About lossPercent of the messages complete with a timeout after messageTimeoutMs, the
+///     rest are acknowledged, and the counters agree with the callbacks.
+/// </summary>
+static void TestLoss(void)
+{
+    Start("latencyMs=10,lossPercent=20,messageTimeoutMs=1000");
+    RunUntil(nowMs);
+    for (intptr_t i = 0; i < MAX_MESSAGES; i++) {
+        Check(Send(i) == 0, "send failed", i);
+        // Let the pending list drain before it fills
+        if (i % 50 == 49) {
+            uint64_t sentMs = nowMs;
+            RunUntil(sentMs + 10);
+            Check(!FakeCloudTransport.isSendIdle(), "lost messages not still pending", i);
+            RunUntil(sentMs + 1000);
+        }
+    }
+
+    int lost = CountResults(IOTHUB_CLIENT_CONFIRMATION_MESSAGE_TIMEOUT);
+    int acknowledged = CountResults(IOTHUB_CLIENT_CONFIRMATION_OK);
+    Check(lost + acknowledged == MAX_MESSAGES, "messages not all confirmed", lost + acknowledged);
+    Check(lost > MAX_MESSAGES * 15 / 100 && lost < MAX_MESSAGES * 25 / 100,
+          "loss far from lossPercent", lost);
+    FakeTransportStatistics after;
+    FakeTransport_GetStatistics(&after);
+    Check((int)(after.lost - before.lost) == lost, "lost messages not counted",
+          after.lost - before.lost);
+    Check((int)(after.acknowledged - before.acknowledged) == acknowledged,
+          "acknowledged messages not counted", after.acknowledged - before.acknowledged);
+}
+
+/// <summary>
+///     Above ratePerSecond, once the burst is used up, messages are accepted one interval apart,
+///     and each one held back is counted as throttled.
+/// </summary>
+static void TestRateLimit(void)
+{
+    Start("latencyMs=0,ratePerSecond=10,burst=5");
+    RunUntil(nowMs);
+    uint64_t startMs = nowMs;
+    for (intptr_t i = 0; i < 20; i++) {
+        Send(i);
+    }
+    RunUntil(startMs);
+    Check(confirmations == 5, "burst not accepted at once", confirmations);
+    // The sixth message is accepted one interval later, then one every 100 ms
+    RunUntil(startMs + 99);
+    Check(confirmations == 5, "throttled message accepted early", confirmations);
+    RunUntil(startMs + 1000);
+    Check(confirmations == 15, "throttled messages not accepted at the rate", confirmations);
+    RunUntil(startMs + 1500);
+    Check(confirmations == 20, "throttled messages not all accepted", confirmations);
+    for (int i = 0; i < 20; i++) {
+        Check(results[i] == IOTHUB_CLIENT_CONFIRMATION_OK, "throttled message not acknowledged",
+              i);
+    }
+
+    FakeTransportStatistics after;
+    FakeTransport_GetStatistics(&after);
+    Check(after.throttled - before.throttled == 15, "throttled messages not counted",
+          after.throttled - before.throttled);
+}
+
+/// <summary>
+///     With FAKE_TRANSPORT_MAX_PENDING messages pending, further sends are refused and counted,
+///     so the gateway's own backpressure has to hold them.
+/// </summary>
+static void TestBackpressure(void)
+{
+    Start("latencyMs=100");
+    RunUntil(nowMs);
+    uint64_t startMs = nowMs;
+    for (intptr_t i = 0; i < FAKE_TRANSPORT_MAX_PENDING; i++) {
+        Check(Send(i) == 0, "send below the pending limit failed", i);
+    }
+    Check(Send(FAKE_TRANSPORT_MAX_PENDING) != 0, "send above the pending limit accepted", 0);
+    Check(!FakeCloudTransport.isSendIdle(), "idle with messages pending", 0);
+
+    FakeTransportStatistics after;
+    FakeTransport_GetStatistics(&after);
+    Check(after.rejected - before.rejected == 1, "refused send not counted",
+          after.rejected - before.rejected);
+    Check(after.maxPending == FAKE_TRANSPORT_MAX_PENDING, "most pending not counted",
+          after.maxPending);
+
+    RunUntil(startMs + 100);
+    Check(confirmations == FAKE_TRANSPORT_MAX_PENDING, "pending messages not acknowledged",
+          confirmations);
+    Check(results[FAKE_TRANSPORT_MAX_PENDING] == NO_RESULT, "refused message confirmed", 0);
+    Check(Send(FAKE_TRANSPORT_MAX_PENDING) == 0, "send after draining failed", 0);
+}
+
+/// <summary>
+///     A reported properties patch gets status 204 after the latency, and destroying the
+///     connection completes every message still held with BECAUSE_DESTROY.
+/// </summary>
+static void TestReportedStateAndDestroy(void)
+{
+    Start("latencyMs=100");
+    RunUntil(nowMs);
+    uint64_t startMs = nowMs;
+    static const unsigned char patch[] = "{\"Test\":1}";
+    Check(FakeCloudTransport.sendReportedState(patch, sizeof(patch) - 1, ReportedStateCallback,
+                                               NULL) == 0,
+          "reported state not queued", 0);
+    RunUntil(startMs + 100);
+    Check(reportedStatus == 204, "reported state not acknowledged", reportedStatus);
+
+    for (intptr_t i = 0; i < 10; i++) {
+        Send(i);
+    }
+    Check(FakeCloudTransport.sendReportedState(patch, sizeof(patch) - 1, ReportedStateCallback,
+                                               NULL) == 0,
+          "reported state not queued", 0);
+    FakeCloudTransport.destroy();
+    Check(CountResults(IOTHUB_CLIENT_CONFIRMATION_BECAUSE_DESTROY) == 10,
+          "held messages not completed on destroy",
+          CountResults(IOTHUB_CLIENT_CONFIRMATION_BECAUSE_DESTROY));
+    Check(reportedStatus == 500, "held reported state not failed on destroy", reportedStatus);
+    Check(!FakeCloudTransport.isCreated() && FakeCloudTransport.isSendIdle(),
+          "connection not gone after destroy", 0);
+    Check(Send(10) != 0, "send accepted without a connection", 0);
+}
+
+int main(void)
+{
+    // First, as the maximum acknowledgement time is kept for the life of the process
+    TestLatency();
+    TestConnect();
+    TestLoss();
+    TestRateLimit();
+    TestBackpressure();
+    TestReportedStateAndDestroy();
+
+    printf(failures == 0 ? "PASS\n" : "%d checks failed\n", failures);
+    return failures == 0 ? EXIT_SUCCESS : EXIT_FAILURE;
+}
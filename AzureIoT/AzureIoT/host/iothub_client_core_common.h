@@ -0,0 +1,51 @@
+#pragma once
+#include <stddef.h>
+
+// Stand-in for the IoT Hub SDK header, for the programs in this directory. It declares only the
+// types that cloud_transport.h and fake_transport.c use, with the SDK's names, values and
+// callback signatures.
+
+typedef struct IOTHUB_MESSAGE_HANDLE_DATA_TAG *IOTHUB_MESSAGE_HANDLE;
+
+typedef enum {
+    IOTHUB_CLIENT_CONFIRMATION_OK,
+    IOTHUB_CLIENT_CONFIRMATION_BECAUSE_DESTROY,
+    IOTHUB_CLIENT_CONFIRMATION_MESSAGE_TIMEOUT,
+    IOTHUB_CLIENT_CONFIRMATION_ERROR
+} IOTHUB_CLIENT_CONFIRMATION_RESULT;
+
+typedef enum {
+    IOTHUB_CLIENT_CONNECTION_AUTHENTICATED,
+    IOTHUB_CLIENT_CONNECTION_UNAUTHENTICATED
+} IOTHUB_CLIENT_CONNECTION_STATUS;
+
+typedef enum {
+    IOTHUB_CLIENT_CONNECTION_EXPIRED_SAS_TOKEN,
+    IOTHUB_CLIENT_CONNECTION_DEVICE_DISABLED,
+    IOTHUB_CLIENT_CONNECTION_BAD_CREDENTIAL,
+    IOTHUB_CLIENT_CONNECTION_RETRY_EXPIRED,
+    IOTHUB_CLIENT_CONNECTION_NO_NETWORK,
+    IOTHUB_CLIENT_CONNECTION_COMMUNICATION_ERROR,
+    IOTHUB_CLIENT_CONNECTION_OK,
+    IOTHUB_CLIENT_CONNECTION_NO_PING_RESPONSE
+} IOTHUB_CLIENT_CONNECTION_STATUS_REASON;
+
+typedef enum {
+    DEVICE_TWIN_UPDATE_COMPLETE,
+    DEVICE_TWIN_UPDATE_PARTIAL
+} DEVICE_TWIN_UPDATE_STATE;
+
+typedef void (*IOTHUB_CLIENT_EVENT_CONFIRMATION_CALLBACK)(IOTHUB_CLIENT_CONFIRMATION_RESULT result,
+                                                          void *userContextCallback);
+typedef void (*IOTHUB_CLIENT_CONNECTION_STATUS_CALLBACK)(
+    IOTHUB_CLIENT_CONNECTION_STATUS result, IOTHUB_CLIENT_CONNECTION_STATUS_REASON reason,
+    void *userContextCallback);
+typedef void (*IOTHUB_CLIENT_DEVICE_TWIN_CALLBACK)(DEVICE_TWIN_UPDATE_STATE update_state,
+                                                   const unsigned char *payLoad, size_t size,
+                                                   void *userContextCallback);
+typedef void (*IOTHUB_CLIENT_REPORTED_STATE_CALLBACK)(int status_code, void *userContextCallback);
+typedef int (*IOTHUB_CLIENT_DEVICE_METHOD_CALLBACK_ASYNC)(const char *method_name,
+                                                          const unsigned char *payload,
+                                                          size_t size, unsigned char **response,
+                                                          size_t *response_size,
+                                                          void *userContextCallback);
@@ -0,0 +1,136 @@
+// Tests of message_shaper.c on a Linux host. Messages the shaper lets through are recorded
+// instead of being sent. Exits with 0 if every check passes.
+//
+// Build and run from the directory above:
+//     gcc -std=gnu11 -Ihost -I. host/message_shaper_test.c message_shaper.c outbound_queue.c
+//         -o message_shaper_test && ./message_shaper_test
+
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "message_shaper.h"
+
+#define NODE_DOOR 8
+#define NODE_ROOM 4
+#define NODE_OUTSIDE 6
+#define MAX_SENT 64
+
+static MessageShaper shaper;
+static TelemetryMessage sent[MAX_SENT];
+static size_t sentCount;
+static int failures;
+
+static void Check(bool condition, const char *what)
+{
+    if (!condition) {
+        failures++;
+        printf("FAIL: %s\n", what);
+    }
+}
+
+static int RecordMessage(const TelemetryMessage *message, void *context)
+{
+    (void)context;
+    if (sentCount < MAX_SENT) {
+        sent[sentCount] = *message;
+    }
+    sentCount++;
+    return 0;
+}
+
+/// <summary>
+///     Starts a shaper with every bucket disabled and sending paused, as before the client exists.
+/// </summary>
+static void Reset(MessageShaperPolicy policy)
+{
+    MessageShaperConfig config = {.policy = policy};
+    MessageShaper_Init(&shaper, &config, RecordMessage, NULL, 0);
+    MessageShaper_SetPaused(&shaper, true);
+    sentCount = 0;
+}
+
+static void Submit(int node, MessagePriority priority, TelemetryClass telemetryClass,
+                   const char *key, const char *value)
+{
+    TelemetryMessage message;
+    TelemetryMessage_Init(&message, node, priority, telemetryClass, &key, &value, 1);
+    MessageShaper_Submit(&shaper, &message, 0);
+}
+
+static void Resume(void)
+{
+    MessageShaper_SetPaused(&shaper, false);
+    MessageShaper_Poll(&shaper, 0);
+}
+
+static bool SentValue(size_t index, const char *value)
+{
+    return index < sentCount && strcmp(sent[index].values[0], value) == 0;
+}
+
+/// <summary>
+///     Under the merge policy, a door that opens and closes while sending is paused produces two
+///     messages, in order, rather than one carrying the last state.
+/// </summary>
+static void TestEventsNotMerged(void)
+{
+    Reset(MessageShaperPolicy_Merge);
+    Submit(NODE_DOOR, MessagePriority_High, TelemetryClass_Event, "DoorState", "1");
+    Submit(NODE_DOOR, MessagePriority_High, TelemetryClass_Event, "DoorState", "0");
+    Check(shaper.statistics.merged == 0, "door event was merged");
+    Resume();
+    Check(sentCount == 2, "door events were not both sent");
+    Check(SentValue(0, "1") && SentValue(1, "0"), "door events were sent out of order");
+}
+
+/// <summary>
+///     Readings from one node are still folded into one message carrying the latest value.
+/// </summary>
+static void TestReadingsMerged(void)
+{
+    Reset(MessageShaperPolicy_Merge);
+    Submit(NODE_ROOM, MessagePriority_Normal, TelemetryClass_Environment, "RoomTemp", "21");
+    Submit(NODE_ROOM, MessagePriority_Normal, TelemetryClass_Environment, "RoomTemp", "22");
+    Check(shaper.statistics.merged == 1, "reading was not merged");
+    Resume();
+    Check(sentCount == 1 && SentValue(0, "22"), "merged reading was not sent with the last value");
+}
+
+/// <summary>
+///     Under the drop policy, a throttled message is dropped on arrival if it is low priority or
+///     no more important than what is already queued, and queued otherwise.
+/// </summary>
+static void TestDropOnArrival(void)
+{
+    // One message a second with no burst, so everything after the first is throttled
+    MessageShaperConfig config = {.globalMilliMessagesPerSecond = 1000,
+                                  .globalBurst = 1,
+                                  .policy = MessageShaperPolicy_DropLowestPriority};
+    MessageShaper_Init(&shaper, &config, RecordMessage, NULL, 0);
+    sentCount = 0;
+
+    Submit(NODE_ROOM, MessagePriority_Normal, TelemetryClass_Environment, "RoomTemp", "21");
+    Check(sentCount == 1, "first reading was not sent");
+    Submit(NODE_ROOM, MessagePriority_Low, TelemetryClass_Battery, "Battery", "90");
+    Check(shaper.statistics.droppedOnArrival == 1, "low-priority message was not dropped");
+    Submit(NODE_ROOM, MessagePriority_Normal, TelemetryClass_Environment, "RoomTemp", "22");
+    Check(shaper.queue.count == 1, "reading was not queued in the empty queue");
+    Submit(NODE_OUTSIDE, MessagePriority_Normal, TelemetryClass_Environment, "OutTemp", "5");
+    Check(shaper.statistics.droppedOnArrival == 2, "reading no more important was not dropped");
+    Submit(NODE_OUTSIDE, MessagePriority_High, TelemetryClass_Environment, "OutTemp", "6");
+    Submit(NODE_DOOR, MessagePriority_Low, TelemetryClass_Event, "DoorState", "1");
+    Check(shaper.queue.count == 3, "more important reading or event was not queued");
+    Check(shaper.statistics.dropped == 2 && shaper.statistics.delayed == 3,
+          "drops and delays were not counted");
+}
+
+int main(void)
+{
+    TestEventsNotMerged();
+    TestReadingsMerged();
+    TestDropOnArrival();
+
+    printf(failures == 0 ? "PASS\n" : "%d checks failed\n", failures);
+    return failures == 0 ? EXIT_SUCCESS : EXIT_FAILURE;
+}
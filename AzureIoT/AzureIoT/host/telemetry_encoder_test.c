@@ -0,0 +1,105 @@
+// Tests of the JSON bodies and the CBOR value encoding in telemetry_encoder.c, on a Linux host.
+// Exits with 0 if every check passes.
+//
+// Build and run from the directory above:
+//     gcc -std=gnu11 -I. host/telemetry_encoder_test.c telemetry_encoder.c
+//         -o telemetry_encoder_test && ./telemetry_encoder_test
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "telemetry_encoder.h"
+
+// CBOR major types, in the top three bits of the first byte of an item
+#define MAJOR_UNSIGNED 0
+#define MAJOR_NEGATIVE 1
+#define MAJOR_TEXT 3
+#define MAJOR_SIMPLE_OR_FLOAT 7
+
+static int failures;
+
+/// <summary>
+///     Encodes one field and checks the major type and total length of its value.
+/// </summary>
+static void CheckValue(const char *value, int major, size_t length)
+{
+    uint8_t storage[64];
+    TelemetryBuffer buffer;
+    TelemetryBuffer_Init(&buffer, storage, sizeof(storage));
+    const TelemetryEncoder *encoder = &CborTelemetryEncoder;
+    // The map head and the one-byte key "k" with its head come first
+    encoder->begin(&buffer);
+    size_t valueStart = buffer.length + 2;
+    if (encoder->addField(&buffer, "k", value) != 0) {
+        failures++;
+        printf("FAIL: \"%s\" could not be added\n", value);
+        return;
+    }
+    int actualMajor = storage[valueStart] >> 5;
+    size_t actualLength = buffer.length - valueStart;
+    if (actualMajor != major || actualLength != length) {
+        failures++;
+        printf("FAIL: \"%s\" encoded as major type %d, %zu bytes; expected %d, %zu bytes\n",
+               value, actualMajor, actualLength, major, length);
+    }
+}
+
+/// <summary>
+///     Encodes one record with the JSON encoder and checks the body byte for byte.
+/// </summary>
+static void CheckJson(const char *const keys[], const char *const values[], size_t count,
+                      const char *expected)
+{
+    uint8_t storage[128];
+    TelemetryBuffer buffer;
+    TelemetryBuffer_Init(&buffer, storage, sizeof(storage));
+    const TelemetryEncoder *encoder = &JsonTelemetryEncoder;
+    encoder->begin(&buffer);
+    for (size_t i = 0; i < count; i++) {
+        encoder->addField(&buffer, keys[i], values[i]);
+    }
+    encoder->end(&buffer);
+    if (buffer.length != strlen(expected) || memcmp(storage, expected, buffer.length) != 0) {
+        failures++;
+        printf("FAIL: JSON body %.*s; expected %s\n", (int)buffer.length, storage, expected);
+    }
+}
+
+int main(void)
+{
+    // Single readings keep the exact bodies of the per-reading snprintf templates they replaced
+    CheckJson((const char *[]){"RoomTemp"}, (const char *[]){"23"}, 1, "{ \"RoomTemp\": \"23\"}");
+    CheckJson((const char *[]){"inOffice"}, (const char *[]){"1"}, 1, "{ \"inOffice\": \"1\"}");
+    // The Name/Evalue template also had a space before the closing brace, which is not kept
+    CheckJson((const char *[]){"Name", "Evalue"}, (const char *[]){"n", "v"}, 2,
+              "{ \"Name\": \"n\", \"Evalue\": \"v\"}");
+
+    // Integers and finite decimals become numbers
+    CheckValue("23", MAJOR_UNSIGNED, 1);
+    CheckValue("1012", MAJOR_UNSIGNED, 3);
+    CheckValue("-5", MAJOR_NEGATIVE, 1);
+    CheckValue("3.5", MAJOR_SIMPLE_OR_FLOAT, 5);
+    CheckValue("-0.25", MAJOR_SIMPLE_OR_FLOAT, 5);
+    CheckValue("1e3", MAJOR_SIMPLE_OR_FLOAT, 5);
+    CheckValue("5.", MAJOR_SIMPLE_OR_FLOAT, 5);
+    // An integer too large for long long is still a finite float
+    CheckValue("99999999999999999999", MAJOR_SIMPLE_OR_FLOAT, 5);
+
+    // Anything strtod would accept that is not a finite decimal stays text
+    CheckValue("nan", MAJOR_TEXT, 4);
+    CheckValue("inf", MAJOR_TEXT, 4);
+    CheckValue("-inf", MAJOR_TEXT, 5);
+    CheckValue("0x1A", MAJOR_TEXT, 5);
+    CheckValue(" 5", MAJOR_TEXT, 3);
+    CheckValue("+5", MAJOR_TEXT, 3);
+    CheckValue("1e39", MAJOR_TEXT, 5);
+    CheckValue("1e-50", MAJOR_TEXT, 6);
+    CheckValue("1e", MAJOR_TEXT, 3);
+    CheckValue("-", MAJOR_TEXT, 2);
+    CheckValue(".", MAJOR_TEXT, 2);
+    CheckValue("", MAJOR_TEXT, 1);
+    CheckValue("True", MAJOR_TEXT, 5);
+
+    printf(failures == 0 ? "PASS\n" : "%d checks failed\n", failures);
+    return failures == 0 ? EXIT_SUCCESS : EXIT_FAILURE;
+}
@@ -0,0 +1,204 @@
+// Tests of the timer wheel in epoll_timerfd_utilities.c, on a Linux host. The clock is replaced
+// so that time can jump, and the file is included whole so that the wheel can be advanced
+// without waiting on its timerfd. Exits with 0 if every check passes.
+//
+// Build and run from the directory above:
+//     gcc -std=gnu11 -Ihost -I. host/timer_wheel_test.c handler_statistics.c stall_watchdog.c
+//         -o timer_wheel_test -lpthread && ./timer_wheel_test
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+
+static uint64_t fakeNowNs;
+
+static int FakeClockGetTime(clockid_t clock, struct timespec *now)
+{
+    (void)clock;
+    now->tv_sec = (time_t)(fakeNowNs / 1000000000);
+    now->tv_nsec = (long)(fakeNowNs % 1000000000);
+    return 0;
+}
+
+#define clock_gettime FakeClockGetTime
+#include "epoll_timerfd_utilities.c"
+#undef clock_gettime
+
+#define TEST_TIMERS 2000
+
+static int epollFd = -1;
+static TimerWheel wheel;
+static LogicalTimer timers[TEST_TIMERS];
+// Time each timer should next run at, or 0 if it should not run
+static uint64_t expectedMs[TEST_TIMERS];
+static uint64_t lastRunMs;
+static uint32_t timersRun;
+static int failures;
+
+static void SetNowMs(uint64_t nowMs)
+{
+    fakeNowNs = nowMs * 1000000;
+}
+
+static void Check(bool condition, const char *what, uint64_t value)
+{
+    if (!condition) {
+        failures++;
+        printf("FAIL: %s (%llu)\n", what, (unsigned long long)value);
+    }
+}
+
+static void CheckedTimerHandler(LogicalTimer *timer)
+{
+    size_t i = (size_t)(timer - timers);
+    Check(wheel.currentMs == expectedMs[i], "timer ran at the wrong time", i);
+    Check(wheel.currentMs >= lastRunMs, "timers ran out of order", i);
+    lastRunMs = wheel.currentMs;
+    timersRun++;
+    expectedMs[i] = timer->periodMs != 0 ? timer->expiryMs : 0;
+}
+
+static void Reset(uint64_t startMs)
+{
+    SetNowMs(startMs);
+    TimerWheel_Close(&wheel);
+    CloseFdAndPrintError(epollFd, "Epoll");
+    epollFd = CreateEpollFd();
+    if (epollFd < 0 || TimerWheel_Init(&wheel, epollFd) != 0) {
+        exit(EXIT_FAILURE);
+    }
+    lastRunMs = 0;
+    timersRun = 0;
+    for (size_t i = 0; i < TEST_TIMERS; i++) {
+        LogicalTimer_Init(&timers[i], CheckedTimerHandler, NULL);
+        expectedMs[i] = 0;
+    }
+}
+
+static void StartOneShot(size_t i, uint32_t delayMs)
+{
+    TimerWheel_StartOneShot(&wheel, &timers[i], delayMs);
+    expectedMs[i] = timers[i].expiryMs;
+}
+
+static void CheckNoneMissed(void)
+{
+    for (size_t i = 0; i < TEST_TIMERS; i++) {
+        if (LogicalTimer_IsArmed(&timers[i]) && timers[i].periodMs == 0) {
+            Check(timers[i].expiryMs > wheel.currentMs, "timer missed", i);
+        }
+    }
+}
+
+// Delays on both sides of every level boundary and of the overflow list
+static const uint32_t boundaryDelaysMs[] = {
+    1,        2,        63,        64,        65,        4095,       4096,       4097,
+    262143,   262144,   262145,    16777215,  16777216,  16777217,   100000000,  1u << 31};
+
+/// <summary>
+///     Every timer cascades down to level 0 and runs at its expiry, whether the wheel is advanced
+///     in one jump or slot by slot.
+/// </summary>
+static void TestCascade(uint64_t startMs, bool oneJump)
+{
+    Reset(startMs);
+    size_t count = sizeof(boundaryDelaysMs) / sizeof(boundaryDelaysMs[0]);
+    for (size_t i = 0; i < count; i++) {
+        StartOneShot(i, boundaryDelaysMs[i]);
+    }
+    uint64_t endMs = startMs + (1ULL << 31) + 1;
+    if (oneJump) {
+        AdvanceTimerWheel(&wheel, endMs);
+    } else {
+        // Stop at every deadline, as the timerfd would
+        for (uint64_t deadline = GetNextDeadline(&wheel); deadline != 0;
+             deadline = GetNextDeadline(&wheel)) {
+            AdvanceTimerWheel(&wheel, deadline);
+        }
+    }
+    Check(timersRun == count, "cascaded timers did not all run", timersRun);
+    CheckNoneMissed();
+    Check(GetNextDeadline(&wheel) == 0, "wheel not empty", GetNextDeadline(&wheel));
+}
+
+/// <summary>
+///     After a sleep of 30 days, a periodic timer runs once and skips the periods it missed, and
+///     a timer started before the sleep still runs at its own expiry.
+/// </summary>
+static void TestLongSleep(void)
+{
+    uint64_t startMs = 12345678;
+    Reset(startMs);
+    TimerWheel_StartPeriodic(&wheel, &timers[0], 1000);
+    expectedMs[0] = timers[0].expiryMs;
+    StartOneShot(1, 7u * 24 * 60 * 60 * 1000);
+
+    uint64_t wakeMs = startMs + 30ULL * 24 * 60 * 60 * 1000 + 500;
+    SetNowMs(wakeMs);
+    AdvanceTimerWheel(&wheel, wakeMs);
+    Check(timersRun == 2, "timers did not run once each across the sleep", timersRun);
+    CheckNoneMissed();
+    Check(wheel.currentMs == wakeMs, "wheel did not reach the wake time", wheel.currentMs);
+    Check(timers[0].expiryMs > wakeMs && timers[0].expiryMs <= wakeMs + 1000,
+          "periodic timer did not skip its missed periods", timers[0].expiryMs);
+}
+
+/// <summary>
+///     Random starts, restarts and cancels against the expected expiry of every timer, with the
+///     wheel advanced to each deadline or by a random step.
+/// </summary>
+static void TestRandom(void)
+{
+    Reset(((uint64_t)1 << 24) * 3 - 7000);
+    srand(1);
+    for (size_t i = 0; i < TEST_TIMERS; i++) {
+        uint32_t scale = (uint32_t[]){100, 10000, 1000000, 30000000}[rand() % 4];
+        StartOneShot(i, (uint32_t)rand() % scale);
+    }
+    uint64_t endMs = wheel.currentMs + 40000000;
+    while (wheel.currentMs < endMs) {
+        uint64_t deadline = GetNextDeadline(&wheel);
+        uint64_t earliest = 0;
+        for (size_t i = 0; i < TEST_TIMERS; i++) {
+            if (expectedMs[i] != 0 && (earliest == 0 || expectedMs[i] < earliest)) {
+                earliest = expectedMs[i];
+            }
+        }
+        Check(deadline == earliest, "next deadline is not the earliest expiry", deadline);
+
+        uint64_t nowMs = wheel.currentMs + (uint64_t)(rand() % 5000);
+        if (rand() % 3 != 0 && deadline != 0) {
+            nowMs = deadline;
+        }
+        SetNowMs(nowMs);
+        AdvanceTimerWheel(&wheel, nowMs);
+        // Restart or cancel a few timers between wakeups
+        for (int n = 0; n < 3; n++) {
+            size_t i = (size_t)rand() % TEST_TIMERS;
+            if (rand() % 2 == 0) {
+                StartOneShot(i, (uint32_t)rand() % 1000000);
+            } else {
+                TimerWheel_Cancel(&wheel, &timers[i]);
+                expectedMs[i] = 0;
+            }
+        }
+    }
+    Check(timersRun > TEST_TIMERS, "too few timers ran", timersRun);
+    CheckNoneMissed();
+}
+
+int main(void)
+{
+    wheel.timerFd = -1;
+    TestCascade(12345678, true);
+    TestCascade(12345678, false);
+    // Just before the top level and the overflow list roll over
+    TestCascade(((uint64_t)1 << 24) * 5 - 3, true);
+    TestCascade(((uint64_t)1 << 24) * 5 - 3, false);
+    TestLongSleep();
+    TestRandom();
+
+    printf(failures == 0 ? "PASS\n" : "%d checks failed\n", failures);
+    return failures == 0 ? EXIT_SUCCESS : EXIT_FAILURE;
+}
@@ -0,0 +1,90 @@
+#include <stdio.h>
+#include <string.h>
+#include "input_sampler.h"
+
+void InputSampler_Init(InputSampler *sampler, const InputSamplerConfig *config,
+                       InputSamplerCallback callback, void *context, uint64_t nowMs)
+{
+    memset(sampler, 0, sizeof(*sampler));
+    sampler->config = *config;
+    sampler->state = InputState_Released;
+    sampler->stateSinceMs = nowMs;
+    sampler->callback = callback;
+    sampler->callbackContext = context;
+    sampler->statistics.windowStartMs = nowMs;
+}
+
+void InputSampler_SetConfig(InputSampler *sampler, const InputSamplerConfig *config)
+{
+    sampler->config = *config;
+}
+
+static void SetState(InputSampler *sampler, InputState state, uint64_t nowMs)
+{
+    sampler->state = state;
+    sampler->stateSinceMs = nowMs;
+    sampler->lastActivityMs = nowMs;
+}
+
+uint32_t InputSampler_Sample(InputSampler *sampler, bool active, uint64_t nowMs)
+{
+    sampler->statistics.samples++;
+    bool settled = nowMs - sampler->stateSinceMs >= sampler->config.debounceMs;
+
+    switch (sampler->state) {
+    case InputState_Released:
+        if (active) {
+            SetState(sampler, InputState_MaybePressed, nowMs);
+        }
+        break;
+    case InputState_MaybePressed:
+        if (!active) {
+            sampler->statistics.bounces++;
+            SetState(sampler, InputState_Released, nowMs);
+        } else if (settled) {
+            SetState(sampler, InputState_Pressed, nowMs);
+            sampler->statistics.presses++;
+            sampler->callback(true, sampler->callbackContext);
+        }
+        break;
+    case InputState_Pressed:
+        if (!active) {
+            SetState(sampler, InputState_MaybeReleased, nowMs);
+        }
+        break;
+    case InputState_MaybeReleased:
+        if (active) {
+            sampler->statistics.bounces++;
+            SetState(sampler, InputState_Pressed, nowMs);
+        } else if (settled) {
+            SetState(sampler, InputState_Released, nowMs);
+            sampler->statistics.releases++;
+            sampler->callback(false, sampler->callbackContext);
+        }
+        break;
+    }
+
+    bool debouncing =
+        sampler->state == InputState_MaybePressed || sampler->state == InputState_MaybeReleased;
+    if (debouncing || nowMs - sampler->lastActivityMs < sampler->config.activeHoldMs) {
+        return sampler->config.activePeriodMs;
+    }
+    return sampler->config.idlePeriodMs;
+}
+
+int InputSampler_FormatStatistics(InputSampler *sampler, uint64_t nowMs, char *buffer,
+                                  size_t bufferSize)
+{
+    InputSamplerStatistics *s = &sampler->statistics;
+    uint64_t elapsedMs = nowMs - s->windowStartMs;
+    uint64_t windowSamples = s->samples - s->windowSamples;
+    uint32_t samplesPerSecond = elapsedMs > 0 ? (uint32_t)(windowSamples * 1000 / elapsedMs) : 0;
+    s->windowSamples = s->samples;
+    s->windowStartMs = nowMs;
+
+    return snprintf(buffer, bufferSize,
+                    "\"samplesPerSecond\":%u,\"samples\":%llu,\"presses\":%u,\"releases\":%u,"
+                    "\"bounces\":%u",
+                    samplesPerSecond, (unsigned long long)s->samples, s->presses, s->releases,
+                    s->bounces);
+}
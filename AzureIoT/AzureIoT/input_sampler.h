@@ -0,0 +1,102 @@
+#pragma once
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+/// <summary>
+///     Debounce state of a sampled input.
+/// </summary>
+typedef enum {
+    InputState_Released,
+    /// <summary>Seen active, waiting for it to stay active for the debounce time.</summary>
+    InputState_MaybePressed,
+    InputState_Pressed,
+    /// <summary>Seen inactive, waiting for it to stay inactive for the debounce time.</summary>
+    InputState_MaybeReleased
+} InputState;
+
+/// <summary>
+///     Function called when the debounced input changes.
+/// </summary>
+/// <param name="pressed">true when the input became active, false when it was released</param>
+/// <param name="context">Context given to InputSampler_Init</param>
+typedef void (*InputSamplerCallback)(bool pressed, void *context);
+
+/// <summary>
+///     Sampling rates and debounce time.
+/// </summary>
+typedef struct InputSamplerConfig {
+    /// <summary>Sample period while nothing is happening.</summary>
+    uint32_t idlePeriodMs;
+    /// <summary>Sample period while debouncing and shortly after a change.</summary>
+    uint32_t activePeriodMs;
+    /// <summary>Time the raw input must hold a new level before it is accepted.</summary>
+    uint32_t debounceMs;
+    /// <summary>Time after a change during which sampling stays fast.</summary>
+    uint32_t activeHoldMs;
+} InputSamplerConfig;
+
+/// <summary>
+///     Counters describing the sampling load and the input's behaviour.
+/// </summary>
+typedef struct InputSamplerStatistics {
+    uint64_t samples;
+    uint32_t presses;
+    uint32_t releases;
+    /// <summary>Raw changes that reverted within the debounce time.</summary>
+    uint32_t bounces;
+    /// <summary>Samples and time at the start of the current rate window.</summary>
+    uint64_t windowSamples;
+    uint64_t windowStartMs;
+} InputSamplerStatistics;
+
+/// <summary>
+/// <para>Adaptive sampler and debouncer for a polled input such as a button GPIO.</para>
+/// <para>Applications cannot get interrupts from a GPIO, so the input has to be polled. The
+/// sampler polls at the idle period and speeds up only from the first raw edge until the input
+/// has been stable for the hold time. A change is reported only once the raw level has held for
+/// the debounce time.</para>
+/// </summary>
+typedef struct InputSampler {
+    InputSamplerConfig config;
+    InputState state;
+    uint64_t stateSinceMs;
+    uint64_t lastActivityMs;
+    InputSamplerCallback callback;
+    void *callbackContext;
+    InputSamplerStatistics statistics;
+} InputSampler;
+
+/// <summary>
+///     Initializes a sampler for an input that starts released.
+/// </summary>
+/// <param name="sampler">Sampler to initialize</param>
+/// <param name="config">Sampling rates and debounce time</param>
+/// <param name="callback">Function called when the debounced input changes</param>
+/// <param name="context">Context passed to callback</param>
+/// <param name="nowMs">Current monotonic time in milliseconds</param>
+void InputSampler_Init(InputSampler *sampler, const InputSamplerConfig *config,
+                       InputSamplerCallback callback, void *context, uint64_t nowMs);
+
+/// <summary>
+///     Changes the sampling rates and debounce time. The debounce state is kept; the new rates
+///     apply from the next sample.
+/// </summary>
+void InputSampler_SetConfig(InputSampler *sampler, const InputSamplerConfig *config);
+
+/// <summary>
+///     Feeds one raw sample into the debounce state machine.
+/// </summary>
+/// <param name="sampler">The sampler</param>
+/// <param name="active">Raw level of the input, true if pressed</param>
+/// <param name="nowMs">Current monotonic time in milliseconds</param>
+/// <returns>Milliseconds until the next sample should be taken</returns>
+uint32_t InputSampler_Sample(InputSampler *sampler, bool active, uint64_t nowMs);
+
+/// <summary>
+///     Formats the statistics as a JSON object body, without the surrounding braces, including
+///     the samples per second since the previous call, and starts a new rate window.
+/// </summary>
+/// <returns>The snprintf result</returns>
+int InputSampler_FormatStatistics(InputSampler *sampler, uint64_t nowMs, char *buffer,
+                                  size_t bufferSize);
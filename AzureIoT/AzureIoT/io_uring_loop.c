@@ -0,0 +1,381 @@
+#ifdef EVENT_LOOP_IO_URING
+
+#include <errno.h>
+#include <stdbool.h>
+#include <string.h>
+#include <unistd.h>
+#include <linux/io_uring.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <applibs/log.h>
+#include "io_uring_loop.h"
+
+#define IO_URING_LOOP_ENTRIES 64
+#define IO_URING_LOOP_MAX_FDS 32
+
+// Tags for completions that do not belong to a registration.
+#define TIMEOUT_USER_DATA UINT64_MAX
+#define REMOVE_USER_DATA (UINT64_MAX - 1)
+
+/// <summary>
+///     A registered file descriptor. The generation is part of the poll's user data, so that a
+///     completion for an earlier registration of the slot is recognised and dropped.
+/// </summary>
+typedef struct Registration {
+    int fd;
+    void *eventData;
+    uint32_t events;
+    uint32_t generation;
+    bool armed;
+} Registration;
+
+typedef struct IoUringLoop {
+    int ringFd;
+    void *sqRing;
+    size_t sqRingSize;
+    void *cqRing;
+    size_t cqRingSize;
+    struct io_uring_sqe *sqes;
+    size_t sqesSize;
+    unsigned int *sqHead;
+    unsigned int *sqTail;
+    unsigned int sqMask;
+    unsigned int sqEntries;
+    unsigned int *sqArray;
+    unsigned int *cqHead;
+    unsigned int *cqTail;
+    unsigned int cqMask;
+    struct io_uring_cqe *cqes;
+    struct __kernel_timespec timeout;
+    uint32_t enterCalls;
+    Registration registrations[IO_URING_LOOP_MAX_FDS];
+} IoUringLoop;
+
+static IoUringLoop loop = {.ringFd = -1};
+
+static int Enter(unsigned int toSubmit, unsigned int minComplete, unsigned int flags)
+{
+    loop.enterCalls++;
+    return (int)syscall(__NR_io_uring_enter, loop.ringFd, toSubmit, minComplete, flags, NULL, 0);
+}
+
+static unsigned int GetUnsubmitted(void)
+{
+    return *loop.sqTail - __atomic_load_n(loop.sqHead, __ATOMIC_ACQUIRE);
+}
+
+/// <summary>
+///     Takes the next submission entry, first submitting the queued ones if the ring is full.
+/// </summary>
+/// <returns>A cleared entry, or NULL if the queue could not be flushed</returns>
+static struct io_uring_sqe *GetSqe(void)
+{
+    if (GetUnsubmitted() == loop.sqEntries && Enter(loop.sqEntries, 0, 0) < 0) {
+        Log_Debug("ERROR: Could not submit to io_uring: %s (%d).\n", strerror(errno), errno);
+        return NULL;
+    }
+
+    unsigned int tail = *loop.sqTail;
+    unsigned int index = tail & loop.sqMask;
+    struct io_uring_sqe *sqe = &loop.sqes[index];
+    memset(sqe, 0, sizeof(*sqe));
+    loop.sqArray[index] = index;
+    return sqe;
+}
+
+/// <summary>
+///     Makes the entry taken by GetSqe visible to the kernel at the next io_uring_enter.
+/// </summary>
+static void QueueSqe(void)
+{
+    __atomic_store_n(loop.sqTail, *loop.sqTail + 1, __ATOMIC_RELEASE);
+}
+
+static uint64_t GetUserData(const Registration *registration)
+{
+    return ((uint64_t)(registration - loop.registrations) << 32) | registration->generation;
+}
+
+static Registration *FindRegistration(int fd)
+{
+    for (int i = 0; i < IO_URING_LOOP_MAX_FDS; i++) {
+        if (loop.registrations[i].fd == fd) {
+            return &loop.registrations[i];
+        }
+    }
+    return NULL;
+}
+
+/// <summary>
+///     Cancels the registration's poll, if one is pending, and moves it to a new generation.
+/// </summary>
+static int Disarm(Registration *registration)
+{
+    if (registration->armed) {
+        struct io_uring_sqe *sqe = GetSqe();
+        if (sqe == NULL) {
+            return -1;
+        }
+        sqe->opcode = IORING_OP_POLL_REMOVE;
+        sqe->fd = -1;
+        sqe->addr = GetUserData(registration);
+        sqe->user_data = REMOVE_USER_DATA;
+        QueueSqe();
+        registration->armed = false;
+    }
+    registration->generation++;
+    return 0;
+}
+
+static int ArmPolls(void)
+{
+    for (int i = 0; i < IO_URING_LOOP_MAX_FDS; i++) {
+        Registration *registration = &loop.registrations[i];
+        if (registration->fd < 0 || registration->armed) {
+            continue;
+        }
+        struct io_uring_sqe *sqe = GetSqe();
+        if (sqe == NULL) {
+            return -1;
+        }
+        sqe->opcode = IORING_OP_POLL_ADD;
+        sqe->fd = registration->fd;
+        sqe->poll32_events = registration->events;
+        sqe->user_data = GetUserData(registration);
+        QueueSqe();
+        registration->armed = true;
+    }
+    return 0;
+}
+
+static void ReleaseRing(void)
+{
+    if (loop.sqes != NULL) {
+        munmap(loop.sqes, loop.sqesSize);
+    }
+    if (loop.cqRing != NULL && loop.cqRing != loop.sqRing) {
+        munmap(loop.cqRing, loop.cqRingSize);
+    }
+    if (loop.sqRing != NULL) {
+        munmap(loop.sqRing, loop.sqRingSize);
+    }
+    memset(&loop, 0, sizeof(loop));
+    loop.ringFd = -1;
+    for (int i = 0; i < IO_URING_LOOP_MAX_FDS; i++) {
+        loop.registrations[i].fd = -1;
+    }
+}
+
+int IoUringLoop_Create(void)
+{
+    if (loop.ringFd >= 0) {
+        Log_Debug("ERROR: The io_uring event loop has already been created.\n");
+        return -1;
+    }
+    ReleaseRing();
+
+    struct io_uring_params params;
+    memset(&params, 0, sizeof(params));
+    int ringFd = (int)syscall(__NR_io_uring_setup, IO_URING_LOOP_ENTRIES, &params);
+    if (ringFd < 0) {
+        Log_Debug("ERROR: Could not create io_uring: %s (%d).\n", strerror(errno), errno);
+        return -1;
+    }
+
+    loop.sqRingSize = params.sq_off.array + params.sq_entries * sizeof(unsigned int);
+    loop.cqRingSize = params.cq_off.cqes + params.cq_entries * sizeof(struct io_uring_cqe);
+    if ((params.features & IORING_FEAT_SINGLE_MMAP) != 0) {
+        if (loop.cqRingSize > loop.sqRingSize) {
+            loop.sqRingSize = loop.cqRingSize;
+        }
+        loop.cqRingSize = loop.sqRingSize;
+    }
+    loop.sqRing = mmap(NULL, loop.sqRingSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+                       ringFd, IORING_OFF_SQ_RING);
+    if (loop.sqRing == MAP_FAILED) {
+        loop.sqRing = NULL;
+        goto fail;
+    }
+    if ((params.features & IORING_FEAT_SINGLE_MMAP) != 0) {
+        loop.cqRing = loop.sqRing;
+    } else {
+        loop.cqRing = mmap(NULL, loop.cqRingSize, PROT_READ | PROT_WRITE,
+                           MAP_SHARED | MAP_POPULATE, ringFd, IORING_OFF_CQ_RING);
+        if (loop.cqRing == MAP_FAILED) {
+            loop.cqRing = NULL;
+            goto fail;
+        }
+    }
+    loop.sqesSize = params.sq_entries * sizeof(struct io_uring_sqe);
+    loop.sqes = mmap(NULL, loop.sqesSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+                     ringFd, IORING_OFF_SQES);
+    if (loop.sqes == MAP_FAILED) {
+        loop.sqes = NULL;
+        goto fail;
+    }
+
+    char *sq = loop.sqRing;
+    char *cq = loop.cqRing;
+    loop.sqHead = (unsigned int *)(sq + params.sq_off.head);
+    loop.sqTail = (unsigned int *)(sq + params.sq_off.tail);
+    loop.sqMask = *(unsigned int *)(sq + params.sq_off.ring_mask);
+    loop.sqEntries = params.sq_entries;
+    loop.sqArray = (unsigned int *)(sq + params.sq_off.array);
+    loop.cqHead = (unsigned int *)(cq + params.cq_off.head);
+    loop.cqTail = (unsigned int *)(cq + params.cq_off.tail);
+    loop.cqMask = *(unsigned int *)(cq + params.cq_off.ring_mask);
+    loop.cqes = (struct io_uring_cqe *)(cq + params.cq_off.cqes);
+    loop.ringFd = ringFd;
+    return ringFd;
+
+fail:
+    Log_Debug("ERROR: Could not map io_uring: %s (%d).\n", strerror(errno), errno);
+    ReleaseRing();
+    close(ringFd);
+    return -1;
+}
+
+int IoUringLoop_Register(int ringFd, int fd, void *eventData, uint32_t events)
+{
+    if (ringFd != loop.ringFd) {
+        errno = EBADF;
+        return -1;
+    }
+
+    Registration *registration = FindRegistration(fd);
+    if (registration == NULL) {
+        registration = FindRegistration(-1);
+        if (registration == NULL) {
+            Log_Debug("ERROR: Too many file descriptors registered with io_uring.\n");
+            errno = ENOSPC;
+            return -1;
+        }
+        registration->fd = fd;
+        registration->armed = false;
+        registration->generation++;
+    } else if (registration->events != events && Disarm(registration) != 0) {
+        return -1;
+    }
+
+    // Edge-triggered and one-shot epoll flags have no poll equivalent; the mask is used as a
+    // level-triggered poll mask.
+    registration->events = events & ~(uint32_t)(EPOLLET | EPOLLONESHOT);
+    registration->eventData = eventData;
+    return 0;
+}
+
+int IoUringLoop_Unregister(int ringFd, int fd)
+{
+    if (ringFd != loop.ringFd) {
+        errno = EBADF;
+        return -1;
+    }
+    Registration *registration = FindRegistration(fd);
+    if (registration == NULL) {
+        return 0;
+    }
+    int result = Disarm(registration);
+    registration->fd = -1;
+    registration->eventData = NULL;
+    return result;
+}
+
+void IoUringLoop_ForgetFd(int fd)
+{
+    if (fd < 0 || loop.ringFd < 0) {
+        return;
+    }
+    if (fd == loop.ringFd) {
+        ReleaseRing();
+        return;
+    }
+    (void)IoUringLoop_Unregister(loop.ringFd, fd);
+    // Submit the cancel now, so that the poll drops its reference to the file before it is
+    // closed.
+    if (GetUnsubmitted() > 0) {
+        (void)Enter(GetUnsubmitted(), 0, 0);
+    }
+}
+
+int IoUringLoop_Wait(int ringFd, struct epoll_event *events, int maxEvents, int timeoutMs,
+                     uint32_t *syscalls)
+{
+    if (ringFd != loop.ringFd) {
+        errno = EBADF;
+        return -1;
+    }
+    if (ArmPolls() != 0) {
+        return -1;
+    }
+
+    bool ready = *loop.cqHead != __atomic_load_n(loop.cqTail, __ATOMIC_ACQUIRE);
+    unsigned int minComplete = 0;
+    if (!ready && timeoutMs != 0) {
+        minComplete = 1;
+        if (timeoutMs > 0) {
+            // Completes at the timeout, or as soon as any other request completes.
+            struct io_uring_sqe *sqe = GetSqe();
+            if (sqe == NULL) {
+                return -1;
+            }
+            loop.timeout.tv_sec = timeoutMs / 1000;
+            loop.timeout.tv_nsec = (long long)(timeoutMs % 1000) * 1000000;
+            sqe->opcode = IORING_OP_TIMEOUT;
+            sqe->fd = -1;
+            sqe->addr = (uint64_t)(uintptr_t)&loop.timeout;
+            sqe->len = 1;
+            sqe->off = 1;
+            sqe->user_data = TIMEOUT_USER_DATA;
+            QueueSqe();
+        }
+    }
+
+    int result = 0;
+    if (minComplete > 0 || GetUnsubmitted() > 0) {
+        result = Enter(GetUnsubmitted(), minComplete, minComplete > 0 ? IORING_ENTER_GETEVENTS : 0);
+    }
+    *syscalls += loop.enterCalls;
+    loop.enterCalls = 0;
+    if (result < 0 && errno != EINTR) {
+        return -1;
+    }
+
+    int count = 0;
+    unsigned int head = *loop.cqHead;
+    unsigned int tail = __atomic_load_n(loop.cqTail, __ATOMIC_ACQUIRE);
+    for (; head != tail && count < maxEvents; head++) {
+        const struct io_uring_cqe *cqe = &loop.cqes[head & loop.cqMask];
+        if (cqe->user_data == TIMEOUT_USER_DATA || cqe->user_data == REMOVE_USER_DATA) {
+            continue;
+        }
+        uint64_t index = cqe->user_data >> 32;
+        if (index >= IO_URING_LOOP_MAX_FDS) {
+            continue;
+        }
+        Registration *registration = &loop.registrations[index];
+        if (registration->fd < 0 || registration->generation != (uint32_t)cqe->user_data) {
+            continue;
+        }
+
+        if (cqe->res < 0) {
+            // Report the failure once. The poll is left marked as armed so that it is not
+            // submitted again to fail on every wait.
+            Log_Debug("ERROR: io_uring poll failed for fd %d: %s (%d).\n", registration->fd,
+                      strerror(-cqe->res), -cqe->res);
+            events[count].events = EPOLLERR;
+        } else {
+            registration->armed = false;
+            events[count].events = (uint32_t)cqe->res;
+        }
+        events[count].data.ptr = registration->eventData;
+        count++;
+    }
+    __atomic_store_n(loop.cqHead, head, __ATOMIC_RELEASE);
+
+    if (result < 0 && count == 0) {
+        return -1;
+    }
+    return count;
+}
+
+#endif
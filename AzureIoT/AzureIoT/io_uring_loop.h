@@ -0,0 +1,50 @@
+#pragma once
+#include <stdint.h>
+#include <sys/epoll.h>
+
+/// <summary>
+/// <para>io_uring backend for the event loop in epoll_timerfd_utilities, used instead of epoll
+/// when EVENT_LOOP_IO_URING is defined. It is meant for Linux hosts that run the gateway against
+/// pty or serial stand-ins; the device build always uses epoll.</para>
+/// <para>Each registered file descriptor has a one-shot poll request on the ring. Registering,
+/// unregistering and re-arming only queue submission entries, and the wait submits everything
+/// queued, together with its timeout, in the same io_uring_enter call that waits for
+/// completions. A poll is re-armed after its handler has run, so a file descriptor that is still
+/// ready completes again straight away, as it would with level-triggered epoll.</para>
+/// <para>There is one ring per process. These functions are called by epoll_timerfd_utilities
+/// and have the same contract as the epoll calls they replace.</para>
+/// </summary>
+
+/// <summary>
+///     Creates the ring.
+/// </summary>
+/// <returns>The ring file descriptor, or -1 on failure</returns>
+int IoUringLoop_Create(void);
+
+/// <summary>
+///     Registers a file descriptor, or changes the events and data of one already registered.
+/// </summary>
+/// <returns>0 on success, or -1 on failure</returns>
+int IoUringLoop_Register(int ringFd, int fd, void *eventData, uint32_t events);
+
+/// <summary>
+///     Unregisters a file descriptor. Does nothing if it is not registered.
+/// </summary>
+/// <returns>0 on success, or -1 on failure</returns>
+int IoUringLoop_Unregister(int ringFd, int fd);
+
+/// <summary>
+///     Must be called before a file descriptor is closed. A pending poll holds a reference to
+///     the file, so unlike epoll the ring does not forget a closed file descriptor by itself.
+///     Closing the ring file descriptor releases the ring.
+/// </summary>
+void IoUringLoop_ForgetFd(int fd);
+
+/// <summary>
+///     Submits the queued requests and waits for completions, like epoll_wait.
+/// </summary>
+/// <param name="syscalls">Incremented by the number of io_uring_enter calls made since the last
+/// wait, including this one</param>
+/// <returns>The number of events stored, or -1 with errno set</returns>
+int IoUringLoop_Wait(int ringFd, struct epoll_event *events, int maxEvents, int timeoutMs,
+                     uint32_t *syscalls);
@@ -0,0 +1,103 @@
+#include <applibs/log.h>
+#include <iothub_device_client_ll.h>
+#include <iothub_client_options.h>
+#include <iothubtransportmqtt.h>
+#include <azure_prov_client/iothub_security_factory.h>
+#include "cloud_transport.h"
+
+// Tells the client to take the device ID from the device authentication certificate.
+static const int deviceIdForDaaCertUsage = 1;
+
+static IOTHUB_DEVICE_CLIENT_LL_HANDLE clientHandle = NULL;
+
+static void Destroy(void)
+{
+    if (clientHandle != NULL) {
+        IoTHubDeviceClient_LL_Destroy(clientHandle);
+        clientHandle = NULL;
+    }
+}
+
+static int Create(const char *hostName, const char *deviceId, int keepAliveSeconds,
+                  const CloudTransportCallbacks *callbacks, bool *authFailure)
+{
+    Destroy();
+    *authFailure = false;
+
+    if (iothub_security_init(IOTHUB_SECURITY_TYPE_X509) != 0) {
+        Log_Debug("ERROR: Could not initialize IoT Hub security\n");
+        *authFailure = true;
+        return -1;
+    }
+    clientHandle = IoTHubDeviceClient_LL_CreateFromDeviceAuth(hostName, deviceId, MQTT_Protocol);
+    if (clientHandle == NULL) {
+        Log_Debug("ERROR: Could not create the IoT Hub client for %s\n", hostName);
+        return -1;
+    }
+    if (IoTHubDeviceClient_LL_SetOption(clientHandle, "SetDeviceId", &deviceIdForDaaCertUsage) !=
+        IOTHUB_CLIENT_OK) {
+        Log_Debug("ERROR: failure setting option \"SetDeviceId\"\n");
+        Destroy();
+        *authFailure = true;
+        return -1;
+    }
+    if (IoTHubDeviceClient_LL_SetOption(clientHandle, OPTION_KEEP_ALIVE, &keepAliveSeconds) !=
+        IOTHUB_CLIENT_OK) {
+        Log_Debug("ERROR: failure setting option \"%s\"\n", OPTION_KEEP_ALIVE);
+    }
+
+    IoTHubDeviceClient_LL_SetDeviceMethodCallback(clientHandle, callbacks->method,
+                                                  callbacks->context);
+    IoTHubDeviceClient_LL_SetDeviceTwinCallback(clientHandle, callbacks->twinUpdate,
+                                                callbacks->context);
+    IoTHubDeviceClient_LL_SetConnectionStatusCallback(clientHandle, callbacks->connectionStatus,
+                                                      callbacks->context);
+    return 0;
+}
+
+static bool IsCreated(void)
+{
+    return clientHandle != NULL;
+}
+
+static int SendEvent(IOTHUB_MESSAGE_HANDLE message,
+                     IOTHUB_CLIENT_EVENT_CONFIRMATION_CALLBACK callback, void *context)
+{
+    return IoTHubDeviceClient_LL_SendEventAsync(clientHandle, message, callback, context) ==
+                   IOTHUB_CLIENT_OK
+               ? 0
+               : -1;
+}
+
+static int SendReportedState(const unsigned char *json, size_t length,
+                             IOTHUB_CLIENT_REPORTED_STATE_CALLBACK callback, void *context)
+{
+    return IoTHubDeviceClient_LL_SendReportedState(clientHandle, json, length, callback,
+                                                   context) == IOTHUB_CLIENT_OK
+               ? 0
+               : -1;
+}
+
+static bool IsSendIdle(void)
+{
+    IOTHUB_CLIENT_STATUS status;
+    return IoTHubDeviceClient_LL_GetSendStatus(clientHandle, &status) == IOTHUB_CLIENT_OK &&
+           status == IOTHUB_CLIENT_SEND_STATUS_IDLE;
+}
+
+static void DoWork(void)
+{
+    IoTHubDeviceClient_LL_DoWork(clientHandle);
+}
+
+const CloudTransport IoTHubCloudTransport = {.name = "iothub",
+                                             .localHostName = NULL,
+                                             .localDeviceId = NULL,
+                                             .create = Create,
+                                             .destroy = Destroy,
+                                             .isCreated = IsCreated,
+                                             .sendEvent = SendEvent,
+                                             .sendReportedState = SendReportedState,
+                                             .isSendIdle = IsSendIdle,
+                                             .doWork = DoWork,
+                                             .formatStatistics = NULL};
@@ -0,0 +1,158 @@
+#include <stdio.h>
+#include <string.h>
+#include "keepalive_controller.h"
+
+static uint32_t Clamp(const KeepaliveController *controller, uint32_t seconds)
+{
+    if (seconds < controller->config.minSeconds) {
+        return controller->config.minSeconds;
+    }
+    if (seconds > controller->config.maxSeconds) {
+        return controller->config.maxSeconds;
+    }
+    return seconds;
+}
+
+/// <summary>
+///     Chooses the keepalive to try after a connection has proven provenSeconds.
+/// </summary>
+static uint32_t NextProbe(const KeepaliveController *controller)
+{
+    uint32_t proven = controller->provenSeconds;
+    uint32_t failed = controller->failedSeconds;
+    if (failed == 0) {
+        uint32_t raised = proven + proven / 2;
+        if (raised < proven + controller->config.resolutionSeconds) {
+            raised = proven + controller->config.resolutionSeconds;
+        }
+        return Clamp(controller, raised);
+    }
+    if (failed - proven <= controller->config.resolutionSeconds) {
+        return Clamp(controller, proven);
+    }
+    return Clamp(controller, proven + (failed - proven) / 2);
+}
+
+void KeepaliveController_Init(KeepaliveController *controller, const KeepaliveConfig *config)
+{
+    memset(controller, 0, sizeof(*controller));
+    controller->config = *config;
+    controller->nextSeconds = Clamp(controller, config->initialSeconds);
+}
+
+void KeepaliveController_Restore(KeepaliveController *controller, uint32_t nextSeconds,
+                                 uint32_t provenSeconds, uint32_t failedSeconds)
+{
+    controller->nextSeconds =
+        Clamp(controller, nextSeconds != 0 ? nextSeconds : controller->config.initialSeconds);
+    controller->provenSeconds = provenSeconds != 0 ? Clamp(controller, provenSeconds) : 0;
+    controller->failedSeconds = failedSeconds != 0 ? Clamp(controller, failedSeconds) : 0;
+    if (controller->failedSeconds != 0 && controller->failedSeconds <= controller->provenSeconds) {
+        controller->failedSeconds = 0;
+    }
+    controller->survivalsSinceFailure = 0;
+    controller->provenTimeouts = 0;
+    controller->connected = false;
+}
+
+uint32_t KeepaliveController_GetSeconds(const KeepaliveController *controller)
+{
+    return controller->nextSeconds;
+}
+
+void KeepaliveController_Connected(KeepaliveController *controller, uint64_t nowMs)
+{
+    controller->activeSeconds = controller->nextSeconds;
+    controller->connected = true;
+    controller->connectionProven = false;
+    controller->connectedSinceMs = nowMs;
+}
+
+bool KeepaliveController_Poll(KeepaliveController *controller, uint64_t nowMs)
+{
+    if (!controller->connected || controller->connectionProven) {
+        return false;
+    }
+    uint64_t survivalMs = (uint64_t)controller->config.survivalIntervals *
+                          controller->activeSeconds * 1000;
+    uint64_t minSurvivalMs = (uint64_t)controller->config.minSurvivalSeconds * 1000;
+    if (survivalMs < minSurvivalMs) {
+        survivalMs = minSurvivalMs;
+    }
+    if (nowMs - controller->connectedSinceMs < survivalMs) {
+        return false;
+    }
+
+    controller->connectionProven = true;
+    controller->statistics.survivals++;
+    controller->provenTimeouts = 0;
+    if (controller->activeSeconds > controller->provenSeconds) {
+        controller->provenSeconds = controller->activeSeconds;
+    }
+    if (controller->failedSeconds != 0 &&
+        (controller->failedSeconds <= controller->provenSeconds ||
+         ++controller->survivalsSinceFailure >= controller->config.retryFailedAfter)) {
+        controller->failedSeconds = 0;
+        controller->survivalsSinceFailure = 0;
+    }
+
+    uint32_t next = NextProbe(controller);
+    if (next > controller->nextSeconds) {
+        controller->statistics.raises++;
+    }
+    controller->nextSeconds = next;
+    return true;
+}
+
+bool KeepaliveController_IsRaisePending(const KeepaliveController *controller)
+{
+    return controller->connected && controller->nextSeconds > controller->activeSeconds;
+}
+
+bool KeepaliveController_Disconnected(KeepaliveController *controller, bool idleTimeout,
+                                      uint64_t nowMs)
+{
+    if (!controller->connected) {
+        return false;
+    }
+    controller->connected = false;
+    // A connection lost within its first interval was not idle for a whole interval.
+    if (!idleTimeout ||
+        nowMs - controller->connectedSinceMs < (uint64_t)controller->activeSeconds * 1000) {
+        return false;
+    }
+
+    controller->statistics.idleTimeouts++;
+    uint32_t active = controller->activeSeconds;
+    if (active <= controller->provenSeconds) {
+        // A value that used to work has failed. Once is more likely a blip than a changed link.
+        if (++controller->provenTimeouts < controller->config.provenTimeoutsToForget) {
+            return false;
+        }
+        controller->provenSeconds = 0;
+        controller->provenTimeouts = 0;
+    }
+    controller->failedSeconds = active;
+    controller->survivalsSinceFailure = 0;
+
+    uint32_t next = controller->provenSeconds != 0 ? controller->provenSeconds
+                                                   : Clamp(controller, active / 2);
+    if (next < controller->nextSeconds) {
+        controller->statistics.backoffs++;
+    }
+    controller->nextSeconds = next;
+    return true;
+}
+
+int KeepaliveController_FormatStatistics(const KeepaliveController *controller, char *buffer,
+                                         size_t bufferSize)
+{
+    const KeepaliveStatistics *s = &controller->statistics;
+    return snprintf(buffer, bufferSize,
+                    "\"seconds\":%u,\"activeSeconds\":%u,\"provenSeconds\":%u,"
+                    "\"failedSeconds\":%u,\"raises\":%u,\"backoffs\":%u,\"survivals\":%u,"
+                    "\"idleTimeouts\":%u",
+                    controller->nextSeconds, controller->connected ? controller->activeSeconds : 0,
+                    controller->provenSeconds, controller->failedSeconds, s->raises, s->backoffs,
+                    s->survivals, s->idleTimeouts);
+}
@@ -0,0 +1,126 @@
+#pragma once
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+/// <summary>
+///     Limits and pace of the keepalive search.
+/// </summary>
+typedef struct KeepaliveConfig {
+    uint32_t minSeconds;
+    uint32_t maxSeconds;
+    /// <summary>Keepalive on a network with nothing learned yet.</summary>
+    uint32_t initialSeconds;
+    /// <summary>A connection proves its keepalive once it has lasted this many keepalive
+    /// intervals, and at least minSurvivalSeconds.</summary>
+    uint32_t survivalIntervals;
+    uint32_t minSurvivalSeconds;
+    /// <summary>The search stops once the proven and failed values are this close.</summary>
+    uint32_t resolutionSeconds;
+    /// <summary>Proven connections after which a failed value is forgotten, so that a link that
+    /// has improved is probed again.</summary>
+    uint32_t retryFailedAfter;
+    /// <summary>Idle timeouts in a row at or below the proven value before it is discarded, so
+    /// that a single network blip does not throw away what has been learned.</summary>
+    uint32_t provenTimeoutsToForget;
+} KeepaliveConfig;
+
+typedef struct KeepaliveStatistics {
+    /// <summary>Times the keepalive for the next connection was raised.</summary>
+    uint32_t raises;
+    /// <summary>Times it was lowered after an idle timeout.</summary>
+    uint32_t backoffs;
+    /// <summary>Connections that lasted long enough to prove their keepalive.</summary>
+    uint32_t survivals;
+    /// <summary>Connections lost in a way that suggests the link dropped them while idle.</summary>
+    uint32_t idleTimeouts;
+} KeepaliveStatistics;
+
+/// <summary>
+/// <para>Learns the longest MQTT keepalive a network tolerates.</para>
+/// <para>Each connection uses the keepalive chosen for it when it was created. When a
+/// connection lasts several intervals, its keepalive is proven and the next connection tries a
+/// longer one: half as long again while nothing has failed, then halfway between the longest
+/// proven and the shortest failed value. When a connection is dropped by a ping timeout or a
+/// communication error after at least one interval, the link most likely expired it while idle,
+/// as NAT gateways on cellular links do. The failed value is recorded and the next connection
+/// goes back to the longest proven value, or half the failed value if none is proven. A proven
+/// value is only discarded after several such timeouts in a row, as the link has then changed.
+/// </para>
+/// <para>A raised value is meant to be applied to the live connection, once it is idle, so that
+/// a link that never drops still gets the longer keepalive; see
+/// KeepaliveController_IsRaisePending.</para>
+/// <para>Longer keepalives cost fewer wakeups and less traffic on stable links. Shorter ones
+/// keep connections alive where idle mappings expire quickly.</para>
+/// </summary>
+typedef struct KeepaliveController {
+    KeepaliveConfig config;
+    /// <summary>Keepalive for the next connection.</summary>
+    uint32_t nextSeconds;
+    /// <summary>Keepalive of the current connection.</summary>
+    uint32_t activeSeconds;
+    /// <summary>Longest keepalive a connection has lasted with, or 0.</summary>
+    uint32_t provenSeconds;
+    /// <summary>Shortest keepalive the link has dropped a connection with, or 0.</summary>
+    uint32_t failedSeconds;
+    uint32_t survivalsSinceFailure;
+    /// <summary>Idle timeouts in a row at or below provenSeconds.</summary>
+    uint32_t provenTimeouts;
+    bool connected;
+    bool connectionProven;
+    uint64_t connectedSinceMs;
+    KeepaliveStatistics statistics;
+} KeepaliveController;
+
+/// <summary>
+///     Initializes the controller with nothing learned.
+/// </summary>
+void KeepaliveController_Init(KeepaliveController *controller, const KeepaliveConfig *config);
+
+/// <summary>
+///     Replaces what has been learned, e.g. with what was stored for the current network. Values
+///     out of range are clamped, and a keepalive of 0 is taken as the initial one.
+/// </summary>
+void KeepaliveController_Restore(KeepaliveController *controller, uint32_t nextSeconds,
+                                 uint32_t provenSeconds, uint32_t failedSeconds);
+
+/// <summary>
+///     Gets the keepalive to create the next connection with.
+/// </summary>
+uint32_t KeepaliveController_GetSeconds(const KeepaliveController *controller);
+
+/// <summary>
+///     Records that a connection created with KeepaliveController_GetSeconds is up.
+/// </summary>
+void KeepaliveController_Connected(KeepaliveController *controller, uint64_t nowMs);
+
+/// <summary>
+///     Checks whether the current connection has lasted long enough to prove its keepalive.
+///     Call periodically while connected.
+/// </summary>
+/// <returns>true if what has been learned changed and should be stored</returns>
+bool KeepaliveController_Poll(KeepaliveController *controller, uint64_t nowMs);
+
+/// <summary>
+///     Checks whether the current connection uses a shorter keepalive than the one learned
+///     since it was made, so that it should be recreated with the new one.
+/// </summary>
+bool KeepaliveController_IsRaisePending(const KeepaliveController *controller);
+
+/// <summary>
+///     Records that the current connection was lost, or is being closed to apply a new
+///     keepalive, in which case idleTimeout is false.
+/// </summary>
+/// <param name="idleTimeout">true if it was lost to a ping timeout or a communication error,
+/// which is how an expired idle mapping shows</param>
+/// <returns>true if what has been learned changed and should be stored</returns>
+bool KeepaliveController_Disconnected(KeepaliveController *controller, bool idleTimeout,
+                                      uint64_t nowMs);
+
+/// <summary>
+///     Formats the keepalive state and statistics as a JSON object body, without the
+///     surrounding braces.
+/// </summary>
+/// <returns>The snprintf result</returns>
+int KeepaliveController_FormatStatistics(const KeepaliveController *controller, char *buffer,
+                                         size_t bufferSize);
@@ -0,0 +1,70 @@
+#include <stdio.h>
+#include <string.h>
+#include "load_shedder.h"
+
+void LoadShedder_Init(LoadShedder *shedder, size_t lowWatermark, size_t highWatermark,
+                      size_t maxInFlight)
+{
+    memset(shedder, 0, sizeof(*shedder));
+    shedder->lowWatermark = lowWatermark;
+    shedder->highWatermark = highWatermark;
+    shedder->maxInFlight = maxInFlight;
+}
+
+bool LoadShedder_Update(LoadShedder *shedder, size_t queued, size_t inFlight)
+{
+    shedder->queued = queued;
+    shedder->inFlight = inFlight;
+    if (queued > shedder->statistics.peakQueued) {
+        shedder->statistics.peakQueued = queued;
+    }
+    if (inFlight > shedder->statistics.peakInFlight) {
+        shedder->statistics.peakInFlight = inFlight;
+    }
+
+    bool sendPaused = inFlight >= shedder->maxInFlight;
+    if (sendPaused && !shedder->sendPaused) {
+        shedder->statistics.sendPauses++;
+    }
+    shedder->sendPaused = sendPaused;
+
+    size_t backlog = queued + inFlight;
+    bool underPressure = shedder->underPressure;
+    if (!underPressure && backlog >= shedder->highWatermark) {
+        underPressure = true;
+        shedder->statistics.pressureEpisodes++;
+    } else if (underPressure && backlog <= shedder->lowWatermark) {
+        underPressure = false;
+    }
+
+    bool changed = underPressure != shedder->underPressure;
+    shedder->underPressure = underPressure;
+    return changed;
+}
+
+LoadShedDecision LoadShedder_Decide(LoadShedder *shedder, TelemetryClass telemetryClass,
+                                    MessagePriority priority)
+{
+    if (!shedder->underPressure) {
+        return LoadShedDecision_Forward;
+    }
+
+    if (telemetryClass == TelemetryClass_Battery && priority == MessagePriority_Low) {
+        shedder->statistics.droppedBatteryReadings++;
+        return LoadShedDecision_Drop;
+    }
+    shedder->statistics.aggregatedReadings++;
+    return LoadShedDecision_Aggregate;
+}
+
+int LoadShedder_FormatStatistics(const LoadShedder *shedder, char *buffer, size_t bufferSize)
+{
+    const LoadShedderStatistics *s = &shedder->statistics;
+    return snprintf(buffer, bufferSize,
+                    "\"underPressure\":%s,\"queued\":%zu,\"inFlight\":%zu,\"peakQueued\":%zu,"
+                    "\"peakInFlight\":%zu,\"pressureEpisodes\":%u,\"sendPauses\":%u,"
+                    "\"aggregatedReadings\":%u,\"droppedBatteryReadings\":%u",
+                    shedder->underPressure ? "true" : "false", shedder->queued, shedder->inFlight,
+                    s->peakQueued, s->peakInFlight, s->pressureEpisodes, s->sendPauses,
+                    s->aggregatedReadings, s->droppedBatteryReadings);
+}
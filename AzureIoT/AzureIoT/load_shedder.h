@@ -0,0 +1,84 @@
+#pragma once
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include "outbound_queue.h"
+
+/// <summary>
+///     What to do with a raw sensor reading at the current load.
+/// </summary>
+typedef enum {
+    /// <summary>Send the reading as it is, or aggregate it if aggregation is configured.</summary>
+    LoadShedDecision_Forward,
+    /// <summary>Fold the reading into the edge aggregator even if raw forwarding is
+    /// configured.</summary>
+    LoadShedDecision_Aggregate,
+    /// <summary>Discard the reading.</summary>
+    LoadShedDecision_Drop
+} LoadShedDecision;
+
+/// <summary>
+///     Counters for every shedding decision taken while under pressure.
+/// </summary>
+typedef struct LoadShedderStatistics {
+    /// <summary>Times the backlog rose to the high watermark.</summary>
+    uint32_t pressureEpisodes;
+    /// <summary>Times sending was paused because too many messages were in flight.</summary>
+    uint32_t sendPauses;
+    uint32_t aggregatedReadings;
+    uint32_t droppedBatteryReadings;
+    size_t peakQueued;
+    size_t peakInFlight;
+} LoadShedderStatistics;
+
+/// <summary>
+/// <para>Backpressure from the cloud connection back to ingestion.</para>
+/// <para>The backlog is the number of messages waiting in the shaper plus the number handed to
+/// the IoT Hub client and not yet confirmed. Pressure starts when the backlog reaches the high
+/// watermark and ends when it falls to the low watermark, so the gateway does not flap between
+/// the two modes. Separately, sending is paused while the in-flight count is at its limit, which
+/// bounds the memory held by the IoT Hub client however slow the network is.</para>
+/// </summary>
+typedef struct LoadShedder {
+    size_t lowWatermark;
+    size_t highWatermark;
+    size_t maxInFlight;
+    size_t queued;
+    size_t inFlight;
+    bool underPressure;
+    bool sendPaused;
+    LoadShedderStatistics statistics;
+} LoadShedder;
+
+/// <summary>
+///     Initializes a load shedder with no backlog.
+/// </summary>
+/// <param name="shedder">Load shedder to initialize</param>
+/// <param name="lowWatermark">Backlog at which pressure ends</param>
+/// <param name="highWatermark">Backlog at which pressure starts</param>
+/// <param name="maxInFlight">Messages the IoT Hub client may hold before sending is paused</param>
+void LoadShedder_Init(LoadShedder *shedder, size_t lowWatermark, size_t highWatermark,
+                      size_t maxInFlight);
+
+/// <summary>
+///     Updates the backlog and the pressure and pause states that follow from it.
+/// </summary>
+/// <param name="shedder">The load shedder</param>
+/// <param name="queued">Messages waiting in the shaper</param>
+/// <param name="inFlight">Messages handed to the IoT Hub client and not yet confirmed</param>
+/// <returns>true if the pressure state changed</returns>
+bool LoadShedder_Update(LoadShedder *shedder, size_t queued, size_t inFlight);
+
+/// <summary>
+///     Decides what to do with a raw sensor reading. Under pressure, low-priority battery
+///     readings are dropped and other readings are aggregated. Events do not come through here:
+///     they go straight to the shaper, which never sheds them in favour of other traffic.
+/// </summary>
+LoadShedDecision LoadShedder_Decide(LoadShedder *shedder, TelemetryClass telemetryClass,
+                                    MessagePriority priority);
+
+/// <summary>
+///     Formats the statistics as a JSON object body, without the surrounding braces.
+/// </summary>
+/// <returns>The snprintf result</returns>
+int LoadShedder_FormatStatistics(const LoadShedder *shedder, char *buffer, size_t bufferSize);
@@ -27,6 +27,7 @@
 #include "applibs_versions.h"
 #include <applibs/log.h>
 #include <applibs/networking.h>
+#include <applibs/wificonfig.h>
 #include <applibs/gpio.h>
 #include <applibs/storage.h>
 #include <applibs/uart.h>
@@ -38,6 +39,23 @@
 #include <hw/sample_hardware.h>
 
 #include "epoll_timerfd_utilities.h"
+#include "telemetry_encoder.h"
+#include "message_shaper.h"
+#include "edge_aggregator.h"
+#include "message_properties.h"
+#include "batch_packer.h"
+#include "load_shedder.h"
+#include "input_sampler.h"
+#include "work_queue.h"
+#include "worker_pool.h"
+#include "stall_watchdog.h"
+#include "connection_state.h"
+#include "keepalive_controller.h"
+#include "device_storage.h"
+#include "cloud_transport.h"
+#ifdef CLOUD_TRANSPORT_FAKE
+#include "fake_transport.h"
+#endif
 
 // Azure IoT SDK
 #include <iothub_client_core_common.h>
@@ -45,7 +63,9 @@
 #include <iothub_client_options.h>
 #include <iothubtransportmqtt.h>
 #include <iothub.h>
-#include <azure_sphere_provisioning.h>
+#include <azure_prov_client/prov_device_ll_client.h>
+#include <azure_prov_client/prov_security_factory.h>
+#include <azure_prov_client/prov_transport_mqtt_client.h>
 
 static volatile sig_atomic_t terminationRequired = false;
 
@@ -57,21 +77,165 @@ static volatile sig_atomic_t terminationRequired = false;
 static char scopeId[SCOPEID_LENGTH]; // ScopeId for the Azure IoT Central application, set in
 									 // app_manifest.json, CmdArgs
 
-static IOTHUB_DEVICE_CLIENT_LL_HANDLE iothubClientHandle = NULL;
-static const int keepalivePeriodSeconds = 20;
+// The connection to the cloud. Building with CLOUD_TRANSPORT_FAKE replaces IoT Hub with an
+// in-process stand-in, configured from the second CmdArgs entry, to measure the gateway without
+// a hub.
+#ifdef CLOUD_TRANSPORT_FAKE
+static const CloudTransport *const cloudTransport = &FakeCloudTransport;
+static const char *fakeTransportSettings = NULL;
+#else
+static const CloudTransport *const cloudTransport = &IoTHubCloudTransport;
+#endif
 static bool iothubAuthenticated = false;
+
+// MQTT keepalive, learned separately for each network because the idle timeout of whatever NAT
+// sits between the device and the hub is a property of the network. What has been learned is
+// stored in mutable storage under "keepalive", keyed by the hex SSID of the Wi-Fi network, or
+// "default" when the device is not on Wi-Fi. The hub drops connections idle for longer than
+// 1177 seconds, which bounds the keepalive from above.
+static const KeepaliveConfig keepaliveConfig = { .minSeconds = 10, .maxSeconds = 1170,
+	.initialSeconds = 20, .survivalIntervals = 3, .minSurvivalSeconds = 10 * 60,
+	.resolutionSeconds = 10, .retryFailedAfter = 20, .provenTimeoutsToForget = 3 };
+static const size_t MaxKeepaliveNetworks = 8;
+#define KEEPALIVE_NETWORK_LENGTH (2 * WIFICONFIG_SSID_MAX_LENGTH + 1)
+static KeepaliveController keepalive;
+static char keepaliveNetwork[KEEPALIVE_NETWORK_LENGTH];
+static WorkItem keepaliveSaveWork;
+// Lost connections by the reason the client gave, reported next to the keepalive.
+#define CONNECTION_REASON_COUNT (IOTHUB_CLIENT_CONNECTION_NO_PING_RESPONSE + 1)
+static uint32_t disconnectReasons[CONNECTION_REASON_COUNT];
+
+// Device Provisioning Service. The hub it assigns is cached in mutable storage under
+// "provisioning", so that restarts and reconnects go straight to that hub. DPS is only used when
+// nothing is cached for the scope ID, or when the cached hub fails before it has authenticated
+// the device or later rejects its credentials.
+static const char *const DpsEndpoint = "global.azure-devices-provisioning.net";
+static const uint32_t DpsTimeoutMs = 10000;
+static const uint32_t DpsPollPeriodMs = 100;
+// Tells the DPS client to take the device ID from the device authentication certificate.
+static const int deviceIdForDaaCertUsage = 1;
+#define HUB_HOST_NAME_LENGTH 128
+#define DEVICE_ID_LENGTH 129
+static char hubHostName[HUB_HOST_NAME_LENGTH];
+static char hubDeviceId[DEVICE_ID_LENGTH];
+static bool useCachedHub = true;
+static bool connectedToCachedHub = false;
+static bool cachedHubConfirmed = false;
+static PROV_DEVICE_LL_HANDLE provisioningHandle = NULL;
+static bool provisioningDone = false;
+static PROV_DEVICE_RESULT provisioningResult;
+static uint64_t provisioningStartMs;
+// Startup timings: the process start, and the times from it to the first UART frame and to the
+// first message IoT Hub acknowledged, or 0 until then. The first connection is timed in
+// provisioningStatistics. They are sent once as gateway telemetry after the first
+// acknowledgement.
+static uint64_t startTimeMs;
+static uint32_t firstFrameMs = 0;
+static uint32_t firstAckMs = 0;
+static WorkItem startupTimingsWork;
+static struct {
+	uint32_t cachedConnects;
+	uint32_t cacheFailures;
+	uint32_t dpsRegistrations;
+	uint32_t dpsFailures;
+	uint32_t lastDpsMs;
+	// Time from start to the first authenticated connection, or 0 until then
+	uint32_t firstConnectMs;
+} provisioningStatistics;
+// Telemetry body encoding, selected with the "TelemetryEncoding" desired property.
+static const TelemetryEncoder *telemetryEncoder = &JsonTelemetryEncoder;
+
+// Message shaping in front of IoT Hub, sized for an S1 hub unit shared with other devices.
+// The policy can be changed with the "MessageShaperPolicy" desired property.
+static const MessageShaperConfig messageShaperConfig = {
+	.globalMilliMessagesPerSecond = 2000, .globalBurst = 20,
+	.dailyQuota = 400000, .dailyBurst = 500,
+	.nodeMilliMessagesPerSecond = 500, .nodeBurst = 6,
+	.policy = MessageShaperPolicy_Merge };
+static MessageShaper messageShaper;
+
+// With the "TelemetryBatching" desired property on, records released by the shaper are packed
+// into messages of up to one 4 KB IoT Hub metering block, less room for the routing properties.
+// This is well under the hub's 256 KB message limit and the MQTT packet size. A batch that has
+// not filled up is sent after BatchWindowMs. Batches are sent as arrays, which IoT Central does
+// not parse, so batching is off by default and every record is sent as its own message.
+static const size_t BatchMessageSizeLimit = 4096 - 256;
+static const int BatchWindowMs = 1000;
+static BatchPacker batchPacker;
+
+// Mesh node indexes, taken from the last digit of the node name reported over the UART.
+#define NODE_TRACKER 2
+#define NODE_SERVER 3
+#define NODE_ROOM 4
+#define NODE_OUTSIDE 6
+#define NODE_DOOR 8
+
+// Environmental readings are summarized per node and metric over tumbling windows of this many
+// seconds; 0 forwards every reading. Off by default, as aggregation changes the telemetry keys
+// that dashboards and device templates expect. Set with the "AggregationWindowSeconds" desired
+// property, up to MaxAggregationWindowSeconds.
+static int aggregationWindowSeconds = 0;
+static const int MaxAggregationWindowSeconds = 24 * 60 * 60;
+static EdgeAggregator edgeAggregator;
+// Server cabinet temperatures above this (in hundredths of a degree) are also sent raw.
+static const int32_t ServerTemperatureAlarmThreshold = 3500;
+
+// Backpressure: the backlog is the shaper queue plus the messages handed to the IoT Hub client
+// and not yet confirmed. From the high watermark until it falls back to the low one, battery
+// readings are dropped and other readings are aggregated, over PressureAggregationWindowSeconds
+// if aggregation is switched off. Events are never merged, and are not shed to make room for
+// other traffic. The shaper is paused while MaxMessagesInFlight messages are in the client, so
+// its memory use stays bounded.
+static const size_t OutboundLowWatermark = 8;
+static const size_t OutboundHighWatermark = 24;
+static const size_t MaxMessagesInFlight = 8;
+static const int PressureAggregationWindowSeconds = 60;
+static LoadShedder loadShedder;
+static size_t messagesInFlight = 0;
+
+// Closed batches are turned into IoT Hub messages on a worker thread, leaving only the hand-over
+// to the client on the main thread. The MT3620 gives the application a single core, so the
+// default is to build them inline; gateway builds for multi-core hosts can set WORKER_THREADS in
+// the compiler options.
+#ifndef WORKER_THREADS
+#define WORKER_THREADS 0
+#endif
+static WorkerPool workerPool = WORKER_POOL_INITIALIZER;
+// Messages submitted to the pool and not yet handed to the client. They count towards the
+// backlog along with messagesInFlight.
+static size_t messagesBeingBuilt = 0;
+
+typedef struct MessageBuildJob {
+	WorkerJob job;
+	PackedMessage message;
+	const TelemetryEncoder *encoder;
+	IOTHUB_MESSAGE_HANDLE messageHandle;
+	uint8_t body[];
+} MessageBuildJob;
+
+static void BuildPackedMessage(WorkerJob *job);
+static void SendBuiltMessage(WorkerJob *job);
 static void SendMessageCallback(IOTHUB_CLIENT_CONFIRMATION_RESULT result, void *context);
-static void ReceiveHubMessage(IOTHUB_CLIENT_CONFIRMATION_RESULT result, const unsigned char *payload, size_t payloadSize, void *userContextCallback);
+static int ReceiveHubMessage(const char *methodName, const unsigned char *payload, size_t payloadSize,
+	unsigned char **response, size_t *responseSize, void *userContextCallback);
 static void TwinCallback(DEVICE_TWIN_UPDATE_STATE updateState, const unsigned char *payload,
 	size_t payloadSize, void *userContextCallback);
 
 
 static void TwinReportBoolState(const char *propertyName, bool propertyValue);
+static void TwinReportJsonState(const char *propertyName, const char *propertyJson);
 static void ReportStatusCallback(int result, void *context);
 static const char *GetReasonString(IOTHUB_CLIENT_CONNECTION_STATUS_REASON reason);
-static const char *getAzureSphereProvisioningResultString(
-	AZURE_SPHERE_PROV_RETURN_VALUE provisioningResult);
+static ConnectionFailure ClassifyConnectionReason(IOTHUB_CLIENT_CONNECTION_STATUS_REASON reason);
+static ConnectionFailure ClassifyProvisioningResult(PROV_DEVICE_RESULT result);
+static uint32_t GetJitterSeed(void);
 static void SendTelemetry(const unsigned char *key, const unsigned char *value);
+static int SendTelemetryMessage(const TelemetryMessage *message, void *context);
+static void SendPackedMessage(const PackedMessage *message, void *context);
+static void SendTelemetryFields(int node, MessagePriority priority, TelemetryClass telemetryClass,
+	const char *const keys[], const char *const values[], size_t count);
+static void SendAggregate(int node, MessagePriority priority, TelemetryClass telemetryClass,
+	const char *const keys[], const char *const values[], size_t count, void *context);
 static void SendRoomPressure(const unsigned char *value);
 static void SendRoomHumidity(const unsigned char *value);
 static void SendRoomTemperature(const unsigned char *value);
@@ -91,7 +255,15 @@ static void SendDoorBattery(const unsigned char *value);
 
 static void SendDoorState();
 
-static void SetupAzureClient(void);
+static int SetupAzureClient(const char *hostName, const char *deviceId, ConnectionFailure *failure);
+static bool LoadCachedHub(void);
+static void SaveCachedHub(void);
+static void SelectKeepaliveNetwork(void);
+static void SaveKeepalive(WorkItem *item);
+static void ApplyRaisedKeepalive(void);
+static int StartProvisioning(void);
+static void StopProvisioning(void);
+static int FinishProvisioning(ConnectionFailure *failure);
 
 // Function to generate simulated Temperature data/telemetry
 static void SendSimulatedTemperature(void);
@@ -116,16 +288,111 @@ static bool tracker_LED = false;
 
 // Timer / polling
 static int buttonPollTimerFd = -1;
-static int azureTimerFd = -1;
 static int epollFd = -1;
 
+// The Azure poll, DoWork, shaper, statistics, aggregation and batch flush timers all run on one
+// timer wheel, and so share a single timerfd.
+static TimerWheel timerWheel;
+static LogicalTimer azureTimer;
+static LogicalTimer doWorkTimer;
+static LogicalTimer shaperTimer;
+static LogicalTimer statisticsTimer;
+static LogicalTimer aggregationTimer;
+static LogicalTimer batchFlushTimer;
+
+// How late the timers that need no exact timing may run, so that they share a wakeup with
+// another timer or with UART traffic rather than waking the loop on their own.
+static const uint32_t StatisticsSlackMs = 5000;
+static const uint32_t BatchFlushSlackMs = 250;
+static const uint32_t AzurePollSlackMs = 500;
+static const uint32_t ReconnectSlackMs = 250;
+
+// Running time of each handler, reported every StatisticsReportPeriodSeconds. The timer wheel
+// entry covers all of the logical timers below it.
+static HandlerStatistics uartHandlerStatistics = { .name = "Uart" };
+static HandlerStatistics timerWheelHandlerStatistics = { .name = "TimerWheel" };
+static HandlerStatistics azureHandlerStatistics = { .name = "AzureTimer" };
+static HandlerStatistics doWorkHandlerStatistics = { .name = "DoWork" };
+static HandlerStatistics shaperHandlerStatistics = { .name = "Shaper" };
+static HandlerStatistics buttonHandlerStatistics = { .name = "Button" };
+static HandlerStatistics aggregationHandlerStatistics = { .name = "Aggregation" };
+static HandlerStatistics batchFlushHandlerStatistics = { .name = "BatchFlush" };
+static HandlerStatistics deferredWorkHandlerStatistics = { .name = "DeferredWork" };
+static HandlerStatistics idleWorkHandlerStatistics = { .name = "IdleWork" };
+static HandlerStatistics statisticsHandlerStatistics = { .name = "Statistics" };
+static HandlerStatistics *const handlerStatistics[] = {
+	&uartHandlerStatistics, &timerWheelHandlerStatistics, &azureHandlerStatistics,
+	&doWorkHandlerStatistics, &shaperHandlerStatistics, &buttonHandlerStatistics,
+	&aggregationHandlerStatistics, &batchFlushHandlerStatistics, &deferredWorkHandlerStatistics,
+	&idleWorkHandlerStatistics, &statisticsHandlerStatistics };
+// With the "HandlerHistograms" desired property on, every statistics report also writes the full
+// histograms of the handlers that ran in its window to the debug log.
+static bool dumpHandlerHistograms = false;
+
+// The handlers that wake the loop, each from its own file descriptor or logical timer. A
+// wakeup in which a handler runs is counted against it in the Wakeups reported property.
+static HandlerStatistics *const wakeupSources[] = {
+	&uartHandlerStatistics, &azureHandlerStatistics, &doWorkHandlerStatistics,
+	&shaperHandlerStatistics, &buttonHandlerStatistics, &aggregationHandlerStatistics,
+	&batchFlushHandlerStatistics, &statisticsHandlerStatistics };
+#define WAKEUP_SOURCE_COUNT (sizeof(wakeupSources) / sizeof(wakeupSources[0]))
+
+// Any timed handler that runs for longer than this is counted as a stall and named in the log,
+// by a watchdog thread while it is still running and again when it returns. The stall count and
+// the worst stall are sent as telemetry at the next statistics report.
+static const uint32_t HandlerBudgetMs = 100;
+static uint32_t stallsReported = 0;
+
+// The UART is dispatched first in each wakeup, as its receive FIFO overflows if it waits. It
+// returns after UartReadBudgetBytes or UartReadBudgetUs, whichever comes first, so that a
+// continuous byte stream cannot keep the timer wheel, and with it the cloud connection, from
+// running; the rest is read on the next wakeup.
+static const size_t UartReadBudgetBytes = 1024;
+#define UartReadBudgetUs 2000
+
+// Up to this many ready file descriptors are handled per wakeup of the main loop, e.g. the UART,
+// the button timer and the Azure timer together.
+#define MaxEventsPerWakeup 8
+static struct epoll_event readyEvents[MaxEventsPerWakeup];
+static EventDispatchStatistics eventDispatchStatistics;
+
+// Work deferred out of the event handlers. The deferred queue is drained after every batch of
+// events; the idle queue runs one item at a time, and only when no events are ready, so that
+// reporting never delays the UART.
+static WorkQueue deferredWork;
+static WorkQueue idleWork;
+static WorkItem statisticsWork;
+static WorkItem uartFrameWork;
+
 // Azure IoT poll periods
 static const int AzureIoTDefaultPollPeriodSeconds = 5;
-static const int AzureIoTMinReconnectPeriodSeconds = 60;
-static const int AzureIoTMaxReconnectPeriodSeconds = 10 * 60;
+
+// DoWork also runs on demand: straight away when a message is handed to an idle client, and then
+// every AzureIoTFollowUpDoWorkMs while the client still has messages in flight. The poll period
+// above remains as the floor that keeps the connection alive.
+static const int AzureIoTFollowUpDoWorkMs = 100;
+
+// Period for reporting pipeline statistics to the device twin
+static const int StatisticsReportPeriodSeconds = 60;
 
 static int azureIoTPollPeriodSeconds = -1;
 
+// Connecting to IoT Hub runs as an async task on the event loop: it waits for the network,
+// registers with DPS unless a hub is cached, creates the client and sleeps between failed
+// attempts for as long as the connection state machine says. The Azure timer starts it whenever
+// the client is not authenticated and it is not already running, and a lost connection starts
+// it straight away through connectWork. While the network is down it is checked every
+// NetworkCheckPeriodMs, so a connection is retried soon after the network returns.
+static AsyncTask connectTask;
+static ConnectionStateMachine connection;
+static WorkItem connectWork;
+static const ConnectionBackoffConfig connectionBackoffConfig = {
+	.fastRetries = 3, .fastRetryMinMs = 1000, .fastRetryMaxMs = 5000,
+	.transientBaseMs = 5 * 1000, .authBaseMs = 60 * 1000, .capMs = 10 * 60 * 1000 };
+static const uint32_t NetworkCheckPeriodMs = 2000;
+static int ConnectToAzureTask(AsyncTask *task);
+static void StartConnecting(WorkItem *item);
+
 // Button state variables
 static GPIO_Value_Type sendMessageButtonState = GPIO_Value_High;
 static GPIO_Value_Type sendOrientationButtonState = GPIO_Value_High;
@@ -135,17 +402,49 @@ static bool IsButtonPressed(int fd, GPIO_Value_Type *oldState);
 static void SendMessageButtonHandler(void);
 static void SendOrientationButtonHandler(void);
 static bool deviceIsUp = false; // Orientation
-static void AzureTimerEventHandler(EventData *eventData);
+static void AzureTimerEventHandler(LogicalTimer *timer);
+static void RunDoWork(void);
+static void ShaperTimerEventHandler(LogicalTimer *timer);
+static void StatisticsTimerEventHandler(LogicalTimer *timer);
+static void AggregationTimerEventHandler(LogicalTimer *timer);
+static void ArmAggregationTimer(void);
+static void UpdateBackpressure(void);
+static uint32_t GetStartupTimeMs(void);
+static void SendStartupTimings(WorkItem *item);
+static void ReportStalls(void);
+static void ReportStatistics(WorkItem *item);
+static void DispatchUartFrames(WorkItem *item);
+static void BatchFlushTimerEventHandler(LogicalTimer *timer);
+static void DoWorkTimerEventHandler(LogicalTimer *timer);
+static void ScheduleDoWork(int delayMs);
+static bool IsIoTHubSendIdle(void);
 
 //UART STUFF
 // File descriptors - initialized to invalid value
 static int uartFd = -1;
 static int gpioButtonFd = -1;
-static int gpioButtonTimerFd = -1;
 //static int epollFd = -1;
 
 // State variables
-static GPIO_Value_Type buttonState = GPIO_Value_High;
+
+// SAMPLE_BUTTON_1 is polled every 20 ms while idle and every 2 ms from the first edge until it
+// has been stable for 250 ms; a new level must hold for 10 ms to count.
+static const InputSamplerConfig buttonSamplerConfig = {
+	.idlePeriodMs = 20, .activePeriodMs = 2, .debounceMs = 10, .activeHoldMs = 250 };
+
+// Low-power mode, set with the LowPowerMode desired property. The idle button sampling and the
+// Azure poll are slowed down, and the timers are aligned to a common grid so that they expire
+// together: the periodic timers to LowPowerAlignmentMs, and the short DoWork, shaper and idle
+// button delays to LowPowerFastAlignmentMs. A timer fires at most one alignment late, and
+// debouncing a press keeps its exact 2 ms rate.
+static bool lowPowerMode = false;
+static const uint32_t LowPowerAlignmentMs = 1000;
+static const uint32_t LowPowerFastAlignmentMs = 100;
+static const int AzureIoTLowPowerPollPeriodSeconds = 10;
+static const InputSamplerConfig buttonSamplerLowPowerConfig = {
+	.idlePeriodMs = 100, .activePeriodMs = 2, .debounceMs = 10, .activeHoldMs = 250 };
+static InputSampler buttonSampler;
+static LogicalTimer buttonSampleTimer;
 
 // Termination state
 //static volatile sig_atomic_t terminationRequired = false;
@@ -192,8 +491,9 @@ char mydoorstate[1] = "";
 int main(int argc, char *argv[])
 {
 	Log_Debug("IoT Hub/Central Application starting.\n");
+	startTimeMs = GetMonotonicTimeMs();
 	mydoorstate[0] = '0';
-	if (argc == 2) {
+	if (argc >= 2) {
 		Log_Debug("Setting Azure Scope ID %s\n", argv[1]);
 		strncpy(scopeId, argv[1], SCOPEID_LENGTH);
 	}
@@ -201,6 +501,11 @@ int main(int argc, char *argv[])
 		Log_Debug("ScopeId needs to be set in the app_manifest CmdArgs\n");
 		return -1;
 	}
+#ifdef CLOUD_TRANSPORT_FAKE
+	if (argc >= 3) {
+		fakeTransportSettings = argv[2];
+	}
+#endif
 
 	Log_Debug("UART application starting.\n");
 	if (InitPeripheralsAndHandlers() != 0) {
@@ -209,8 +514,27 @@ int main(int argc, char *argv[])
 
 	// Main loop
 	while (!terminationRequired) {
-		if (WaitForEventAndCallHandler(epollFd) != 0) {
+		// Only block in epoll_wait when there is no idle work waiting to run
+		int timeoutMs = WorkQueue_IsEmpty(&idleWork) ? -1 : 0;
+		int eventCount = WaitForEventsAndCallHandlers(epollFd, readyEvents, MaxEventsPerWakeup,
+			timeoutMs, &eventDispatchStatistics);
+		if (eventCount < 0) {
 			terminationRequired = true;
+			break;
+		}
+		HandlerTiming timing;
+		if (!WorkQueue_IsEmpty(&deferredWork)) {
+			HandlerStatistics_Begin(&deferredWorkHandlerStatistics, &timing);
+			WorkQueue_RunAll(&deferredWork);
+			HandlerStatistics_End(&deferredWorkHandlerStatistics, &timing);
+		}
+		if (eventCount > 0) {
+			TimerWheel_RunDue(&timerWheel);
+		}
+		if (eventCount == 0 && !WorkQueue_IsEmpty(&idleWork)) {
+			HandlerStatistics_Begin(&idleWorkHandlerStatistics, &timing);
+			WorkQueue_RunOne(&idleWork);
+			HandlerStatistics_End(&idleWorkHandlerStatistics, &timing);
 		}
 	}
 
@@ -221,13 +545,8 @@ int main(int argc, char *argv[])
 	return 0;
 }
 
-static void ButtonTimerEventHandler(EventData *eventData)
+static void ButtonTimerEventHandler(LogicalTimer *timer)
 {
-	if (ConsumeTimerFdEvent(gpioButtonTimerFd) != 0) {
-		terminationRequired = true;
-		return;
-	}
-
 	// Check for a button press
 	GPIO_Value_Type newButtonState;
 	int result = GPIO_GetValue(gpioButtonFd, &newButtonState);
@@ -237,13 +556,23 @@ static void ButtonTimerEventHandler(EventData *eventData)
 		return;
 	}
 
-	// If the button has just been pressed, send data over the UART
 	// The button has GPIO_Value_Low when pressed and GPIO_Value_High when released
-	if (newButtonState != buttonState) {
-		if (newButtonState == GPIO_Value_Low) {
-			SendUartMessage(uartFd, "Hello world!\n");
-		}
-		buttonState = newButtonState;
+	uint32_t nextSampleMs = InputSampler_Sample(&buttonSampler, newButtonState == GPIO_Value_Low,
+		GetMonotonicTimeMs());
+	bool idle = nextSampleMs >= buttonSamplerLowPowerConfig.idlePeriodMs;
+	LogicalTimer_SetAlignment(&buttonSampleTimer,
+		lowPowerMode && idle ? LowPowerFastAlignmentMs : 0);
+	TimerWheel_StartOneShot(&timerWheel, &buttonSampleTimer, nextSampleMs);
+}
+
+/// <summary>
+///     Called by the button sampler when the debounced button state changes.
+/// </summary>
+static void ButtonChangedHandler(bool pressed, void *context)
+{
+	// If the button has just been pressed, send data over the UART
+	if (pressed) {
+		SendUartMessage(uartFd, "Hello world!\n");
 	}
 }
 
@@ -322,17 +651,139 @@ static void setevalue(const unsigned char *value) {
 	got2 = 0;
 }
 
+// A complete node message, copied out of the parser state so that the telemetry it carries can
+// be sent after the UART handler returns.
+typedef struct UartFrame {
+	char node;
+	char status;
+	bool door;
+	bool battery;
+	unsigned char doorState[sizeof(buttondata) + 1];
+	unsigned char batteryValue[sizeof(batteryvalue) + 1];
+	unsigned char evalue1[sizeof(evalue1) + 1];
+	unsigned char evalue2[sizeof(evalue2) + 1];
+	unsigned char evalue3[sizeof(evalue3) + 1];
+} UartFrame;
+
+#define UART_FRAME_QUEUE_LENGTH 16
+static UartFrame uartFrames[UART_FRAME_QUEUE_LENGTH];
+static size_t uartFrameHead = 0;
+static size_t uartFrameCount = 0;
+static uint32_t uartFramesReceived = 0;
+
+/// <summary>
+///     Copies a parser field, which need not be terminated, into a terminated frame field one
+///     byte longer.
+/// </summary>
+static void CopyFrameField(unsigned char *target, const char *source, size_t sourceSize)
+{
+	memcpy(target, source, sourceSize);
+	target[sourceSize] = '\0';
+}
+
+/// <summary>
+///     Sends the telemetry carried by one node message.
+/// </summary>
+static void DispatchUartFrame(const UartFrame *frame)
+{
+	if (frame->node == '8' && frame->status != '0' && frame->door) {
+		SendDoorState(frame->doorState); //mydoorstate
+	}
+	else if (frame->node == '8' && frame->status != '0' && frame->battery) {
+		//Log_Debug("SENDING DOORBATTERY OF : %s\n", (char *)frame->batteryValue);
+		SendDoorBattery(frame->batteryValue);//evalue1
+	}
+
+	else if (frame->node == '4' && frame->status != '0' && !frame->battery) {
+
+		SendRoomTemperature(frame->evalue1);
+		SendRoomHumidity(frame->evalue2);
+		SendRoomPressure(frame->evalue3);
+	}
+	else if (frame->node == '3' && frame->status != '0' && !frame->battery) {
+		//if node is from server cabinet
+		SendServerTemperature(frame->evalue1);
+		SendServerHumidity(frame->evalue2);
+		SendServerPressure(frame->evalue3);
+	}
+	else if (frame->node == '6' && frame->status != '0' && !frame->battery) {
+
+		SendOutsideTemperature(frame->evalue1);
+		SendOutsideHumidity(frame->evalue2);
+		SendOutsidePressure(frame->evalue3);
+	}
+	else if (frame->node == '6' && frame->status != '0' && frame->battery) {
+		SendOutsideBattery(frame->batteryValue);
+	}
+	else if (frame->node == '3' && frame->status != '0' && frame->battery) {
+		SendServerBattery(frame->batteryValue);
+	}
+	else if (frame->node == '4' && frame->status != '0' && frame->battery) {
+		SendRoomBattery(frame->batteryValue);
+	}
+	else if (frame->node == '2' && frame->status != '0' && frame->battery) {
+		SendTrackerBattery(frame->batteryValue);
+		SendInOffice(frame->evalue1);
+	}
+}
+
+/// <summary>
+///     Deferred work: sends the telemetry of every queued node message.
+/// </summary>
+static void DispatchUartFrames(WorkItem *item)
+{
+	while (uartFrameCount > 0) {
+		const UartFrame *frame = &uartFrames[uartFrameHead];
+		uartFrameHead = (uartFrameHead + 1) % UART_FRAME_QUEUE_LENGTH;
+		uartFrameCount--;
+		DispatchUartFrame(frame);
+	}
+}
+
+/// <summary>
+///     Queues the node message that the parser has just completed, to be sent once the current
+///     batch of events has been handled.
+/// </summary>
+static void QueueUartFrame(void)
+{
+	if (uartFrameCount == UART_FRAME_QUEUE_LENGTH) {
+		// A burst longer than the queue: send what is queued now rather than lose a message
+		Log_Debug("WARNING: UART frame queue full, sending queued frames early\n");
+		DispatchUartFrames(&uartFrameWork);
+	}
+
+	UartFrame *frame = &uartFrames[(uartFrameHead + uartFrameCount) % UART_FRAME_QUEUE_LENGTH];
+	frame->node = name2[3];
+	frame->status = value2[0];
+	frame->door = door == 1;
+	frame->battery = battery == 1;
+	CopyFrameField(frame->doorState, buttondata, sizeof(buttondata));
+	CopyFrameField(frame->batteryValue, batteryvalue, sizeof(batteryvalue));
+	CopyFrameField(frame->evalue1, evalue1, sizeof(evalue1));
+	CopyFrameField(frame->evalue2, evalue2, sizeof(evalue2));
+	CopyFrameField(frame->evalue3, evalue3, sizeof(evalue3));
+	uartFrameCount++;
+	uartFramesReceived++;
+	if (firstFrameMs == 0) {
+		firstFrameMs = GetStartupTimeMs();
+		Log_Debug("INFO: First UART frame %u ms after start.\n", firstFrameMs);
+	}
+
+	WorkQueue_Post(&deferredWork, &uartFrameWork);
+}
+
 //Handler that 
 static void UartEventHandler(EventData *eventData)
 {
 	const size_t receiveBufferSize = 128;
 	uint8_t receiveBuffer[receiveBufferSize + 1]; // allow extra byte for string termination
-	ssize_t bytesRead = -1;
+	size_t bytesThisDispatch = 0;
 
-	for (int i = 0; i < 32767 && bytesRead == -1; i++) {
-		bytesRead = read(uartFd, receiveBuffer, receiveBufferSize);
+	ssize_t bytesRead = read(uartFd, receiveBuffer, receiveBufferSize);
+	if (bytesRead < 0 && errno == EAGAIN) {
+		// Drained at the end of the previous dispatch; epoll reports the fd again on new data
+		return;
 	}
-
 	if (bytesRead < 0) {
 		Log_Debug("ERROR: Could not read UART: %s (%d).\n", strerror(errno), errno);
 		terminationRequired = true;
@@ -481,55 +932,8 @@ static void UartEventHandler(EventData *eventData)
 					//complete message, print
 					Log_Debug("my whole message is: %s \n", (char *)message);
 
-					if (name2[3] == '8' && value2[0] != '0' && door == 1) {
-						SendDoorState(buttondata); //mydoorstate
-					}
-					else if (name2[3] == '8' && value2[0] != '0' && battery == 1) {
-						//Log_Debug("SENDING DOORBATTERY OF : %s\n", (char *)batteryvalue);
-						SendDoorBattery(batteryvalue);//evalue1
-					}
-
-					else if (name2[3] == '8') {
-						got1 = 0;
-						got2 = 0;
-						evalue1start = 0;
-						evalue2start = 0;
-						evalue3start = 0;
-
-						memset(&value2[0], 0, sizeof(value2));
-						memset(&name2[0], 0, sizeof(name2));
-					}
-					else if (name2[3] == '4' && value2[0] != '0' && battery == 0) {
-
-						SendRoomTemperature(evalue1);
-						SendRoomHumidity(evalue2);
-						SendRoomPressure(evalue3);
-					}
-					else if (name2[3] == '3' && value2[0] != '0' && battery == 0) {
-						//if node is from server cabinet
-						SendServerTemperature(evalue1);
-						SendServerHumidity(evalue2);
-						SendServerPressure(evalue3);
-					}
-					else if (name2[3] == '6' && value2[0] != '0' && battery == 0) {
-
-						SendOutsideTemperature(evalue1);
-						SendOutsideHumidity(evalue2);
-						SendOutsidePressure(evalue3);
-					}
-					else if (name2[3] == '6' && value2[0] != '0' && battery == 1) {
-						SendOutsideBattery(batteryvalue);
-					}
-					else if (name2[3] == '3' && value2[0] != '0' && battery == 1) {
-						SendServerBattery(batteryvalue);
-					}
-					else if (name2[3] == '4' && value2[0] != '0' && battery == 1) {
-						SendRoomBattery(batteryvalue);
-					}
-					else if (name2[3] == '2' && value2[0] != '0' && battery == 1) {
-						SendTrackerBattery(batteryvalue);
-						SendInOffice(evalue1);
-					}
+					QueueUartFrame();
+
 					recordbatteryvalue = 0;
 					batterystart = 0;
 					S = 0;
@@ -570,14 +974,17 @@ static void UartEventHandler(EventData *eventData)
 		}
 		//#endif
 				//Log_Debug("%s", (char *)receiveBuffer);
-	} while ((bytesRead = read(uartFd, receiveBuffer, receiveBufferSize)) > 0);
+		bytesThisDispatch += (size_t)bytesRead;
+	} while (bytesThisDispatch < UartReadBudgetBytes && !IsEventHandlerOverBudget() &&
+		(bytesRead = read(uartFd, receiveBuffer, receiveBufferSize)) > 0);
 }
 
 
 
 // event handler data structures. Only the event handler field needs to be populated.
-static EventData buttonEventData = { .eventHandler = &ButtonTimerEventHandler };
-static EventData uartEventData = { .eventHandler = &UartEventHandler };
+static EventData uartEventData = { .eventHandler = &UartEventHandler,
+	.statistics = &uartHandlerStatistics, .priority = EventPriority_High,
+	.budgetUs = UartReadBudgetUs };
 
 //END OF UART SEGMENT
 
@@ -598,32 +1005,470 @@ static void ButtonPollTimerEventHandler(EventData *eventData)
 /// <summary>
 /// Azure timer event:  Check connection status and send telemetry
 /// </summary>
-static void AzureTimerEventHandler(EventData *eventData)
+static void AzureTimerEventHandler(LogicalTimer *timer)
 {
-	if (ConsumeTimerFdEvent(azureTimerFd) != 0) {
-		terminationRequired = true;
+	StartConnecting(NULL);
+
+	if (iothubAuthenticated) {
+		if (KeepaliveController_Poll(&keepalive, GetMonotonicTimeMs())) {
+			WorkQueue_Post(&deferredWork, &keepaliveSaveWork);
+		}
+		ApplyRaisedKeepalive();
+		SendSimulatedTemperature();
+		RunDoWork();
+	}
+}
+
+/// <summary>
+///     Lets the IoT Hub client do its work, and schedules a follow-up if messages are still in
+///     flight so that they are not left waiting for the next poll tick.
+/// </summary>
+static void RunDoWork(void)
+{
+	cloudTransport->doWork();
+
+	if (!IsIoTHubSendIdle()) {
+		ScheduleDoWork(AzureIoTFollowUpDoWorkMs);
+	}
+}
+
+/// <summary>
+///     Arms the DoWork timer to expire after the given delay, unless it is already due sooner.
+/// </summary>
+/// <param name="delayMs">Delay in milliseconds; 0 runs DoWork on the next millisecond</param>
+static void ScheduleDoWork(int delayMs)
+{
+	if (LogicalTimer_IsArmed(&doWorkTimer) &&
+		doWorkTimer.expiryMs <= GetMonotonicTimeMs() + (uint64_t)delayMs) {
 		return;
 	}
+	TimerWheel_StartOneShot(&timerWheel, &doWorkTimer, (uint32_t)delayMs);
+}
 
-	bool isNetworkReady = false;
-	if (Networking_IsNetworkingReady(&isNetworkReady) != -1) {
-		if (isNetworkReady && !iothubAuthenticated) {
-			SetupAzureClient();
-		}
+/// <summary>
+/// DoWork timer event:  Run the IoT Hub client for work that was scheduled on demand
+/// </summary>
+static void DoWorkTimerEventHandler(LogicalTimer *timer)
+{
+	if (iothubAuthenticated) {
+		RunDoWork();
+	}
+}
+
+/// <summary>
+///     Checks whether the IoT Hub client has no telemetry waiting to be sent or acknowledged.
+/// </summary>
+static bool IsIoTHubSendIdle(void)
+{
+	return cloudTransport->isSendIdle();
+}
+
+/// <summary>
+///     Arms the shaper timer for the moment the next delayed message can be released, or
+///     disarms it if nothing is waiting.
+/// </summary>
+static void ScheduleShaperTimer(void)
+{
+	int64_t delayMs = MessageShaper_GetNextReleaseDelayMs(&messageShaper, GetMonotonicTimeMs());
+	if (delayMs < 0) {
+		TimerWheel_Cancel(&timerWheel, &shaperTimer);
 	}
 	else {
-		Log_Debug("Failed to get Network state\n");
+		TimerWheel_StartOneShot(&timerWheel, &shaperTimer, (uint32_t)delayMs);
 	}
+}
 
-	if (iothubAuthenticated) {
-		SendSimulatedTemperature();
-		IoTHubDeviceClient_LL_DoWork(iothubClientHandle);
+/// <summary>
+/// Shaper timer event:  Release messages that were delayed by the token buckets
+/// </summary>
+static void ShaperTimerEventHandler(LogicalTimer *timer)
+{
+	MessageShaper_Poll(&messageShaper, GetMonotonicTimeMs());
+	ScheduleShaperTimer();
+	UpdateBackpressure();
+}
+
+/// <summary>
+/// Statistics timer event:  Queue the statistics report to run when the loop is idle
+/// </summary>
+static void StatisticsTimerEventHandler(LogicalTimer *timer)
+{
+	WorkQueue_Post(&idleWork, &statisticsWork);
+}
+
+// Size of the JSON object reported for each statistics section. HandlerTiming is the largest, at
+// up to about 150 bytes per handler. TwinReportJsonState adds the property name around it.
+#define STATISTICS_SECTION_SIZE 2048
+
+/// <summary>
+///     Writes the members of a statistics section, without the enclosing braces.
+/// </summary>
+/// <returns>The snprintf result</returns>
+typedef int (*StatisticsFormatter)(char *buffer, size_t bufferSize);
+
+/// <summary>
+///     Reports one statistics section to the device twin as a JSON object property.
+/// </summary>
+static void ReportJsonSection(const char *name, StatisticsFormatter format)
+{
+	static char section[STATISTICS_SECTION_SIZE];
+	section[0] = '{';
+	int len = format(section + 1, sizeof(section) - 2);
+	if (len < 0 || (size_t)len >= sizeof(section) - 2) {
+		Log_Debug("ERROR: %s statistics do not fit in %d bytes.\n", name, STATISTICS_SECTION_SIZE);
+		return;
+	}
+	section[1 + len] = '}';
+	section[2 + len] = 0;
+	TwinReportJsonState(name, section);
+}
+
+/// <summary>
+///     Appends to a section that a formatter has written len characters of, like snprintf.
+/// </summary>
+/// <returns>The length the section would have, or -1 on an encoding error</returns>
+static int AppendToSection(char *buffer, size_t bufferSize, int len, const char *format, ...)
+{
+	if (len < 0) {
+		return len;
+	}
+	size_t used = (size_t)len < bufferSize ? (size_t)len : bufferSize;
+	va_list args;
+	va_start(args, format);
+	int added = vsnprintf(buffer + used, bufferSize - used, format, args);
+	va_end(args);
+	return added < 0 ? -1 : len + added;
+}
+
+static int FormatMessageShaperSection(char *buffer, size_t bufferSize)
+{
+	return MessageShaper_FormatStatistics(&messageShaper, buffer, bufferSize);
+}
+
+static int FormatBatchPackerSection(char *buffer, size_t bufferSize)
+{
+	return BatchPacker_FormatStatistics(&batchPacker, buffer, bufferSize);
+}
+
+static int FormatLoadShedderSection(char *buffer, size_t bufferSize)
+{
+	return LoadShedder_FormatStatistics(&loadShedder, buffer, bufferSize);
+}
+
+static int FormatButtonSamplerSection(char *buffer, size_t bufferSize)
+{
+	return InputSampler_FormatStatistics(&buttonSampler, GetMonotonicTimeMs(), buffer, bufferSize);
+}
+
+static int FormatProvisioningSection(char *buffer, size_t bufferSize)
+{
+	return snprintf(buffer, bufferSize,
+		"\"hub\":\"%s\",\"cachedConnects\":%u,\"cacheFailures\":%u,\"dpsRegistrations\":%u,"
+		"\"dpsFailures\":%u,\"lastDpsMs\":%u,\"firstConnectMs\":%u",
+		!cloudTransport->isCreated() ? "none" : cloudTransport->localHostName != NULL ? "local"
+			: connectedToCachedHub ? "cached" : "dps",
+		provisioningStatistics.cachedConnects, provisioningStatistics.cacheFailures,
+		provisioningStatistics.dpsRegistrations, provisioningStatistics.dpsFailures,
+		provisioningStatistics.lastDpsMs, provisioningStatistics.firstConnectMs);
+}
+
+static int FormatConnectionSection(char *buffer, size_t bufferSize)
+{
+	return ConnectionStateMachine_FormatStatistics(&connection, GetMonotonicTimeMs(), buffer,
+		bufferSize);
+}
+
+static int FormatKeepaliveSection(char *buffer, size_t bufferSize)
+{
+	int len = KeepaliveController_FormatStatistics(&keepalive, buffer, bufferSize);
+	len = AppendToSection(buffer, bufferSize, len, ",\"network\":\"%s\",\"disconnects\":{",
+		keepaliveNetwork);
+	for (int i = 0; i < CONNECTION_REASON_COUNT; i++) {
+		// Reasons are reported without the IOTHUB_CLIENT_CONNECTION_ prefix
+		const char *reason = GetReasonString((IOTHUB_CLIENT_CONNECTION_STATUS_REASON)i);
+		if (strncmp(reason, "IOTHUB_CLIENT_CONNECTION_", 25) == 0) {
+			reason += 25;
+		}
+		len = AppendToSection(buffer, bufferSize, len, "%s\"%s\":%u", i == 0 ? "" : ",", reason,
+			disconnectReasons[i]);
+	}
+	return AppendToSection(buffer, bufferSize, len, "}");
+}
+
+static int FormatTimerWheelSection(char *buffer, size_t bufferSize)
+{
+	return TimerWheel_FormatStatistics(&timerWheel, buffer, bufferSize);
+}
+
+static int FormatWorkerPoolSection(char *buffer, size_t bufferSize)
+{
+	return WorkerPool_FormatStatistics(&workerPool, buffer, bufferSize);
+}
+
+/// <summary>
+///     Formats the event loop counters, with the wakeups and UART frames per second since the
+///     last report.
+/// </summary>
+static int FormatEventLoopSection(char *buffer, size_t bufferSize)
+{
+	static uint32_t lastWakeups = 0;
+	static uint32_t lastFrames = 0;
+	static uint64_t lastWakeupsMs = 0;
+	uint64_t nowMs = GetMonotonicTimeMs();
+	uint32_t wakeupsPerSecond = lastWakeupsMs != 0 && nowMs > lastWakeupsMs
+		? (uint32_t)((uint64_t)(eventDispatchStatistics.wakeups - lastWakeups) * 1000 /
+			(nowMs - lastWakeupsMs))
+		: 0;
+	uint32_t framesPerSecond = lastWakeupsMs != 0 && nowMs > lastWakeupsMs
+		? (uint32_t)((uint64_t)(uartFramesReceived - lastFrames) * 1000 / (nowMs - lastWakeupsMs))
+		: 0;
+	lastWakeups = eventDispatchStatistics.wakeups;
+	lastFrames = uartFramesReceived;
+	lastWakeupsMs = nowMs;
+
+	return snprintf(buffer, bufferSize,
+		"\"backend\":\"%s\",\"wakeups\":%u,\"wakeupsPerSecond\":%u,\"syscalls\":%u,"
+		"\"framesPerSecond\":%u,\"events\":%u,\"maxEventsPerWakeup\":%u,"
+		"\"staleEventsSkipped\":%u,\"budgetYields\":%u,\"deferredRuns\":%u,\"idleRuns\":%u,"
+		"\"coalesced\":%u",
+		GetEventLoopBackendName(), eventDispatchStatistics.wakeups, wakeupsPerSecond,
+		eventDispatchStatistics.syscalls, framesPerSecond, eventDispatchStatistics.eventsDispatched,
+		eventDispatchStatistics.maxEventsPerWakeup, eventDispatchStatistics.staleEventsSkipped,
+		eventDispatchStatistics.budgetYields,
+		deferredWork.statistics.runs, idleWork.statistics.runs,
+		deferredWork.statistics.coalesced + idleWork.statistics.coalesced);
+}
+
+/// <summary>
+///     Formats the wakeups per second since the last report, in total and for each source.
+/// </summary>
+static int FormatWakeupsSection(char *buffer, size_t bufferSize)
+{
+	static uint32_t lastWakeups = 0;
+	static uint32_t lastCalls[WAKEUP_SOURCE_COUNT];
+	static uint32_t lastWatchdogWakeups = 0;
+	static uint64_t lastReportMs = 0;
+	uint64_t nowMs = GetMonotonicTimeMs();
+	uint64_t elapsedMs = nowMs - lastReportMs;
+
+	int len = snprintf(buffer, bufferSize, "\"lowPowerMode\":%s", lowPowerMode ? "true" : "false");
+	for (size_t i = 0; i <= WAKEUP_SOURCE_COUNT; i++) {
+		const char *name = i == 0 ? "total" : wakeupSources[i - 1]->name;
+		uint32_t count = i == 0 ? eventDispatchStatistics.wakeups : wakeupSources[i - 1]->calls;
+		uint32_t *last = i == 0 ? &lastWakeups : &lastCalls[i - 1];
+		// Hundredths of a wakeup per second
+		uint32_t rate = lastReportMs != 0 && elapsedMs > 0
+			? (uint32_t)((uint64_t)(count - *last) * 100000 / elapsedMs)
+			: 0;
+		*last = count;
+		len = AppendToSection(buffer, bufferSize, len, ",\"%s\":%u.%02u", name, rate / 100,
+			rate % 100);
+	}
+	// The watchdog thread's wakeups cost power too, though they are not loop wakeups.
+	StallWatchdogStatistics stalls;
+	StallWatchdog_GetStatistics(&stalls);
+	uint32_t watchdogRate = lastReportMs != 0 && elapsedMs > 0
+		? (uint32_t)((uint64_t)(stalls.threadWakeups - lastWatchdogWakeups) * 100000 / elapsedMs)
+		: 0;
+	lastWatchdogWakeups = stalls.threadWakeups;
+	lastReportMs = nowMs;
+	return AppendToSection(buffer, bufferSize, len, ",\"watchdogThread\":%u.%02u",
+		watchdogRate / 100, watchdogRate % 100);
+}
+
+/// <summary>
+///     Formats a percentile summary of every handler's running time over the last report window.
+/// </summary>
+static int FormatHandlerTimingSection(char *buffer, size_t bufferSize)
+{
+	int len = 0;
+	for (size_t i = 0; i < sizeof(handlerStatistics) / sizeof(handlerStatistics[0]); i++) {
+		if (i > 0) {
+			len = AppendToSection(buffer, bufferSize, len, ",");
+		}
+		if (len < 0 || (size_t)len >= bufferSize) {
+			return len;
+		}
+		int added = HandlerStatistics_FormatSummary(handlerStatistics[i], buffer + len,
+			bufferSize - (size_t)len);
+		len = added < 0 ? -1 : len + added;
+	}
+	return len;
+}
+
+// Sections reported by ReportStatistics, in order
+static const struct {
+	const char *name;
+	StatisticsFormatter format;
+} statisticsSections[] = {
+	{ "MessageShaper", FormatMessageShaperSection },
+	{ "BatchPacker", FormatBatchPackerSection },
+	{ "LoadShedder", FormatLoadShedderSection },
+	{ "ButtonSampler", FormatButtonSamplerSection },
+	{ "Provisioning", FormatProvisioningSection },
+	{ "Connection", FormatConnectionSection },
+	{ "Keepalive", FormatKeepaliveSection },
+	{ "TimerWheel", FormatTimerWheelSection },
+	{ "WorkerPool", FormatWorkerPoolSection },
+	{ "EventLoop", FormatEventLoopSection },
+	{ "Watchdog", StallWatchdog_FormatStatistics },
+	{ "Wakeups", FormatWakeupsSection },
+	{ "HandlerTiming", FormatHandlerTimingSection } };
+
+/// <summary>
+///     Idle work: reports pipeline counters to the device twin
+/// </summary>
+static void ReportStatistics(WorkItem *item)
+{
+	if (!iothubAuthenticated) {
+		return;
+	}
+
+	for (size_t i = 0; i < sizeof(statisticsSections) / sizeof(statisticsSections[0]); i++) {
+		ReportJsonSection(statisticsSections[i].name, statisticsSections[i].format);
+	}
+	if (cloudTransport->formatStatistics != NULL) {
+		ReportJsonSection("Transport", cloudTransport->formatStatistics);
+	}
+	ReportStalls();
+
+	// HandlerTiming has been reported, so its window ends here
+	for (size_t i = 0; i < sizeof(handlerStatistics) / sizeof(handlerStatistics[0]); i++) {
+		if (dumpHandlerHistograms) {
+			HandlerStatistics_Dump(handlerStatistics[i]);
+		}
+		HandlerStatistics_ResetWindow(handlerStatistics[i]);
+	}
+}
+
+/// <summary>
+///     Sends the stall count and the worst stall as telemetry if there has been a stall since the
+///     last report.
+/// </summary>
+static void ReportStalls(void)
+{
+	StallWatchdogStatistics stalls;
+	StallWatchdog_GetStatistics(&stalls);
+	if (stalls.stalls == stallsReported) {
+		return;
+	}
+	stallsReported = stalls.stalls;
+
+	char count[12], worstMs[12], lastMs[12];
+	snprintf(count, sizeof(count), "%u", stalls.stalls);
+	snprintf(worstMs, sizeof(worstMs), "%u", stalls.worstMs);
+	snprintf(lastMs, sizeof(lastMs), "%u", stalls.lastMs);
+	const char *keys[] = { "LoopStalls", "WorstStallMs", "WorstStallHandler", "LastStallMs",
+		"LastStallHandler" };
+	const char *values[] = { count, worstMs, stalls.worstHandler, lastMs, stalls.lastHandler };
+	SendTelemetryFields(TELEMETRY_NODE_GATEWAY, MessagePriority_Normal, TelemetryClass_Event,
+		keys, values, 5);
+}
+
+/// <summary>
+/// Aggregation timer event:  Close the current window and send one summary per series
+/// </summary>
+static void AggregationTimerEventHandler(LogicalTimer *timer)
+{
+	EdgeAggregator_Flush(&edgeAggregator);
+}
+
+/// <summary>
+/// Batch flush timer event:  Send batches that did not fill up within the batching window
+/// </summary>
+static void BatchFlushTimerEventHandler(LogicalTimer *timer)
+{
+	BatchPacker_Flush(&batchPacker);
+}
+
+/// <summary>
+///     Sets the aggregation window, sending what has been collected so far. A window of 0
+///     seconds disables aggregation.
+/// </summary>
+static void SetAggregationWindow(int windowSeconds)
+{
+	EdgeAggregator_Flush(&edgeAggregator);
+	aggregationWindowSeconds = windowSeconds;
+	ArmAggregationTimer();
+}
+
+/// <summary>
+///     Switches low-power mode on or off, re-arming the periodic timers so that the new poll
+///     period and alignment take effect straight away.
+/// </summary>
+static void SetLowPowerMode(bool enabled)
+{
+	lowPowerMode = enabled;
+	uint32_t alignMs = enabled ? LowPowerAlignmentMs : 0;
+	uint32_t fastAlignMs = enabled ? LowPowerFastAlignmentMs : 0;
+	LogicalTimer_SetAlignment(&azureTimer, alignMs);
+	LogicalTimer_SetAlignment(&statisticsTimer, alignMs);
+	LogicalTimer_SetAlignment(&aggregationTimer, alignMs);
+	LogicalTimer_SetAlignment(&batchFlushTimer, alignMs);
+	LogicalTimer_SetAlignment(&connectTask.timer, alignMs);
+	LogicalTimer_SetAlignment(&doWorkTimer, fastAlignMs);
+	LogicalTimer_SetAlignment(&shaperTimer, fastAlignMs);
+	InputSampler_SetConfig(&buttonSampler,
+		enabled ? &buttonSamplerLowPowerConfig : &buttonSamplerConfig);
+	// The watchdog thread's own wakeups would undo much of the saving; stalls are still counted
+	// when handlers return.
+	StallWatchdog_SetParked(enabled);
+
+	azureIoTPollPeriodSeconds =
+		enabled ? AzureIoTLowPowerPollPeriodSeconds : AzureIoTDefaultPollPeriodSeconds;
+	TimerWheel_StartPeriodic(&timerWheel, &azureTimer, (uint32_t)azureIoTPollPeriodSeconds * 1000);
+	TimerWheel_StartPeriodic(&timerWheel, &statisticsTimer,
+		(uint32_t)StatisticsReportPeriodSeconds * 1000);
+	ArmAggregationTimer();
+}
+
+/// <summary>
+///     Sets the aggregation timer to the configured window, or to the pressure window if
+///     aggregation is off but the outbound backlog is under pressure.
+/// </summary>
+static void ArmAggregationTimer(void)
+{
+	int windowSeconds = aggregationWindowSeconds;
+	if (windowSeconds == 0 && loadShedder.underPressure) {
+		windowSeconds = PressureAggregationWindowSeconds;
+	}
+	TimerWheel_StartPeriodic(&timerWheel, &aggregationTimer, (uint32_t)windowSeconds * 1000);
+}
+
+/// <summary>
+///     Recomputes the outbound backlog, pausing or resuming the shaper and switching load
+///     shedding on or off as the watermarks are crossed.
+/// </summary>
+static void UpdateBackpressure(void)
+{
+	bool pressureChanged =
+		LoadShedder_Update(&loadShedder, messageShaper.queue.count,
+			messagesInFlight + messagesBeingBuilt);
+
+	// Until there is a client to send them, readings wait in the shaper's queue, where they are
+	// merged and shed like any other backlog.
+	bool paused = loadShedder.sendPaused || !iothubAuthenticated;
+	bool wasPaused = messageShaper.paused;
+	MessageShaper_SetPaused(&messageShaper, paused);
+	if (wasPaused && !paused) {
+		// Release the queue from the event loop rather than from inside the caller.
+		ScheduleShaperTimer();
+	}
+
+	if (pressureChanged) {
+		Log_Debug("INFO: outbound backlog %s\n",
+			loadShedder.underPressure ? "under pressure, shedding load" : "back to normal");
+		if (aggregationWindowSeconds == 0) {
+			if (!loadShedder.underPressure) {
+				EdgeAggregator_Flush(&edgeAggregator);
+			}
+			ArmAggregationTimer();
+		}
 	}
 }
 
 // event handler data structures. Only the event handler field needs to be populated.
 static EventData buttonPollEventData = { .eventHandler = &ButtonPollTimerEventHandler };
-static EventData azureEventData = { .eventHandler = &AzureTimerEventHandler };
 
 /// <summary>
 ///     Set up SIGTERM termination handler, initialize peripherals, and set up event handlers.
@@ -640,6 +1485,18 @@ static int InitPeripheralsAndHandlers(void)
 	if (epollFd < 0) {
 		return -1;
 	}
+	// Stalls are still counted when handlers return if the watchdog thread cannot start
+	StallWatchdog_Start(HandlerBudgetMs);
+	// Without stored settings every connection goes through DPS
+	DeviceStorage_Load();
+#ifdef CLOUD_TRANSPORT_FAKE
+	FakeTransportConfig fakeTransportConfig = FakeTransportDefaultConfig;
+	if (FakeTransport_ParseConfig(fakeTransportSettings, &fakeTransportConfig) != 0) {
+		Log_Debug("ERROR: fake transport settings %s are not understood\n", fakeTransportSettings);
+		return -1;
+	}
+	FakeTransport_Configure(&fakeTransportConfig);
+#endif
 
 	UART_Config uartConfig;
 	UART_InitConfig(&uartConfig);
@@ -662,19 +1519,75 @@ static int InitPeripheralsAndHandlers(void)
 		Log_Debug("ERROR: Could not open button GPIO: %s (%d).\n", strerror(errno), errno);
 		return -1;
 	}
-	struct timespec buttonPressCheckPeriod = { 0, 1000000 };
-	gpioButtonTimerFd =
-		CreateTimerFdAndAddToEpoll(epollFd, &buttonPressCheckPeriod, &buttonEventData, EPOLLIN);
-	if (gpioButtonTimerFd < 0) {
-		return -1;
-	}
 
 	//END UART
 
+	if (TimerWheel_Init(&timerWheel, epollFd) != 0) {
+		return -1;
+	}
+	timerWheel.eventData.statistics = &timerWheelHandlerStatistics;
+	InputSampler_Init(&buttonSampler, &buttonSamplerConfig, ButtonChangedHandler, NULL,
+		GetMonotonicTimeMs());
+	LogicalTimer_Init(&buttonSampleTimer, ButtonTimerEventHandler, NULL);
+	buttonSampleTimer.statistics = &buttonHandlerStatistics;
+	TimerWheel_StartOneShot(&timerWheel, &buttonSampleTimer, buttonSamplerConfig.idlePeriodMs);
+	LogicalTimer_Init(&azureTimer, AzureTimerEventHandler, NULL);
+	AsyncTask_Init(&connectTask, &timerWheel, epollFd, ConnectToAzureTask, NULL);
+	WorkItem_Init(&connectWork, StartConnecting, NULL);
+	KeepaliveController_Init(&keepalive, &keepaliveConfig);
+	WorkItem_Init(&keepaliveSaveWork, SaveKeepalive, NULL);
+	ConnectionStateMachine_Init(&connection, &connectionBackoffConfig, GetJitterSeed(),
+		GetMonotonicTimeMs());
+	LogicalTimer_Init(&doWorkTimer, DoWorkTimerEventHandler, NULL);
+	LogicalTimer_Init(&shaperTimer, ShaperTimerEventHandler, NULL);
+	LogicalTimer_Init(&statisticsTimer, StatisticsTimerEventHandler, NULL);
+	WorkQueue_Init(&deferredWork);
+	WorkQueue_Init(&idleWork);
+	WorkItem_Init(&statisticsWork, ReportStatistics, NULL);
+	WorkItem_Init(&startupTimingsWork, SendStartupTimings, NULL);
+	WorkItem_Init(&uartFrameWork, DispatchUartFrames, NULL);
+	LogicalTimer_Init(&aggregationTimer, AggregationTimerEventHandler, NULL);
+	LogicalTimer_Init(&batchFlushTimer, BatchFlushTimerEventHandler, NULL);
+	azureTimer.statistics = &azureHandlerStatistics;
+	doWorkTimer.statistics = &doWorkHandlerStatistics;
+	shaperTimer.statistics = &shaperHandlerStatistics;
+	aggregationTimer.statistics = &aggregationHandlerStatistics;
+	batchFlushTimer.statistics = &batchFlushHandlerStatistics;
+	statisticsTimer.statistics = &statisticsHandlerStatistics;
+	LogicalTimer_SetSlack(&statisticsTimer, StatisticsSlackMs);
+	LogicalTimer_SetSlack(&batchFlushTimer, BatchFlushSlackMs);
+	LogicalTimer_SetSlack(&azureTimer, AzurePollSlackMs);
+	LogicalTimer_SetSlack(&connectTask.timer, ReconnectSlackMs);
+
 	azureIoTPollPeriodSeconds = AzureIoTDefaultPollPeriodSeconds;
-	struct timespec azureTelemetryPeriod = { azureIoTPollPeriodSeconds, 0 };
-	azureTimerFd =
-		CreateTimerFdAndAddToEpoll(epollFd, &azureTelemetryPeriod, &azureEventData, EPOLLIN);
+	TimerWheel_StartPeriodic(&timerWheel, &azureTimer, (uint32_t)azureIoTPollPeriodSeconds * 1000);
+
+	MessageProperties_Init();
+	MessageProperties_RegisterNode(NODE_TRACKER, "Tracker");
+	MessageProperties_RegisterNode(NODE_SERVER, "Server");
+	MessageProperties_RegisterNode(NODE_ROOM, "Room");
+	MessageProperties_RegisterNode(NODE_OUTSIDE, "Outside");
+	MessageProperties_RegisterNode(NODE_DOOR, "Door");
+	// Started after the property sets are built, since the workers read them. Jobs run inline if
+	// the threads cannot be started.
+	WorkerPool_Start(&workerPool, WORKER_THREADS, epollFd);
+
+	BatchPacker_Init(&batchPacker, telemetryEncoder, BatchMessageSizeLimit, SendPackedMessage, NULL);
+	MessageShaper_Init(&messageShaper, &messageShaperConfig, SendTelemetryMessage, NULL,
+		GetMonotonicTimeMs());
+	TimerWheel_StartPeriodic(&timerWheel, &statisticsTimer,
+		(uint32_t)StatisticsReportPeriodSeconds * 1000);
+
+	LoadShedder_Init(&loadShedder, OutboundLowWatermark, OutboundHighWatermark, MaxMessagesInFlight);
+	// Sending starts paused, until there is a client
+	UpdateBackpressure();
+	EdgeAggregator_Init(&edgeAggregator, SendAggregate, NULL);
+	EdgeAggregator_SetRawThreshold(&edgeAggregator, NODE_SERVER, "ServerTemp", INT32_MIN,
+		ServerTemperatureAlarmThreshold);
+	ArmAggregationTimer();
+	// Connect as soon as the loop runs rather than on the first Azure tick. Readings from the
+	// UART are buffered until the connection is up.
+	WorkQueue_Post(&deferredWork, &connectWork);
 	/*if (buttonPollTimerFd < 0) {
 		Log_Debug("-1 RETURNED AT 380");
 		return -1;
@@ -695,13 +1608,19 @@ static void ClosePeripheralsAndHandlers(void)
 		GPIO_SetValue(deviceTwinStatusLedGpioFd, GPIO_Value_High);
 	}
 	CloseFdAndPrintError(buttonPollTimerFd, "ButtonTimer");
-	CloseFdAndPrintError(azureTimerFd, "AzureTimer");
+	WorkerPool_Stop(&workerPool, epollFd);
+	StallWatchdog_Stop();
+	AsyncTask_Cancel(&connectTask);
+	StopProvisioning();
+	cloudTransport->destroy();
+	TimerWheel_Close(&timerWheel);
 	CloseFdAndPrintError(sendMessageButtonGpioFd, "SendMessageButton");
 	CloseFdAndPrintError(sendOrientationButtonGpioFd, "SendOrientationButton");
 	CloseFdAndPrintError(deviceTwinStatusLedGpioFd, "StatusLed");
 	CloseFdAndPrintError(gpioButtonFd, "GpioButton");
 	CloseFdAndPrintError(uartFd, "Uart");
 	CloseFdAndPrintError(epollFd, "Epoll");
+	DeviceStorage_Close();
 }
 
 /// <summary>
@@ -714,26 +1633,126 @@ static void HubConnectionStatusCallback(IOTHUB_CLIENT_CONNECTION_STATUS result,
 {
 	iothubAuthenticated = (result == IOTHUB_CLIENT_CONNECTION_AUTHENTICATED);
 	Log_Debug("IoT Hub Authenticated: %s\n", GetReasonString(reason));
+
+	uint64_t nowMs = GetMonotonicTimeMs();
+	ConnectionState state = ConnectionStateMachine_GetState(&connection);
+	if (iothubAuthenticated) {
+		if (state != ConnectionState_Connected) {
+			ConnectionStateMachine_Connected(&connection, nowMs);
+		}
+		KeepaliveController_Connected(&keepalive, nowMs);
+		if (connectedToCachedHub) {
+			cachedHubConfirmed = true;
+		}
+		if (provisioningStatistics.firstConnectMs == 0) {
+			provisioningStatistics.firstConnectMs = GetStartupTimeMs();
+			Log_Debug("INFO: Connected to IoT Hub %u ms after start.\n",
+				provisioningStatistics.firstConnectMs);
+		}
+	} else if (state == ConnectionState_Connected) {
+		if ((int)reason >= 0 && (int)reason < CONNECTION_REASON_COUNT) {
+			disconnectReasons[reason]++;
+		}
+		// An idle mapping that expired shows up as a missed ping response or a broken socket.
+		bool idleTimeout = reason == IOTHUB_CLIENT_CONNECTION_NO_PING_RESPONSE ||
+			reason == IOTHUB_CLIENT_CONNECTION_COMMUNICATION_ERROR;
+		if (KeepaliveController_Disconnected(&keepalive, idleTimeout, nowMs)) {
+			Log_Debug("INFO: Keepalive lowered to %u s after an idle timeout.\n",
+				KeepaliveController_GetSeconds(&keepalive));
+			WorkQueue_Post(&deferredWork, &keepaliveSaveWork);
+		}
+		ConnectionFailure failure = ClassifyConnectionReason(reason);
+		// A cached hub that never accepted the device, or now rejects it, may no longer be the
+		// one DPS assigns, so the next attempt asks DPS again.
+		if (connectedToCachedHub && failure != ConnectionFailure_Network &&
+			(!cachedHubConfirmed || failure == ConnectionFailure_Auth)) {
+			useCachedHub = false;
+			provisioningStatistics.cacheFailures++;
+		}
+		uint32_t delayMs = ConnectionStateMachine_Fail(&connection, failure, nowMs);
+		Log_Debug("INFO: IoT Hub connection lost, reconnecting in %u ms.\n", delayMs);
+		// The client cannot be recreated from inside its own callback.
+		WorkQueue_Post(&deferredWork, &connectWork);
+	}
+	UpdateBackpressure();
 }
 
 /// <summary>
-///     Sets up the Azure IoT Hub connection (creates the iothubClientHandle)
-///     When the SAS Token for a device expires the connection needs to be recreated
-///     which is why this is not simply a one time call.
+///     Classifies the reason the IoT Hub client gave for losing its connection.
 /// </summary>
-
-char * EtherDATA_Message[100];
-
-static void ReceiveHubMessage(IOTHUB_CLIENT_CONFIRMATION_RESULT result, const unsigned char *payload, size_t payloadSize, void *userContextCallback)
+static ConnectionFailure ClassifyConnectionReason(IOTHUB_CLIENT_CONNECTION_STATUS_REASON reason)
 {
-	size_t nullTerminatedJsonSize = payloadSize + 1;
-	char *nullTerminatedJsonString = (char *)malloc(nullTerminatedJsonSize);
-	if (nullTerminatedJsonString == NULL) {
-		Log_Debug("ERROR: Could not allocate buffer for payload.\n");
-		abort();
+	switch (reason) {
+	case IOTHUB_CLIENT_CONNECTION_NO_NETWORK:
+		return ConnectionFailure_Network;
+	case IOTHUB_CLIENT_CONNECTION_BAD_CREDENTIAL:
+	case IOTHUB_CLIENT_CONNECTION_DEVICE_DISABLED:
+		return ConnectionFailure_Auth;
+	default:
+		return ConnectionFailure_Transient;
 	}
-	// Copy the provided buffer to a null terminated buffer.
-	memcpy(nullTerminatedJsonString, payload, payloadSize);
+}
+
+/// <summary>
+///     Classifies a failed DPS registration.
+/// </summary>
+static ConnectionFailure ClassifyProvisioningResult(PROV_DEVICE_RESULT result)
+{
+	switch (result) {
+	case PROV_DEVICE_RESULT_DEV_AUTH_ERROR:
+	case PROV_DEVICE_RESULT_KEY_ERROR:
+	case PROV_DEVICE_RESULT_UNAUTHORIZED:
+	case PROV_DEVICE_RESULT_DISABLED:
+		return ConnectionFailure_Auth;
+	default:
+		return ConnectionFailure_Transient;
+	}
+}
+
+/// <summary>
+///     Seeds the reconnect jitter from the sub-second parts of the clocks, which differ between
+///     devices even when a whole fleet restarts together.
+/// </summary>
+static uint32_t GetJitterSeed(void)
+{
+	struct timespec realtime;
+	struct timespec monotonic;
+	clock_gettime(CLOCK_REALTIME, &realtime);
+	clock_gettime(CLOCK_MONOTONIC, &monotonic);
+	return (uint32_t)realtime.tv_nsec ^ ((uint32_t)monotonic.tv_nsec << 7) ^
+		(uint32_t)realtime.tv_sec;
+}
+
+/// <summary>
+///     Starts the connect task unless the client is authenticated or the task is already running.
+///     Also run as deferred work after a lost connection.
+/// </summary>
+static void StartConnecting(WorkItem *item)
+{
+	if (!iothubAuthenticated && !AsyncTask_IsRunning(&connectTask)) {
+		AsyncTask_Start(&connectTask);
+	}
+}
+
+/// <summary>
+///     Sets up the Azure IoT Hub connection (creates the iothubClientHandle)
+///     When the SAS Token for a device expires the connection needs to be recreated
+///     which is why this is not simply a one time call.
+/// </summary>
+
+char * EtherDATA_Message[100];
+
+static int ReceiveHubMessage(const char *methodName, const unsigned char *payload, size_t payloadSize,
+	unsigned char **response, size_t *responseSize, void *userContextCallback)
+{
+	size_t nullTerminatedJsonSize = payloadSize + 1;
+	char *nullTerminatedJsonString = (char *)malloc(nullTerminatedJsonSize);
+	if (nullTerminatedJsonString == NULL) {
+		Log_Debug("ERROR: Could not allocate buffer for payload.\n");
+		abort();
+	}
+	// Copy the provided buffer to a null terminated buffer.
+	memcpy(nullTerminatedJsonString, payload, payloadSize);
 	// Add the null terminator at the end.
 	nullTerminatedJsonString[nullTerminatedJsonSize - 1] = 0;
 
@@ -764,61 +1783,372 @@ cleanup:
 	// Release the allocated memory.
 	json_value_free(rootProperties);
 	free(nullTerminatedJsonString);
+
+	static const char emptyResponse[] = "{}";
+	*responseSize = sizeof(emptyResponse) - 1;
+	*response = malloc(*responseSize);
+	if (*response == NULL) {
+		*responseSize = 0;
+		return 500;
+	}
+	memcpy(*response, emptyResponse, *responseSize);
+	return 200;
 }
 
-static void SetupAzureClient(void)
+/// <summary>
+///     Async task that connects to IoT Hub once the network is up, waiting between failed
+///     attempts for as long as the connection state machine says. Each attempt tries the cached
+///     hub first and falls back to DPS in the same attempt. DPS registration is polled from the
+///     event loop rather than blocking it. The task finishes when the client is authenticated.
+/// </summary>
+static int ConnectToAzureTask(AsyncTask *task)
 {
-	if (iothubClientHandle != NULL)
-		IoTHubDeviceClient_LL_Destroy(iothubClientHandle);
+	ASYNC_BEGIN(task);
+	while (!iothubAuthenticated) {
+		if (ConnectionStateMachine_GetState(&connection) == ConnectionState_BackingOff) {
+			ASYNC_SLEEP(task, ConnectionStateMachine_GetRetryDelayMs(&connection));
+		}
 
-	AZURE_SPHERE_PROV_RETURN_VALUE provResult =
-		IoTHubDeviceClient_LL_CreateWithAzureSphereDeviceAuthProvisioning(scopeId, 10000,
-			&iothubClientHandle);
-	Log_Debug("IoTHubDeviceClient_LL_CreateWithAzureSphereDeviceAuthProvisioning returned '%s'.\n",
-		getAzureSphereProvisioningResultString(provResult));
+		bool isNetworkReady = false;
+		if (Networking_IsNetworkingReady(&isNetworkReady) == -1) {
+			Log_Debug("Failed to get Network state\n");
+		}
+		if (!isNetworkReady) {
+			ConnectionStateMachine_WaitForNetwork(&connection, GetMonotonicTimeMs());
+			ASYNC_SLEEP(task, NetworkCheckPeriodMs);
+			continue;
+		}
 
-	if (provResult.result != AZURE_SPHERE_PROV_RESULT_OK) {
+		ConnectionStateMachine_StartAttempt(&connection, GetMonotonicTimeMs());
+		ConnectionFailure failure;
+		if (cloudTransport->localHostName != NULL) {
+			// A local stand-in needs no provisioning.
+			if (SetupAzureClient(cloudTransport->localHostName, cloudTransport->localDeviceId,
+				&failure) == 0) {
+				ConnectionStateMachine_Connected(&connection, GetMonotonicTimeMs());
+				break;
+			}
+		} else {
+			if (useCachedHub && LoadCachedHub()) {
+				if (SetupAzureClient(hubHostName, hubDeviceId, &failure) == 0) {
+					connectedToCachedHub = true;
+					cachedHubConfirmed = false;
+					provisioningStatistics.cachedConnects++;
+					ConnectionStateMachine_Connected(&connection, GetMonotonicTimeMs());
+					break;
+				}
+				useCachedHub = false;
+				provisioningStatistics.cacheFailures++;
+			}
 
-		// If we fail to connect, reduce the polling frequency, starting at
-		// AzureIoTMinReconnectPeriodSeconds and with a backoff up to
-		// AzureIoTMaxReconnectPeriodSeconds
-		if (azureIoTPollPeriodSeconds == AzureIoTDefaultPollPeriodSeconds) {
-			azureIoTPollPeriodSeconds = AzureIoTMinReconnectPeriodSeconds;
+			if (StartProvisioning() == 0) {
+				while (!provisioningDone &&
+					GetMonotonicTimeMs() - provisioningStartMs < DpsTimeoutMs) {
+					Prov_Device_LL_DoWork(provisioningHandle);
+					ASYNC_SLEEP(task, DpsPollPeriodMs);
+				}
+			}
+			if (FinishProvisioning(&failure) == 0 &&
+				SetupAzureClient(hubHostName, hubDeviceId, &failure) == 0) {
+				connectedToCachedHub = false;
+				ConnectionStateMachine_Connected(&connection, GetMonotonicTimeMs());
+				break;
+			}
+		}
+
+		uint32_t delayMs = ConnectionStateMachine_Fail(&connection, failure, GetMonotonicTimeMs());
+		if (ConnectionStateMachine_GetState(&connection) == ConnectionState_WaitingForNetwork) {
+			// The network looked ready but the attempt failed for want of it, so check again
+			// later rather than retrying within this dispatch.
+			Log_Debug("ERROR: failure to create IoTHub Handle - no network, will retry in %u ms.\n",
+				NetworkCheckPeriodMs);
+			ASYNC_SLEEP(task, NetworkCheckPeriodMs);
 		}
 		else {
-			azureIoTPollPeriodSeconds *= 2;
-			if (azureIoTPollPeriodSeconds > AzureIoTMaxReconnectPeriodSeconds) {
-				azureIoTPollPeriodSeconds = AzureIoTMaxReconnectPeriodSeconds;
-			}
+			Log_Debug("ERROR: failure to create IoTHub Handle - will retry in %u ms.\n", delayMs);
 		}
+	}
+	ASYNC_END(task);
+}
+
+/// <summary>
+///     Creates the connection to a hub through the cloud transport and registers its callbacks.
+/// </summary>
+/// <param name="hostName">Host name of the hub</param>
+/// <param name="deviceId">The device's ID on the hub</param>
+/// <param name="failure">Set to the kind of failure if the client could not be created</param>
+/// <returns>0 on success, or -1 if the client could not be created</returns>
+static int SetupAzureClient(const char *hostName, const char *deviceId, ConnectionFailure *failure)
+{
+	// Destroying the client completes every message it held.
+	cloudTransport->destroy();
+	messagesInFlight = 0;
+	UpdateBackpressure();
+
+	static const CloudTransportCallbacks callbacks = { .connectionStatus = HubConnectionStatusCallback,
+		.twinUpdate = TwinCallback, .method = ReceiveHubMessage, .context = NULL };
+	// The keepalive is fixed for the life of the client; ApplyRaisedKeepalive recreates the
+	// client when a longer one has been learned.
+	SelectKeepaliveNetwork();
+	uint32_t keepaliveSeconds = KeepaliveController_GetSeconds(&keepalive);
+	bool authFailure;
+	if (cloudTransport->create(hostName, deviceId, (int)keepaliveSeconds, &callbacks,
+		&authFailure) != 0) {
+		*failure = authFailure ? ConnectionFailure_Auth : ConnectionFailure_Transient;
+		return -1;
+	}
+	Log_Debug("Connecting to %s %s as %s, keepalive %u s\n", cloudTransport->name, hostName,
+		deviceId, keepaliveSeconds);
 
-		struct timespec azureTelemetryPeriod = { azureIoTPollPeriodSeconds, 0 };
-		SetTimerFdToPeriod(azureTimerFd, &azureTelemetryPeriod);
+	iothubAuthenticated = true;
+	ScheduleDoWork(0);
+	// The client queues messages until it has connected, so buffered readings are handed over now.
+	UpdateBackpressure();
+	return 0;
+}
+
+/// <summary>
+///     Loads the hub cached by the last DPS registration into hubHostName and hubDeviceId.
+/// </summary>
+/// <returns>true if a hub is cached for the current scope ID</returns>
+static bool LoadCachedHub(void)
+{
+	JSON_Object *root = DeviceStorage_GetRoot();
+	const char *cachedScopeId = json_object_dotget_string(root, "provisioning.scopeId");
+	const char *hostName = json_object_dotget_string(root, "provisioning.hostName");
+	const char *deviceId = json_object_dotget_string(root, "provisioning.deviceId");
+	if (cachedScopeId == NULL || hostName == NULL || deviceId == NULL ||
+		strcmp(cachedScopeId, scopeId) != 0 || strlen(hostName) >= sizeof(hubHostName) ||
+		strlen(deviceId) >= sizeof(hubDeviceId)) {
+		return false;
+	}
+	strcpy(hubHostName, hostName);
+	strcpy(hubDeviceId, deviceId);
+	return true;
+}
 
-		Log_Debug("ERROR: failure to create IoTHub Handle - will retry in %i seconds.\n",
-			azureIoTPollPeriodSeconds);
+/// <summary>
+///     Caches the hub DPS assigned, unless it is already cached, to spare the flash.
+/// </summary>
+static void SaveCachedHub(void)
+{
+	JSON_Object *root = DeviceStorage_GetRoot();
+	const char *cachedScopeId = json_object_dotget_string(root, "provisioning.scopeId");
+	const char *hostName = json_object_dotget_string(root, "provisioning.hostName");
+	const char *deviceId = json_object_dotget_string(root, "provisioning.deviceId");
+	if (cachedScopeId != NULL && hostName != NULL && deviceId != NULL &&
+		strcmp(cachedScopeId, scopeId) == 0 && strcmp(hostName, hubHostName) == 0 &&
+		strcmp(deviceId, hubDeviceId) == 0) {
 		return;
 	}
 
-	// Successfully connected, so make sure the polling frequency is back to the default
-	azureIoTPollPeriodSeconds = AzureIoTDefaultPollPeriodSeconds;
-	struct timespec azureTelemetryPeriod = { azureIoTPollPeriodSeconds, 0 };
-	SetTimerFdToPeriod(azureTimerFd, &azureTelemetryPeriod);
+	json_object_dotset_string(root, "provisioning.scopeId", scopeId);
+	json_object_dotset_string(root, "provisioning.hostName", hubHostName);
+	json_object_dotset_string(root, "provisioning.deviceId", hubDeviceId);
+	if (DeviceStorage_Save() != 0) {
+		Log_Debug("WARNING: Could not cache the IoT Hub assignment\n");
+	}
+}
 
-	iothubAuthenticated = true;
+/// <summary>
+///     Switches the keepalive controller to what has been learned on the current network, if the
+///     device has changed networks since the last connection.
+/// </summary>
+static void SelectKeepaliveNetwork(void)
+{
+	char network[KEEPALIVE_NETWORK_LENGTH] = "default";
+	WifiConfig_ConnectedNetwork wifiNetwork;
+	if (WifiConfig_GetCurrentNetwork(&wifiNetwork) == 0) {
+		for (size_t i = 0; i < wifiNetwork.ssidLength && i < WIFICONFIG_SSID_MAX_LENGTH; i++) {
+			snprintf(network + 2 * i, 3, "%02x", wifiNetwork.ssid[i]);
+		}
+	}
+	if (strcmp(network, keepaliveNetwork) == 0) {
+		return;
+	}
+	strcpy(keepaliveNetwork, network);
+
+	JSON_Object *learned = json_object_get_object(
+		json_object_get_object(DeviceStorage_GetRoot(), "keepalive"), keepaliveNetwork);
+	KeepaliveController_Restore(&keepalive, (uint32_t)json_object_get_number(learned, "seconds"),
+		(uint32_t)json_object_get_number(learned, "proven"),
+		(uint32_t)json_object_get_number(learned, "failed"));
+	Log_Debug("INFO: Keepalive for network %s is %u s.\n", keepaliveNetwork,
+		KeepaliveController_GetSeconds(&keepalive));
+}
 
-	if (IoTHubDeviceClient_LL_SetOption(iothubClientHandle, OPTION_KEEP_ALIVE,
-		&keepalivePeriodSeconds) != IOTHUB_CLIENT_OK) {
-		Log_Debug("ERROR: failure setting option \"%s\"\n", OPTION_KEEP_ALIVE);
+/// <summary>
+///     Recreates the client with the keepalive learned since it was created, once no telemetry
+///     is waiting to be sent or acknowledged. The client only takes its keepalive when it
+///     connects, so a link that never drops would otherwise keep the one it started with. As the
+///     keepalive converges by bisection, this costs a handful of reconnections per network.
+/// </summary>
+static void ApplyRaisedKeepalive(void)
+{
+	if (!KeepaliveController_IsRaisePending(&keepalive) || !IsIoTHubSendIdle() ||
+		messagesInFlight != 0 || messagesBeingBuilt != 0) {
 		return;
 	}
 
-	IoTHubDeviceClient_LL_SetDeviceMethodCallback(iothubClientHandle, ReceiveHubMessage, NULL);
-	//IoTHubDeviceClient_LL_DeviceMethodResponse(iothubClientHandle, HubConnectionStatusCallback, NULL, 1, 1);
+	uint64_t nowMs = GetMonotonicTimeMs();
+	KeepaliveController_Disconnected(&keepalive, false, nowMs);
+	Log_Debug("INFO: Reconnecting to raise the keepalive to %u s.\n",
+		KeepaliveController_GetSeconds(&keepalive));
+	bool local = cloudTransport->localHostName != NULL;
+	ConnectionFailure failure;
+	if (SetupAzureClient(local ? cloudTransport->localHostName : hubHostName,
+		local ? cloudTransport->localDeviceId : hubDeviceId, &failure) != 0) {
+		iothubAuthenticated = false;
+		uint32_t delayMs = ConnectionStateMachine_Fail(&connection, failure, nowMs);
+		Log_Debug("ERROR: failure to recreate IoTHub Handle - will retry in %u ms.\n", delayMs);
+		UpdateBackpressure();
+		StartConnecting(NULL);
+	}
+}
 
-	IoTHubDeviceClient_LL_SetDeviceTwinCallback(iothubClientHandle, TwinCallback, NULL);
-	IoTHubDeviceClient_LL_SetConnectionStatusCallback(iothubClientHandle,
-		HubConnectionStatusCallback, NULL);
+/// <summary>
+///     Deferred work: stores what the keepalive controller has learned on the current network.
+///     The most recently updated networks are kept, up to MaxKeepaliveNetworks.
+/// </summary>
+static void SaveKeepalive(WorkItem *item)
+{
+	JSON_Object *root = DeviceStorage_GetRoot();
+	JSON_Object *networks = json_object_get_object(root, "keepalive");
+	if (networks == NULL) {
+		json_object_set_value(root, "keepalive", json_value_init_object());
+		networks = json_object_get_object(root, "keepalive");
+	}
+	if (networks == NULL) {
+		return;
+	}
+
+	// Each network carries the sequence number of its last update, so the stalest can be found.
+	double latest = 0;
+	for (size_t i = 0; i < json_object_get_count(networks); i++) {
+		double updated = json_object_get_number(
+			json_object_get_object(networks, json_object_get_name(networks, i)), "updated");
+		latest = updated > latest ? updated : latest;
+	}
+	json_object_remove(networks, keepaliveNetwork);
+	while (json_object_get_count(networks) >= MaxKeepaliveNetworks) {
+		const char *stalest = NULL;
+		double stalestUpdated = 0;
+		for (size_t i = 0; i < json_object_get_count(networks); i++) {
+			const char *name = json_object_get_name(networks, i);
+			double updated =
+				json_object_get_number(json_object_get_object(networks, name), "updated");
+			if (stalest == NULL || updated < stalestUpdated) {
+				stalest = name;
+				stalestUpdated = updated;
+			}
+		}
+		json_object_remove(networks, stalest);
+	}
+	JSON_Value *learned = json_value_init_object();
+	JSON_Object *learnedObject = json_value_get_object(learned);
+	json_object_set_number(learnedObject, "updated", latest + 1);
+	json_object_set_number(learnedObject, "seconds", KeepaliveController_GetSeconds(&keepalive));
+	json_object_set_number(learnedObject, "proven", keepalive.provenSeconds);
+	json_object_set_number(learnedObject, "failed", keepalive.failedSeconds);
+	if (json_object_set_value(networks, keepaliveNetwork, learned) != JSONSuccess) {
+		json_value_free(learned);
+		return;
+	}
+	if (DeviceStorage_Save() != 0) {
+		Log_Debug("WARNING: Could not store the learned keepalive\n");
+	}
+}
+
+/// <summary>
+///     Called by Prov_Device_LL_DoWork when DPS registration finishes.
+/// </summary>
+static void ProvisioningRegisterCallback(PROV_DEVICE_RESULT result, const char *iothubUri,
+	const char *deviceId, void *context)
+{
+	provisioningResult = result;
+	if (result == PROV_DEVICE_RESULT_OK) {
+		if (iothubUri == NULL || deviceId == NULL || strlen(iothubUri) >= sizeof(hubHostName) ||
+			strlen(deviceId) >= sizeof(hubDeviceId)) {
+			provisioningResult = PROV_DEVICE_RESULT_PARSING;
+		} else {
+			strcpy(hubHostName, iothubUri);
+			strcpy(hubDeviceId, deviceId);
+		}
+	}
+	provisioningDone = true;
+}
+
+/// <summary>
+///     Starts registering with DPS. The caller polls Prov_Device_LL_DoWork until
+///     provisioningDone is set or DpsTimeoutMs has passed, then calls FinishProvisioning.
+/// </summary>
+/// <returns>0 on success, or -1 if registration could not be started</returns>
+static int StartProvisioning(void)
+{
+	provisioningDone = false;
+	provisioningStartMs = GetMonotonicTimeMs();
+
+	if (prov_dev_security_init(SECURE_DEVICE_TYPE_X509) != 0) {
+		Log_Debug("ERROR: Could not initialize DPS security\n");
+		return -1;
+	}
+	provisioningHandle = Prov_Device_LL_Create(DpsEndpoint, scopeId, Prov_Device_MQTT_Protocol);
+	if (provisioningHandle == NULL) {
+		Log_Debug("ERROR: Could not create the DPS client\n");
+		prov_dev_security_deinit();
+		return -1;
+	}
+	if (Prov_Device_LL_SetOption(provisioningHandle, "SetDeviceId", &deviceIdForDaaCertUsage) !=
+		PROV_DEVICE_RESULT_OK ||
+		Prov_Device_LL_Register_Device(provisioningHandle, ProvisioningRegisterCallback, NULL,
+			NULL, NULL) != PROV_DEVICE_RESULT_OK) {
+		Log_Debug("ERROR: Could not start DPS registration\n");
+		StopProvisioning();
+		return -1;
+	}
+	return 0;
+}
+
+/// <summary>
+///     Releases the DPS client, if there is one.
+/// </summary>
+static void StopProvisioning(void)
+{
+	if (provisioningHandle != NULL) {
+		Prov_Device_LL_Destroy(provisioningHandle);
+		provisioningHandle = NULL;
+		prov_dev_security_deinit();
+	}
+}
+
+/// <summary>
+///     Releases the DPS client and, if registration succeeded, caches the assigned hub.
+/// </summary>
+/// <param name="failure">Set to the kind of failure if registration did not succeed</param>
+/// <returns>0 on success, with the hub in hubHostName and hubDeviceId, or -1 on failure</returns>
+static int FinishProvisioning(ConnectionFailure *failure)
+{
+	StopProvisioning();
+	provisioningStatistics.lastDpsMs = (uint32_t)(GetMonotonicTimeMs() - provisioningStartMs);
+
+	if (!provisioningDone || provisioningResult != PROV_DEVICE_RESULT_OK) {
+		if (provisioningDone) {
+			Log_Debug("ERROR: DPS registration failed: %d\n", provisioningResult);
+			*failure = ClassifyProvisioningResult(provisioningResult);
+		} else {
+			Log_Debug("ERROR: DPS registration did not finish\n");
+			*failure = ConnectionFailure_Transient;
+		}
+		provisioningStatistics.dpsFailures++;
+		return -1;
+	}
+
+	Log_Debug("DPS assigned IoT Hub %s after %u ms\n", hubHostName,
+		provisioningStatistics.lastDpsMs);
+	provisioningStatistics.dpsRegistrations++;
+	SaveCachedHub();
+	useCachedHub = true;
+	return 0;
 }
 
 
@@ -864,6 +2194,84 @@ static void TwinCallback(DEVICE_TWIN_UPDATE_STATE updateState, const unsigned ch
 		TwinReportBoolState("StatusLED", statusLedOn);
 	}
 
+	JSON_Object *EncodingState = json_object_dotget_object(desiredProperties, "TelemetryEncoding");
+	if (EncodingState != NULL) {
+		const char *encodingName = json_object_get_string(EncodingState, "value");
+		const TelemetryEncoder *encoder =
+			encodingName != NULL ? GetTelemetryEncoderByName(encodingName) : NULL;
+		if (encoder != NULL) {
+			telemetryEncoder = encoder;
+			BatchPacker_SetEncoder(&batchPacker, telemetryEncoder);
+			Log_Debug("INFO: Telemetry encoding set to '%s'.\n", telemetryEncoder->name);
+		}
+		else {
+			Log_Debug("WARNING: Unknown telemetry encoding '%s'.\n",
+				encodingName != NULL ? encodingName : "(null)");
+		}
+	}
+
+	JSON_Object *BatchingState = json_object_dotget_object(desiredProperties, "TelemetryBatching");
+	if (BatchingState != NULL) {
+		int batching = json_object_get_boolean(BatchingState, "value");
+		if (batching == 0 || batching == 1) {
+			BatchPacker_SetBatching(&batchPacker, batching == 1);
+			Log_Debug("INFO: Telemetry batching %s.\n", batching == 1 ? "on" : "off");
+			TwinReportBoolState("TelemetryBatching", batching == 1);
+		}
+	}
+
+	JSON_Object *HistogramsState = json_object_dotget_object(desiredProperties, "HandlerHistograms");
+	if (HistogramsState != NULL) {
+		int histograms = json_object_get_boolean(HistogramsState, "value");
+		if (histograms == 0 || histograms == 1) {
+			dumpHandlerHistograms = histograms == 1;
+			TwinReportBoolState("HandlerHistograms", dumpHandlerHistograms);
+		}
+	}
+
+	JSON_Object *PolicyState = json_object_dotget_object(desiredProperties, "MessageShaperPolicy");
+	if (PolicyState != NULL) {
+		const char *policyName = json_object_get_string(PolicyState, "value");
+		MessageShaperPolicy policy;
+		if (policyName != NULL && MessageShaper_ParsePolicy(policyName, &policy) == 0) {
+			MessageShaper_SetPolicy(&messageShaper, policy);
+			Log_Debug("INFO: Message shaper policy set to '%s'.\n", policyName);
+		}
+		else {
+			Log_Debug("WARNING: Unknown message shaper policy '%s'.\n",
+				policyName != NULL ? policyName : "(null)");
+		}
+	}
+
+	JSON_Object *LowPowerState = json_object_dotget_object(desiredProperties, "LowPowerMode");
+	if (LowPowerState != NULL) {
+		// parson returns -1 for a missing or non-boolean value, which must not count as true.
+		int lowPower = json_object_get_boolean(LowPowerState, "value");
+		if (lowPower == 0 || lowPower == 1) {
+			SetLowPowerMode(lowPower == 1);
+			Log_Debug("INFO: Low-power mode %s.\n", lowPowerMode ? "on" : "off");
+			TwinReportBoolState("LowPowerMode", lowPowerMode);
+		}
+		else {
+			Log_Debug("WARNING: LowPowerMode must be true or false.\n");
+		}
+	}
+
+	JSON_Object *WindowState = json_object_dotget_object(desiredProperties, "AggregationWindowSeconds");
+	if (WindowState != NULL) {
+		JSON_Value *windowValue = json_object_get_value(WindowState, "value");
+		double windowSeconds = json_value_get_number(windowValue);
+		if (json_value_get_type(windowValue) == JSONNumber && windowSeconds >= 0 &&
+			windowSeconds <= MaxAggregationWindowSeconds) {
+			SetAggregationWindow((int)windowSeconds);
+			Log_Debug("INFO: Aggregation window set to %d seconds.\n", aggregationWindowSeconds);
+		}
+		else {
+			Log_Debug("WARNING: AggregationWindowSeconds must be a number from 0 to %d.\n",
+				MaxAggregationWindowSeconds);
+		}
+	}
+
 	JSON_Object *HUBState = json_object_dotget_object(desiredProperties, "office_LED");
 	if (HUBState != NULL) {
 		char hub_code[10] = "";
@@ -910,7 +2318,7 @@ cleanup:
 /// </summary>
 static const char *GetReasonString(IOTHUB_CLIENT_CONNECTION_STATUS_REASON reason)
 {
-	static char *reasonString = "unknown reason";
+	const char *reasonString = "unknown reason";
 	switch (reason) {
 	case IOTHUB_CLIENT_CONNECTION_EXPIRED_SAS_TOKEN:
 		reasonString = "IOTHUB_CLIENT_CONNECTION_EXPIRED_SAS_TOKEN";
@@ -933,514 +2341,282 @@ static const char *GetReasonString(IOTHUB_CLIENT_CONNECTION_STATUS_REASON reason
 	case IOTHUB_CLIENT_CONNECTION_OK:
 		reasonString = "IOTHUB_CLIENT_CONNECTION_OK";
 		break;
+	case IOTHUB_CLIENT_CONNECTION_NO_PING_RESPONSE:
+		reasonString = "IOTHUB_CLIENT_CONNECTION_NO_PING_RESPONSE";
+		break;
 	}
 	return reasonString;
 }
 
 /// <summary>
-///     Converts AZURE_SPHERE_PROV_RETURN_VALUE to a string.
+///     Adds a telemetry message released by the message shaper to the batch for its class, and
+///     starts the batching window if it opened a new batch. This is the message shaper's send
+///     function.
 /// </summary>
-static const char *getAzureSphereProvisioningResultString(
-	AZURE_SPHERE_PROV_RETURN_VALUE provisioningResult)
+/// <param name="message">The message to send</param>
+/// <param name="context">Unused</param>
+/// <returns>0 on success, or -1 on failure</returns>
+static int SendTelemetryMessage(const TelemetryMessage *message, void *context)
 {
-	switch (provisioningResult.result) {
-	case AZURE_SPHERE_PROV_RESULT_OK:
-		return "AZURE_SPHERE_PROV_RESULT_OK";
-	case AZURE_SPHERE_PROV_RESULT_INVALID_PARAM:
-		return "AZURE_SPHERE_PROV_RESULT_INVALID_PARAM";
-	case AZURE_SPHERE_PROV_RESULT_NETWORK_NOT_READY:
-		return "AZURE_SPHERE_PROV_RESULT_NETWORK_NOT_READY";
-	case AZURE_SPHERE_PROV_RESULT_DEVICEAUTH_NOT_READY:
-		return "AZURE_SPHERE_PROV_RESULT_DEVICEAUTH_NOT_READY";
-	case AZURE_SPHERE_PROV_RESULT_PROV_DEVICE_ERROR:
-		return "AZURE_SPHERE_PROV_RESULT_PROV_DEVICE_ERROR";
-	case AZURE_SPHERE_PROV_RESULT_GENERIC_ERROR:
-		return "AZURE_SPHERE_PROV_RESULT_GENERIC_ERROR";
-	default:
-		return "UNKNOWN_RETURN_VALUE";
+	bool batchWasOpen = BatchPacker_HasOpenBatch(&batchPacker);
+	int result = BatchPacker_Append(&batchPacker, message);
+	if (result < 0) {
+		Log_Debug("WARNING: telemetry message does not fit in the message size limit\n");
+		return -1;
+	}
+
+	if (!batchWasOpen && BatchPacker_HasOpenBatch(&batchPacker)) {
+		TimerWheel_StartOneShot(&timerWheel, &batchFlushTimer, BatchWindowMs);
 	}
+	// A record that joined an open batch adds no hub message, so the shaper does not charge it.
+	return result == 1 ? MESSAGE_SHAPER_SEND_JOINED : 0;
 }
 
 /// <summary>
-///     Sends telemetry to IoT Hub
+///     Sends a closed batch to IoT Hub, with the node's routing properties and the encoder's
+///     content type.
 /// </summary>
-/// <param name="key">The telemetry item to update</param>
-/// <param name="value">new telemetry value</param>
-
-
-
-static void SendDoorState(const unsigned char *value)
+/// <param name="message">The packed message body and its routing information</param>
+/// <param name="context">Unused</param>
+static void SendPackedMessage(const PackedMessage *message, void *context)
 {
-	//Log_Debug("MY CHOPPED UP ROOMTEMP IS: %s%s%s%s", (char *)value1, (char *)value2, (char *)value3, (char *)value4);
-	static char eventBuffer[100] = { 0 };
-	static const char *EventMsgTemplate = "{ \"DoorState\": \"%s\"}";
-	int len = snprintf(eventBuffer, sizeof(eventBuffer), EventMsgTemplate, value);
-	//int len = snprintf(eventBuffer, sizeof(eventBuffer), EventMsgTemplate, value);
-	if (len < 0)
-		return;
-
-	//Log_Debug("Sending IoT Hub Message: %s\n", eventBuffer);
-
-	IOTHUB_MESSAGE_HANDLE messageHandle = IoTHubMessage_CreateFromString(eventBuffer);
-
-	if (messageHandle == 0) {
-		Log_Debug("WARNING: unable to create a new IoTHubMessage\n");
+	// The batch storage is reused as soon as this returns, so the job takes a copy of the body.
+	MessageBuildJob *build = malloc(sizeof(*build) + message->length);
+	if (build == NULL) {
+		Log_Debug("WARNING: unable to allocate a message build job\n");
+		MessageShaper_CountSendFailure(&messageShaper);
 		return;
 	}
-
-	if (IoTHubDeviceClient_LL_SendEventAsync(iothubClientHandle, messageHandle, SendMessageCallback,
-		/*&callback_param*/ 0) != IOTHUB_CLIENT_OK) {
-		Log_Debug("WARNING: failed to hand over the message to IoTHubClient\n");
-	}
-	else {
-		//	Log_Debug("INFO: IoTHubClient accepted the message for delivery\n");
-	}
-
-	IoTHubMessage_Destroy(messageHandle);
+	memcpy(build->body, message->body, message->length);
+	build->message = *message;
+	build->message.body = build->body;
+	build->encoder = batchPacker.encoder;
+	build->messageHandle = NULL;
+	build->job.run = BuildPackedMessage;
+	build->job.complete = SendBuiltMessage;
+	build->job.context = build;
+
+	messagesBeingBuilt++;
+	// One worker per class keeps each class's batches in order.
+	WorkerPool_Submit(&workerPool, &build->job, (unsigned int)message->telemetryClass);
 }
 
-static void SendInOffice(const unsigned char *value)
+/// <summary>
+///     Worker job: creates the IoT Hub message for a closed batch and sets its properties. Does
+///     not touch the client, which belongs to the main thread.
+/// </summary>
+static void BuildPackedMessage(WorkerJob *job)
 {
-	static char eventBuffer[100] = { 0 };
-	static const char *EventMsgTemplate = "{ \"inOffice\": \"1\"}";
-	int len = snprintf(eventBuffer, sizeof(eventBuffer), EventMsgTemplate);
-	//int len = snprintf(eventBuffer, sizeof(eventBuffer), EventMsgTemplate, value);
-	if (len < 0)
-		return;
-	//Log_Debug("Sending IoT Hub Message: %s\n", eventBuffer);
-	IOTHUB_MESSAGE_HANDLE messageHandle = IoTHubMessage_CreateFromString(eventBuffer);
+	MessageBuildJob *build = job->context;
+	build->messageHandle = IoTHubMessage_CreateFromByteArray(build->body, build->message.length);
 
-	if (messageHandle == 0) {
+	if (build->messageHandle == 0) {
 		Log_Debug("WARNING: unable to create a new IoTHubMessage\n");
 		return;
 	}
 
-	if (IoTHubDeviceClient_LL_SendEventAsync(iothubClientHandle, messageHandle, SendMessageCallback,
-		/*&callback_param*/ 0) != IOTHUB_CLIENT_OK) {
-		Log_Debug("WARNING: failed to hand over the message to IoTHubClient\n");
+	if (MessageProperties_Apply(build->messageHandle, build->message.node,
+		build->message.telemetryClass, build->message.priority, build->encoder) != 0) {
+		Log_Debug("WARNING: unable to set message properties\n");
 	}
-	else {
-		//	Log_Debug("INFO: IoTHubClient accepted the message for delivery\n");
-	}
-
-	IoTHubMessage_Destroy(messageHandle);
 }
 
-static void SendDoorBattery(const unsigned char *value)
+/// <summary>
+///     Completes a message build job on the main thread by handing the message to the client.
+/// </summary>
+static void SendBuiltMessage(WorkerJob *job)
 {
-	//Log_Debug("MY CHOPPED UP ROOMTEMP IS: %s%s%s%s", (char *)value1, (char *)value2, (char *)value3, (char *)value4);
-	static char eventBuffer[100] = { 0 };
-	static const char *EventMsgTemplate = "{ \"DoorBat\": \"%s\"}";
-	//int len = snprintf(eventBuffer, sizeof(eventBuffer), EventMsgTemplate);
-	int len = snprintf(eventBuffer, sizeof(eventBuffer), EventMsgTemplate, value);
-	if (len < 0)
-		return;
+	MessageBuildJob *build = job->context;
+	messagesBeingBuilt--;
 
-	//Log_Debug("Sending IoT Hub Message: %s\n", eventBuffer);
-
-	IOTHUB_MESSAGE_HANDLE messageHandle = IoTHubMessage_CreateFromString(eventBuffer);
-
-	if (messageHandle == 0) {
-		Log_Debug("WARNING: unable to create a new IoTHubMessage\n");
-		return;
-	}
-
-	if (IoTHubDeviceClient_LL_SendEventAsync(iothubClientHandle, messageHandle, SendMessageCallback,
-		/*&callback_param*/ 0) != IOTHUB_CLIENT_OK) {
-		Log_Debug("WARNING: failed to hand over the message to IoTHubClient\n");
+	if (build->messageHandle == 0) {
+		MessageShaper_CountSendFailure(&messageShaper);
 	}
 	else {
-		//	Log_Debug("INFO: IoTHubClient accepted the message for delivery\n");
+		bool wasIdle = IsIoTHubSendIdle();
+		if (cloudTransport->sendEvent(build->messageHandle, SendMessageCallback,
+			/*&callback_param*/ 0) != 0) {
+			Log_Debug("WARNING: failed to hand over the message to IoTHubClient\n");
+			MessageShaper_CountSendFailure(&messageShaper);
+		}
+		else {
+			//	Log_Debug("INFO: IoTHubClient accepted the message for delivery\n");
+			if (wasIdle) {
+				ScheduleDoWork(0);
+			}
+			messagesInFlight++;
+		}
+
+		IoTHubMessage_Destroy(build->messageHandle);
 	}
 
-	IoTHubMessage_Destroy(messageHandle);
+	free(build);
+	UpdateBackpressure();
 }
 
-static void SendTrackerBattery(const unsigned char *value)
+/// <summary>
+///     Sends the given fields to IoT Hub as a single message, subject to the message shaper.
+/// </summary>
+/// <param name="node">Index of the mesh node the values came from, or TELEMETRY_NODE_GATEWAY</param>
+/// <param name="priority">Priority used if the message has to be delayed or dropped</param>
+/// <param name="telemetryClass">Kind of data, reported as the metricClass property</param>
+/// <param name="keys">The telemetry items to update</param>
+/// <param name="values">New telemetry values, as text from the UART parser</param>
+/// <param name="count">Number of key/value pairs</param>
+static void SendTelemetryFields(int node, MessagePriority priority, TelemetryClass telemetryClass,
+	const char *const keys[], const char *const values[], size_t count)
 {
-	static char eventBuffer[100] = { 0 };
-	static const char *EventMsgTemplate = "{ \"TrackerBat\": \"%s\"}";
-	//int len = snprintf(eventBuffer, sizeof(eventBuffer), EventMsgTemplate);
-	int len = snprintf(eventBuffer, sizeof(eventBuffer), EventMsgTemplate, value);
-	if (len < 0)
-		return;
-
-	//Log_Debug("Sending IoT Hub Message: %s\n", eventBuffer);
+	TelemetryMessage message;
+	TelemetryMessage_Init(&message, node, priority, telemetryClass, keys, values, count);
+	MessageShaper_Submit(&messageShaper, &message, GetMonotonicTimeMs());
+	ScheduleShaperTimer();
+	UpdateBackpressure();
+}
 
-	IOTHUB_MESSAGE_HANDLE messageHandle = IoTHubMessage_CreateFromString(eventBuffer);
+/// <summary>
+///     Sends a single telemetry value to IoT Hub
+/// </summary>
+/// <param name="node">Index of the mesh node the value came from</param>
+/// <param name="priority">Priority used if the message has to be delayed or dropped</param>
+/// <param name="telemetryClass">Kind of data, reported as the metricClass property</param>
+/// <param name="key">The telemetry item to update</param>
+/// <param name="value">new telemetry value</param>
+static void SendTelemetryField(int node, MessagePriority priority, TelemetryClass telemetryClass,
+	const char *key, const unsigned char *value)
+{
+	const char *keys[] = { key };
+	const char *values[] = { (const char *)value };
+	SendTelemetryFields(node, priority, telemetryClass, keys, values, 1);
+}
 
-	if (messageHandle == 0) {
-		Log_Debug("WARNING: unable to create a new IoTHubMessage\n");
+/// <summary>
+///     Sends a numeric sensor reading, either by adding it to the current aggregation window or,
+///     if aggregation is off or the value cannot be aggregated, directly. While the outbound
+///     backlog is under pressure the load shedder may aggregate or drop it instead.
+/// </summary>
+/// <param name="node">Index of the mesh node the value came from</param>
+/// <param name="priority">Priority used if the message has to be delayed or dropped</param>
+/// <param name="telemetryClass">Kind of data, reported as the metricClass property</param>
+/// <param name="key">The telemetry item to update</param>
+/// <param name="value">new telemetry value</param>
+static void SendSensorReading(int node, MessagePriority priority, TelemetryClass telemetryClass,
+	const char *key, const unsigned char *value)
+{
+	bool aggregate = aggregationWindowSeconds > 0;
+	switch (LoadShedder_Decide(&loadShedder, telemetryClass, priority)) {
+	case LoadShedDecision_Drop:
 		return;
+	case LoadShedDecision_Aggregate:
+		aggregate = true;
+		break;
+	default:
+		break;
 	}
 
-	if (IoTHubDeviceClient_LL_SendEventAsync(iothubClientHandle, messageHandle, SendMessageCallback,
-		/*&callback_param*/ 0) != IOTHUB_CLIENT_OK) {
-		Log_Debug("WARNING: failed to hand over the message to IoTHubClient\n");
-	}
-	else {
-		//	Log_Debug("INFO: IoTHubClient accepted the message for delivery\n");
+	if (aggregate &&
+		EdgeAggregator_AddReading(&edgeAggregator, node, priority, telemetryClass, key,
+			(const char *)value) == 0) {
+		return;
 	}
-
-	IoTHubMessage_Destroy(messageHandle);
+	SendTelemetryField(node, priority, telemetryClass, key, value);
 }
 
-static void SendOutsideBattery(const unsigned char *value)
+/// <summary>
+///     Sends a window summary or threshold sample produced by the edge aggregator.
+/// </summary>
+static void SendAggregate(int node, MessagePriority priority, TelemetryClass telemetryClass,
+	const char *const keys[], const char *const values[], size_t count, void *context)
 {
-	static char eventBuffer[100] = { 0 };
-	static const char *EventMsgTemplate = "{ \"OutsideBat\": \"%s\"}";
-	int len = snprintf(eventBuffer, sizeof(eventBuffer), EventMsgTemplate, value);
-	if (len < 0)
-		return;
+	SendTelemetryFields(node, priority, telemetryClass, keys, values, count);
+}
 
+static void SendDoorState(const unsigned char *value)
+{
+	SendTelemetryField(NODE_DOOR, MessagePriority_High, TelemetryClass_Event, "DoorState", value);
+}
 
-	IOTHUB_MESSAGE_HANDLE messageHandle = IoTHubMessage_CreateFromString(eventBuffer);
+static void SendInOffice(const unsigned char *value)
+{
+	SendTelemetryField(NODE_TRACKER, MessagePriority_Normal, TelemetryClass_Event, "inOffice",
+		(const unsigned char *)"1");
+}
 
-	if (messageHandle == 0) {
-		Log_Debug("WARNING: unable to create a new IoTHubMessage\n");
-		return;
-	}
+static void SendDoorBattery(const unsigned char *value)
+{
+	SendSensorReading(NODE_DOOR, MessagePriority_Low, TelemetryClass_Battery, "DoorBat", value);
+}
 
-	if (IoTHubDeviceClient_LL_SendEventAsync(iothubClientHandle, messageHandle, SendMessageCallback,
-		/*&callback_param*/ 0) != IOTHUB_CLIENT_OK) {
-		Log_Debug("WARNING: failed to hand over the message to IoTHubClient\n");
-	}
-	else {
-			Log_Debug("INFO: IoTHubClient accepted the message for delivery\n");
-	}
+static void SendTrackerBattery(const unsigned char *value)
+{
+	SendSensorReading(NODE_TRACKER, MessagePriority_Low, TelemetryClass_Battery, "TrackerBat", value);
+}
 
-	IoTHubMessage_Destroy(messageHandle);
+static void SendOutsideBattery(const unsigned char *value)
+{
+	SendSensorReading(NODE_OUTSIDE, MessagePriority_Low, TelemetryClass_Battery, "OutsideBat", value);
 }
 
 static void SendServerBattery(const unsigned char *value)
 {
-	static char eventBuffer[100] = { 0 };
-	static const char *EventMsgTemplate = "{ \"ServerBat\": \"%s\"}";
-	int len = snprintf(eventBuffer, sizeof(eventBuffer), EventMsgTemplate, value);
-	if (len < 0)
-		return;
-
-
-	IOTHUB_MESSAGE_HANDLE messageHandle = IoTHubMessage_CreateFromString(eventBuffer);
-
-	if (messageHandle == 0) {
-		Log_Debug("WARNING: unable to create a new IoTHubMessage\n");
-		return;
-	}
-
-	if (IoTHubDeviceClient_LL_SendEventAsync(iothubClientHandle, messageHandle, SendMessageCallback,
-		/*&callback_param*/ 0) != IOTHUB_CLIENT_OK) {
-		Log_Debug("WARNING: failed to hand over the message to IoTHubClient\n");
-	}
-	else {
-	}
-
-	IoTHubMessage_Destroy(messageHandle);
+	SendSensorReading(NODE_SERVER, MessagePriority_Low, TelemetryClass_Battery, "ServerBat", value);
 }
 
 static void SendRoomBattery(const unsigned char *value)
 {
-	static char eventBuffer[100] = { 0 };
-	static const char *EventMsgTemplate = "{ \"RoomBat\": \"%s\"}";
-	//int len = snprintf(eventBuffer, sizeof(eventBuffer), EventMsgTemplate);
-	int len = snprintf(eventBuffer, sizeof(eventBuffer), EventMsgTemplate, value);
-	if (len < 0)
-		return;
-
-
-	IOTHUB_MESSAGE_HANDLE messageHandle = IoTHubMessage_CreateFromString(eventBuffer);
-
-	if (messageHandle == 0) {
-		Log_Debug("WARNING: unable to create a new IoTHubMessage\n");
-		return;
-	}
-
-	if (IoTHubDeviceClient_LL_SendEventAsync(iothubClientHandle, messageHandle, SendMessageCallback,
-		/*&callback_param*/ 0) != IOTHUB_CLIENT_OK) {
-		Log_Debug("WARNING: failed to hand over the message to IoTHubClient\n");
-	}
-	else {
-		//	Log_Debug("INFO: IoTHubClient accepted the message for delivery\n");
-	}
-
-	IoTHubMessage_Destroy(messageHandle);
+	SendSensorReading(NODE_ROOM, MessagePriority_Low, TelemetryClass_Battery, "RoomBat", value);
 }
 
-
 static void SendOutsidePressure(const unsigned char *value)
 {
-	static char eventBuffer[100] = { 0 };
-	static const char *EventMsgTemplate = "{ \"OutsidePres\": \"%s\"}";
-	int len = snprintf(eventBuffer, sizeof(eventBuffer), EventMsgTemplate, value);
-	if (len < 0)
-		return;
-
-
-	IOTHUB_MESSAGE_HANDLE messageHandle = IoTHubMessage_CreateFromString(eventBuffer);
-
-	if (messageHandle == 0) {
-		Log_Debug("WARNING: unable to create a new IoTHubMessage\n");
-		return;
-	}
-
-	if (IoTHubDeviceClient_LL_SendEventAsync(iothubClientHandle, messageHandle, SendMessageCallback,
-		/*&callback_param*/ 0) != IOTHUB_CLIENT_OK) {
-		Log_Debug("WARNING: failed to hand over the message to IoTHubClient\n");
-	}
-	else {
-	}
-
-	IoTHubMessage_Destroy(messageHandle);
+	SendSensorReading(NODE_OUTSIDE, MessagePriority_Normal, TelemetryClass_Environment, "OutsidePres", value);
 }
 
 static void SendServerPressure(const unsigned char *value)
 {
-	static char eventBuffer[100] = { 0 };
-	static const char *EventMsgTemplate = "{ \"ServerPres\": \"%s\"}";
-	int len = snprintf(eventBuffer, sizeof(eventBuffer), EventMsgTemplate, value);
-	if (len < 0)
-		return;
-
-
-	IOTHUB_MESSAGE_HANDLE messageHandle = IoTHubMessage_CreateFromString(eventBuffer);
-
-	if (messageHandle == 0) {
-		Log_Debug("WARNING: unable to create a new IoTHubMessage\n");
-		return;
-	}
-
-	if (IoTHubDeviceClient_LL_SendEventAsync(iothubClientHandle, messageHandle, SendMessageCallback,
-		/*&callback_param*/ 0) != IOTHUB_CLIENT_OK) {
-		Log_Debug("WARNING: failed to hand over the message to IoTHubClient\n");
-	}
-	else {
-	}
-
-	IoTHubMessage_Destroy(messageHandle);
+	SendSensorReading(NODE_SERVER, MessagePriority_Normal, TelemetryClass_Environment, "ServerPres", value);
 }
 
 static void SendRoomPressure(const unsigned char *value)
 {
-	static char eventBuffer[100] = { 0 };
-	static const char *EventMsgTemplate = "{ \"RoomPres\": \"%s\"}";
-	int len = snprintf(eventBuffer, sizeof(eventBuffer), EventMsgTemplate, value);
-	if (len < 0)
-		return;
-
-
-	IOTHUB_MESSAGE_HANDLE messageHandle = IoTHubMessage_CreateFromString(eventBuffer);
-
-	if (messageHandle == 0) {
-		Log_Debug("WARNING: unable to create a new IoTHubMessage\n");
-		return;
-	}
-
-	if (IoTHubDeviceClient_LL_SendEventAsync(iothubClientHandle, messageHandle, SendMessageCallback,
-		/*&callback_param*/ 0) != IOTHUB_CLIENT_OK) {
-		Log_Debug("WARNING: failed to hand over the message to IoTHubClient\n");
-	}
-	else {
-		//	Log_Debug("INFO: IoTHubClient accepted the message for delivery\n");
-	}
-
-	IoTHubMessage_Destroy(messageHandle);
+	SendSensorReading(NODE_ROOM, MessagePriority_Normal, TelemetryClass_Environment, "RoomPres", value);
 }
 
 static void SendOutsideHumidity(const unsigned char *value)
 {
-
-	static char eventBuffer[100] = { 0 };
-	static const char *EventMsgTemplate = "{ \"OutsideHumi\": \"%s\"}";
-	int len = snprintf(eventBuffer, sizeof(eventBuffer), EventMsgTemplate, value);
-	if (len < 0)
-		return;
-
-	//Log_Debug("Sending IoT Hub Message: %s\n", eventBuffer);
-
-	IOTHUB_MESSAGE_HANDLE messageHandle = IoTHubMessage_CreateFromString(eventBuffer);
-
-	if (messageHandle == 0) {
-		Log_Debug("WARNING: unable to create a new IoTHubMessage\n");
-		return;
-	}
-
-	if (IoTHubDeviceClient_LL_SendEventAsync(iothubClientHandle, messageHandle, SendMessageCallback,
-		/*&callback_param*/ 0) != IOTHUB_CLIENT_OK) {
-		Log_Debug("WARNING: failed to hand over the message to IoTHubClient\n");
-	}
-	else {
-	}
-
-	IoTHubMessage_Destroy(messageHandle);
+	SendSensorReading(NODE_OUTSIDE, MessagePriority_Normal, TelemetryClass_Environment, "OutsideHumi", value);
 }
 
 static void SendServerHumidity(const unsigned char *value)
 {
-
-	static char eventBuffer[100] = { 0 };
-	static const char *EventMsgTemplate = "{ \"ServerHumi\": \"%s\"}";
-	int len = snprintf(eventBuffer, sizeof(eventBuffer), EventMsgTemplate, value);
-	if (len < 0)
-		return;
-
-
-	IOTHUB_MESSAGE_HANDLE messageHandle = IoTHubMessage_CreateFromString(eventBuffer);
-
-	if (messageHandle == 0) {
-		Log_Debug("WARNING: unable to create a new IoTHubMessage\n");
-		return;
-	}
-
-	if (IoTHubDeviceClient_LL_SendEventAsync(iothubClientHandle, messageHandle, SendMessageCallback,
-		/*&callback_param*/ 0) != IOTHUB_CLIENT_OK) {
-		Log_Debug("WARNING: failed to hand over the message to IoTHubClient\n");
-	}
-	else {
-	}
-
-	IoTHubMessage_Destroy(messageHandle);
+	SendSensorReading(NODE_SERVER, MessagePriority_Normal, TelemetryClass_Environment, "ServerHumi", value);
 }
+
 static void SendRoomHumidity(const unsigned char *value)
 {
-	static char eventBuffer[100] = { 0 };
-	static const char *EventMsgTemplate = "{ \"RoomHumi\": \"%s\"}";
-	int len = snprintf(eventBuffer, sizeof(eventBuffer), EventMsgTemplate, value);
-	//int len = snprintf(eventBuffer, sizeof(eventBuffer), EventMsgTemplate, value);
-	if (len < 0)
-		return;
-
-	//Log_Debug("Sending IoT Hub Message: %s\n", eventBuffer);
-
-	IOTHUB_MESSAGE_HANDLE messageHandle = IoTHubMessage_CreateFromString(eventBuffer);
-
-	if (messageHandle == 0) {
-		Log_Debug("WARNING: unable to create a new IoTHubMessage\n");
-		return;
-	}
-
-	if (IoTHubDeviceClient_LL_SendEventAsync(iothubClientHandle, messageHandle, SendMessageCallback,
-		/*&callback_param*/ 0) != IOTHUB_CLIENT_OK) {
-		Log_Debug("WARNING: failed to hand over the message to IoTHubClient\n");
-	}
-	else {
-		//Log_Debug("INFO: IoTHubClient accepted the message for delivery\n");
-	}
-
-	IoTHubMessage_Destroy(messageHandle);
+	SendSensorReading(NODE_ROOM, MessagePriority_Normal, TelemetryClass_Environment, "RoomHumi", value);
 }
 
 static void SendOutsideTemperature(const unsigned char *value)
 {
-	static char eventBuffer[100] = { 0 };
-	static const char *EventMsgTemplate = "{ \"OutsideTemp\": \"%s\"}";
-	int len = snprintf(eventBuffer, sizeof(eventBuffer), EventMsgTemplate, value);
-	//int len = snprintf(eventBuffer, sizeof(eventBuffer), EventMsgTemplate, value);
-	if (len < 0)
-		return;
-
-	//Log_Debug("Sending IoT Hub Message: %s\n", eventBuffer);
-
-	IOTHUB_MESSAGE_HANDLE messageHandle = IoTHubMessage_CreateFromString(eventBuffer);
-
-	if (messageHandle == 0) {
-		Log_Debug("WARNING: unable to create a new IoTHubMessage\n");
-		return;
-	}
-
-	if (IoTHubDeviceClient_LL_SendEventAsync(iothubClientHandle, messageHandle, SendMessageCallback,
-		/*&callback_param*/ 0) != IOTHUB_CLIENT_OK) {
-		Log_Debug("WARNING: failed to hand over the message to IoTHubClient\n");
-	}
-	else {
-		//Log_Debug("INFO: IoTHubClient accepted the message for delivery\n");
-	}
-
-	IoTHubMessage_Destroy(messageHandle);
+	SendSensorReading(NODE_OUTSIDE, MessagePriority_Normal, TelemetryClass_Environment, "OutsideTemp", value);
 }
 
 static void SendServerTemperature(const unsigned char *value)
 {
-	static char eventBuffer[100] = { 0 };
-	static const char *EventMsgTemplate = "{ \"ServerTemp\": \"%s\"}";
-	int len = snprintf(eventBuffer, sizeof(eventBuffer), EventMsgTemplate, value);
-	//int len = snprintf(eventBuffer, sizeof(eventBuffer), EventMsgTemplate, value);
-	if (len < 0)
-		return;
-
-	//Log_Debug("Sending IoT Hub Message: %s\n", eventBuffer);
-
-	IOTHUB_MESSAGE_HANDLE messageHandle = IoTHubMessage_CreateFromString(eventBuffer);
-
-	if (messageHandle == 0) {
-		Log_Debug("WARNING: unable to create a new IoTHubMessage\n");
-		return;
-	}
-
-	if (IoTHubDeviceClient_LL_SendEventAsync(iothubClientHandle, messageHandle, SendMessageCallback,
-		/*&callback_param*/ 0) != IOTHUB_CLIENT_OK) {
-		Log_Debug("WARNING: failed to hand over the message to IoTHubClient\n");
-	}
-	else {
-		//Log_Debug("INFO: IoTHubClient accepted the message for delivery\n");
-	}
-
-	IoTHubMessage_Destroy(messageHandle);
+	SendSensorReading(NODE_SERVER, MessagePriority_Normal, TelemetryClass_Environment, "ServerTemp", value);
 }
 
 static void SendRoomTemperature(const unsigned char *value)
 {
-	static char eventBuffer[100] = { 0 };
-	static const char *EventMsgTemplate = "{ \"RoomTemp\": \"%s\"}";
-	int len = snprintf(eventBuffer, sizeof(eventBuffer), EventMsgTemplate, value);
-	//int len = snprintf(eventBuffer, sizeof(eventBuffer), EventMsgTemplate, value);
-	if (len < 0)
-		return;
-
-
-	IOTHUB_MESSAGE_HANDLE messageHandle = IoTHubMessage_CreateFromString(eventBuffer);
-
-	if (messageHandle == 0) {
-		Log_Debug("WARNING: unable to create a new IoTHubMessage\n");
-		return;
-	}
-
-	if (IoTHubDeviceClient_LL_SendEventAsync(iothubClientHandle, messageHandle, SendMessageCallback,
-		/*&callback_param*/ 0) != IOTHUB_CLIENT_OK) {
-		Log_Debug("WARNING: failed to hand over the message to IoTHubClient\n");
-	}
-	else {
-		//Log_Debug("INFO: IoTHubClient accepted the message for delivery\n");
-	}
-
-	IoTHubMessage_Destroy(messageHandle);
+	SendSensorReading(NODE_ROOM, MessagePriority_Normal, TelemetryClass_Environment, "RoomTemp", value);
 }
 
 static void SendTelemetry(const unsigned char *key, const unsigned char *value)
 {
-	static char eventBuffer[100] = { 0 };
-	static const char *EventMsgTemplate = "{ \"Name\": \"%s\", \"Evalue\": \"%s\" }";
-	int len = snprintf(eventBuffer, sizeof(eventBuffer), EventMsgTemplate, key, value);
-	if (len < 0)
-		return;
-
-	//Log_Debug("Sending IoT Hub Message: %s\n", eventBuffer);
-
-	IOTHUB_MESSAGE_HANDLE messageHandle = IoTHubMessage_CreateFromString(eventBuffer);
-
-	if (messageHandle == 0) {
-		Log_Debug("WARNING: unable to create a new IoTHubMessage\n");
-		return;
-	}
-
-	if (IoTHubDeviceClient_LL_SendEventAsync(iothubClientHandle, messageHandle, SendMessageCallback,
-		/*&callback_param*/ 0) != IOTHUB_CLIENT_OK) {
-		Log_Debug("WARNING: failed to hand over the message to IoTHubClient\n");
-	}
-	else {
-		//	Log_Debug("INFO: IoTHubClient accepted the message for delivery\n");
-	}
-
-	IoTHubMessage_Destroy(messageHandle);
+	const char *keys[] = { "Name", "Evalue" };
+	const char *values[] = { (const char *)key, (const char *)value };
+	SendTelemetryFields(TELEMETRY_NODE_GATEWAY, MessagePriority_High, TelemetryClass_Event, keys,
+		values, 2);
 }
 
 /// <summary>
@@ -1451,6 +2627,41 @@ static void SendTelemetry(const unsigned char *key, const unsigned char *value)
 static void SendMessageCallback(IOTHUB_CLIENT_CONFIRMATION_RESULT result, void *context)
 {
 	//Log_Debug("INFO: Message received by IoT Hub. Result is: %d\n", result);
+	if (messagesInFlight > 0) {
+		messagesInFlight--;
+	}
+	if (result == IOTHUB_CLIENT_CONFIRMATION_OK && firstAckMs == 0) {
+		firstAckMs = GetStartupTimeMs();
+		Log_Debug("INFO: First message acknowledged %u ms after start.\n", firstAckMs);
+		// Not sent from inside the client's callback.
+		WorkQueue_Post(&deferredWork, &startupTimingsWork);
+	}
+	UpdateBackpressure();
+}
+
+/// <summary>
+///     Gets the time since the process started, at least 1 ms so that the startup timings can use
+///     0 for "not yet".
+/// </summary>
+static uint32_t GetStartupTimeMs(void)
+{
+	uint64_t elapsedMs = GetMonotonicTimeMs() - startTimeMs;
+	return elapsedMs == 0 ? 1 : (uint32_t)elapsedMs;
+}
+
+/// <summary>
+///     Deferred work: sends the startup timings as gateway telemetry.
+/// </summary>
+static void SendStartupTimings(WorkItem *item)
+{
+	char frameMs[12], connectMs[12], ackMs[12];
+	snprintf(frameMs, sizeof(frameMs), "%u", firstFrameMs);
+	snprintf(connectMs, sizeof(connectMs), "%u", provisioningStatistics.firstConnectMs);
+	snprintf(ackMs, sizeof(ackMs), "%u", firstAckMs);
+	const char *keys[] = { "FirstFrameMs", "FirstConnectMs", "FirstAckMs" };
+	const char *values[] = { frameMs, connectMs, ackMs };
+	SendTelemetryFields(TELEMETRY_NODE_GATEWAY, MessagePriority_High, TelemetryClass_Event,
+		keys, values, 3);
 }
 
 /// <summary>
@@ -1462,7 +2673,7 @@ static void SendMessageCallback(IOTHUB_CLIENT_CONFIRMATION_RESULT result, void *
 /// <param name="propertyValue">the IoT Hub Device Twin property value</param>
 static void TwinReportBoolState(const char *propertyName, bool propertyValue)
 {
-	if (iothubClientHandle == NULL) {
+	if (!cloudTransport->isCreated()) {
 		Log_Debug("ERROR: client not initialized\n");
 	}
 	else {
@@ -1472,14 +2683,45 @@ static void TwinReportBoolState(const char *propertyName, bool propertyValue)
 		if (len < 0)
 			return;
 
-		if (IoTHubDeviceClient_LL_SendReportedState(
-			iothubClientHandle, (unsigned char *)reportedPropertiesString,
-			strlen(reportedPropertiesString), ReportStatusCallback, 0) != IOTHUB_CLIENT_OK) {
+		if (cloudTransport->sendReportedState((unsigned char *)reportedPropertiesString,
+			strlen(reportedPropertiesString), ReportStatusCallback, 0) != 0) {
 			Log_Debug("ERROR: failed to set reported state for '%s'.\n", propertyName);
 		}
 		else {
 			Log_Debug("INFO: Reported state for '%s' to value '%s'.\n", propertyName,
 				(propertyValue == true ? "true" : "false"));
+			ScheduleDoWork(0);
+		}
+	}
+}
+
+/// <summary>
+///     Creates and enqueues a report of a Device Twin reported property whose value is a JSON
+///     object or other JSON fragment, such as a set of statistics counters.
+/// </summary>
+/// <param name="propertyName">the IoT Hub Device Twin property name</param>
+/// <param name="propertyJson">the property value, already formatted as JSON</param>
+static void TwinReportJsonState(const char *propertyName, const char *propertyJson)
+{
+	if (!cloudTransport->isCreated()) {
+		Log_Debug("ERROR: client not initialized\n");
+	}
+	else {
+		static char reportedPropertiesString[STATISTICS_SECTION_SIZE + 64] = { 0 };
+		int len = snprintf(reportedPropertiesString, sizeof(reportedPropertiesString), "{\"%s\":%s}",
+			propertyName, propertyJson);
+		if (len < 0 || (size_t)len >= sizeof(reportedPropertiesString)) {
+			Log_Debug("ERROR: reported state for '%s' does not fit in %zu bytes.\n", propertyName,
+				sizeof(reportedPropertiesString));
+			return;
+		}
+
+		if (cloudTransport->sendReportedState((unsigned char *)reportedPropertiesString,
+			(size_t)len, ReportStatusCallback, 0) != 0) {
+			Log_Debug("ERROR: failed to set reported state for '%s'.\n", propertyName);
+		}
+		else {
+			ScheduleDoWork(0);
 		}
 	}
 }
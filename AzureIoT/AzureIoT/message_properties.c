@@ -0,0 +1,59 @@
+#include <stdio.h>
+#include <string.h>
+#include "message_properties.h"
+
+static MessagePropertySet nodePropertySets[MESSAGE_PROPERTIES_MAX_NODES];
+static MessagePropertySet gatewayPropertySet;
+static MessagePropertySet mixedPropertySet;
+
+static const char *const priorityNames[] = {"low", "normal", "high"};
+static const char *const classNames[] = {"environment", "battery", "event"};
+
+void MessageProperties_Init(void)
+{
+    for (int i = 0; i < MESSAGE_PROPERTIES_MAX_NODES; i++) {
+        snprintf(nodePropertySets[i].nodeId, sizeof(nodePropertySets[i].nodeId), "%d", i);
+        snprintf(nodePropertySets[i].nodeName, sizeof(nodePropertySets[i].nodeName), "%d", i);
+    }
+    strcpy(gatewayPropertySet.nodeId, "gateway");
+    strcpy(gatewayPropertySet.nodeName, "gateway");
+    strcpy(mixedPropertySet.nodeId, "multiple");
+    strcpy(mixedPropertySet.nodeName, "multiple");
+}
+
+int MessageProperties_RegisterNode(int node, const char *nodeName)
+{
+    if (node < 0 || node >= MESSAGE_PROPERTIES_MAX_NODES) {
+        return -1;
+    }
+    snprintf(nodePropertySets[node].nodeName, sizeof(nodePropertySets[node].nodeName), "%s",
+             nodeName);
+    return 0;
+}
+
+int MessageProperties_Apply(IOTHUB_MESSAGE_HANDLE messageHandle, int node,
+                            TelemetryClass telemetryClass, MessagePriority priority,
+                            const TelemetryEncoder *encoder)
+{
+    const MessagePropertySet *set = &gatewayPropertySet;
+    if (node >= 0 && node < MESSAGE_PROPERTIES_MAX_NODES) {
+        set = &nodePropertySets[node];
+    } else if (node == TELEMETRY_NODE_MIXED) {
+        set = &mixedPropertySet;
+    }
+
+    if (IoTHubMessage_SetContentTypeSystemProperty(messageHandle, encoder->contentType) !=
+            IOTHUB_MESSAGE_OK ||
+        (encoder->contentEncoding != NULL &&
+         IoTHubMessage_SetContentEncodingSystemProperty(messageHandle, encoder->contentEncoding) !=
+             IOTHUB_MESSAGE_OK) ||
+        IoTHubMessage_SetProperty(messageHandle, "nodeId", set->nodeId) != IOTHUB_MESSAGE_OK ||
+        IoTHubMessage_SetProperty(messageHandle, "nodeName", set->nodeName) != IOTHUB_MESSAGE_OK ||
+        IoTHubMessage_SetProperty(messageHandle, "metricClass", classNames[telemetryClass]) !=
+            IOTHUB_MESSAGE_OK ||
+        IoTHubMessage_SetProperty(messageHandle, "priority", priorityNames[priority]) !=
+            IOTHUB_MESSAGE_OK) {
+        return -1;
+    }
+    return 0;
+}
@@ -0,0 +1,47 @@
+#pragma once
+#include <iothub_client_core_common.h>
+#include "outbound_queue.h"
+#include "telemetry_encoder.h"
+
+#define MESSAGE_PROPERTIES_MAX_NODES 10
+
+/// <summary>
+/// <para>Application properties attached to every message from one node.</para>
+/// <para>The strings are built once when the node is registered so that sending a message only
+/// hands existing strings to IoTHubMessage_SetProperty. Hub routes can then select traffic on
+/// nodeId, nodeName, metricClass and priority without querying the body.</para>
+/// </summary>
+typedef struct MessagePropertySet {
+    char nodeId[12];
+    char nodeName[16];
+} MessagePropertySet;
+
+/// <summary>
+///     Builds the property sets for every node index, plus the gateway's own set and the set used
+///     for messages that mix nodes. Nodes that are not registered by name get their index as the
+///     name.
+/// </summary>
+void MessageProperties_Init(void);
+
+/// <summary>
+///     Sets the human-readable name reported for a node, e.g. "Room".
+/// </summary>
+/// <param name="node">Node index</param>
+/// <param name="nodeName">Name reported in the nodeName property</param>
+/// <returns>0 on success, or -1 if the node index is out of range</returns>
+int MessageProperties_RegisterNode(int node, const char *nodeName);
+
+/// <summary>
+///     Attaches the node's application properties, the class and priority properties, and the
+///     encoder's content-type and content-encoding system properties to an outgoing message.
+/// </summary>
+/// <param name="messageHandle">Message to add the properties to</param>
+/// <param name="node">Node the readings came from, TELEMETRY_NODE_GATEWAY or
+/// TELEMETRY_NODE_MIXED</param>
+/// <param name="telemetryClass">Kind of data in the message</param>
+/// <param name="priority">Highest priority of the readings in the message</param>
+/// <param name="encoder">Encoder used for the message body</param>
+/// <returns>0 on success, or -1 if any property could not be set</returns>
+int MessageProperties_Apply(IOTHUB_MESSAGE_HANDLE messageHandle, int node,
+                            TelemetryClass telemetryClass, MessagePriority priority,
+                            const TelemetryEncoder *encoder);
@@ -0,0 +1,318 @@
+#include <stdio.h>
+#include <string.h>
+#include "message_shaper.h"
+
+#define MICRO_TOKENS_PER_TOKEN 1000000ULL
+#define SECONDS_PER_DAY 86400ULL
+
+void TokenBucket_Init(TokenBucket *bucket, uint32_t milliTokensPerSecond, uint32_t burst,
+                      uint64_t nowMs)
+{
+    bucket->refillMilliTokensPerSecond = milliTokensPerSecond;
+    bucket->capacityMicroTokens = (uint64_t)burst * MICRO_TOKENS_PER_TOKEN;
+    bucket->microTokens = bucket->capacityMicroTokens;
+    bucket->lastRefillMs = nowMs;
+}
+
+static bool TokenBucket_IsEnabled(const TokenBucket *bucket)
+{
+    return bucket->refillMilliTokensPerSecond != 0;
+}
+
+static void TokenBucket_Refill(TokenBucket *bucket, uint64_t nowMs)
+{
+    if (nowMs <= bucket->lastRefillMs) {
+        return;
+    }
+    uint64_t added = (nowMs - bucket->lastRefillMs) * bucket->refillMilliTokensPerSecond;
+    bucket->microTokens += added;
+    if (bucket->microTokens > bucket->capacityMicroTokens) {
+        bucket->microTokens = bucket->capacityMicroTokens;
+    }
+    bucket->lastRefillMs = nowMs;
+}
+
+static bool TokenBucket_HasToken(TokenBucket *bucket, uint64_t nowMs)
+{
+    if (!TokenBucket_IsEnabled(bucket)) {
+        return true;
+    }
+    TokenBucket_Refill(bucket, nowMs);
+    return bucket->microTokens >= MICRO_TOKENS_PER_TOKEN;
+}
+
+static void TokenBucket_Take(TokenBucket *bucket)
+{
+    if (TokenBucket_IsEnabled(bucket)) {
+        bucket->microTokens -= MICRO_TOKENS_PER_TOKEN;
+    }
+}
+
+static void TokenBucket_Give(TokenBucket *bucket)
+{
+    if (TokenBucket_IsEnabled(bucket)) {
+        bucket->microTokens += MICRO_TOKENS_PER_TOKEN;
+        if (bucket->microTokens > bucket->capacityMicroTokens) {
+            bucket->microTokens = bucket->capacityMicroTokens;
+        }
+    }
+}
+
+static uint64_t TokenBucket_GetDelayMs(TokenBucket *bucket, uint64_t nowMs)
+{
+    if (TokenBucket_HasToken(bucket, nowMs)) {
+        return 0;
+    }
+    uint64_t missing = MICRO_TOKENS_PER_TOKEN - bucket->microTokens;
+    uint64_t rate = bucket->refillMilliTokensPerSecond;
+    return (missing + rate - 1) / rate;
+}
+
+static TokenBucket *GetNodeBucket(MessageShaper *shaper, int node)
+{
+    if (node < 0 || node >= MESSAGE_SHAPER_MAX_NODES) {
+        return NULL;
+    }
+    return &shaper->nodeBuckets[node];
+}
+
+/// <summary>
+///     Takes one token from every bucket that applies to the node, or none if any of them is
+///     empty. Throttling is attributed to the first empty bucket when countThrottling is set.
+/// </summary>
+static bool TryTakeTokens(MessageShaper *shaper, int node, uint64_t nowMs, bool countThrottling)
+{
+    TokenBucket *nodeBucket = GetNodeBucket(shaper, node);
+
+    if (!TokenBucket_HasToken(&shaper->globalBucket, nowMs)) {
+        if (countThrottling) {
+            shaper->statistics.throttledGlobal++;
+        }
+        return false;
+    }
+    if (!TokenBucket_HasToken(&shaper->dailyBucket, nowMs)) {
+        if (countThrottling) {
+            shaper->statistics.throttledDaily++;
+        }
+        return false;
+    }
+    if (nodeBucket != NULL && !TokenBucket_HasToken(nodeBucket, nowMs)) {
+        if (countThrottling) {
+            shaper->statistics.throttledNode++;
+        }
+        return false;
+    }
+
+    TokenBucket_Take(&shaper->globalBucket);
+    TokenBucket_Take(&shaper->dailyBucket);
+    if (nodeBucket != NULL) {
+        TokenBucket_Take(nodeBucket);
+    }
+    return true;
+}
+
+/// <summary>
+///     Gives back the tokens TryTakeTokens took for a message that did not cost a hub message.
+/// </summary>
+static void GiveTokens(MessageShaper *shaper, int node)
+{
+    TokenBucket *nodeBucket = GetNodeBucket(shaper, node);
+    TokenBucket_Give(&shaper->globalBucket);
+    TokenBucket_Give(&shaper->dailyBucket);
+    if (nodeBucket != NULL) {
+        TokenBucket_Give(nodeBucket);
+    }
+}
+
+static void SendMessage(MessageShaper *shaper, const TelemetryMessage *message)
+{
+    int result = shaper->send(message, shaper->sendContext);
+    if (result < 0) {
+        shaper->statistics.sendFailures++;
+        GiveTokens(shaper, message->node);
+        return;
+    }
+    shaper->statistics.sent++;
+    if (result == MESSAGE_SHAPER_SEND_JOINED) {
+        shaper->statistics.joined++;
+        GiveTokens(shaper, message->node);
+    }
+}
+
+void MessageShaper_Init(MessageShaper *shaper, const MessageShaperConfig *config,
+                        MessageShaperSendFunction send, void *sendContext, uint64_t nowMs)
+{
+    memset(shaper, 0, sizeof(*shaper));
+    shaper->config = *config;
+    shaper->send = send;
+    shaper->sendContext = sendContext;
+
+    TokenBucket_Init(&shaper->globalBucket, config->globalMilliMessagesPerSecond,
+                     config->globalBurst, nowMs);
+    TokenBucket_Init(&shaper->dailyBucket,
+                     (uint32_t)((uint64_t)config->dailyQuota * 1000 / SECONDS_PER_DAY),
+                     config->dailyBurst, nowMs);
+    for (int i = 0; i < MESSAGE_SHAPER_MAX_NODES; i++) {
+        TokenBucket_Init(&shaper->nodeBuckets[i], config->nodeMilliMessagesPerSecond,
+                         config->nodeBurst, nowMs);
+    }
+    OutboundQueue_Init(&shaper->queue);
+}
+
+void MessageShaper_SetPolicy(MessageShaper *shaper, MessageShaperPolicy policy)
+{
+    shaper->config.policy = policy;
+}
+
+void MessageShaper_SetPaused(MessageShaper *shaper, bool paused)
+{
+    shaper->paused = paused;
+}
+
+static void Enqueue(MessageShaper *shaper, const TelemetryMessage *message)
+{
+    bool isEvent = message->telemetryClass == TelemetryClass_Event;
+
+    // Under the drop policy a throttled message that would be the first to go when the queue
+    // fills is dropped now rather than held. Messages held back by a pause are not throttled,
+    // and are queued as usual.
+    if (shaper->config.policy == MessageShaperPolicy_DropLowestPriority && !isEvent &&
+        !shaper->paused) {
+        int lowest = OutboundQueue_FindSheddable(&shaper->queue);
+        if (message->priority == MessagePriority_Low ||
+            (lowest >= 0 && message->priority <= shaper->queue.messages[lowest].priority)) {
+            shaper->statistics.dropped++;
+            shaper->statistics.droppedOnArrival++;
+            return;
+        }
+    }
+
+    if (OutboundQueue_IsFull(&shaper->queue)) {
+        // Events are never shed in favour of other traffic: an incoming event always displaces
+        // the lowest-priority non-event, whatever the policy, and events are never the victim.
+        int victim = OutboundQueue_FindSheddable(&shaper->queue);
+        if (victim < 0 ||
+            (!isEvent && (shaper->config.policy != MessageShaperPolicy_DropLowestPriority ||
+                          shaper->queue.messages[victim].priority >= message->priority))) {
+            shaper->statistics.dropped++;
+            if (isEvent) {
+                shaper->statistics.eventsDropped++;
+            }
+            return;
+        }
+        OutboundQueue_RemoveAt(&shaper->queue, (size_t)victim);
+        shaper->statistics.dropped++;
+        if (isEvent) {
+            shaper->statistics.evictedForEvents++;
+        }
+    }
+
+    OutboundQueue_Push(&shaper->queue, message);
+    shaper->statistics.delayed++;
+}
+
+void MessageShaper_Submit(MessageShaper *shaper, const TelemetryMessage *message, uint64_t nowMs)
+{
+    shaper->statistics.submitted++;
+
+    // Release the backlog first so that a new message never overtakes an older one from the
+    // same node.
+    MessageShaper_Poll(shaper, nowMs);
+
+    int waiting = OutboundQueue_FindLastFromNode(&shaper->queue, message->node);
+    if (waiting < 0 && !shaper->paused && TryTakeTokens(shaper, message->node, nowMs, true)) {
+        SendMessage(shaper, message);
+        return;
+    }
+
+    // Events are never merged: each one is a state change the hub must see, not a reading that
+    // a later one supersedes.
+    if (shaper->config.policy == MessageShaperPolicy_Merge && waiting >= 0 &&
+        message->telemetryClass != TelemetryClass_Event &&
+        TelemetryMessage_Merge(&shaper->queue.messages[waiting], message) == 0) {
+        shaper->statistics.merged++;
+        return;
+    }
+
+    Enqueue(shaper, message);
+}
+
+void MessageShaper_Poll(MessageShaper *shaper, uint64_t nowMs)
+{
+    // The send function may pause the shaper part way through the queue.
+    size_t i = 0;
+    while (i < shaper->queue.count && !shaper->paused) {
+        if (!TokenBucket_HasToken(&shaper->globalBucket, nowMs) ||
+            !TokenBucket_HasToken(&shaper->dailyBucket, nowMs)) {
+            return;
+        }
+
+        int node = shaper->queue.messages[i].node;
+        // A node that is out of tokens must not hold up the others, but its later messages
+        // must keep waiting behind this one.
+        if (!TryTakeTokens(shaper, node, nowMs, false)) {
+            i++;
+            continue;
+        }
+
+        TelemetryMessage message = shaper->queue.messages[i];
+        OutboundQueue_RemoveAt(&shaper->queue, i);
+        SendMessage(shaper, &message);
+    }
+}
+
+int64_t MessageShaper_GetNextReleaseDelayMs(MessageShaper *shaper, uint64_t nowMs)
+{
+    if (shaper->queue.count == 0 || shaper->paused) {
+        return -1;
+    }
+
+    uint64_t sharedDelay = TokenBucket_GetDelayMs(&shaper->globalBucket, nowMs);
+    uint64_t dailyDelay = TokenBucket_GetDelayMs(&shaper->dailyBucket, nowMs);
+    if (dailyDelay > sharedDelay) {
+        sharedDelay = dailyDelay;
+    }
+
+    uint64_t nodeDelay = UINT64_MAX;
+    for (size_t i = 0; i < shaper->queue.count; i++) {
+        TokenBucket *bucket = GetNodeBucket(shaper, shaper->queue.messages[i].node);
+        uint64_t delay = bucket != NULL ? TokenBucket_GetDelayMs(bucket, nowMs) : 0;
+        if (delay < nodeDelay) {
+            nodeDelay = delay;
+        }
+    }
+
+    return (int64_t)(nodeDelay > sharedDelay ? nodeDelay : sharedDelay);
+}
+
+void MessageShaper_CountSendFailure(MessageShaper *shaper)
+{
+    shaper->statistics.sendFailures++;
+}
+
+int MessageShaper_ParsePolicy(const char *name, MessageShaperPolicy *policy)
+{
+    if (strcmp(name, "delay") == 0) {
+        *policy = MessageShaperPolicy_Delay;
+    } else if (strcmp(name, "merge") == 0) {
+        *policy = MessageShaperPolicy_Merge;
+    } else if (strcmp(name, "drop") == 0) {
+        *policy = MessageShaperPolicy_DropLowestPriority;
+    } else {
+        return -1;
+    }
+    return 0;
+}
+
+int MessageShaper_FormatStatistics(const MessageShaper *shaper, char *buffer, size_t bufferSize)
+{
+    const MessageShaperStatistics *s = &shaper->statistics;
+    return snprintf(buffer, bufferSize,
+                    "\"submitted\":%u,\"sent\":%u,\"joined\":%u,\"sendFailures\":%u,"
+                    "\"delayed\":%u,\"merged\":%u,\"dropped\":%u,\"droppedOnArrival\":%u,"
+                    "\"evictedForEvents\":%u,\"eventsDropped\":%u,\"throttledGlobal\":%u,\"throttledDaily\":%u,"
+                    "\"throttledNode\":%u,\"queued\":%zu",
+                    s->submitted, s->sent, s->joined, s->sendFailures, s->delayed, s->merged,
+                    s->dropped, s->droppedOnArrival, s->evictedForEvents, s->eventsDropped, s->throttledGlobal,
+                    s->throttledDaily, s->throttledNode, shaper->queue.count);
+}
@@ -0,0 +1,189 @@
+#pragma once
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include "outbound_queue.h"
+
+#define MESSAGE_SHAPER_MAX_NODES 10
+
+/// <summary>
+/// <para>Token bucket rate limiter.</para>
+/// <para>Tokens are held in millionths so that slow refill rates, such as a daily quota spread
+/// over the day, do not lose precision between frequent refills.</para>
+/// </summary>
+typedef struct TokenBucket {
+    uint64_t microTokens;
+    uint64_t capacityMicroTokens;
+    /// <summary>
+    /// Refill rate in thousandths of a token per second; one millisecond therefore adds exactly
+    /// this many micro-tokens.
+    /// </summary>
+    uint32_t refillMilliTokensPerSecond;
+    uint64_t lastRefillMs;
+} TokenBucket;
+
+/// <summary>
+///     What the shaper does with a message that arrives when there are no tokens for it.
+/// </summary>
+typedef enum {
+    /// <summary>Queue the message and send it once tokens are available.</summary>
+    MessageShaperPolicy_Delay,
+    /// <summary>Fold the message into the queued message from the same node, so the backlog
+    /// leaves as one message carrying the latest value of every field. Events are queued as
+    /// under Delay.</summary>
+    MessageShaperPolicy_Merge,
+    /// <summary>Drop the message at once if it is low priority or no more important than every
+    /// message queued, otherwise queue it; when the queue is full, drop the oldest message with
+    /// the lowest priority instead of the newest. Events are always queued.</summary>
+    MessageShaperPolicy_DropLowestPriority
+} MessageShaperPolicy;
+
+/// <summary>
+///     Returned by a send function that added the message to a hub message already charged for,
+///     such as an open batch. The shaper gives back the tokens it took for the message, so that
+///     the buckets count hub messages rather than records.
+/// </summary>
+#define MESSAGE_SHAPER_SEND_JOINED 1
+
+/// <summary>
+///     Function the shaper calls to actually send a message.
+/// </summary>
+/// <returns>0 if the message starts a new hub message, MESSAGE_SHAPER_SEND_JOINED if it joined
+/// one already charged for, or -1 on failure; failed messages are counted, their tokens given
+/// back, and not retried</returns>
+typedef int (*MessageShaperSendFunction)(const TelemetryMessage *message, void *context);
+
+/// <summary>
+///     Rate limits for a message shaper. A rate of zero disables that bucket.
+/// </summary>
+typedef struct MessageShaperConfig {
+    /// <summary>Sustained messages per second across all nodes (hub per-second throttle).</summary>
+    uint32_t globalMilliMessagesPerSecond;
+    uint32_t globalBurst;
+    /// <summary>Messages per day (hub tier quota).</summary>
+    uint32_t dailyQuota;
+    uint32_t dailyBurst;
+    /// <summary>Sustained messages per second from any single node.</summary>
+    uint32_t nodeMilliMessagesPerSecond;
+    uint32_t nodeBurst;
+    MessageShaperPolicy policy;
+} MessageShaperConfig;
+
+/// <summary>
+///     Counters describing what the shaper did with the messages submitted to it.
+/// </summary>
+typedef struct MessageShaperStatistics {
+    uint32_t submitted;
+    uint32_t sent;
+    /// <summary>Sent messages that joined a hub message already charged for.</summary>
+    uint32_t joined;
+    /// <summary>Messages the send function failed, and hub messages reported as failed later
+    /// through MessageShaper_CountSendFailure.</summary>
+    uint32_t sendFailures;
+    uint32_t delayed;
+    uint32_t merged;
+    uint32_t dropped;
+    /// <summary>Throttled messages the drop policy discarded instead of queueing, because they
+    /// were low priority or no more important than the least important message queued.</summary>
+    uint32_t droppedOnArrival;
+    /// <summary>Queued messages dropped to make room for an event.</summary>
+    uint32_t evictedForEvents;
+    /// <summary>Events dropped because the queue held nothing but events.</summary>
+    uint32_t eventsDropped;
+    uint32_t throttledGlobal;
+    uint32_t throttledDaily;
+    uint32_t throttledNode;
+} MessageShaperStatistics;
+
+/// <summary>
+///     Token-bucket shaper in front of the IoT Hub send call, with one global bucket, one bucket
+///     for the daily quota and one bucket per node.
+/// </summary>
+typedef struct MessageShaper {
+    MessageShaperConfig config;
+    TokenBucket globalBucket;
+    TokenBucket dailyBucket;
+    TokenBucket nodeBuckets[MESSAGE_SHAPER_MAX_NODES];
+    OutboundQueue queue;
+    MessageShaperSendFunction send;
+    void *sendContext;
+    /// <summary>Set while the consumer cannot take more messages; everything is queued.</summary>
+    bool paused;
+    MessageShaperStatistics statistics;
+} MessageShaper;
+
+/// <summary>
+///     Initializes a token bucket that starts full.
+/// </summary>
+/// <param name="bucket">Bucket to initialize</param>
+/// <param name="milliTokensPerSecond">Refill rate in thousandths of a token per second</param>
+/// <param name="burst">Maximum number of tokens the bucket holds</param>
+/// <param name="nowMs">Current monotonic time in milliseconds</param>
+void TokenBucket_Init(TokenBucket *bucket, uint32_t milliTokensPerSecond, uint32_t burst,
+                      uint64_t nowMs);
+
+/// <summary>
+///     Initializes the shaper. The buckets start full.
+/// </summary>
+/// <param name="shaper">Shaper to initialize</param>
+/// <param name="config">Rate limits and policy</param>
+/// <param name="send">Function used to send messages that are let through</param>
+/// <param name="sendContext">Context passed to send</param>
+/// <param name="nowMs">Current monotonic time in milliseconds</param>
+void MessageShaper_Init(MessageShaper *shaper, const MessageShaperConfig *config,
+                        MessageShaperSendFunction send, void *sendContext, uint64_t nowMs);
+
+/// <summary>
+///     Changes the policy applied to messages that are throttled from now on.
+/// </summary>
+void MessageShaper_SetPolicy(MessageShaper *shaper, MessageShaperPolicy policy);
+
+/// <summary>
+///     Stops or resumes sending. While paused, submitted messages are queued (or merged) as if
+///     they had been throttled, so the consumer's backlog cannot grow. After resuming, call
+///     MessageShaper_Poll to release the queue.
+/// </summary>
+void MessageShaper_SetPaused(MessageShaper *shaper, bool paused);
+
+/// <summary>
+///     Sends the message if tokens are available and nothing from the same node is already
+///     waiting, otherwise applies the configured policy.
+/// </summary>
+/// <param name="shaper">The shaper</param>
+/// <param name="message">Message to send; it is copied if it has to wait</param>
+/// <param name="nowMs">Current monotonic time in milliseconds</param>
+void MessageShaper_Submit(MessageShaper *shaper, const TelemetryMessage *message, uint64_t nowMs);
+
+/// <summary>
+///     Sends as many waiting messages as the buckets allow, oldest first.
+/// </summary>
+/// <param name="shaper">The shaper</param>
+/// <param name="nowMs">Current monotonic time in milliseconds</param>
+void MessageShaper_Poll(MessageShaper *shaper, uint64_t nowMs);
+
+/// <summary>
+///     Gets how long until at least one waiting message could be sent.
+/// </summary>
+/// <param name="shaper">The shaper</param>
+/// <param name="nowMs">Current monotonic time in milliseconds</param>
+/// <returns>Delay in milliseconds, or -1 if nothing is waiting or the shaper is paused</returns>
+int64_t MessageShaper_GetNextReleaseDelayMs(MessageShaper *shaper, uint64_t nowMs);
+
+/// <summary>
+///     Counts a hub message that could not be handed over after the send function had accepted
+///     its records, e.g. one built asynchronously from a batch.
+/// </summary>
+void MessageShaper_CountSendFailure(MessageShaper *shaper);
+
+/// <summary>
+///     Parses a policy name as used in the device twin: "delay", "merge" or "drop".
+/// </summary>
+/// <returns>0 on success, or -1 if the name is unknown</returns>
+int MessageShaper_ParsePolicy(const char *name, MessageShaperPolicy *policy);
+
+/// <summary>
+///     Formats the statistics as a JSON object body, without the surrounding braces, e.g.
+///     "\"submitted\":10,\"sent\":8,...".
+/// </summary>
+/// <returns>The snprintf result</returns>
+int MessageShaper_FormatStatistics(const MessageShaper *shaper, char *buffer, size_t bufferSize);
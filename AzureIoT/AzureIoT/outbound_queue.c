@@ -0,0 +1,111 @@
+#include <string.h>
+#include "outbound_queue.h"
+
+static void CopyField(char *target, size_t targetSize, const char *source)
+{
+    strncpy(target, source, targetSize - 1);
+    target[targetSize - 1] = 0;
+}
+
+void TelemetryMessage_Init(TelemetryMessage *message, int node, MessagePriority priority,
+                           TelemetryClass telemetryClass, const char *const keys[],
+                           const char *const values[], size_t count)
+{
+    message->node = node;
+    message->priority = priority;
+    message->telemetryClass = telemetryClass;
+    message->fieldCount = 0;
+    for (size_t i = 0; i < count && i < TELEMETRY_MESSAGE_MAX_FIELDS; i++) {
+        CopyField(message->keys[i], TELEMETRY_KEY_LENGTH, keys[i]);
+        CopyField(message->values[i], TELEMETRY_VALUE_LENGTH, values[i]);
+        message->fieldCount++;
+    }
+}
+
+static int FindField(const TelemetryMessage *message, const char *key)
+{
+    for (size_t i = 0; i < message->fieldCount; i++) {
+        if (strcmp(message->keys[i], key) == 0) {
+            return (int)i;
+        }
+    }
+    return -1;
+}
+
+int TelemetryMessage_Merge(TelemetryMessage *target, const TelemetryMessage *source)
+{
+    if (target->telemetryClass != source->telemetryClass) {
+        return -1;
+    }
+
+    size_t newKeys = 0;
+    for (size_t i = 0; i < source->fieldCount; i++) {
+        if (FindField(target, source->keys[i]) < 0) {
+            newKeys++;
+        }
+    }
+    if (target->fieldCount + newKeys > TELEMETRY_MESSAGE_MAX_FIELDS) {
+        return -1;
+    }
+
+    for (size_t i = 0; i < source->fieldCount; i++) {
+        int field = FindField(target, source->keys[i]);
+        if (field < 0) {
+            field = (int)target->fieldCount++;
+            memcpy(target->keys[field], source->keys[i], TELEMETRY_KEY_LENGTH);
+        }
+        memcpy(target->values[field], source->values[i], TELEMETRY_VALUE_LENGTH);
+    }
+    if (source->priority > target->priority) {
+        target->priority = source->priority;
+    }
+    return 0;
+}
+
+void OutboundQueue_Init(OutboundQueue *queue)
+{
+    queue->count = 0;
+}
+
+int OutboundQueue_Push(OutboundQueue *queue, const TelemetryMessage *message)
+{
+    if (OutboundQueue_IsFull(queue)) {
+        return -1;
+    }
+    queue->messages[queue->count++] = *message;
+    return 0;
+}
+
+void OutboundQueue_RemoveAt(OutboundQueue *queue, size_t index)
+{
+    if (index >= queue->count) {
+        return;
+    }
+    memmove(&queue->messages[index], &queue->messages[index + 1],
+            (queue->count - index - 1) * sizeof(TelemetryMessage));
+    queue->count--;
+}
+
+int OutboundQueue_FindSheddable(const OutboundQueue *queue)
+{
+    int lowest = -1;
+    for (size_t i = 0; i < queue->count; i++) {
+        if (queue->messages[i].telemetryClass == TelemetryClass_Event) {
+            continue;
+        }
+        if (lowest < 0 || queue->messages[i].priority < queue->messages[lowest].priority) {
+            lowest = (int)i;
+        }
+    }
+    return lowest;
+}
+
+int OutboundQueue_FindLastFromNode(const OutboundQueue *queue, int node)
+{
+    for (size_t i = queue->count; i > 0; i--) {
+        if (queue->messages[i - 1].node == node) {
+            return (int)(i - 1);
+        }
+    }
+    return -1;
+}
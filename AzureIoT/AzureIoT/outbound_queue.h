@@ -0,0 +1,122 @@
+#pragma once
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#define TELEMETRY_MESSAGE_MAX_FIELDS 6
+#define TELEMETRY_KEY_LENGTH 16
+#define TELEMETRY_VALUE_LENGTH 16
+#define OUTBOUND_QUEUE_CAPACITY 32
+
+/// <summary>
+///     Node index used for telemetry generated by the gateway itself rather than a mesh node.
+/// </summary>
+#define TELEMETRY_NODE_GATEWAY (-1)
+
+/// <summary>
+///     Node index used for a packed message that holds readings from more than one node.
+/// </summary>
+#define TELEMETRY_NODE_MIXED (-2)
+
+/// <summary>
+///     Relative importance of a telemetry message, used when messages have to be delayed or
+///     dropped. Higher values are more important.
+/// </summary>
+typedef enum {
+    MessagePriority_Low = 0,
+    MessagePriority_Normal = 1,
+    MessagePriority_High = 2
+} MessagePriority;
+
+/// <summary>
+///     Kind of data a telemetry message carries, used for routing in the hub.
+/// </summary>
+typedef enum {
+    /// <summary>Temperature, humidity and pressure readings.</summary>
+    TelemetryClass_Environment = 0,
+    /// <summary>Node battery levels.</summary>
+    TelemetryClass_Battery = 1,
+    /// <summary>Discrete events such as door state changes and button presses.</summary>
+    TelemetryClass_Event = 2
+} TelemetryClass;
+
+/// <summary>
+/// <para>A telemetry message waiting to be encoded and sent.</para>
+/// <para>Keys and values are copied in so that the message does not reference the UART parser
+/// buffers, which are reused for the next frame.</para>
+/// </summary>
+typedef struct TelemetryMessage {
+    /// <summary>
+    /// Index of the mesh node the readings came from, or TELEMETRY_NODE_GATEWAY.
+    /// </summary>
+    int node;
+    MessagePriority priority;
+    TelemetryClass telemetryClass;
+    size_t fieldCount;
+    char keys[TELEMETRY_MESSAGE_MAX_FIELDS][TELEMETRY_KEY_LENGTH];
+    char values[TELEMETRY_MESSAGE_MAX_FIELDS][TELEMETRY_VALUE_LENGTH];
+} TelemetryMessage;
+
+/// <summary>
+///     Fixed-capacity FIFO of telemetry messages waiting to leave the device.
+/// </summary>
+typedef struct OutboundQueue {
+    TelemetryMessage messages[OUTBOUND_QUEUE_CAPACITY];
+    size_t count;
+} OutboundQueue;
+
+/// <summary>
+///     Fills in a message from parallel key and value arrays. Keys and values that are too long
+///     are truncated; fields beyond TELEMETRY_MESSAGE_MAX_FIELDS are ignored.
+/// </summary>
+/// <param name="message">Message to fill in</param>
+/// <param name="node">Node index, or TELEMETRY_NODE_GATEWAY</param>
+/// <param name="priority">Message priority</param>
+/// <param name="telemetryClass">Kind of data the fields hold</param>
+/// <param name="keys">Field names</param>
+/// <param name="values">Field values</param>
+/// <param name="count">Number of fields</param>
+void TelemetryMessage_Init(TelemetryMessage *message, int node, MessagePriority priority,
+                           TelemetryClass telemetryClass, const char *const keys[],
+                           const char *const values[], size_t count);
+
+/// <summary>
+///     Copies the fields of source into target, replacing values of keys that are already present.
+/// </summary>
+/// <returns>0 on success, or -1 if the messages are of different classes or target does not
+/// have room for the new keys (target is then unchanged)</returns>
+int TelemetryMessage_Merge(TelemetryMessage *target, const TelemetryMessage *source);
+
+/// <summary>
+///     Empties the queue.
+/// </summary>
+void OutboundQueue_Init(OutboundQueue *queue);
+
+/// <summary>
+///     Appends a copy of the message to the tail of the queue.
+/// </summary>
+/// <returns>0 on success, or -1 if the queue is full</returns>
+int OutboundQueue_Push(OutboundQueue *queue, const TelemetryMessage *message);
+
+/// <summary>
+///     Removes the message at the given position, preserving the order of the others.
+/// </summary>
+void OutboundQueue_RemoveAt(OutboundQueue *queue, size_t index);
+
+/// <summary>
+///     Finds the oldest message with the lowest priority that may be shed under load, i.e. one
+///     that is not an event.
+/// </summary>
+/// <returns>Its position, or -1 if the queue holds only events</returns>
+int OutboundQueue_FindSheddable(const OutboundQueue *queue);
+
+/// <summary>
+///     Finds the newest queued message from the given node.
+/// </summary>
+/// <returns>Its position, or -1 if there is none</returns>
+int OutboundQueue_FindLastFromNode(const OutboundQueue *queue, int node);
+
+static inline bool OutboundQueue_IsFull(const OutboundQueue *queue)
+{
+    return queue->count == OUTBOUND_QUEUE_CAPACITY;
+}
@@ -0,0 +1,39 @@
+#include "spsc_ring.h"
+
+_Static_assert((SPSC_RING_CAPACITY & (SPSC_RING_CAPACITY - 1)) == 0,
+               "SPSC_RING_CAPACITY must be a power of two");
+
+void SpscRing_Init(SpscRing *ring)
+{
+    for (size_t i = 0; i < SPSC_RING_CAPACITY; i++) {
+        ring->slots[i] = NULL;
+    }
+    atomic_init(&ring->head, 0);
+    atomic_init(&ring->tail, 0);
+}
+
+bool SpscRing_Push(SpscRing *ring, void *entry)
+{
+    size_t tail = atomic_load_explicit(&ring->tail, memory_order_relaxed);
+    size_t head = atomic_load_explicit(&ring->head, memory_order_acquire);
+    if (tail - head == SPSC_RING_CAPACITY) {
+        return false;
+    }
+
+    ring->slots[tail & (SPSC_RING_CAPACITY - 1)] = entry;
+    atomic_store_explicit(&ring->tail, tail + 1, memory_order_release);
+    return true;
+}
+
+void *SpscRing_Pop(SpscRing *ring)
+{
+    size_t head = atomic_load_explicit(&ring->head, memory_order_relaxed);
+    size_t tail = atomic_load_explicit(&ring->tail, memory_order_acquire);
+    if (head == tail) {
+        return NULL;
+    }
+
+    void *entry = ring->slots[head & (SPSC_RING_CAPACITY - 1)];
+    atomic_store_explicit(&ring->head, head + 1, memory_order_release);
+    return entry;
+}
@@ -0,0 +1,40 @@
+#pragma once
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stddef.h>
+
+/// <summary>
+///     Number of slots in a ring. Must be a power of two.
+/// </summary>
+#define SPSC_RING_CAPACITY 8
+
+/// <summary>
+/// <para>Lock-free ring of pointers between exactly one producer thread and one consumer
+/// thread.</para>
+/// <para>The producer only writes tail and the consumer only writes head, so each index has a
+/// single writer. The release store of an index publishes the slot it covers and the acquire load
+/// on the other side makes the slot contents visible before they are used. The indexes run
+/// freely and are masked on access, so a full ring uses every slot.</para>
+/// </summary>
+typedef struct SpscRing {
+    void *slots[SPSC_RING_CAPACITY];
+    atomic_size_t head;
+    atomic_size_t tail;
+} SpscRing;
+
+/// <summary>
+///     Initializes an empty ring. Must be called before either thread uses it.
+/// </summary>
+void SpscRing_Init(SpscRing *ring);
+
+/// <summary>
+///     Adds an entry. Call only from the producer thread.
+/// </summary>
+/// <returns>true on success, or false if the ring is full</returns>
+bool SpscRing_Push(SpscRing *ring, void *entry);
+
+/// <summary>
+///     Removes the oldest entry. Call only from the consumer thread.
+/// </summary>
+/// <returns>The entry, or NULL if the ring is empty</returns>
+void *SpscRing_Pop(SpscRing *ring);
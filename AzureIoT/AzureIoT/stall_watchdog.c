@@ -0,0 +1,256 @@
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+#include <applibs/log.h>
+#include "stall_watchdog.h"
+
+static bool enabled = false;
+static uint32_t budgetMs = 0;
+static StallWatchdogStatistics statistics;
+
+// The handler the main thread is running, shared with the watchdog thread. The main thread is
+// the only writer; the sequence number is odd while it is changing the pair, so the watchdog
+// thread can tell a torn read and retry.
+static atomic_uint sequence;
+static _Atomic(const char *) currentName;
+static atomic_uint currentStartMs;
+
+static atomic_bool stopping;
+static atomic_uint liveDetections;
+static atomic_uint threadWakeups;
+static pthread_t watchdogThread;
+static bool threadStarted = false;
+
+// The thread waits on the condition: with no deadline while no handler is running or it is
+// parked, otherwise until the running handler's budget runs out. It sets idle before its last
+// check for a running handler, so a handler that starts after that check sees it and signals.
+// Parked is only changed with the mutex held.
+static pthread_mutex_t wakeMutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t wakeCondition;
+static atomic_bool parked;
+static atomic_bool idle;
+
+static uint32_t GetTimeMs(void)
+{
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (uint32_t)((uint64_t)now.tv_sec * 1000 + (uint64_t)now.tv_nsec / 1000000);
+}
+
+static void PublishCurrent(const char *name, uint32_t startMs)
+{
+    unsigned int seq = atomic_load_explicit(&sequence, memory_order_relaxed);
+    atomic_store_explicit(&sequence, seq + 1, memory_order_relaxed);
+    atomic_thread_fence(memory_order_release);
+    atomic_store_explicit(&currentName, name, memory_order_relaxed);
+    atomic_store_explicit(&currentStartMs, startMs, memory_order_relaxed);
+    atomic_store_explicit(&sequence, seq + 2, memory_order_release);
+}
+
+/// <summary>
+///     Reads the handler the main thread is running, retrying torn reads.
+/// </summary>
+/// <returns>The sequence number the handler was published with</returns>
+static unsigned int ReadCurrent(const char **name, uint32_t *startMs)
+{
+    for (;;) {
+        unsigned int before = atomic_load_explicit(&sequence, memory_order_acquire);
+        *name = atomic_load_explicit(&currentName, memory_order_relaxed);
+        *startMs = atomic_load_explicit(&currentStartMs, memory_order_relaxed);
+        atomic_thread_fence(memory_order_acquire);
+        if ((before & 1) == 0 &&
+            atomic_load_explicit(&sequence, memory_order_relaxed) == before) {
+            return before;
+        }
+    }
+}
+
+/// <summary>
+///     Waits on the condition for up to timeoutMs, or without a deadline if it is 0. Called
+///     with wakeMutex held.
+/// </summary>
+static void Wait(uint32_t timeoutMs)
+{
+    if (timeoutMs == 0) {
+        pthread_cond_wait(&wakeCondition, &wakeMutex);
+    } else {
+        struct timespec deadline;
+        clock_gettime(CLOCK_MONOTONIC, &deadline);
+        deadline.tv_sec += timeoutMs / 1000;
+        deadline.tv_nsec += (long)(timeoutMs % 1000) * 1000000;
+        if (deadline.tv_nsec >= 1000000000) {
+            deadline.tv_sec++;
+            deadline.tv_nsec -= 1000000000;
+        }
+        pthread_cond_timedwait(&wakeCondition, &wakeMutex, &deadline);
+    }
+    atomic_fetch_add(&threadWakeups, 1);
+}
+
+static void *WatchdogThread(void *argument)
+{
+    (void)argument;
+    unsigned int reportedSequence = 0;
+
+    pthread_mutex_lock(&wakeMutex);
+    while (!atomic_load(&stopping)) {
+        const char *name;
+        uint32_t startMs;
+        unsigned int seq = ReadCurrent(&name, &startMs);
+        if (atomic_load(&parked) || name == NULL) {
+            atomic_store(&idle, true);
+            atomic_thread_fence(memory_order_seq_cst);
+            ReadCurrent(&name, &startMs);
+            if ((atomic_load(&parked) || name == NULL) && !atomic_load(&stopping)) {
+                Wait(0);
+            }
+            atomic_store(&idle, false);
+            continue;
+        }
+
+        uint32_t runningMs = GetTimeMs() - startMs;
+        if (runningMs <= budgetMs) {
+            // Sleep until this handler's budget runs out; if another handler is running by then,
+            // its own deadline is checked instead.
+            Wait(budgetMs - runningMs + 1);
+            continue;
+        }
+        if (seq != reportedSequence) {
+            reportedSequence = seq;
+            atomic_fetch_add(&liveDetections, 1);
+            Log_Debug("WARNING: event loop stalled: %s has been running for %u ms\n", name,
+                      runningMs);
+        }
+        Wait(budgetMs);
+    }
+    pthread_mutex_unlock(&wakeMutex);
+    return NULL;
+}
+
+int StallWatchdog_Start(uint32_t newBudgetMs)
+{
+    budgetMs = newBudgetMs < 2 ? 2 : newBudgetMs;
+    memset(&statistics, 0, sizeof(statistics));
+    statistics.budgetMs = budgetMs;
+    atomic_init(&sequence, 0);
+    atomic_init(&currentName, NULL);
+    atomic_init(&currentStartMs, 0);
+    atomic_init(&stopping, false);
+    atomic_init(&liveDetections, 0);
+    atomic_init(&threadWakeups, 0);
+    atomic_init(&idle, false);
+    atomic_init(&parked, false);
+    enabled = true;
+
+    // Deadlines are on the monotonic clock, like the handler start times.
+    pthread_condattr_t attributes;
+    pthread_condattr_init(&attributes);
+    pthread_condattr_setclock(&attributes, CLOCK_MONOTONIC);
+    int result = pthread_cond_init(&wakeCondition, &attributes);
+    pthread_condattr_destroy(&attributes);
+    if (result != 0) {
+        Log_Debug("ERROR: Could not create watchdog condition: %s (%d).\n", strerror(result),
+                  result);
+        return -1;
+    }
+
+    result = pthread_create(&watchdogThread, NULL, WatchdogThread, NULL);
+    if (result != 0) {
+        Log_Debug("ERROR: Could not start watchdog thread: %s (%d).\n", strerror(result), result);
+        pthread_cond_destroy(&wakeCondition);
+        return -1;
+    }
+    threadStarted = true;
+    return 0;
+}
+
+void StallWatchdog_Stop(void)
+{
+    if (!threadStarted) {
+        return;
+    }
+    pthread_mutex_lock(&wakeMutex);
+    atomic_store(&stopping, true);
+    pthread_cond_signal(&wakeCondition);
+    pthread_mutex_unlock(&wakeMutex);
+    pthread_join(watchdogThread, NULL);
+    pthread_cond_destroy(&wakeCondition);
+    threadStarted = false;
+}
+
+void StallWatchdog_SetParked(bool newParked)
+{
+    if (!threadStarted) {
+        return;
+    }
+    pthread_mutex_lock(&wakeMutex);
+    atomic_store(&parked, newParked);
+    pthread_cond_signal(&wakeCondition);
+    pthread_mutex_unlock(&wakeMutex);
+}
+
+void StallWatchdog_Enter(StallWatchScope *scope, const char *name, uint64_t nowMs)
+{
+    if (!enabled) {
+        return;
+    }
+    scope->previousName = atomic_load_explicit(&currentName, memory_order_relaxed);
+    scope->previousStartMs = atomic_load_explicit(&currentStartMs, memory_order_relaxed);
+    scope->stallsAtEntry = statistics.stalls;
+    PublishCurrent(name, (uint32_t)nowMs);
+
+    // Only the outermost handler needs to wake an idle watchdog thread; a nested one runs
+    // within the outer one's deadline.
+    if (threadStarted && scope->previousName == NULL) {
+        atomic_thread_fence(memory_order_seq_cst);
+        if (atomic_load(&idle) && !atomic_load(&parked)) {
+            pthread_mutex_lock(&wakeMutex);
+            pthread_cond_signal(&wakeCondition);
+            pthread_mutex_unlock(&wakeMutex);
+        }
+    }
+}
+
+void StallWatchdog_Leave(const StallWatchScope *scope, uint32_t elapsedMs)
+{
+    if (!enabled) {
+        return;
+    }
+
+    // A stall inside a nested handler has already been counted against that handler.
+    if (elapsedMs > budgetMs && statistics.stalls == scope->stallsAtEntry) {
+        const char *name = atomic_load_explicit(&currentName, memory_order_relaxed);
+        statistics.stalls++;
+        statistics.lastMs = elapsedMs;
+        statistics.lastHandler = name;
+        if (elapsedMs > statistics.worstMs) {
+            statistics.worstMs = elapsedMs;
+            statistics.worstHandler = name;
+        }
+        Log_Debug("WARNING: %s ran for %u ms, over the %u ms budget\n", name, elapsedMs, budgetMs);
+    }
+
+    PublishCurrent(scope->previousName, scope->previousStartMs);
+}
+
+void StallWatchdog_GetStatistics(StallWatchdogStatistics *copy)
+{
+    *copy = statistics;
+    copy->liveDetections = atomic_load(&liveDetections);
+    copy->threadWakeups = atomic_load(&threadWakeups);
+}
+
+int StallWatchdog_FormatStatistics(char *buffer, size_t bufferSize)
+{
+    StallWatchdogStatistics s;
+    StallWatchdog_GetStatistics(&s);
+    return snprintf(buffer, bufferSize,
+                    "\"budgetMs\":%u,\"stalls\":%u,\"worstMs\":%u,\"worstHandler\":\"%s\","
+                    "\"lastMs\":%u,\"lastHandler\":\"%s\",\"liveDetections\":%u,"
+                    "\"threadWakeups\":%u",
+                    s.budgetMs, s.stalls, s.worstMs, s.worstHandler ? s.worstHandler : "",
+                    s.lastMs, s.lastHandler ? s.lastHandler : "", s.liveDetections,
+                    s.threadWakeups);
+}
@@ -0,0 +1,88 @@
+#pragma once
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+/// <summary>
+///     State saved when a handler starts, so that handlers run from inside other handlers, such
+///     as logical timers run by the timer wheel, are attributed correctly.
+/// </summary>
+typedef struct StallWatchScope {
+    const char *previousName;
+    uint32_t previousStartMs;
+    uint32_t stallsAtEntry;
+} StallWatchScope;
+
+/// <summary>
+///     Stalls seen by the watchdog. Only the main thread writes them, apart from liveDetections.
+/// </summary>
+typedef struct StallWatchdogStatistics {
+    uint32_t budgetMs;
+    uint32_t stalls;
+    uint32_t worstMs;
+    const char *worstHandler;
+    uint32_t lastMs;
+    const char *lastHandler;
+    /// <summary>
+    /// Stalls the watchdog thread reported while the handler was still running.
+    /// </summary>
+    uint32_t liveDetections;
+    /// <summary>
+    /// Times the watchdog thread woke up.
+    /// </summary>
+    uint32_t threadWakeups;
+} StallWatchdogStatistics;
+
+/// <summary>
+/// <para>Starts the event loop watchdog.</para>
+/// <para>The main thread names the handler it is running through StallWatchdog_Enter and
+/// StallWatchdog_Leave. A handler that runs for longer than the budget counts as a stall when
+/// it returns. A watchdog thread also logs a handler that is still running past the budget, so a
+/// handler that blocks for seconds, or never returns, is named while it is blocked. The thread
+/// sleeps on a condition variable: without a deadline while the loop is idle, and until the
+/// budget runs out while a handler is running. The outermost handler wakes it only if it is
+/// idle, so it wakes at most about twice per loop wakeup, and once per budget while the loop is
+/// busy.</para>
+/// </summary>
+/// <param name="budgetMs">Longest time a handler may run, at least 2 ms</param>
+/// <returns>0 on success, or -1 if the thread could not be started. Stalls are still counted
+/// when handlers return.</returns>
+int StallWatchdog_Start(uint32_t budgetMs);
+
+/// <summary>
+///     Stops the watchdog thread.
+/// </summary>
+void StallWatchdog_Stop(void);
+
+/// <summary>
+///     Parks or resumes the watchdog thread. A parked thread sleeps without waking until it is
+///     resumed, for low-power operation; stalls are then only counted when handlers return.
+/// </summary>
+void StallWatchdog_SetParked(bool parked);
+
+/// <summary>
+///     Records that the main thread is starting a handler. Does nothing if the watchdog has not
+///     been started.
+/// </summary>
+/// <param name="scope">Caller storage that must be passed to StallWatchdog_Leave</param>
+/// <param name="name">Handler name; the string must stay in memory</param>
+/// <param name="nowMs">Current CLOCK_MONOTONIC time in milliseconds</param>
+void StallWatchdog_Enter(StallWatchScope *scope, const char *name, uint64_t nowMs);
+
+/// <summary>
+///     Records that the handler started by the matching StallWatchdog_Enter has returned.
+/// </summary>
+/// <param name="scope">Storage passed to StallWatchdog_Enter</param>
+/// <param name="elapsedMs">How long the handler ran</param>
+void StallWatchdog_Leave(const StallWatchScope *scope, uint32_t elapsedMs);
+
+/// <summary>
+///     Copies the statistics.
+/// </summary>
+void StallWatchdog_GetStatistics(StallWatchdogStatistics *statistics);
+
+/// <summary>
+///     Formats the statistics as a JSON object body, without the surrounding braces.
+/// </summary>
+/// <returns>The snprintf result</returns>
+int StallWatchdog_FormatStatistics(char *buffer, size_t bufferSize);
@@ -0,0 +1,317 @@
+#include <errno.h>
+#include <math.h>
+#include <stdbool.h>
+#include <stdlib.h>
+#include <string.h>
+#include "telemetry_encoder.h"
+
+void TelemetryBuffer_Init(TelemetryBuffer *buffer, uint8_t *storage, size_t capacity)
+{
+    buffer->data = storage;
+    buffer->capacity = capacity;
+    buffer->length = 0;
+    buffer->fieldCount = 0;
+    buffer->recordCount = 0;
+    buffer->inBatch = false;
+}
+
+/// <summary>
+///     Prepares the buffer for a new record: outside a batch the previous message is discarded.
+/// </summary>
+static void StartRecord(TelemetryBuffer *buffer)
+{
+    if (!buffer->inBatch) {
+        buffer->length = 0;
+    }
+    buffer->fieldCount = 0;
+}
+
+static void StartBatch(TelemetryBuffer *buffer)
+{
+    buffer->length = 0;
+    buffer->fieldCount = 0;
+    buffer->recordCount = 0;
+    buffer->inBatch = true;
+}
+
+static int AppendBytes(TelemetryBuffer *buffer, const void *bytes, size_t count)
+{
+    if (buffer->capacity - buffer->length < count) {
+        return -1;
+    }
+    memcpy(buffer->data + buffer->length, bytes, count);
+    buffer->length += count;
+    return 0;
+}
+
+// JSON encoder. The body is kept null terminated so it can be logged directly, which means one
+// byte of the capacity is always reserved for the terminator.
+
+static int JsonAppend(TelemetryBuffer *buffer, const char *text)
+{
+    size_t textLength = strlen(text);
+    if (buffer->capacity - buffer->length < textLength + 1) {
+        return -1;
+    }
+    memcpy(buffer->data + buffer->length, text, textLength + 1);
+    buffer->length += textLength;
+    return 0;
+}
+
+static int JsonBegin(TelemetryBuffer *buffer)
+{
+    StartRecord(buffer);
+    return JsonAppend(buffer, buffer->inBatch && buffer->recordCount > 0 ? ",{" : "{");
+}
+
+static int JsonAddField(TelemetryBuffer *buffer, const char *key, const char *value)
+{
+    size_t start = buffer->length;
+    if (JsonAppend(buffer, buffer->fieldCount == 0 ? " \"" : ", \"") != 0 ||
+        JsonAppend(buffer, key) != 0 || JsonAppend(buffer, "\": \"") != 0 ||
+        JsonAppend(buffer, value) != 0 || JsonAppend(buffer, "\"") != 0) {
+        buffer->length = start;
+        buffer->data[start] = 0;
+        return -1;
+    }
+    buffer->fieldCount++;
+    return 0;
+}
+
+static int JsonEnd(TelemetryBuffer *buffer)
+{
+    if (JsonAppend(buffer, "}") != 0) {
+        return -1;
+    }
+    buffer->recordCount++;
+    return 0;
+}
+
+static int JsonBeginBatch(TelemetryBuffer *buffer)
+{
+    StartBatch(buffer);
+    return JsonAppend(buffer, "[");
+}
+
+static int JsonEndBatch(TelemetryBuffer *buffer)
+{
+    buffer->inBatch = false;
+    return JsonAppend(buffer, "]");
+}
+
+const TelemetryEncoder JsonTelemetryEncoder = {.name = "json",
+                                               .contentType = "application/json",
+                                               .contentEncoding = "utf-8",
+                                               .begin = JsonBegin,
+                                               .addField = JsonAddField,
+                                               .end = JsonEnd,
+                                               .beginBatch = JsonBeginBatch,
+                                               .endBatch = JsonEndBatch,
+                                               .batchClosingSize = 1,
+                                               .batchOpeningSize = 1};
+
+// CBOR encoder. Uses an indefinite-length map so fields can be appended without knowing the
+// final count up front.
+
+#define CBOR_MAJOR_UNSIGNED 0
+#define CBOR_MAJOR_NEGATIVE 1
+#define CBOR_MAJOR_TEXT 3
+#define CBOR_INDEFINITE_ARRAY 0x9f
+#define CBOR_INDEFINITE_MAP 0xbf
+#define CBOR_FLOAT32 0xfa
+#define CBOR_BREAK 0xff
+
+static int CborAppendHead(TelemetryBuffer *buffer, uint8_t majorType, uint64_t argument)
+{
+    uint8_t head[9];
+    size_t headLength;
+    uint8_t initial = (uint8_t)(majorType << 5);
+
+    if (argument < 24) {
+        head[0] = (uint8_t)(initial | argument);
+        headLength = 1;
+    } else if (argument <= UINT8_MAX) {
+        head[0] = initial | 24;
+        head[1] = (uint8_t)argument;
+        headLength = 2;
+    } else if (argument <= UINT16_MAX) {
+        head[0] = initial | 25;
+        head[1] = (uint8_t)(argument >> 8);
+        head[2] = (uint8_t)argument;
+        headLength = 3;
+    } else if (argument <= UINT32_MAX) {
+        head[0] = initial | 26;
+        for (int i = 0; i < 4; i++) {
+            head[1 + i] = (uint8_t)(argument >> (24 - 8 * i));
+        }
+        headLength = 5;
+    } else {
+        head[0] = initial | 27;
+        for (int i = 0; i < 8; i++) {
+            head[1 + i] = (uint8_t)(argument >> (56 - 8 * i));
+        }
+        headLength = 9;
+    }
+
+    return AppendBytes(buffer, head, headLength);
+}
+
+static int CborAppendText(TelemetryBuffer *buffer, const char *text)
+{
+    size_t textLength = strlen(text);
+    if (CborAppendHead(buffer, CBOR_MAJOR_TEXT, textLength) != 0) {
+        return -1;
+    }
+    return AppendBytes(buffer, text, textLength);
+}
+
+static bool IsDigit(char c)
+{
+    return c >= '0' && c <= '9';
+}
+
+/// <summary>
+///     Checks that the whole string is a plain decimal number: an optional minus sign, digits
+///     with an optional fraction, and an optional exponent. strtoll and strtof would also accept
+///     leading spaces, a plus sign, hexadecimal, "nan" and "inf".
+/// </summary>
+static bool IsDecimalNumber(const char *value, bool *isInteger)
+{
+    const char *c = value;
+    if (*c == '-') {
+        c++;
+    }
+    size_t digits = 0;
+    while (IsDigit(*c)) {
+        c++;
+        digits++;
+    }
+    *isInteger = true;
+    if (*c == '.') {
+        *isInteger = false;
+        c++;
+        while (IsDigit(*c)) {
+            c++;
+            digits++;
+        }
+    }
+    if (digits == 0) {
+        return false;
+    }
+    if (*c == 'e' || *c == 'E') {
+        *isInteger = false;
+        c++;
+        if (*c == '-' || *c == '+') {
+            c++;
+        }
+        if (!IsDigit(*c)) {
+            return false;
+        }
+        while (IsDigit(*c)) {
+            c++;
+        }
+    }
+    return *c == 0;
+}
+
+/// <summary>
+///     Writes the value as a CBOR integer or float if the whole string is a decimal number that
+///     fits, and as a text string otherwise.
+/// </summary>
+static int CborAppendValue(TelemetryBuffer *buffer, const char *value)
+{
+    bool isInteger;
+    if (!IsDecimalNumber(value, &isInteger)) {
+        return CborAppendText(buffer, value);
+    }
+
+    char *end = NULL;
+    errno = 0;
+    long long integer = isInteger ? strtoll(value, &end, 10) : 0;
+    // An integer out of range is still written as a float
+    if (isInteger && errno != ERANGE) {
+        if (integer >= 0) {
+            return CborAppendHead(buffer, CBOR_MAJOR_UNSIGNED, (uint64_t)integer);
+        }
+        return CborAppendHead(buffer, CBOR_MAJOR_NEGATIVE, (uint64_t)(-1 - integer));
+    }
+
+    errno = 0;
+    float real = strtof(value, &end);
+    // Overflow gives infinity and underflow loses the value, so both are kept as text
+    if (*end == 0 && errno != ERANGE && isfinite(real)) {
+        uint32_t bits;
+        memcpy(&bits, &real, sizeof(bits));
+        uint8_t encoded[5] = {CBOR_FLOAT32, (uint8_t)(bits >> 24), (uint8_t)(bits >> 16),
+                              (uint8_t)(bits >> 8), (uint8_t)bits};
+        return AppendBytes(buffer, encoded, sizeof(encoded));
+    }
+
+    return CborAppendText(buffer, value);
+}
+
+static int CborBegin(TelemetryBuffer *buffer)
+{
+    static const uint8_t mapStart = CBOR_INDEFINITE_MAP;
+    StartRecord(buffer);
+    return AppendBytes(buffer, &mapStart, 1);
+}
+
+static int CborAddField(TelemetryBuffer *buffer, const char *key, const char *value)
+{
+    size_t start = buffer->length;
+    if (CborAppendText(buffer, key) != 0 || CborAppendValue(buffer, value) != 0) {
+        buffer->length = start;
+        return -1;
+    }
+    buffer->fieldCount++;
+    return 0;
+}
+
+static int CborEnd(TelemetryBuffer *buffer)
+{
+    static const uint8_t mapEnd = CBOR_BREAK;
+    if (AppendBytes(buffer, &mapEnd, 1) != 0) {
+        return -1;
+    }
+    buffer->recordCount++;
+    return 0;
+}
+
+static int CborBeginBatch(TelemetryBuffer *buffer)
+{
+    static const uint8_t arrayStart = CBOR_INDEFINITE_ARRAY;
+    StartBatch(buffer);
+    return AppendBytes(buffer, &arrayStart, 1);
+}
+
+static int CborEndBatch(TelemetryBuffer *buffer)
+{
+    static const uint8_t arrayEnd = CBOR_BREAK;
+    buffer->inBatch = false;
+    return AppendBytes(buffer, &arrayEnd, 1);
+}
+
+const TelemetryEncoder CborTelemetryEncoder = {.name = "cbor",
+                                               .contentType = "application/cbor",
+                                               .contentEncoding = NULL,
+                                               .begin = CborBegin,
+                                               .addField = CborAddField,
+                                               .end = CborEnd,
+                                               .beginBatch = CborBeginBatch,
+                                               .endBatch = CborEndBatch,
+                                               .batchClosingSize = 1,
+                                               .batchOpeningSize = 1};
+
+const TelemetryEncoder *GetTelemetryEncoderByName(const char *name)
+{
+    static const TelemetryEncoder *const encoders[] = {&JsonTelemetryEncoder,
+                                                       &CborTelemetryEncoder};
+
+    for (size_t i = 0; i < sizeof(encoders) / sizeof(encoders[0]); i++) {
+        if (strcmp(encoders[i]->name, name) == 0) {
+            return encoders[i];
+        }
+    }
+    return NULL;
+}
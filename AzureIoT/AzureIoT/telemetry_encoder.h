@@ -0,0 +1,117 @@
+#pragma once
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+/// <summary>
+/// <para>Output buffer that a telemetry encoder appends fields to.</para>
+/// <para>The storage is owned by the caller; the encoder only tracks how much of it has been
+/// written so that a message can be built incrementally and handed to the IoT Hub SDK
+/// without a second copy.</para>
+/// </summary>
+typedef struct TelemetryBuffer {
+    /// <summary>
+    /// Caller-provided storage for the encoded message.
+    /// </summary>
+    uint8_t *data;
+    /// <summary>
+    /// Size of the storage in bytes.
+    /// </summary>
+    size_t capacity;
+    /// <summary>
+    /// Number of bytes encoded so far.
+    /// </summary>
+    size_t length;
+    /// <summary>
+    /// Number of fields added since the last call to begin.
+    /// </summary>
+    size_t fieldCount;
+    /// <summary>
+    /// Number of records completed since the last call to beginBatch.
+    /// </summary>
+    size_t recordCount;
+    /// <summary>
+    /// Set between beginBatch and endBatch; records are then appended rather than replacing
+    /// the buffer contents.
+    /// </summary>
+    bool inBatch;
+} TelemetryBuffer;
+
+/// <summary>
+/// <para>Function table for a telemetry body encoding.</para>
+/// <para>A message is built by calling begin, then addField once per key/value pair, then end.
+/// Several such records can be packed into one message as an array by wrapping them in
+/// beginBatch and endBatch. Every function returns 0 on success or -1 if the encoded output does
+/// not fit; addField then leaves the buffer exactly as it was before the call.</para>
+/// </summary>
+typedef struct TelemetryEncoder {
+    /// <summary>
+    /// Name used to select the encoder from configuration, e.g. "json" or "cbor".
+    /// </summary>
+    const char *name;
+    /// <summary>
+    /// Value for the message content-type system property.
+    /// </summary>
+    const char *contentType;
+    /// <summary>
+    /// Value for the message content-encoding system property, or NULL if none applies.
+    /// </summary>
+    const char *contentEncoding;
+    /// <summary>
+    /// Starts a record. Outside a batch this resets the buffer first.
+    /// </summary>
+    int (*begin)(TelemetryBuffer *buffer);
+    /// <summary>
+    /// Appends one field. The value is taken as text from the UART parser; encoders that support
+    /// native numbers write it as a number when the whole string is numeric.
+    /// </summary>
+    int (*addField)(TelemetryBuffer *buffer, const char *key, const char *value);
+    /// <summary>
+    /// Completes a record.
+    /// </summary>
+    int (*end)(TelemetryBuffer *buffer);
+    /// <summary>
+    /// Resets the buffer and opens an array of records.
+    /// </summary>
+    int (*beginBatch)(TelemetryBuffer *buffer);
+    /// <summary>
+    /// Closes the array of records. Always writes exactly batchClosingSize bytes.
+    /// </summary>
+    int (*endBatch)(TelemetryBuffer *buffer);
+    /// <summary>
+    /// Number of bytes endBatch appends, so that a packer can reserve room for it up front.
+    /// </summary>
+    size_t batchClosingSize;
+    /// <summary>
+    /// Number of bytes beginBatch writes. A batch holding a single record can be sent without
+    /// its array framing by skipping this many bytes and not calling endBatch.
+    /// </summary>
+    size_t batchOpeningSize;
+} TelemetryEncoder;
+
+/// <summary>
+///     JSON encoder. Produces the same bodies the application has always sent, e.g.
+///     { "RoomTemp": "23"}, so existing IoT Central templates keep working.
+/// </summary>
+extern const TelemetryEncoder JsonTelemetryEncoder;
+
+/// <summary>
+///     CBOR (RFC 7049) encoder. Writes an indefinite-length map whose numeric values are
+///     encoded as CBOR integers or single-precision floats rather than quoted strings.
+/// </summary>
+extern const TelemetryEncoder CborTelemetryEncoder;
+
+/// <summary>
+///     Initializes a telemetry buffer over caller-provided storage.
+/// </summary>
+/// <param name="buffer">Buffer to initialize</param>
+/// <param name="storage">Storage the encoded message is written to</param>
+/// <param name="capacity">Size of the storage in bytes</param>
+void TelemetryBuffer_Init(TelemetryBuffer *buffer, uint8_t *storage, size_t capacity);
+
+/// <summary>
+///     Looks up an encoder by its configuration name (case-sensitive).
+/// </summary>
+/// <param name="name">Encoder name, e.g. "json" or "cbor"</param>
+/// <returns>The matching encoder, or NULL if the name is unknown</returns>
+const TelemetryEncoder *GetTelemetryEncoderByName(const char *name);
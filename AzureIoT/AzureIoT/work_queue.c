@@ -0,0 +1,75 @@
+#include <string.h>
+#include "work_queue.h"
+
+void WorkItem_Init(WorkItem *item, WorkFunction function, void *context)
+{
+    item->next = NULL;
+    item->function = function;
+    item->context = context;
+    item->queued = false;
+}
+
+void WorkQueue_Init(WorkQueue *queue)
+{
+    memset(queue, 0, sizeof(*queue));
+}
+
+bool WorkQueue_Post(WorkQueue *queue, WorkItem *item)
+{
+    if (item->queued) {
+        queue->statistics.coalesced++;
+        return false;
+    }
+
+    item->queued = true;
+    item->next = NULL;
+    if (queue->tail != NULL) {
+        queue->tail->next = item;
+    } else {
+        queue->head = item;
+    }
+    queue->tail = item;
+
+    queue->depth++;
+    queue->statistics.posted++;
+    if (queue->depth > queue->statistics.maxDepth) {
+        queue->statistics.maxDepth = queue->depth;
+    }
+    return true;
+}
+
+bool WorkQueue_IsEmpty(const WorkQueue *queue)
+{
+    return queue->head == NULL;
+}
+
+bool WorkQueue_RunOne(WorkQueue *queue)
+{
+    WorkItem *item = queue->head;
+    if (item == NULL) {
+        return false;
+    }
+
+    queue->head = item->next;
+    if (queue->head == NULL) {
+        queue->tail = NULL;
+    }
+    queue->depth--;
+
+    // Clear the flag before running so that the function can post its item again.
+    item->queued = false;
+    item->next = NULL;
+    queue->statistics.runs++;
+    item->function(item);
+    return true;
+}
+
+size_t WorkQueue_RunAll(WorkQueue *queue)
+{
+    size_t pending = queue->depth;
+    size_t run = 0;
+    while (run < pending && WorkQueue_RunOne(queue)) {
+        run++;
+    }
+    return run;
+}
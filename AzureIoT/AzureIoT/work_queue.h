@@ -0,0 +1,86 @@
+#pragma once
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+/// Forward declaration of the work item passed to the work functions.
+struct WorkItem;
+
+/// <summary>
+///     Function signature for deferred work.
+/// </summary>
+/// <param name="item">The work item being run</param>
+typedef void (*WorkFunction)(struct WorkItem *item);
+
+/// <summary>
+/// <para>A piece of work that can be posted to a <see cref="WorkQueue" />.</para>
+/// <para>The item is linked into the queue rather than copied, so it must stay in memory while
+/// it is queued. Posting an item that is already queued does nothing, which coalesces repeated
+/// requests for the same work into one run.</para>
+/// </summary>
+typedef struct WorkItem {
+    struct WorkItem *next;
+    WorkFunction function;
+    /// <summary>
+    /// Caller data for the work function.
+    /// </summary>
+    void *context;
+    bool queued;
+} WorkItem;
+
+/// <summary>
+///     Counters describing how much work a queue ran.
+/// </summary>
+typedef struct WorkQueueStatistics {
+    uint32_t posted;
+    uint32_t coalesced;
+    uint32_t runs;
+    uint32_t maxDepth;
+} WorkQueueStatistics;
+
+/// <summary>
+///     First-in, first-out queue of work items.
+/// </summary>
+typedef struct WorkQueue {
+    WorkItem *head;
+    WorkItem *tail;
+    uint32_t depth;
+    WorkQueueStatistics statistics;
+} WorkQueue;
+
+/// <summary>
+///     Initializes an item that is not queued.
+/// </summary>
+/// <param name="item">Item to initialize</param>
+/// <param name="function">Function that does the work</param>
+/// <param name="context">Caller data for the function</param>
+void WorkItem_Init(WorkItem *item, WorkFunction function, void *context);
+
+/// <summary>
+///     Initializes an empty queue.
+/// </summary>
+void WorkQueue_Init(WorkQueue *queue);
+
+/// <summary>
+///     Adds an item to the end of the queue, unless it is already queued.
+/// </summary>
+/// <returns>true if the item was added, false if it was already queued</returns>
+bool WorkQueue_Post(WorkQueue *queue, WorkItem *item);
+
+/// <summary>
+///     Checks whether the queue is empty.
+/// </summary>
+bool WorkQueue_IsEmpty(const WorkQueue *queue);
+
+/// <summary>
+///     Runs the items that are queued when it is called. Items posted while they run, including
+///     an item that re-posts itself, wait for the next call so that the caller is not starved.
+/// </summary>
+/// <returns>The number of items run</returns>
+size_t WorkQueue_RunAll(WorkQueue *queue);
+
+/// <summary>
+///     Runs the item at the head of the queue, if any.
+/// </summary>
+/// <returns>true if an item was run</returns>
+bool WorkQueue_RunOne(WorkQueue *queue);
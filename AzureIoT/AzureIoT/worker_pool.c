@@ -0,0 +1,213 @@
+#include <errno.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/eventfd.h>
+#include <applibs/log.h>
+#include "worker_pool.h"
+
+static void *WorkerThread(void *argument)
+{
+    Worker *worker = argument;
+    WorkerPool *pool = worker->pool;
+
+    for (;;) {
+        WorkerJob *job;
+        while ((job = SpscRing_Pop(&worker->requests)) != NULL) {
+            job->run(job);
+            CompletionQueue_Post(&pool->completions, &job->completion);
+        }
+
+        if (atomic_load(&pool->stopping)) {
+            return NULL;
+        }
+
+        // The counter keeps any wakeup written since the ring was found empty, so this does not
+        // miss a job.
+        eventfd_t wakeups;
+        if (eventfd_read(worker->wakeFd, &wakeups) != 0 && errno != EINTR) {
+            Log_Debug("ERROR: worker could not wait for jobs: %s (%d).\n", strerror(errno), errno);
+            return NULL;
+        }
+    }
+}
+
+static void CompleteJob(WorkerPool *pool, WorkerJob *job)
+{
+    pool->statistics.completed++;
+    job->complete(job);
+}
+
+/// <summary>
+///     Pushes a job to its worker's ring and wakes the worker.
+/// </summary>
+/// <returns>true on success, or false if the ring is full</returns>
+static bool PushJob(WorkerPool *pool, Worker *worker, WorkerJob *job)
+{
+    if (worker->pending >= SPSC_RING_CAPACITY || !SpscRing_Push(&worker->requests, job)) {
+        return false;
+    }
+    worker->pending++;
+    if (worker->pending > pool->statistics.maxPending) {
+        pool->statistics.maxPending = worker->pending;
+    }
+    eventfd_write(worker->wakeFd, 1);
+    return true;
+}
+
+/// <summary>
+///     Moves held-back jobs to the ring while it has room.
+/// </summary>
+static void PushOverflow(WorkerPool *pool, Worker *worker)
+{
+    while (worker->overflowHead != NULL && PushJob(pool, worker, worker->overflowHead)) {
+        worker->overflowHead = worker->overflowHead->next;
+        if (worker->overflowHead == NULL) {
+            worker->overflowTail = NULL;
+        }
+    }
+}
+
+static void FinishedJobHandler(CompletionEntry *entry)
+{
+    WorkerJob *job = entry->context;
+    Worker *worker = job->worker;
+    WorkerPool *pool = worker->pool;
+    worker->pending--;
+    CompleteJob(pool, job);
+    // While stopping, the threads may have exited, so WorkerPool_Stop runs what is held back.
+    if (!atomic_load(&pool->stopping)) {
+        PushOverflow(pool, worker);
+    }
+}
+
+int WorkerPool_Start(WorkerPool *pool, unsigned int threadCount, int epollFd)
+{
+    memset(pool, 0, sizeof(*pool));
+    pool->completions.eventData.fd = -1;
+    atomic_init(&pool->stopping, false);
+    for (unsigned int i = 0; i < WORKER_POOL_MAX_THREADS; i++) {
+        pool->workers[i].wakeFd = -1;
+        pool->workers[i].pool = pool;
+        SpscRing_Init(&pool->workers[i].requests);
+    }
+
+    if (threadCount == 0) {
+        return 0;
+    }
+    if (threadCount > WORKER_POOL_MAX_THREADS) {
+        threadCount = WORKER_POOL_MAX_THREADS;
+    }
+
+    if (CompletionQueue_Init(&pool->completions, epollFd, WORKER_POOL_COMPLETION_BATCH) != 0) {
+        return -1;
+    }
+
+    for (unsigned int i = 0; i < threadCount; i++) {
+        Worker *worker = &pool->workers[i];
+        worker->wakeFd = eventfd(0, EFD_CLOEXEC);
+        if (worker->wakeFd < 0) {
+            Log_Debug("ERROR: Could not create worker eventfd: %s (%d).\n", strerror(errno),
+                      errno);
+            WorkerPool_Stop(pool, epollFd);
+            return -1;
+        }
+
+        // Count the worker before it starts so that a failure further on stops it.
+        pool->threadCount = i + 1;
+        int result = pthread_create(&worker->thread, NULL, WorkerThread, worker);
+        if (result != 0) {
+            Log_Debug("ERROR: Could not start worker thread: %s (%d).\n", strerror(result), result);
+            WorkerPool_Stop(pool, epollFd);
+            return -1;
+        }
+        worker->started = true;
+    }
+
+    return 0;
+}
+
+void WorkerPool_Stop(WorkerPool *pool, int epollFd)
+{
+    atomic_store(&pool->stopping, true);
+    for (unsigned int i = 0; i < pool->threadCount; i++) {
+        Worker *worker = &pool->workers[i];
+        if (worker->started) {
+            eventfd_write(worker->wakeFd, 1);
+            pthread_join(worker->thread, NULL);
+            worker->started = false;
+        }
+    }
+
+    // Every thread has exited, so closing the queue completes the jobs left in it.
+    CompletionQueue_Close(&pool->completions, epollFd);
+
+    for (unsigned int i = 0; i < pool->threadCount; i++) {
+        Worker *worker = &pool->workers[i];
+        while (worker->overflowHead != NULL) {
+            WorkerJob *job = worker->overflowHead;
+            worker->overflowHead = job->next;
+            pool->statistics.ranInline++;
+            job->run(job);
+            CompleteJob(pool, job);
+        }
+        worker->overflowTail = NULL;
+    }
+
+    for (unsigned int i = 0; i < pool->threadCount; i++) {
+        CloseFdAndPrintError(pool->workers[i].wakeFd, "WorkerWake");
+        pool->workers[i].wakeFd = -1;
+    }
+
+    pool->threadCount = 0;
+    atomic_store(&pool->stopping, false);
+}
+
+void WorkerPool_Submit(WorkerPool *pool, WorkerJob *job, unsigned int key)
+{
+    pool->statistics.submitted++;
+
+    if (pool->threadCount > 0) {
+        Worker *worker = &pool->workers[key % pool->threadCount];
+        job->completion.handler = FinishedJobHandler;
+        job->completion.context = job;
+        job->worker = worker;
+        job->next = NULL;
+        // Jobs already held back go first, so a new job cannot overtake them.
+        if (worker->overflowHead == NULL && PushJob(pool, worker, job)) {
+            return;
+        }
+        // The ring only fills up while the worker has jobs to complete, and each completion
+        // moves held-back jobs to the ring.
+        pool->statistics.deferred++;
+        if (worker->overflowTail != NULL) {
+            worker->overflowTail->next = job;
+        } else {
+            worker->overflowHead = job;
+        }
+        worker->overflowTail = job;
+        return;
+    }
+
+    pool->statistics.ranInline++;
+    job->run(job);
+    CompleteJob(pool, job);
+}
+
+int WorkerPool_FormatStatistics(const WorkerPool *pool, char *buffer, size_t bufferSize)
+{
+    const WorkerPoolStatistics *s = &pool->statistics;
+    int len = snprintf(buffer, bufferSize,
+                       "\"threads\":%u,\"submitted\":%u,\"completed\":%u,\"ranInline\":%u,"
+                       "\"deferred\":%u,\"maxPending\":%u,\"completionQueue\":{",
+                       pool->threadCount, s->submitted, s->completed, s->ranInline, s->deferred,
+                       s->maxPending);
+    if (len < 0 || (size_t)len >= bufferSize) {
+        return len;
+    }
+    len += CompletionQueue_FormatStatistics(&pool->completions, buffer + len,
+                                            bufferSize - (size_t)len);
+    if ((size_t)len + 1 < bufferSize) {
+        strcat(buffer, "}");
+    }
+    return len + 1;
+}
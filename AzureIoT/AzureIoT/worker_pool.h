@@ -0,0 +1,155 @@
+#pragma once
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include "epoll_timerfd_utilities.h"
+#include "spsc_ring.h"
+
+#define WORKER_POOL_MAX_THREADS 4
+
+/// <summary>
+///     Most finished jobs completed per wakeup of the main loop.
+/// </summary>
+#define WORKER_POOL_COMPLETION_BATCH 8
+
+/// Forward declaration of the job passed to the job functions.
+struct WorkerJob;
+struct Worker;
+
+/// <summary>
+///     Function signature for the two halves of a job.
+/// </summary>
+/// <param name="job">The job being run</param>
+typedef void (*WorkerJobFunction)(struct WorkerJob *job);
+
+/// <summary>
+/// <para>A unit of work that is run on a worker thread and then completed on the main
+/// thread.</para>
+/// <para>The job is passed by pointer, so it must stay in memory until its complete function has
+/// been called. The run function must not touch state that the main thread owns; whatever it
+/// produces is handed back through the job for the complete function to use.</para>
+/// </summary>
+typedef struct WorkerJob {
+    /// <summary>
+    /// Called on a worker thread, or inline on the main thread if no worker is available.
+    /// </summary>
+    WorkerJobFunction run;
+    /// <summary>
+    /// Called on the main thread once run has returned.
+    /// </summary>
+    WorkerJobFunction complete;
+    /// <summary>
+    /// Caller data for the job functions.
+    /// </summary>
+    void *context;
+    /// <summary>
+    /// Used by the pool to hand the finished job back to the main thread.
+    /// </summary>
+    CompletionEntry completion;
+    struct Worker *worker;
+    /// <summary>
+    /// Next job waiting for room in the same worker's ring.
+    /// </summary>
+    struct WorkerJob *next;
+} WorkerJob;
+
+/// <summary>
+///     One worker thread and the ring that feeds it.
+/// </summary>
+typedef struct Worker {
+    pthread_t thread;
+    bool started;
+    /// <summary>
+    /// eventfd the worker blocks on while its request ring is empty.
+    /// </summary>
+    int wakeFd;
+    /// <summary>
+    /// Jobs from the main thread to the worker.
+    /// </summary>
+    SpscRing requests;
+    /// <summary>
+    /// Jobs submitted and not yet completed. Only the main thread uses it.
+    /// </summary>
+    uint32_t pending;
+    /// <summary>
+    /// Jobs submitted while the ring was full, oldest first. They are moved to the ring as
+    /// earlier jobs complete, so that they still run in order. Only the main thread uses them.
+    /// </summary>
+    struct WorkerJob *overflowHead;
+    struct WorkerJob *overflowTail;
+    struct WorkerPool *pool;
+} Worker;
+
+/// <summary>
+///     Counters describing how the pool was used. Only the main thread updates them.
+/// </summary>
+typedef struct WorkerPoolStatistics {
+    uint32_t submitted;
+    uint32_t completed;
+    /// <summary>
+    /// Jobs run on the main thread because the pool has no threads.
+    /// </summary>
+    uint32_t ranInline;
+    /// <summary>
+    /// Jobs held back because their worker's ring was full.
+    /// </summary>
+    uint32_t deferred;
+    uint32_t maxPending;
+} WorkerPoolStatistics;
+
+/// <summary>
+/// <para>Optional pool of threads that takes CPU work off the epoll thread.</para>
+/// <para>Each worker takes jobs from a lock-free single-producer, single-consumer ring that only
+/// the main thread fills, and sleeps on its own eventfd while the ring is empty. Finished jobs
+/// are posted to a completion queue shared by the workers, so they are completed from the main
+/// loop like any other event.</para>
+/// <para>A pool with no threads runs every job inline, which keeps callers the same on
+/// single-core targets.</para>
+/// </summary>
+typedef struct WorkerPool {
+    CompletionQueue completions;
+    unsigned int threadCount;
+    atomic_bool stopping;
+    Worker workers[WORKER_POOL_MAX_THREADS];
+    WorkerPoolStatistics statistics;
+} WorkerPool;
+
+/// <summary>
+///     Starts the worker threads. If any part of the start fails, the pool is left with no
+///     threads and still accepts jobs, running them inline.
+/// </summary>
+/// <param name="pool">Pool to start</param>
+/// <param name="threadCount">Number of threads, clamped to WORKER_POOL_MAX_THREADS; 0 runs
+/// every job inline</param>
+/// <param name="epollFd">Epoll instance of the main loop</param>
+/// <returns>0 on success, or -1 on failure</returns>
+int WorkerPool_Start(WorkerPool *pool, unsigned int threadCount, int epollFd);
+
+/// <summary>
+///     Stops the threads once they have run every job already in their rings, then completes
+///     those jobs on the calling thread. Jobs still held back for a full ring are run and
+///     completed inline, in order.
+/// </summary>
+void WorkerPool_Stop(WorkerPool *pool, int epollFd);
+
+/// <summary>
+///     Hands a job to a worker. Jobs with the same key go to the same worker and complete in the
+///     order they were submitted. If the worker's ring is full, the job is held back and moved
+///     to the ring once earlier jobs have completed.
+/// </summary>
+/// <param name="pool">The pool</param>
+/// <param name="job">Job to run</param>
+/// <param name="key">Selects the worker</param>
+void WorkerPool_Submit(WorkerPool *pool, WorkerJob *job, unsigned int key);
+
+/// <summary>
+///     Formats the statistics as a JSON object body, without the surrounding braces.
+/// </summary>
+/// <returns>The snprintf result</returns>
+int WorkerPool_FormatStatistics(const WorkerPool *pool, char *buffer, size_t bufferSize);
+
+/// <summary>
+///     Initial value for a pool that has not been started, so that stopping it is safe.
+/// </summary>
+#define WORKER_POOL_INITIALIZER {.completions = {.eventData = {.fd = -1}}}